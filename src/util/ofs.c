@@ -9,10 +9,23 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <stdlib.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
   
-// If word length is 4 then we use 32 bit inode and sector
+// If word length is 4 then we use 32 bit inode and sector. This could be 
+// overridden on the command line, e.g. -DWORD_SIZE=4
+#ifndef WORD_SIZE
 #define WORD_SIZE 2
+#endif
 
 #if WORD_SIZE == 4
 #define DEFAULT_SECTOR_SIZE 4096
@@ -74,6 +87,16 @@ typedef struct Storage_t {
   // Read and write function call backs
   void (*read)(struct Storage_t *disk_p, uint64_t lba, void *buffer);
   void (*write)(struct Storage_t *disk_p, uint64_t lba, void *buffer);
+  // Multi-sector versions of the above. These transfer a run of contiguous
+  // sectors as a single request
+  void (*read_multi)(struct Storage_t *disk_p, 
+                     uint64_t lba, 
+                     size_t count, 
+                     void *buffer);
+  void (*write_multi)(struct Storage_t *disk_p, 
+                      uint64_t lba, 
+                      size_t count, 
+                      const void *buffer);
   void (*free)(struct Storage_t *disk_p);
 } Storage;
 
@@ -119,6 +142,54 @@ void mem_write(Storage *disk_p, uint64_t lba, void *buffer) {
   return;
 }
 
+/*
+ * mem_read_multi() - Reads a run of contiguous sectors into the given buffer
+ *
+ * The IO overhead is only paid once for the entire run, which is the reason
+ * why callers should batch sectors whenever they are contiguous on the disk
+ */
+void mem_read_multi(Storage *disk_p, uint64_t lba, size_t count, void *buffer) {
+  if(lba >= disk_p->sector_count || count > disk_p->sector_count - lba) {
+    fatal_error("Invalid LBA range for read: %lu (%lu sectors)", lba, count);
+  }
+
+  size_t offset = lba * disk_p->sector_size;
+  memcpy(buffer, disk_p->data_p + offset, count * disk_p->sector_size);
+
+#ifdef SIMULATE_IO
+  struct timespec ts;
+  ts.tv_sec = IO_OVERHEAD_MS / 1000;
+  ts.tv_nsec = (IO_OVERHEAD_MS % 1000) * 1000000;
+  nanosleep(&ts, NULL);
+#endif
+
+  return;
+}
+
+/*
+ * mem_write_multi() - Writes a run of contiguous sectors into the memory
+ */
+void mem_write_multi(Storage *disk_p, 
+                     uint64_t lba, 
+                     size_t count, 
+                     const void *buffer) {
+  if(lba >= disk_p->sector_count || count > disk_p->sector_count - lba) {
+    fatal_error("Invalid LBA range for write: %lu (%lu sectors)", lba, count);
+  }
+
+  size_t offset = lba * disk_p->sector_size;
+  memcpy(disk_p->data_p + offset, buffer, count * disk_p->sector_size);
+
+#ifdef SIMULATE_IO
+  struct timespec ts;
+  ts.tv_sec = IO_OVERHEAD_MS / 1000;
+  ts.tv_nsec = (IO_OVERHEAD_MS % 1000) * 1000000;
+  nanosleep(&ts, NULL);
+#endif
+
+  return;
+}
+
 /*
  * mem_free() - Frees a memory object
  */
@@ -154,6 +225,8 @@ Storage *get_mem_storage(size_t sector_count) {
 
   disk_p->read = mem_read;
   disk_p->write = mem_write;
+  disk_p->read_multi = mem_read_multi;
+  disk_p->write_multi = mem_write_multi;
   disk_p->free = mem_free;
 
   return disk_p;
@@ -176,6 +249,162 @@ void free_mem_storage(Storage *disk_p) {
   return;
 }
 
+/*
+ * file_read_multi() - Reads a run of contiguous sectors of an image file 
+ *                     into the given buffer
+ *
+ * pread() does not move the file offset, so multiple threads may read the 
+ * same file at the same time
+ */
+void file_read_multi(Storage *disk_p, uint64_t lba, size_t count, void *buffer) {
+  if(lba >= disk_p->sector_count || count > disk_p->sector_count - lba) {
+    fatal_error("Invalid LBA range for read: %lu (%lu sectors)", lba, count);
+  }
+
+  const int fd = fileno(disk_p->fp);
+  size_t done = 0;
+  const size_t size = count * disk_p->sector_size;
+  while(done < size) {
+    ssize_t ret = pread(fd, 
+                        (uint8_t *)buffer + done, 
+                        size - done, 
+                        (off_t)(lba * disk_p->sector_size + done));
+    if(ret <= 0) {
+      fatal_error("Failed to read the image at LBA %lu", lba);
+    }
+    done += (size_t)ret;
+  }
+
+  return;
+}
+
+/*
+ * file_write_multi() - Writes a run of contiguous sectors into the image file
+ */
+void file_write_multi(Storage *disk_p, 
+                      uint64_t lba, 
+                      size_t count, 
+                      const void *buffer) {
+  if(lba >= disk_p->sector_count || count > disk_p->sector_count - lba) {
+    fatal_error("Invalid LBA range for write: %lu (%lu sectors)", lba, count);
+  }
+
+  const int fd = fileno(disk_p->fp);
+  size_t done = 0;
+  const size_t size = count * disk_p->sector_size;
+  while(done < size) {
+    ssize_t ret = pwrite(fd, 
+                         (const uint8_t *)buffer + done, 
+                         size - done, 
+                         (off_t)(lba * disk_p->sector_size + done));
+    if(ret <= 0) {
+      fatal_error("Failed to write the image at LBA %lu", lba);
+    }
+    done += (size_t)ret;
+  }
+
+  return;
+}
+
+/*
+ * file_read() - Reads a sector of the image file into the given buffer
+ */
+void file_read(Storage *disk_p, uint64_t lba, void *buffer) {
+  file_read_multi(disk_p, lba, 1, buffer);
+  return;
+}
+
+/*
+ * file_write() - Writes a sector of the given buffer into the image file
+ */
+void file_write(Storage *disk_p, uint64_t lba, void *buffer) {
+  file_write_multi(disk_p, lba, 1, buffer);
+  return;
+}
+
+/*
+ * file_free() - Closes the image file
+ */
+void file_free(Storage *disk_p) {
+  fclose(disk_p->fp);
+  return;
+}
+
+/*
+ * get_file_storage() - This function returns a storage object that is backed
+ *                      by an image file
+ *
+ * The number of sectors is the size of the file divided by the sector size. 
+ * Returns NULL if the file could not be opened. The caller is responsible 
+ * for freeing the object upon exit
+ */
+Storage *get_file_storage(const char *path, int writable) {
+  FILE *fp = fopen(path, writable ? "r+b" : "rb");
+  // EARLY RETURN
+  if(fp == NULL) {
+    return NULL;
+  }
+
+  Storage *disk_p = malloc(sizeof(Storage));
+  if(disk_p == NULL) {
+    fatal_error("Failed to allocatoe a Storage object");
+  }
+
+  fseeko(fp, 0, SEEK_END);
+  disk_p->type = STORAGE_TYPE_FILE;
+  disk_p->sector_size = DEFAULT_SECTOR_SIZE;
+  disk_p->sector_count = (size_t)ftello(fp) / disk_p->sector_size;
+  disk_p->fp = fp;
+  disk_p->read = file_read;
+  disk_p->write = file_write;
+  disk_p->read_multi = file_read_multi;
+  disk_p->write_multi = file_write_multi;
+  disk_p->free = file_free;
+
+  return disk_p;
+}
+
+/*
+ * create_file_storage() - This function creates an image file of the given
+ *                         number of sectors, and returns a writable storage
+ *                         object that is backed by it
+ *
+ * An existing file is truncated. Returns NULL if the file could not be 
+ * created
+ */
+Storage *create_file_storage(const char *path, size_t sector_count) {
+  FILE *fp = fopen(path, "wb");
+  // EARLY RETURN
+  if(fp == NULL) {
+    return NULL;
+  }
+
+  const int ret = \
+    ftruncate(fileno(fp), (off_t)(sector_count * DEFAULT_SECTOR_SIZE));
+  fclose(fp);
+  // EARLY RETURN
+  if(ret != 0) {
+    return NULL;
+  }
+
+  return get_file_storage(path, 1);
+}
+
+/*
+ * free_file_storage() - This function closes the image file and frees the 
+ *                       storage object
+ */
+void free_file_storage(Storage *disk_p) {
+  if(disk_p->type != STORAGE_TYPE_FILE) {
+    fatal_error("Invalid type to free as file: %d", disk_p->type);
+  }
+
+  file_free(disk_p);
+  free(disk_p);
+
+  return;
+}
+
 /////////////////////////////////////////////////////////////////////
 // Buffer Layer
 /////////////////////////////////////////////////////////////////////
@@ -309,15 +538,22 @@ void buffer_wb(Buffer *buffer_p, Storage *disk_p) {
  * buffer_find_using_data() - This function returns the corresponding buffer
  *                            given the data pointer into the buffer's data
  *
- * Note that the data pointer can be anywhere inside the data area. We search
- * all the buffer, including those not in-use
+ * Note that the data pointer can be anywhere inside the data area. We check
+ * all the buffers, including those not in-use
  */
 Buffer *buffer_find_using_data(Storage *disk_p, const void *data_p) {
-  for(int i = 0;i < MAX_BUFFER;i++) {
-    if((uint8_t *)data_p >= buffers[i].data && 
-       (uint8_t *)data_p < buffers[i].data + disk_p->sector_size) {
-      return buffers + i;
-    }
+  // Buffers are in a static array, so the index can be computed directly
+  // without scanning all buffers
+  if((uint8_t *)data_p < (uint8_t *)buffers || 
+     (uint8_t *)data_p >= (uint8_t *)(buffers + MAX_BUFFER)) {
+    return NULL;
+  }
+
+  Buffer *buffer_p = \
+    buffers + ((uint8_t *)data_p - (uint8_t *)buffers) / sizeof(Buffer);
+  if((uint8_t *)data_p >= buffer_p->data && 
+     (uint8_t *)data_p < buffer_p->data + disk_p->sector_size) {
+    return buffer_p;
   }
 
   return NULL;
@@ -665,6 +901,63 @@ uint8_t *write_lba(Storage *disk_p, uint64_t lba) {
   return buffer_p->data;
 }
 
+/*
+ * read_lba_multi() - This function reads a run of contiguous sectors directly
+ *                    into the caller's buffer, bypassing the buffer pool
+ *
+ * Sectors that are currently buffered may be newer than their on-disk copy,
+ * so after the bulk read we overlay the buffered content of dirty sectors in
+ * the range. No buffer is allocated or evicted by this function
+ */
+void read_lba_multi(Storage *disk_p, uint64_t lba, size_t count, void *buffer) {
+  disk_p->read_multi(disk_p, lba, count, buffer);
+
+  Buffer *buffer_p = buffer_head_p;
+  while(buffer_p != NULL) {
+    if(buffer_p->dirty == 1 && 
+       buffer_p->lba >= lba && 
+       buffer_p->lba < lba + count) {
+      memcpy((uint8_t *)buffer + (buffer_p->lba - lba) * disk_p->sector_size,
+             buffer_p->data,
+             disk_p->sector_size);
+    }
+
+    buffer_p = buffer_p->next_p;
+  }
+
+  return;
+}
+
+/*
+ * write_lba_multi() - This function writes a run of contiguous sectors 
+ *                     directly from the caller's buffer to the disk
+ *
+ * If any of the sectors is buffered, we also refresh the buffered copy and
+ * clear its dirty flag, since the disk now holds the latest content. The 
+ * buffered copy is updated in-place such that pinned pointers remain valid
+ */
+void write_lba_multi(Storage *disk_p, 
+                     uint64_t lba, 
+                     size_t count, 
+                     const void *buffer) {
+  disk_p->write_multi(disk_p, lba, count, buffer);
+
+  Buffer *buffer_p = buffer_head_p;
+  while(buffer_p != NULL) {
+    if(buffer_p->lba >= lba && buffer_p->lba < lba + count) {
+      memcpy(buffer_p->data,
+             (const uint8_t *)buffer + 
+               (buffer_p->lba - lba) * disk_p->sector_size,
+             disk_p->sector_size);
+      buffer_p->dirty = 0;
+    }
+
+    buffer_p = buffer_p->next_p;
+  }
+
+  return;
+}
+
 /////////////////////////////////////////////////////////////////////
 // FS Layer
 /////////////////////////////////////////////////////////////////////
@@ -683,6 +976,12 @@ uint8_t *write_lba(Storage *disk_p, uint64_t lba) {
 // Run out of inodes
 #define FS_ERR_NO_INODE       5
 #define FS_ERR_NAME_NOT_FOUND 6
+// Name already exists in the directory
+#define FS_ERR_NAME_EXISTS    7
+// Failed to read or write a file of the host
+#define FS_ERR_HOST_IO        8
+// The super block does not keep the number of free sectors and inodes
+#define FS_ERR_NO_SUMMARY     9
 
 #if WORD_SIZE == 4
 typedef uint32_t sector_t;
@@ -714,6 +1013,10 @@ typedef uint8_t halfword_t;
 #define FS_FREE_ARRAY_MAX 100
 #define FS_SIG_SIZE 4
 #define FS_SIG "WZQ"
+// The last byte of the signature is the layout version. Version 0 images
+// do not have any field after the time field of the super block
+#define FS_SIG_VERSION_INDEX 3
+#define FS_SIG_VERSION       1
 // This is the sector ID of the super block
 #define FS_SB_SECTOR 1
 // This indicates invalid sector numbers
@@ -762,8 +1065,57 @@ typedef struct {
   halfword_t ilock;
   halfword_t fmod;
   word_t time[2];
+  // The following fields are only valid with version 1 or above
+  // Feature flags (FS_FEATURE_*)
+  word_t features;
+  // Number of reserved sectors between the inode sectors and the first
+  // file storage sector
+  sector_count_t rsize;
+  // Location of the free extent map and the number of extents in it
+  sector_t fmap_start;
+  sector_count_t fmap_size;
+  sector_count_t fmap_count;
+  // Number of inode sectors that have been initialized. Only valid with 
+  // FS_FEATURE_LAZY_INODE
+  sector_count_t iinit;
+  // Number of free sectors in the file storage and free inodes. Only valid 
+  // with FS_FEATURE_SUMMARY, and only up-to-date after fs_sync()
+  sector_count_t nfree_sector;
+  inode_count_t nfree_inode;
 } __attribute__((packed)) SuperBlock;
 
+// Free space is described by the sorted free extent map instead of the
+// free array and the chained free list
+#define FS_FEATURE_FREE_EXTENT 0x0001
+// Inode sectors are not initialized when the file system is created. Sectors
+// after the high-water mark in the super block are free, and are initialized
+// on first use
+#define FS_FEATURE_LAZY_INODE  0x0002
+// The last slot of the addr. array of a large file is a triple indirection
+// sector, and the one before it is the double indirection sector. This only
+// makes sense with 32 bit sector IDs, since 16 bit sector IDs can already 
+// be exhausted by double indirection
+#define FS_FEATURE_TRIPLE_INDIR 0x0004
+// Regular files that outgrow the addr. array are mapped by extents instead
+// of indirection sectors
+#define FS_FEATURE_EXTENT      0x0008
+// The super block keeps the number of free sectors and inodes, such that 
+// they can be reported without scanning the free extent map or the inode 
+// table
+#define FS_FEATURE_SUMMARY     0x0010
+
+// These are the features of newly created file systems
+#if WORD_SIZE == 4
+#define FS_DEFAULT_FEATURES    (FS_FEATURE_FREE_EXTENT | \
+                                FS_FEATURE_LAZY_INODE | \
+                                FS_FEATURE_TRIPLE_INDIR | \
+                                FS_FEATURE_SUMMARY)
+#else
+#define FS_DEFAULT_FEATURES    (FS_FEATURE_FREE_EXTENT | \
+                                FS_FEATURE_LAZY_INODE | \
+                                FS_FEATURE_SUMMARY)
+#endif
+
 #define FS_ADDR_ARRAY_MAX 8
 
 // This defines the inode structure
@@ -786,6 +1138,21 @@ typedef struct {
   word_t modtime[2];
 } __attribute__((packed)) Inode;
 
+// This is an extent of an extent-mapped file. count logical sectors that
+// start at logical are mapped to contiguous sectors that start at physical
+typedef struct {
+  sector_t logical;
+  sector_t physical;
+  sector_t count;
+} __attribute__((packed)) Extent;
+
+// An extent-mapped file stores up to this many extents in the addr. array,
+// followed by the number of extents and the extent sector. If the extent 
+// sector is valid, all extents are in that sector instead
+#define FS_EXTENT_INODE_MAX   2
+#define FS_EXTENT_COUNT_SLOT  (FS_ADDR_ARRAY_MAX - 2)
+#define FS_EXTENT_SECTOR_SLOT (FS_ADDR_ARRAY_MAX - 1)
+
 #if WORD_SIZE != 4
 #define FS_DIR_ENTRY_NAME_MAX 14
 #else
@@ -835,15 +1202,157 @@ typedef struct {
   inode_count_t inode_per_sector;
   // Number of sector IDs per indirection sector
   sector_count_t id_per_indir_sector;
+  // Number of slots in the addr. array of a large file that point to a
+  // single indirection sector
+  size_t indir_slot_count;
   // The start sector for extra large blocks
   sector_t extra_large_start_sector;
+  // The start sector of the triple indirection range. This may not fit 
+  // into sector_t if the layout has no triple indirection
+  size_t triple_large_start_sector;
+  // Number of extents in an extent sector
+  size_t extent_per_sector;
   dir_count_t dir_per_sector;
-  
+  // Feature flags of the file system
+  word_t features;
+  // Number of initialized inode sectors. Unlike the above, this grows as 
+  // inodes are allocated with FS_FEATURE_LAZY_INODE
+  sector_count_t inode_init_sector_count;
 } Context;
 
+// This describes a run of free sectors
+typedef struct {
+  sector_t start;
+  sector_count_t count;
+} __attribute__((packed)) FreeExtent;
+
+// This is the in-memory free extent map of an allocation group. Extents are
+// sorted by their start sector and never overlap or touch each other 
+// (adjacent extents are merged). They never cross the group boundary
+//
+// The maps of all groups are loaded when the file system is loaded, and only
+// written back to the single on-disk map by fs_sync()
+typedef struct {
+  FreeExtent *extent_p;
+  size_t count;
+  // Maximum number of extents the map could hold
+  size_t capacity;
+  // Whether the in-memory map is newer than the on-disk copy
+  int dirty;
+} FreeMap;
+
+// Maximum number of allocation groups
+#define FS_GROUP_MAX        64
+// Minimum number of storage sectors in an allocation group
+#define FS_GROUP_SECTOR_MIN 512
+
+// This is an allocation group. The file storage and the inode table are 
+// split into groups of equal size (the last group takes the remainder), and 
+// each group has its own free extent map, free inode count and lock, such 
+// that allocations in different groups do not contend
+//
+// Groups only exist in memory. They are derived from the geometry when the 
+// free extent map is loaded
+typedef struct {
+  // Storage sectors in [start, end)
+  size_t start;
+  size_t end;
+  // Inodes in [inode_start, inode_end)
+  size_t inode_start;
+  size_t inode_end;
+  FreeMap map;
+  // Number of free sectors in the map
+  size_t free_sector_count;
+  // Number of free inodes. Only valid if the inode bitmap has been built
+  size_t free_inode_count;
+  // Next-fit allocation in the group continues from this sector, which is 
+  // also where data of new files in the group starts
+  size_t rotor;
+  // Scanning for free inodes in the group continues from this inode
+  size_t inode_rotor;
+  // Protects all fields above except the free inode count
+  pthread_mutex_t lock;
+} AllocGroup;
+
+typedef struct {
+  AllocGroup *group_p;
+  size_t count;
+  size_t sector_per_group;
+  size_t inode_per_group;
+  // Allocation without a hint continues from this sector
+  size_t rotor;
+} GroupTable;
+
+GroupTable group_table;
+
+// Maximum number of sectors or inodes in a per-thread magazine
+#define FS_MAGAZINE_SIZE  32
+// Number of sectors or inodes moved between a magazine and the depot at once
+#define FS_MAGAZINE_BATCH 16
+
+// This is a per-thread cache of free sectors and inodes. Single sectors and
+// inodes are allocated from and freed to the magazine of the calling thread
+// without any lock. Magazines are refilled from and spilled to the depot, 
+// i.e. the free extent maps of the groups and the inode free array in the 
+// super block, FS_MAGAZINE_BATCH entries at a time
+//
+// Sectors and inodes in a magazine are still free on the disk. Magazines are
+// never freed, and all of them are linked such that fs_sync() can return 
+// their content to the depot. When a thread exits, the content of its 
+// magazine is returned as well, and the magazine is reused by a new thread
+//
+// Inodes in magazines are marked in use in the inode bitmap, so the 
+// magazines never read inode sectors, and fs_alloc_inode_near() does not 
+// allocate them. Only sectors could be allocated and freed by several 
+// threads at the same time though: the inode itself is still initialized
+// and freed in its sector, through the buffer pool and the inode cache 
+// which are not locked, so the caller must serialize fs_alloc_inode() and
+// fs_free_inode()
+typedef struct Magazine {
+  // Entries are allocated from the end of the lists
+  sector_t sector_list[FS_MAGAZINE_SIZE];
+  size_t sector_count;
+  inode_id_t inode_list[FS_MAGAZINE_SIZE];
+  size_t inode_count;
+  // Sectors are refilled from this group (modulo the number of groups), 
+  // such that threads refill from different groups
+  size_t group;
+  // Set while the magazine belongs to a thread
+  int in_use;
+  struct Magazine *next_p;
+} Magazine;
+
+// The magazine of the current thread, which is created on first use
+__thread Magazine *thread_magazine_p;
+// The magazine is also stored under this key, such that it is released when
+// the thread exits
+pthread_key_t magazine_key;
+pthread_once_t magazine_key_once = PTHREAD_ONCE_INIT;
+// All magazines and the number of them
+Magazine *magazine_list_p;
+size_t magazine_count;
+pthread_mutex_t magazine_lock = PTHREAD_MUTEX_INITIALIZER;
+// Number of free sectors in all groups and magazines. It is updated 
+// atomically together with the group counters and the magazines, such that
+// it could be read on the allocation path without any lock
+size_t free_sector_total;
+// Protects the inode free array in the super block
+pthread_mutex_t inode_depot_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // This is the content of the fs
 Context context;
 
+// This is the resident copy of the super block of the loaded fs. Allocation
+// changes it in memory, and it is only written back to its sector by 
+// fs_sync()
+SuperBlock super_block;
+// Whether the resident copy is newer than the on-disk super block
+int super_block_dirty;
+// Number of free inodes, which is updated atomically on each allocation and
+// free, and copied into the super block by fs_sync(). There is no such 
+// counter of free sectors, because it is the sum of the group counters
+size_t inode_free_count;
+
 // Next we define flags for inode flags word
 #define FS_INODE_IN_USE      0x8000
 // The following are file type code. We should mask off other bits
@@ -859,7 +1368,12 @@ Context context;
 #define FS_INODE_LARGE       0x1000
 #define FS_INODE_SET_UID     0x0800
 #define FS_INODE_SET_GID     0x0400
-// Note that there is a gap
+// The data of a small file is stored in the addr. array of the inode. This is
+// only valid if FS_INODE_LARGE is not set
+#define FS_INODE_INLINE      0x0200
+// Both of the above are set if the addr. array of a regular file holds 
+// extents
+#define FS_INODE_EXTENT      (FS_INODE_LARGE | FS_INODE_INLINE)
 #define FS_INODE_OWNER_READ  0x0100
 #define FS_INODE_OWNER_WRITE 0x0080
 #define FS_INODE_OWNER_EXEC  0x0040
@@ -877,26 +1391,55 @@ Context context;
 sector_t fs_alloc_sector(Storage *disk_p);
 Inode *fs_load_inode_sector(Storage *disk_p, inode_id_t inode, int write_flag);
 void fs_free_sector(Storage *disk_p, sector_t sector);
+void fs_map_cache_init();
+void fs_inode_map_reset();
+int fs_inode_map_set(inode_id_t inode, int in_use);
+void fs_load_summary(Storage *disk_p);
+void fs_dcache_init();
+void fs_icache_init();
+void fs_dir_slot_init();
+void fs_dir_slot_invalidate(inode_id_t inode);
+void fs_delalloc_reset();
+void fs_magazine_reset();
+void fs_magazine_drain(Storage *disk_p);
+void fs_magazine_release(void *arg);
+void fs_delalloc_drop(inode_id_t inode, sector_t first);
+void fs_delalloc_flush(Storage *disk_p);
+void fs_dcache_invalidate_inode(inode_id_t inode);
+void fs_load_free_map(Storage *disk_p);
+void fs_convert_free_list(Storage *disk_p);
+void fs_sync(Storage *disk_p);
+sector_t fs_alloc_sector_near(Storage *disk_p, sector_t hint);
+sector_t fs_alloc_sectors(Storage *disk_p, sector_count_t count, sector_t hint);
+void fs_free_sectors(Storage *disk_p, sector_t start, sector_count_t count);
+size_t fs_count_free_sectors();
+sector_t fs_group_get_hint(inode_id_t inode);
+size_t fs_write(Storage *disk_p, 
+                Inode *inode_p, 
+                size_t offset, 
+                size_t len, 
+                const void *buffer);
 int fs_print_dir_name(DirEntry *entry_p, FILE *fp);
 
 /*
- * fs_load_context() - This function loads the context object using the super block
+ * fs_load_geometry() - This function fills the layout part of the context 
+ *                      object using a copy of the super block
  *
- * For each file system mounted, this can only be done once, and then used
- * for the entire session
- *
- * This function should only be called after the fs has been initialized or 
- * mounted.
+ * The storage is not accessed, and no cache is changed
  */
-void fs_load_context(Storage *disk_p) {
-  // Load the super block in read-only mode
-  SuperBlock *sb_p = (SuperBlock *)read_lba(disk_p, FS_SB_SECTOR);
+void fs_load_geometry(Storage *disk_p, const SuperBlock *sb_p) {
+  // Fields after the time field do not exist in version 0
+  const int version = sb_p->signature[FS_SIG_VERSION_INDEX];
+  context.features = (version >= 1) ? sb_p->features : 0;
+  const sector_count_t reserved_count = (version >= 1) ? sb_p->rsize : 0;
 
   context.sb_sector = FS_SB_SECTOR;
   context.inode_start_sector = FS_SB_SECTOR + 1;
   context.inode_end_sector = FS_SB_SECTOR + 1 + sb_p->isize;
   context.inode_sector_count = sb_p->isize;
-  context.free_start_sector = context.inode_end_sector;
+  context.inode_init_sector_count = \
+    (context.features & FS_FEATURE_LAZY_INODE) ? sb_p->iinit : sb_p->isize;
+  context.free_start_sector = context.inode_end_sector + reserved_count;
   context.free_end_sector = context.free_start_sector + sb_p->fsize;
   context.free_sector_count = sb_p->fsize;
   context.total_sector_count = \
@@ -909,11 +1452,73 @@ void fs_load_context(Storage *disk_p) {
   
   // These two are used for computing the sector ID of a given offset
   context.id_per_indir_sector = disk_p->sector_size / sizeof(sector_t);
+  context.indir_slot_count = \
+    (context.features & FS_FEATURE_TRIPLE_INDIR) ? \
+    FS_ADDR_ARRAY_MAX - 2 : FS_ADDR_ARRAY_MAX - 1;
   context.extra_large_start_sector = \
-    context.id_per_indir_sector * (FS_ADDR_ARRAY_MAX - 1);
+    context.id_per_indir_sector * context.indir_slot_count;
+  context.triple_large_start_sector = \
+    (size_t)context.extra_large_start_sector + \
+    (size_t)context.id_per_indir_sector * context.id_per_indir_sector;
   
   // This is the number of directory entries per sector
   context.dir_per_sector = disk_p->sector_size / sizeof(DirEntry);
+  context.extent_per_sector = disk_p->sector_size / sizeof(Extent);
+
+  return;
+}
+
+/*
+ * fs_store_super_block() - This function writes the resident super block 
+ *                          back to its sector
+ */
+void fs_store_super_block(Storage *disk_p) {
+  SuperBlock *sb_p = (SuperBlock *)read_lba_for_write(disk_p, FS_SB_SECTOR);
+  memcpy(sb_p, &super_block, sizeof(SuperBlock));
+  super_block_dirty = 0;
+
+  return;
+}
+
+/*
+ * fs_load_context() - This function loads the context object using the super block
+ *
+ * For each file system mounted, this can only be done once, and then used
+ * for the entire session. The super block stays resident in memory
+ *
+ * This function should only be called after the fs has been initialized or 
+ * mounted. Changes to the in-memory free extent map and super block that have
+ * not been written by fs_sync() are discarded.
+ */
+void fs_load_context(Storage *disk_p) {
+  assert(sizeof(SuperBlock) <= disk_p->sector_size);
+  // Load the super block in read-only mode
+  const SuperBlock *sb_p = (SuperBlock *)read_lba(disk_p, FS_SB_SECTOR);
+  if(memcmp(sb_p->signature, FS_SIG, FS_SIG_VERSION_INDEX) != 0) {
+    fatal_error("Invalid file system signature");
+  }
+
+  memcpy(&super_block, sb_p, sizeof(SuperBlock));
+  super_block_dirty = 0;
+  fs_load_geometry(disk_p, &super_block);
+
+  // Cached mappings belong to the previous file system
+  fs_map_cache_init();
+  fs_inode_map_reset();
+  fs_dcache_init();
+  fs_icache_init();
+  fs_dir_slot_init();
+  fs_delalloc_reset();
+  fs_magazine_reset();
+
+  // Load the free extent map. Old images that still use the free list are
+  // converted to the extent map here
+  if(context.features & FS_FEATURE_FREE_EXTENT) {
+    fs_load_free_map(disk_p);
+  } else {
+    fs_convert_free_list(disk_p);
+  }
+  fs_load_summary(disk_p);
 
   return;
 }
@@ -929,59 +1534,228 @@ void fs_reset_addr(Inode *inode_p) {
   return;
 }
 
+// Size of chunks that mkfs generates in memory and writes as a single 
+// request
+#define FS_MKFS_CHUNK_SIZE (4 * 1024 * 1024)
+
+// This is called by mkfs after each chunk is written, with the name of 
+// the region being written, and the number of sectors done and in total
+typedef void (*MkfsProgress)(const char *stage, 
+                             size_t done, 
+                             size_t total, 
+                             void *arg);
+
+MkfsProgress mkfs_progress = NULL;
+void *mkfs_progress_arg = NULL;
+
+// This generates a region of sectors into a chunk, which is written to the
+// storage when it is full. The buffer pool is bypassed
+typedef struct {
+  Storage *disk_p;
+  uint8_t *chunk_p;
+  // Number of sectors in the chunk
+  size_t chunk_sector_count;
+  // First sector of the chunk on the storage
+  size_t chunk_start;
+  // Number of sectors generated in the chunk
+  size_t count;
+  const char *stage;
+  size_t done;
+  size_t total;
+} MkfsWriter;
+
 /*
- * fs_init_inode() - This function initializes the inode from a given sector
- *                   of the storage
+ * fs_set_mkfs_progress() - This function sets the progress callback of mkfs
  *
- * The function also returns the number of sectors the inode array occupies
- * to initialize data sectors.
+ * NULL disables progress reporting
  */
-size_t fs_init_inode(Storage *disk_p, 
-                     size_t inode_start, 
-                     size_t total_end) {
+void fs_set_mkfs_progress(MkfsProgress progress, void *arg) {
+  mkfs_progress = progress;
+  mkfs_progress_arg = arg;
+
+  return;
+}
+
+/*
+ * fs_mkfs_writer_begin() - This function starts writing a region of the
+ *                          given number of sectors
+ */
+void fs_mkfs_writer_begin(MkfsWriter *writer_p, 
+                          Storage *disk_p, 
+                          size_t start, 
+                          size_t total, 
+                          const char *stage) {
+  writer_p->disk_p = disk_p;
+  writer_p->chunk_sector_count = FS_MKFS_CHUNK_SIZE / disk_p->sector_size;
+  // Do not allocate more than the region
+  if(writer_p->chunk_sector_count > total && total != 0) {
+    writer_p->chunk_sector_count = total;
+  }
+  writer_p->chunk_p = aligned_alloc(disk_p->sector_size, 
+                                    writer_p->chunk_sector_count * 
+                                      disk_p->sector_size);
+  if(writer_p->chunk_p == NULL) {
+    fatal_error("Failed to allocate the mkfs chunk");
+  }
+  writer_p->chunk_start = start;
+  writer_p->count = 0;
+  writer_p->stage = stage;
+  writer_p->done = 0;
+  writer_p->total = total;
+
+  return;
+}
+
+/*
+ * fs_mkfs_writer_flush() - This function writes generated sectors of the 
+ *                          chunk, and reports progress
+ */
+void fs_mkfs_writer_flush(MkfsWriter *writer_p) {
+  // EARLY RETURN
+  if(writer_p->count == 0) {
+    return;
+  }
+
+  write_lba_multi(writer_p->disk_p, 
+                  writer_p->chunk_start, 
+                  writer_p->count, 
+                  writer_p->chunk_p);
+  writer_p->chunk_start += writer_p->count;
+  writer_p->done += writer_p->count;
+  writer_p->count = 0;
+  if(mkfs_progress != NULL) {
+    mkfs_progress(writer_p->stage, 
+                  writer_p->done, 
+                  writer_p->total, 
+                  mkfs_progress_arg);
+  }
+
+  return;
+}
+
+/*
+ * fs_mkfs_writer_next() - Returns the zero-filled next sector of the region
+ *                         to be generated by the caller
+ */
+uint8_t *fs_mkfs_writer_next(MkfsWriter *writer_p) {
+  if(writer_p->count == writer_p->chunk_sector_count) {
+    fs_mkfs_writer_flush(writer_p);
+  }
+
+  const size_t sector_size = writer_p->disk_p->sector_size;
+  uint8_t *data_p = writer_p->chunk_p + writer_p->count * sector_size;
+  memset(data_p, 0x00, sector_size);
+  writer_p->count++;
+
+  return data_p;
+}
+
+/*
+ * fs_mkfs_writer_end() - This function writes the rest of the region
+ */
+void fs_mkfs_writer_end(MkfsWriter *writer_p) {
+  fs_mkfs_writer_flush(writer_p);
+  free(writer_p->chunk_p);
+  writer_p->chunk_p = NULL;
+
+  return;
+}
+
+/*
+ * fs_get_inode_sector_count() - This function returns the number of sectors 
+ *                               the inode array occupies
+ *
+ * The inode array starts at the given sector, and has one inode for each 
+ * sector after it
+ */
+size_t fs_get_inode_sector_count(Storage *disk_p, 
+                                 size_t inode_start, 
+                                 size_t total_end) {
   size_t current_inode = inode_start;
   // Number of inodes in each sector
   // This should be an integer
   const size_t inode_per_sector = disk_p->sector_size / sizeof(Inode);
-  info("  # of inodes per sector: %lu", inode_per_sector);  
   // We stop initializing inode when we could allocate one inode for
   // each sector
   while(total_end > current_inode) {
-    void *data = write_lba(disk_p, current_inode);
-    memset(data, 0x00, disk_p->sector_size);
-
-    // Reset the addr array (we may use an arbitrary value for invalid sector,
-    // so setting it to 0x00 may not be sufficient)
-    Inode *inode_p = (Inode *)data;
-    for(int i = 0;i < inode_per_sector;i++) {
-      fs_reset_addr(inode_p + i);
-    }
-
     // Go to the next inode sector
     current_inode++;
     // We have allocated inode for each of the blocks in this range
     total_end -= inode_per_sector;
   }
 
-  // Flush all inode sectors
-  buffer_flush_all_no_rm(disk_p);
-
-  // Number of inodes
   return current_inode - inode_start;
 }
 
 /*
- * fs_init_free_list() - This function builds the free list
+ * fs_write_inode_sectors() - This function writes a range of empty inode 
+ *                            sectors in large chunks
+ */
+void fs_write_inode_sectors(Storage *disk_p, size_t start, size_t count) {
+  // All inode sectors are the same. Reset the addr array (we may use an 
+  // arbitrary value for invalid sector, so setting it to 0x00 may not be 
+  // sufficient)
+  const size_t inode_per_sector = disk_p->sector_size / sizeof(Inode);
+  uint8_t *template_p = malloc(disk_p->sector_size);
+  if(template_p == NULL) {
+    fatal_error("Failed to allocate the inode sector template");
+  }
+  memset(template_p, 0x00, disk_p->sector_size);
+  for(int i = 0;i < inode_per_sector;i++) {
+    fs_reset_addr((Inode *)template_p + i);
+  }
+
+  MkfsWriter writer;
+  fs_mkfs_writer_begin(&writer, disk_p, start, count, "inode");
+  for(size_t i = 0;i < count;i++) {
+    memcpy(fs_mkfs_writer_next(&writer), template_p, disk_p->sector_size);
+  }
+  fs_mkfs_writer_end(&writer);
+  free(template_p);
+
+  return;
+}
+
+/*
+ * fs_init_inode() - This function initializes the inode from a given sector
+ *                   of the storage
  *
- * The free list consists of 99 elements, which are free block numbers,
- * and 1 pointer to the next free block. Note that sectors that hold the 
- * free list themselves could not occur in the free list, and therefore,
- * we begin allocating sectors from the last sector of the entire fs
+ * The function also returns the number of sectors the inode array occupies
+ * to initialize data sectors. Inode sectors are written in large chunks
  */
-size_t fs_init_free_list(Storage *disk_p, size_t free_start, size_t free_end) {
+size_t fs_init_inode(Storage *disk_p, 
+                     size_t inode_start, 
+                     size_t total_end) {
+  info("  # of inodes per sector: %lu", disk_p->sector_size / sizeof(Inode));
+  const size_t inode_sector_count = \
+    fs_get_inode_sector_count(disk_p, inode_start, total_end);
+  fs_write_inode_sectors(disk_p, inode_start, inode_sector_count);
+
+  // Number of inodes
+  return inode_sector_count;
+}
+
+/*
+ * fs_init_free_list() - This function builds the free list
+ *
+ * The free list consists of 99 elements, which are free block numbers,
+ * and 1 pointer to the next free block. Note that sectors that hold the 
+ * free list themselves could not occur in the free list, and therefore,
+ * we begin allocating sectors from the last sector of the entire fs
+ */
+size_t fs_init_free_list(Storage *disk_p, size_t free_start, size_t free_end) {
+  // The list occupies one sector for every FS_FREE_ARRAY_MAX sectors, 
+  // because each sector holds itself and the next 99 free sectors
+  MkfsWriter writer;
+  fs_mkfs_writer_begin(&writer, 
+                       disk_p, 
+                       free_start, 
+                       (free_end - free_start + FS_FREE_ARRAY_MAX - 1) / 
+                         FS_FREE_ARRAY_MAX, 
+                       "free list");
   size_t current_free = free_start;
   while(free_end > current_free) {
-    sector_t *data = (sector_t *)write_lba(disk_p, current_free);
+    sector_t *data = (sector_t *)fs_mkfs_writer_next(&writer);
     // There must be at least one free sector
     assert(free_end > (current_free + 1));
     // current_free should not be counted as a free block
@@ -1012,12 +1786,52 @@ size_t fs_init_free_list(Storage *disk_p, size_t free_start, size_t free_end) {
     // Go to next free block
     current_free++;
   }
-
-  buffer_flush_all_no_rm(disk_p);
+  fs_mkfs_writer_end(&writer);
 
   return current_free - free_start;
 }
 
+/*
+ * fs_get_free_map_size() - This function returns the number of sectors the
+ *                          free extent map needs for a given number of 
+ *                          free sectors
+ *
+ * In the worst case free and used sectors alternate, which requires one
+ * extent for every two sectors
+ */
+size_t fs_get_free_map_size(Storage *disk_p, size_t free_sector_count) {
+  size_t capacity = free_sector_count / 2 + 1;
+  size_t byte_count = capacity * sizeof(FreeExtent);
+  return (byte_count + disk_p->sector_size - 1) / disk_p->sector_size;
+}
+
+/*
+ * fs_init_free_map() - This function writes the initial free extent map
+ *
+ * The map consists of a single extent that covers the entire file storage.
+ * Returns the number of extents in the map
+ */
+size_t fs_init_free_map(Storage *disk_p, 
+                        size_t map_start, 
+                        size_t map_size, 
+                        size_t free_start, 
+                        size_t free_end) {
+  assert(free_end > free_start);
+  MkfsWriter writer;
+  fs_mkfs_writer_begin(&writer, disk_p, map_start, map_size, "free map");
+  for(size_t i = 0;i < map_size;i++) {
+    void *data_p = fs_mkfs_writer_next(&writer);
+    if(i == 0) {
+      FreeExtent *extent_p = (FreeExtent *)data_p;
+      extent_p->start = (sector_t)free_start;
+      extent_p->count = (sector_count_t)(free_end - free_start);
+    }
+  }
+  fs_mkfs_writer_end(&writer);
+
+  return 1UL;
+}
+
 /*
  * fs_get_file_size() - This function returns the size of an inode's file
  */
@@ -1068,10 +1882,19 @@ word_t fs_get_file_type(const Inode *inode_p) {
 
 /*
  * fs_is_file_large() - Returns 1 if the file is large. 0 if not
+ *
+ * Extent-mapped files also have the large flag, but they are not large
+ * files since they do not use indirection sectors
  */
 int fs_is_file_large(const Inode *inode_p) {
-  // We need to convert the mask into 0 or 1
-  return !!(inode_p->flags & FS_INODE_LARGE);
+  return (inode_p->flags & FS_INODE_EXTENT) == FS_INODE_LARGE;
+}
+
+/*
+ * fs_is_file_extent() - Returns 1 if the file is extent-mapped. 0 if not
+ */
+int fs_is_file_extent(const Inode *inode_p) {
+  return (inode_p->flags & FS_INODE_EXTENT) == FS_INODE_EXTENT;
 }
 
 /*
@@ -1087,1768 +1910,12010 @@ void fs_set_file_large(Inode *inode_p) {
  *
  * We determine whether a file is extra large using two sub-conditions:
  *   1. The file has large bit set
- *   2. The file has a valid sector number on addr[7]
+ *   2. The file has a valid sector number on the double indirection slot,
+ *      which is addr[7], or addr[6] with FS_FEATURE_TRIPLE_INDIR
  */
 int fs_is_file_extra_large(const Inode *inode_p) {
   return !!(fs_is_file_large(inode_p) && \
-            inode_p->addr[FS_ADDR_ARRAY_MAX - 1] != FS_INVALID_SECTOR);
+            inode_p->addr[context.indir_slot_count] != FS_INVALID_SECTOR);
 }
 
+// Maximum number of bytes of an inline file
+#define FS_INLINE_SIZE_MAX (sizeof(sector_t) * FS_ADDR_ARRAY_MAX)
+
 /*
- * fs_get_file_sector_p() - This function returns the pointer to the sector
- *                          in the inode's addr. array
- *
- * Returns NULL if the sector does not exist. Note that the returned value 
- * may be inside another indirection sector. If there are interleaved
- * sector operations, the caller should pin the returned value
- *
- * If the caller modifies the entry through the pointer, the pointer's buffer
- * must be marked as dirty, because the pointer may not point to the inode's
- * buffer
+ * fs_is_file_inline() - Returns 1 if the data of the file is stored in the 
+ *                       addr. array
  *
- * Other properties are specified in fs_get_file_sector()
+ * An inline file does not map any sector. Bytes after the end of the file 
+ * in the addr. array are always zero
  */
-sector_t *fs_get_file_sector_p(Storage *disk_p, 
-                               Inode *inode_p, 
-                               size_t offset) {
-  buffer_pin(disk_p, inode_p);
+int fs_is_file_inline(const Inode *inode_p) {
+  return (inode_p->flags & (FS_INODE_INLINE | FS_INODE_LARGE)) == \
+         FS_INODE_INLINE;
+}
 
-  // This is the linear ID in the file. Note that we can only address 16 bit
-  // sector size
-  sector_t sector = (sector_t)(offset / disk_p->sector_size);
-  // Make sure we did not overflow sector_t
-  assert(((size_t)sector * disk_p->sector_size) == offset);
-  sector_t *ret;
-  // If the file is small, then the sector ID must be less than 8
-  if(fs_is_file_large(inode_p) == 0) {
-    assert(sector < FS_ADDR_ARRAY_MAX);
-    // This could be invalid sector
-    ret = &inode_p->addr[sector];
-  } else {
-    // Number of IDs inside an indirection sector
-    sector_t indir_index = sector / context.id_per_indir_sector;
-    sector_t indir_offset = sector % context.id_per_indir_sector;
-    
-    // Then if the file is large file, and the index is not the last one
-    // then we know we can always use the indirection sector
-    if(indir_index < (FS_ADDR_ARRAY_MAX - 1)) {
-      sector_t indir_sector = inode_p->addr[indir_index];
-      // If the sector does not exist, then we assume the range it covers 
-      // contains all zero, and just return invalid
-      if(indir_sector == FS_INVALID_SECTOR) {
-        ret = NULL;
-      } else {
-        sector_t *data_p = (sector_t *)read_lba(disk_p, indir_sector);
-        ret = &data_p[indir_offset]; 
-      }
-    } else if(fs_is_file_extra_large(inode_p) == 0) {
-      // If the offset implies that the file should be extra large
-      // but actually the file is not extra large, we return invalid
-      // sector because there is no way to find the correct sector
-      ret = NULL;
-    } else {
-      assert(sector >= context.extra_large_start_sector);
-      // This branch handles extra large file
-      // This is the address of the first indirection sector
-      const sector_t first_indir_sector = \
-        inode_p->addr[FS_ADDR_ARRAY_MAX - 1];
-      // Starts with 0 in the extra large area
-      sector -= context.extra_large_start_sector;
-      // Just treat it as another array of indir sector
-      indir_index = sector / context.id_per_indir_sector;
-      // It could not overflow the first indirection sector
-      assert(indir_index < context.id_per_indir_sector);
-      indir_offset = sector % context.id_per_indir_sector;
-      sector_t *data_p = (sector_t *)read_lba(disk_p, first_indir_sector);
-      sector_t second_indir_sector = data_p[indir_index];
-      if(second_indir_sector == FS_INVALID_SECTOR) {
-        ret = NULL;
-      } else {
-        sector_t *data_p = (sector_t *)read_lba(disk_p, second_indir_sector);
-        ret = &data_p[indir_offset];
-      }
-    }
-  }
+// Number of inodes whose mapping runs are cached
+#define FS_MAP_CACHE_INODE_MAX 8
+// Number of runs cached for each inode
+#define FS_MAP_CACHE_RUN_MAX   4
+// Number of leaf indirection sectors cached for each inode
+#define FS_MAP_CACHE_INDIR_MAX 4
 
-  buffer_unpin(disk_p, inode_p);
-  return ret;
-}
+// This is a run of logical sectors that are mapped to contiguous physical
+// sectors
+typedef struct {
+  sector_t logical;
+  sector_t physical;
+  sector_count_t count;
+} MapRun;
+
+// This is a leaf indirection sector under the double or triple indirection
+// sector. group is the logical sector divided by the number of IDs per 
+// indirection sector
+typedef struct {
+  sector_t group;
+  // FS_INVALID_SECTOR if not used
+  sector_t sector;
+} MapIndir;
+
+// This is the per-inode mapping cache entry. It caches recently resolved
+// runs such that sequential I/O does not re-walk the addr array and the 
+// indirection sectors for every sector
+typedef struct {
+  // FS_INVALID_INODE if the entry is not used
+  inode_id_t inode;
+  // The run that will be replaced next
+  int next_victim;
+  // Used to find the least recently used inode
+  uint64_t last_access;
+  MapRun runs[FS_MAP_CACHE_RUN_MAX];
+  // The leaf indirection sector that will be replaced next
+  int next_indir_victim;
+  MapIndir indirs[FS_MAP_CACHE_INDIR_MAX];
+} MapCacheEntry;
+
+MapCacheEntry map_cache[FS_MAP_CACHE_INODE_MAX];
+// Logical clock for LRU
+uint64_t map_cache_clock = 0;
+// Statistics
+uint64_t map_cache_hit = 0;
+uint64_t map_cache_miss = 0;
+uint64_t map_cache_indir_hit = 0;
 
 /*
- * fs_get_file_sector() - This function returns the sector ID given an offset in
- *                        the file
- *
- * This function returns invalid sector ID if the offset falls in a region
- * that no data has been written. By default this should map to all-zero sector
- *
- * This function is for read. It does not allocate any sector or change the 
- * layout of the inode's addr list.
+ * fs_map_cache_init() - This function clears the mapping cache
  *
- * This function pins the inode passed in, such that its buffer remains valid
- * after return
+ * It must be called whenever a file system is initialized or loaded
  */
-sector_t fs_get_file_sector(Storage *disk_p,
-                            Inode *inode_p,
-                            size_t offset) {
-  // Just dereference the pointer
-  sector_t *sector = fs_get_file_sector_p(disk_p, inode_p, offset);
-  if(sector == NULL) {
-    return FS_INVALID_SECTOR;
-  } else {
-    return *sector;
+void fs_map_cache_init() {
+  for(int i = 0;i < FS_MAP_CACHE_INODE_MAX;i++) {
+    memset(map_cache + i, 0x00, sizeof(MapCacheEntry));
+    map_cache[i].inode = FS_INVALID_INODE;
   }
+
+  map_cache_clock = 0;
+  map_cache_hit = map_cache_miss = map_cache_indir_hit = 0;
+
+  return;
 }
 
 /*
- * fs_convert_to_large() - Converts a given inode to large file and changes the
- *                         inode addr layout accordingly
- *
- * The inode passed in must not be an inode itself. If this function fails 
- * for lacking free sector, we return INVALID_SECTOR; otherwise return the
- * sector for new indir sector.
- *
- * This function does not logically change the file
- *
- * inode_p should be pinned as we read another sector
+ * fs_map_cache_find() - Returns the cache entry of an inode, or NULL if the
+ *                       inode is not cached
  */
-sector_t fs_convert_to_large(Storage *disk_p, Inode *inode_p) {
-  assert(fs_is_file_large(inode_p) == 0);
-  assert(buffer_is_pinned(disk_p, inode_p) == 1);
-
-  sector_t ret;
-  // First use an indirection sector to hold all pointers
-  sector_t indir_sector = fs_alloc_sector(disk_p);
-  // If allocation fail we return fail
-  if(indir_sector == FS_INVALID_SECTOR) {
-    ret = FS_INVALID_SECTOR;
-  } else {
-    ret = indir_sector;
-    // Copy the addr array into the indir sector
-    sector_t *data_p = (sector_t *)write_lba(disk_p, indir_sector);
-    // Fill the entire disk with INVALID SECTOR
-    for(int i = 0;i < context.id_per_indir_sector;i++) {
-      data_p[i] = FS_INVALID_SECTOR;
+MapCacheEntry *fs_map_cache_find(inode_id_t inode) {
+  for(int i = 0;i < FS_MAP_CACHE_INODE_MAX;i++) {
+    if(map_cache[i].inode == inode) {
+      return map_cache + i;
     }
-    memcpy(data_p, inode_p->addr, sizeof(inode_p->addr));
-    // Reset all sectors of the array
-    fs_reset_addr(inode_p);
-    // It must be the first indir sector as we only have 8 in addr.
-    inode_p->addr[0] = indir_sector;
-    // If the offset is greater than the array size, then we should 
-    // convert it to a large block first
-    fs_set_file_large(inode_p);
   }
 
-  return ret;
+  return NULL;
 }
 
-// These two are used to distinguish data and indir sector when allocating
-// a new sector
-#define FS_INDIR_SECTOR 1
-#define FS_DATA_SECTOR  0
-
 /*
- * fs_addr_read_or_alloc() - This function either reads and returns a given
- *                           sector pointer's value, or allocate a new block
- *                           for it. 
- *
- * The return value is either the value read or allocated. Return 
- * invalid sector if allocation fails
- *
- * If the indir flag is set to 1, then we also initialize it as an indirection
- * sector. Otherwise the sector is not initialized
+ * fs_map_cache_lookup() - This function returns the cached physical sector
+ *                         of a logical sector in the inode
  *
- * Note that the pointer must be in the buffer area because we will pin it
- *
- * Also, the sector_p buffer could be loaded using read-only mode. We will set
- * it as dirty if we truly write into it other than simply reading its value.
+ * Returns FS_INVALID_SECTOR if the mapping is not cached. Holes are never
+ * cached
  */
-sector_t fs_addr_read_or_alloc(Storage *disk_p, sector_t *sector_p, int type) {
-  assert(type == FS_INDIR_SECTOR || type == FS_DATA_SECTOR);
-  buffer_pin(disk_p, sector_p);
-  sector_t sector = *sector_p;
-  if(sector == FS_INVALID_SECTOR) {
-    sector = fs_alloc_sector(disk_p);
-    // This is valid even when the allocation fails, because we did not
-    // change the value by doing this when it fails.
-    *sector_p = sector;
-    // If allocation succeeds we set the buffer as dirty
-    if(sector != FS_INVALID_SECTOR) {
-      buffer_set_dirty(disk_p, sector_p);
-    }
-    // If allocation succeeds and indir is 1 we also initialize it
-    if(type == FS_INDIR_SECTOR && sector != FS_INVALID_SECTOR) {
-      // Blind write
-      sector_t *data_p = (sector_t *)write_lba(disk_p, sector);
-      for(sector_t i = 0;i < context.id_per_indir_sector;i++) {
-        data_p[i] = FS_INVALID_SECTOR;
+sector_t fs_map_cache_lookup(inode_id_t inode, sector_t logical) {
+  MapCacheEntry *entry_p = fs_map_cache_find(inode);
+  if(entry_p != NULL) {
+    for(int i = 0;i < FS_MAP_CACHE_RUN_MAX;i++) {
+      MapRun *run_p = entry_p->runs + i;
+      if(logical >= run_p->logical && logical - run_p->logical < run_p->count) {
+        entry_p->last_access = ++map_cache_clock;
+        map_cache_hit++;
+        return run_p->physical + (logical - run_p->logical);
       }
     }
   }
 
-  buffer_unpin(disk_p, sector_p);
-  return sector;
+  map_cache_miss++;
+  return FS_INVALID_SECTOR;
 }
 
 /*
- * fs_get_file_sector_for_write_large_file() - This function finds or creates a
- *                                             sector for write in a large file
- *
- * The inode should be pinned. The sector should be larger than ADDR size.
- * The inode must point to a large file
- *
- * This function returns invalid sector if allocation fails when trying to
- * add an indirection sector or a data sector. Otherwise it returns the new 
- * data sector we added for found.
+ * fs_map_cache_get_entry() - Returns the cache entry of an inode, and evicts
+ *                            the LRU inode if the inode is not cached
  */
-sector_t fs_get_file_sector_for_write_large_file(Storage *disk_p, 
-                                                 Inode *inode_p, 
-                                                 sector_t sector) {
-  assert(buffer_is_pinned(disk_p, inode_p) == 1);
-  assert(sector >= FS_ADDR_ARRAY_MAX);
-  assert(fs_is_file_large(inode_p) == 1);
-  sector_t ret;
-  // These two are the index and offset of/within the first indirection level
-  sector_t indir_index = sector / context.id_per_indir_sector;
-  sector_t indir_offset = sector % context.id_per_indir_sector;
-  // If the index is still in large file range but not extra large file range
-  if(indir_index < (FS_ADDR_ARRAY_MAX - 1)) {
-    // Read or alloc the first indir sector
-    sector_t indir_sector = \
-      fs_addr_read_or_alloc(disk_p,
-                            &inode_p->addr[indir_index], 
-                            FS_INDIR_SECTOR);
-
-    // Only proceed to check the indir sector if we have not failed
-    // in the previous stage
-    if(indir_sector == FS_INVALID_SECTOR) {
-      ret = FS_INVALID_SECTOR;
-    } else {
-      assert(inode_p->addr[indir_index] != FS_INVALID_SECTOR);
-      // If the target sector is not in the extra large range
-      // we just write the sector
-      // Should pin it because we called alloc sector
-      sector_t *data_p = \
-        (sector_t *)read_lba(disk_p, indir_sector);
-      buffer_pin(disk_p, data_p);
-
-      // Then read or alloc a data sector for the first indir sector
-      // If fails then ret will be invalid sector
-      ret = fs_addr_read_or_alloc(disk_p,
-                                  &data_p[indir_offset], 
-                                  FS_DATA_SECTOR);
-
-      // Unpin the indirection buffer here before return
-      buffer_unpin(disk_p, data_p);
-    }
-  } else {
-    // If we are in this branch, then we fall into the extra large range
-    assert(sector >= context.extra_large_start_sector);
-    sector -= context.extra_large_start_sector;
-    indir_index = sector / context.id_per_indir_sector;
-    // The index cannot overflow a indir sector
-    assert(indir_index < context.id_per_indir_sector);
-    indir_offset = sector % context.id_per_indir_sector;
-    // Read or allocate it
-    sector_t first_indir_sector = \
-      fs_addr_read_or_alloc(disk_p,
-                            &inode_p->addr[FS_ADDR_ARRAY_MAX - 1], 
-                            FS_INDIR_SECTOR);
-    if(first_indir_sector != FS_INVALID_SECTOR) {
-      // If we have set the last sector in addr. array then the file is also
-      // extra large
-      assert(fs_is_file_extra_large(inode_p) == 1);
-      sector_t *first_indir_p = \
-        (sector_t *)read_lba(disk_p, first_indir_sector);
-      // It will be unpinned at the very end
-      buffer_pin(disk_p, first_indir_p);
-      sector_t second_indir_sector = \
-        fs_addr_read_or_alloc(disk_p,
-                              &first_indir_p[indir_index], 
-                              FS_INDIR_SECTOR);
-      if(second_indir_sector != FS_INVALID_SECTOR) {
-        sector_t *second_indir_p = \
-          (sector_t *)read_lba(disk_p, second_indir_sector);
-        buffer_pin(disk_p, second_indir_p);
-        // If the allocation fails then ret will naturally be invalid sector
-        ret = fs_addr_read_or_alloc(disk_p,
-                                    &second_indir_p[indir_offset], 
-                                    FS_DATA_SECTOR);
-        buffer_unpin(disk_p, second_indir_p);
-      } else {
-        ret = FS_INVALID_SECTOR;
+MapCacheEntry *fs_map_cache_get_entry(inode_id_t inode) {
+  MapCacheEntry *entry_p = fs_map_cache_find(inode);
+  if(entry_p == NULL) {
+    entry_p = map_cache;
+    for(int i = 1;i < FS_MAP_CACHE_INODE_MAX;i++) {
+      if(map_cache[i].last_access < entry_p->last_access) {
+        entry_p = map_cache + i;
       }
-      // Release the first indir sector
-      buffer_unpin(disk_p, first_indir_p);
-    } else {
-      ret = FS_INVALID_SECTOR;
     }
+
+    memset(entry_p, 0x00, sizeof(MapCacheEntry));
+    entry_p->inode = inode;
   }
 
-  return ret;
+  entry_p->last_access = ++map_cache_clock;
+  return entry_p;
 }
 
 /*
- * fs_get_file_sector_for_write() - This function returns the sector ID
- *                                  to write into.
- *
- * If the sector does not exist, or the offset exceeds the current file
- * end, then we allocate sector for the indirection block, and then try again
- *
- * Note that this function may leave holes in the array of blocks or indirection
- * blocks. In these cases, the slot has value invalid sector ID. Any read 
- * operation to these ranges should return 0
- *
- * This function returns a sector ID for write. If it returns invalid ID then
- * we have run out of blocks.
+ * fs_map_cache_insert() - This function records a resolved run of mappings
  *
- * This function will pin the inode such that its buffer remains valid
- * after function return
+ * If the run directly follows one of the cached runs both logically and
+ * physically, we extend that run. Otherwise we replace a run in round-robin
+ * order. If the inode is not cached we evict the LRU inode
  */
-sector_t fs_get_file_sector_for_write(Storage *disk_p,
-                                      Inode *inode_p,
-                                      size_t offset) {
-  // First pin the buffer, because we will read sectors
-  buffer_pin(disk_p, inode_p);
-
-  sector_t ret;
-  sector_t sector = (sector_t)(offset / disk_p->sector_size);
-  assert(((size_t)sector * disk_p->sector_size) == offset);
-  if(fs_is_file_large(inode_p) == 0) {
-    // If it is not large, then check the sector offset
-    if(sector >= FS_ADDR_ARRAY_MAX) {
-      // This does not logically change the file
-      sector_t indir_sector = fs_convert_to_large(disk_p, inode_p);
-      if(indir_sector == FS_INVALID_SECTOR) {
-        ret = FS_INVALID_SECTOR;
-      } else {
-        ret = fs_get_file_sector_for_write_large_file(disk_p, inode_p, sector);
-      }
-    } else {
-      // If it fails then ret will be invalid sector
-      ret = fs_addr_read_or_alloc(disk_p, 
-                                  &inode_p->addr[sector], 
-                                  FS_DATA_SECTOR);
+void fs_map_cache_insert(inode_id_t inode, 
+                         sector_t logical, 
+                         sector_t physical, 
+                         sector_count_t count) {
+  assert(physical != FS_INVALID_SECTOR);
+  assert(count != 0);
+  MapCacheEntry *entry_p = fs_map_cache_get_entry(inode);
+  for(int i = 0;i < FS_MAP_CACHE_RUN_MAX;i++) {
+    MapRun *run_p = entry_p->runs + i;
+    if(run_p->count != 0 &&
+       logical == run_p->logical + run_p->count && 
+       physical == run_p->physical + run_p->count) {
+      run_p->count += count;
+      return;
     }
-  } else {
-    // Just forward it to the function
-    ret = fs_get_file_sector_for_write_large_file(disk_p, inode_p, sector);
   }
-  
-  buffer_unpin(disk_p, inode_p);
-  return ret;
+
+  MapRun *run_p = entry_p->runs + entry_p->next_victim;
+  entry_p->next_victim = (entry_p->next_victim + 1) % FS_MAP_CACHE_RUN_MAX;
+  run_p->logical = logical;
+  run_p->physical = physical;
+  run_p->count = count;
+
+  return;
 }
 
 /*
- * fs_alloc_sector_for_dir() - This function allocates a sector for holding
- *                             directory entries
+ * fs_map_cache_lookup_indir() - This function returns the cached leaf 
+ *                               indirection sector of a group of logical
+ *                               sectors
  *
- * We fill the sector with unused entries.
- *
- * If allocation fails we return invalid sector. The buffer should be pinned
+ * Returns FS_INVALID_SECTOR if it is not cached
  */
-sector_t fs_alloc_sector_for_dir(Storage *disk_p, 
-                                 Inode *inode_p, 
-                                 sector_t alloc_for) {
-  assert(buffer_is_pinned(disk_p, inode_p) == 1);
-  // Allocate for the linear sector specifid in the argument
-  sector_t sector = \
-    fs_get_file_sector_for_write(disk_p, 
-                                 inode_p, 
-                                 (size_t)alloc_for * disk_p->sector_size);
-  // If the sector is allocated then initialize its content
-  if(sector != FS_INVALID_SECTOR) {
-    DirEntry *entry_p = (DirEntry *)write_lba(disk_p, sector);
-    for(int i = 0;i < context.dir_per_sector;i++) {
-      entry_p[i].inode = FS_INVALID_INODE;
+sector_t fs_map_cache_lookup_indir(inode_id_t inode, sector_t group) {
+  MapCacheEntry *entry_p = fs_map_cache_find(inode);
+  if(entry_p != NULL) {
+    for(int i = 0;i < FS_MAP_CACHE_INDIR_MAX;i++) {
+      MapIndir *indir_p = entry_p->indirs + i;
+      if(indir_p->sector != FS_INVALID_SECTOR && indir_p->group == group) {
+        entry_p->last_access = ++map_cache_clock;
+        map_cache_indir_hit++;
+        return indir_p->sector;
+      }
     }
   }
 
-  return sector;
+  return FS_INVALID_SECTOR;
 }
 
 /*
- * fs_free_dir_sector() - This function frees a directory's sector
+ * fs_map_cache_insert_indir() - This function records the leaf indirection
+ *                               sector of a group of logical sectors
  *
- * We did not check whether the sector is all empty. The caller should
- * respect this.
+ * Entries are replaced in round-robin order. This saves walking the upper
+ * indirection levels of extra large files, which otherwise costs one or two
+ * buffer lookups per sector
+ */
+void fs_map_cache_insert_indir(inode_id_t inode, 
+                               sector_t group, 
+                               sector_t sector) {
+  assert(sector != FS_INVALID_SECTOR);
+  MapCacheEntry *entry_p = fs_map_cache_get_entry(inode);
+  MapIndir *indir_p = entry_p->indirs + entry_p->next_indir_victim;
+  entry_p->next_indir_victim = \
+    (entry_p->next_indir_victim + 1) % FS_MAP_CACHE_INDIR_MAX;
+  indir_p->group = group;
+  indir_p->sector = sector;
+
+  return;
+}
+
+/*
+ * fs_map_cache_invalidate() - This function drops all cached runs of an inode
  *
- * This function assumes that the inode has been pinned in the buffer
+ * This must be called when a mapping of the inode is removed, or when the 
+ * inode is allocated or freed. Adding new mappings does not contradict the
+ * cached runs, because holes are never cached
  */
-void fs_free_dir_sector(Storage *disk_p, 
-                        Inode *inode_p, 
-                        void *free_sector_p, 
-                        int is_last_sector) {
-  assert(buffer_is_pinned(disk_p, inode_p));
-  // Must pin as we read other sectors, and also must set to dirty
-  buffer_pin(disk_p, free_sector_p);
-  // Just decrease by sector size and the offset now points to the 
-  // last sector
-  const size_t last_offset = fs_get_file_size(inode_p) - disk_p->sector_size;
-  // The returned value may be inside an indirection sector, so we should
-  // change it before we read any sector
-  sector_t * const last_sector_slot_p = \
-    fs_get_file_sector_p(disk_p, inode_p, last_offset);
-  // Dereference to get the sector value
-  const sector_t last_sector = *last_sector_slot_p;
-  // Then remove it from the slot
-  *last_sector_slot_p = FS_INVALID_SECTOR;
-  // Make it dirty. Can be in either inode or indir. sector
-  buffer_set_dirty(disk_p, last_sector_slot_p);
-  assert(last_sector != FS_INVALID_SECTOR);
-  // Only copy for the last sector
-  if(is_last_sector == 0) {
-    void *data_p = read_lba(disk_p, last_sector);
-    memcpy(free_sector_p, data_p, disk_p->sector_size);
-    buffer_set_dirty(disk_p, free_sector_p);
+void fs_map_cache_invalidate(inode_id_t inode) {
+  MapCacheEntry *entry_p = fs_map_cache_find(inode);
+  if(entry_p != NULL) {
+    memset(entry_p, 0x00, sizeof(MapCacheEntry));
+    entry_p->inode = FS_INVALID_INODE;
   }
-  // Reduce the directory size by sector size
-  fs_set_file_size(inode_p, fs_get_file_size(inode_p) - disk_p->sector_size);
-  fs_free_sector(disk_p, last_sector);
-  buffer_unpin(disk_p, free_sector_p);
+
   return;
-} 
+}
+
+// Number of inodes in the inode cache
+#define FS_ICACHE_INODE_MAX 32
+
+// This is an inode held in the inode cache. The inode is a copy of the one
+// in the inode table, which is written back when the entry is evicted or 
+// when the file system is synced
+typedef struct {
+  Inode inode;
+  // FS_INVALID_INODE if the entry is not used
+  inode_id_t id;
+  // Number of fs_iget() and fs_pin() not yet released. Entries with 
+  // references are never evicted
+  uint32_t ref_count;
+  int dirty;
+  // Value of icache_clock when the entry is last returned by fs_iget()
+  uint64_t last_access;
+} ICacheEntry;
+
+ICacheEntry icache[FS_ICACHE_INODE_MAX];
+uint64_t icache_clock;
+uint64_t icache_hit;
+uint64_t icache_miss;
 
 /*
- * fs_free_dir_entry() - This function removes a dir entry from a directory's
- *                       inode
+ * fs_icache_init() - This function clears the inode cache
  *
- * This function proceeds as follows:
- *   1. If the name length is greather than the maximum allowed name length
- *      then we directly return FS_ERR_NAME_NOT_FOUND
- *   2. If the name is '.' or '..' then we return FS_ERR_ILLEGAL_NAME
- *   3. If the name is not found in the directory, then we return
- *      FS_ERR_NAME_NOT_FOUND
- *
- * Note that this function only removes a directory entry, and does not check
- * its type (e.g. whether it is a non-empty directory) or does not free sectors
- * of the dir entry.
+ * Inodes that are not written back are discarded. This must be called when 
+ * a new file system is loaded
+ */
+void fs_icache_init() {
+  memset(icache, 0x00, sizeof(icache));
+  for(int i = 0;i < FS_ICACHE_INODE_MAX;i++) {
+    icache[i].id = FS_INVALID_INODE;
+  }
+  icache_clock = icache_hit = icache_miss = 0;
+
+  return;
+}
+
+/*
+ * fs_icache_find() - Returns the cache entry of an inode, or NULL
+ */
+ICacheEntry *fs_icache_find(inode_id_t inode) {
+  for(int i = 0;i < FS_ICACHE_INODE_MAX;i++) {
+    if(icache[i].id == inode) {
+      return &icache[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * fs_icache_find_using_data() - Returns the cache entry that holds the given
+ *                               pointer, or NULL if the pointer is not into 
+ *                               the inode cache
  *
- * This function pins the inode in the buffer.
+ * The pointer could be the inode itself, or any of its fields
  */
-int fs_free_dir_entry(Storage *disk_p, Inode *inode_p, const char *name) {
-  buffer_pin(disk_p, inode_p);
-  // If length exceeds the maximum file name length then we know we will
-  // not have a match
-  int len = strlen(name);
-  if(len > FS_DIR_ENTRY_NAME_MAX) {
-    return FS_ERR_NAME_NOT_FOUND;
+ICacheEntry *fs_icache_find_using_data(const void *data_p) {
+  if((uint8_t *)data_p < (uint8_t *)icache || 
+     (uint8_t *)data_p >= (uint8_t *)(icache + FS_ICACHE_INODE_MAX)) {
+    return NULL;
   }
 
-  // We could not delete . or ..
-  if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-    return FS_ERR_ILLEGAL_NAME;
+  ICacheEntry *entry_p = \
+    icache + ((uint8_t *)data_p - (uint8_t *)icache) / sizeof(ICacheEntry);
+  assert(entry_p->id != FS_INVALID_INODE);
+  return entry_p;
+}
+
+/*
+ * fs_icache_write_back() - This function copies a dirty cached inode into 
+ *                          its sector buffer
+ */
+void fs_icache_write_back(Storage *disk_p, ICacheEntry *entry_p) {
+  // EARLY RETURN
+  if(entry_p->dirty == 0) {
+    return;
   }
 
-  const size_t dir_size = fs_get_file_size(inode_p);
-  assert(dir_size != 0);
-  assert(dir_size % disk_p->sector_size == 0);
-  const sector_t sector_count = dir_size / disk_p->sector_size;
-  // By default we return this
-  // We will change this if an entry is found below
-  int ret = FS_ERR_NAME_NOT_FOUND;
-  for(sector_t i = 0;i < sector_count;i++) {
-    // Find the i-th sector in the directory
-    sector_t sector = \
-      fs_get_file_sector(disk_p, inode_p, i * disk_p->sector_size);
-    // There is no hole in the directory
-    assert(sector != FS_INVALID_SECTOR);
-    DirEntry *entry_p = (DirEntry *)read_lba(disk_p, sector);
-    // Count how many invalid sectors are there
-    int invalid_count = 0;
-    for(int j = 0;j < context.dir_per_sector;j++) {
-      if(entry_p[j].inode != FS_INVALID_INODE) {
-        // Use memcmp because we do not want to compare the terminating 0
-        if(ret != FS_SUCCESS && memcmp(name, entry_p[j].name, len) == 0) {
-          ret = FS_SUCCESS;
-          entry_p[j].inode = FS_INVALID_INODE;
-          // Because we just deleted an entry
-          invalid_count++;
-          buffer_set_dirty(disk_p, entry_p);
-        }
-      } else {
-        invalid_count++;
-      }
-    }
+  Inode *inode_p = (Inode *)read_lba_for_write(
+    disk_p, context.inode_start_sector + entry_p->id / context.inode_per_sector);
+  memcpy(inode_p + entry_p->id % context.inode_per_sector, 
+         &entry_p->inode, 
+         sizeof(Inode));
+  entry_p->dirty = 0;
 
-    // If the invalid count equals the number of directories per sector
-    // then the current sector is empty. We just copy the last sector to
-    // this location, and frees the last sector
-    if(invalid_count == context.dir_per_sector) {
-      // The first sector can never be invalid
-      assert(i != 0);
-      int is_last_sector = 0;
-      if(i == (sector_count - 1)) {
-        is_last_sector = 1;
-      } else {
-        // Because we need to re-iterate through the sector
-        // as it is replaced by the last sector
-        // For last sector do not need to do this
-        i--;
-      }
-      // Free the sector by copying the last sector to
-      // the i-th sector, and frees the last sector
-      fs_free_dir_sector(disk_p, inode_p, entry_p, is_last_sector);
-    }
+  return;
+}
 
-    // If we have found the name then do not bother going forward
-    if(ret == FS_SUCCESS) {
-      break;
+/*
+ * fs_icache_sync() - This function writes back all dirty cached inodes
+ *
+ * The inodes remain in the cache
+ */
+void fs_icache_sync(Storage *disk_p) {
+  for(int i = 0;i < FS_ICACHE_INODE_MAX;i++) {
+    if(icache[i].id != FS_INVALID_INODE) {
+      fs_icache_write_back(disk_p, &icache[i]);
     }
   }
 
-  buffer_unpin(disk_p, inode_p);
-  return ret;
+  return;
 }
 
 /*
- * fs_add_dir_entry() - This function adds a new dir entry for finds an unused 
- *                      entry in the given inode
- *
- * This function will pin the inode, and unpins it before return. In order for
- * the dir entry to remain valid, the caller should be responsible not to
- * invalidate it.
- *
- * This function sets the buffer as dirty. The caller could directly write into
- * it.
+ * fs_pin() - This function pins an inode, or any other metadata pointer
  *
- * If sector allocation fails, this function returns NULL. Otherwise returns the
- * pointer from the buffer.
+ * Inode pointers could either be into a sector buffer, returned by 
+ * fs_load_inode_sector(), or into the inode cache, returned by fs_iget().
+ * The latter is pinned by taking a reference. FS functions that receive an
+ * inode pointer use these wrappers instead of the buffer's
  */
-DirEntry *fs_add_dir_entry(Storage *disk_p, Inode *inode_p) {
-  // Make sure we are operating on inode that represents dir
-  assert(fs_get_file_type(inode_p) == FS_INODE_TYPE_DIR);
+void fs_pin(Storage *disk_p, const void *data_p) {
+  ICacheEntry *entry_p = fs_icache_find_using_data(data_p);
+  if(entry_p != NULL) {
+    entry_p->ref_count++;
+  } else {
+    buffer_pin(disk_p, data_p);
+  }
 
-  buffer_pin(disk_p, inode_p);
-  DirEntry *ret = NULL;
-  // Find the sector. Note that size of the directory is always a
-  // multiple of sectors
-  size_t dir_size = fs_get_file_size(inode_p);
-  // If the dir size is 0 then we allocate the first sector to it
-  if(dir_size == 0UL) {
-    // Allocate first sector
-    sector_t new_sector = fs_alloc_sector_for_dir(disk_p, inode_p, 0);
-    // EARLY RETURN
-    if(new_sector == FS_INVALID_SECTOR) {
-      buffer_unpin(disk_p, inode_p);
-      return NULL;
-    }
+  return;
+}
 
-    fs_set_file_size(inode_p, disk_p->sector_size);
-    dir_size = disk_p->sector_size;
+/*
+ * fs_unpin() - This function unpins a pointer pinned by fs_pin()
+ */
+void fs_unpin(Storage *disk_p, const void *data_p) {
+  ICacheEntry *entry_p = fs_icache_find_using_data(data_p);
+  if(entry_p != NULL) {
+    assert(entry_p->ref_count != 0);
+    entry_p->ref_count--;
+  } else {
+    buffer_unpin(disk_p, data_p);
   }
-  assert(dir_size != 0);
-  assert(dir_size % disk_p->sector_size == 0);
-  const sector_t last_sector = (sector_t)(dir_size / disk_p->sector_size) - 1;
-  assert(last_sector != (sector_t)-1);
 
-  // Tentatively read it. If we do need to modify the sector we just
-  // set dirty later
-  // We scan all sectors from the last sector
-  for(sector_t sector = last_sector;sector != (sector_t)-1;sector--) {
-    sector_t actual_sector = \
-      fs_get_file_sector(disk_p, inode_p, sector * disk_p->sector_size);
-    // We do not allow holes in the directory
-    assert(actual_sector != FS_INVALID_SECTOR);
-    DirEntry *entry_p = (DirEntry *)read_lba(disk_p, actual_sector);
-    // Check every dir entry
-    for(int i = 0;i < context.dir_per_sector;i++) {
-      if(entry_p[i].inode == FS_INVALID_INODE) {
-        // This is the entry we are looking for
-        ret = entry_p + i;
-        // Set buffer as dirty because we intend to write it back
-        buffer_set_dirty(disk_p, ret);
-        break;
-      }
-    }
+  return;
+}
 
-    if(ret != NULL) {
-      break;
-    }
+/*
+ * fs_set_dirty() - This function marks an inode, or any other metadata 
+ *                  pointer as dirty
+ *
+ * Cached inodes are only copied to the sector buffer on write back
+ */
+void fs_set_dirty(Storage *disk_p, const void *data_p) {
+  ICacheEntry *entry_p = fs_icache_find_using_data(data_p);
+  if(entry_p != NULL) {
+    entry_p->dirty = 1;
+  } else {
+    buffer_set_dirty(disk_p, data_p);
   }
 
-  // If still could not find entry, then allocate one
-  if(ret == NULL) {
-    // Allocate the next sector
-    sector_t new_sector = \
-      fs_alloc_sector_for_dir(disk_p, inode_p, last_sector + 1);
-    // EARLY RETURN
-    if(new_sector == FS_INVALID_SECTOR) {
-      buffer_unpin(disk_p, inode_p);
-      return NULL;
-    }
+  return;
+}
 
-    // Update the sector size. We will write this back later
-    dir_size += disk_p->sector_size;
-    // Update the dir size
-    fs_set_file_size(inode_p, dir_size);
-    // This is the first entry, and it must be not used
-    // Also this buffer is set to dirty when we load it
-    DirEntry *entry_p = (DirEntry *)read_lba_for_write(disk_p, new_sector);
-    ret = entry_p;
+/*
+ * fs_is_pinned() - Returns 1 if the pointer is pinned or referenced
+ */
+int fs_is_pinned(Storage *disk_p, const void *data_p) {
+  ICacheEntry *entry_p = fs_icache_find_using_data(data_p);
+  if(entry_p != NULL) {
+    return !!(entry_p->ref_count != 0);
   }
 
-  buffer_unpin(disk_p, inode_p);
-  return ret;
+  return buffer_is_pinned(disk_p, data_p);
 }
 
 /*
- * fs_open_dir() - This function returns a structure that supports iterating on
- *                 the directory's content
+ * fs_iget() - This function returns the cached copy of an inode, and takes
+ *             a reference on it
  *
- * Note that we only stores the inode number in the iterator. This allows us
- * to iterate while the buffer is unpinned.
+ * The returned pointer stays valid until fs_iput() is called, no matter how
+ * many sectors are read in the meantime, so the caller does not need to pin
+ * it. It could be passed to all FS functions that take an inode pointer. 
+ * Changes are made through fs_set_dirty(), and reach the inode table when 
+ * the entry is evicted or on fs_sync().
  *
- * The dir does not need to be closed. Once finished the caller could just
- * discard the dir structure
+ * If the inode's sector is pinned in the buffer, a caller may hold a pointer
+ * into the sector, and a cached copy would diverge from it. The inode is then
+ * not cached, and the sector is pinned and returned instead
  *
- * If the inode is not a directory this function will report error. The caller
- * should check this error condition
+ * If all cached inodes are referenced, this function reports error
  */
-Dir fs_open_dir(Storage *disk_p, inode_id_t inode) {
-  Dir dir;
-  dir.inode = inode;
-  // Read the inode's sector for its file size
-  Inode *inode_p = \
-    fs_load_inode_sector(disk_p, inode, FS_LOAD_INODE_SECTOR_READ_ONLY);
-  assert(inode_p != NULL);
-  // Must be an inode
-  assert(fs_get_file_type(inode_p) == FS_INODE_TYPE_DIR);
-  // Number of sectors in the directory
-  dir.sector_count = \
-    (sector_count_t)fs_get_file_size(inode_p) / disk_p->sector_size;
-  dir.current_sector = 0;
-  dir.current_index = 0;
+Inode *fs_iget(Storage *disk_p, inode_id_t inode) {
+  assert(inode < context.total_inode_count);
+  icache_clock++;
+  ICacheEntry *entry_p = fs_icache_find(inode);
+  if(entry_p != NULL) {
+    icache_hit++;
+  } else {
+    icache_miss++;
+    // Evict the least recently used entry that is not referenced
+    for(int i = 0;i < FS_ICACHE_INODE_MAX;i++) {
+      if(icache[i].ref_count == 0 && 
+         (entry_p == NULL || icache[i].last_access < entry_p->last_access)) {
+        entry_p = &icache[i];
+      }
+    }
+    if(entry_p == NULL) {
+      fatal_error("All cached inodes are referenced");
+    }
 
-  return dir;
+    if(entry_p->id != FS_INVALID_INODE) {
+      fs_icache_write_back(disk_p, entry_p);
+    }
+    Inode *inode_p = \
+      fs_load_inode_sector(disk_p, inode, FS_LOAD_INODE_SECTOR_READ_ONLY);
+    // EARLY RETURN
+    if(buffer_is_pinned(disk_p, inode_p)) {
+      buffer_pin(disk_p, inode_p);
+      return inode_p;
+    }
+    memcpy(&entry_p->inode, inode_p, sizeof(Inode));
+    entry_p->id = inode;
+    entry_p->dirty = 0;
+  }
+
+  entry_p->ref_count++;
+  entry_p->last_access = icache_clock;
+
+  return &entry_p->inode;
 }
 
 /*
- * fs_dir_next_entry() - This function advances the given dir object
- *                       and loads the next sector if we have reached
- *                       the end of the current sector
+ * fs_iput() - This function releases a reference taken by fs_iget()
+ */
+void fs_iput(Storage *disk_p, Inode *inode_p) {
+  assert(fs_is_pinned(disk_p, inode_p));
+  fs_unpin(disk_p, inode_p);
+
+  return;
+}
+
+/*
+ * fs_get_inode_id() - This function returns the inode number of an inode
+ *                     pointer into an inode sector's buffer or into the 
+ *                     inode cache
  *
- * It takes the current entry pointer, and will return the next entry by
- * incrementing this pointer if we have not finished the current sector
+ * Returns FS_INVALID_INODE if the pointer is not in an inode sector
  */
-void fs_dir_next_entry(Storage *disk_p, Dir *dir_p, DirEntry *entry_p) {
+inode_id_t fs_get_inode_id(Storage *disk_p, const Inode *inode_p) {
+  ICacheEntry *entry_p = fs_icache_find_using_data(inode_p);
+  // EARLY RETURN
+  if(entry_p != NULL) {
+    return entry_p->id;
+  }
+
+  Buffer *buffer_p = buffer_find_using_data(disk_p, inode_p);
+  if(buffer_p == NULL || 
+     buffer_p->in_use == 0 ||
+     buffer_p->lba < context.inode_start_sector || 
+     buffer_p->lba >= context.inode_end_sector) {
+    return FS_INVALID_INODE;
+  }
 
+  return (inode_id_t)((buffer_p->lba - context.inode_start_sector) * 
+                        context.inode_per_sector + 
+                      (inode_p - (const Inode *)buffer_p->data));
 }
- 
+
 /*
- * fs_next_dir() - This function returns the next directory entry for the 
- *                 current iterator
+ * fs_extent_list() - Returns the extents of an extent-mapped file
  *
- * If there is no next dir then we return the NULL pointer. Otherwise the 
- * const pointer is returned, and we increment the iterator structure
+ * The extents are either in the addr. array or in the extent sector, and 
+ * are sorted by their logical sector. The number of extents is stored into
+ * count_p. The inode should be pinned. The returned array is only valid 
+ * until another sector is read
+ */
+Extent *fs_extent_list(Storage *disk_p, Inode *inode_p, size_t *count_p) {
+  assert(fs_is_file_extent(inode_p) == 1);
+  *count_p = inode_p->addr[FS_EXTENT_COUNT_SLOT];
+  // EARLY RETURN
+  if(inode_p->addr[FS_EXTENT_SECTOR_SLOT] == FS_INVALID_SECTOR) {
+    return (Extent *)inode_p->addr;
+  }
+
+  return (Extent *)read_lba(disk_p, inode_p->addr[FS_EXTENT_SECTOR_SLOT]);
+}
+
+/*
+ * fs_extent_search() - Returns the number of extents that start at or before
+ *                      the logical sector
  *
- * The returned value is not pinned. The caller should pin it if necessary
+ * This is a binary search. The extent that may contain the logical sector
+ * is the one before the returned index
  */
-const DirEntry *fs_next_dir(Storage *disk_p, Dir *dir_p) {
-  Inode *inode_p = \
-    fs_load_inode_sector(disk_p, dir_p->inode, FS_LOAD_INODE_SECTOR_READ_ONLY);
-  assert(inode_p != NULL);
+size_t fs_extent_search(const Extent *extent_p, 
+                        size_t count, 
+                        size_t logical) {
+  size_t low = 0;
+  size_t high = count;
+  while(low < high) {
+    const size_t mid = low + (high - low) / 2;
+    if(extent_p[mid].logical <= logical) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
 
-  // If we are not already at the end of the sector
-  if(dir_p->current_index == context.dir_per_sector) {
-    dir_p->current_index = 0;
-    dir_p->current_sector++;
-    if(dir_p->current_sector == dir_p->sector_count) {
-      return NULL;
+  return low;
+}
+
+/*
+ * fs_extent_map() - This function maps logical sectors of an extent-mapped
+ *                   file that start at the given one
+ *
+ * If the sector is in an extent, the physical sector is stored into start_p,
+ * and the number of sectors till the end of the extent is returned. 
+ * Otherwise FS_INVALID_SECTOR is stored, and the number of sectors till the
+ * next extent is returned, which is SIZE_MAX after the last extent. The 
+ * inode should be pinned
+ */
+size_t fs_extent_map(Storage *disk_p, 
+                     Inode *inode_p, 
+                     size_t logical, 
+                     sector_t *start_p) {
+  size_t count;
+  const Extent *extent_p = fs_extent_list(disk_p, inode_p, &count);
+  const size_t index = fs_extent_search(extent_p, count, logical);
+  if(index > 0) {
+    const Extent *prev_p = &extent_p[index - 1];
+    const size_t rel = logical - prev_p->logical;
+    // EARLY RETURN
+    if(rel < prev_p->count) {
+      *start_p = (sector_t)(prev_p->physical + rel);
+      return prev_p->count - rel;
     }
   }
 
-  // This is the linear offset inside the directory
-  size_t next_offset = dir_p->current_sector * disk_p->sector_size;
-  // Then translate the linear sector to global sector
-  sector_t sector = fs_get_file_sector(disk_p, inode_p, next_offset);
-  DirEntry *entry_p = \
-    (DirEntry *)read_lba(disk_p, sector) + dir_p->current_index;
-  // Then start searching at current index in current sector
-  while(1) {
-    // If the current one is valid and if it is reserved names then return it
-    if(dir_p->current_index != context.dir_per_sector &&
-       entry_p[dir_p->current_index].inode != FS_INVALID_INODE && 
-       memcmp(entry_p->name, ".", 1) != 0 && 
-       memcmp(entry_p->name, "..", 2) != 0) {
-      dir_p->current_index++;
-      break;
-    }
+  *start_p = FS_INVALID_SECTOR;
+  return (index < count) ? extent_p[index].logical - logical : SIZE_MAX;
+}
 
-    dir_p->current_index++;
-    entry_p++;
+// Maximum number of indirection levels under a slot of the addr. array
+#define FS_INDIR_LEVEL_MAX 3
 
-    // If the index overflows then go to the next sector
-    if(dir_p->current_index == context.dir_per_sector) {
-      dir_p->current_index = 0;
-      dir_p->current_sector++;
-      // If sector overflows then that's all
-      if(dir_p->current_sector == dir_p->sector_count) {
-        entry_p = NULL;
-        break;
-      } else {
-        // Otherwise load the next sector
-        next_offset += disk_p->sector_size;
-        sector = fs_get_file_sector(disk_p, inode_p, next_offset);
-        entry_p = (DirEntry *)read_lba(disk_p, sector);
-      }
-    }
+/*
+ * fs_get_indir_span() - Returns the number of logical sectors mapped by an
+ *                       indirection sector with the given number of levels
+ */
+size_t fs_get_indir_span(size_t level) {
+  size_t span = 1;
+  for(size_t i = 0;i < level;i++) {
+    span *= context.id_per_indir_sector;
   }
 
-  return entry_p;
+  return span;
 }
 
 /*
- * fs_is_valid_char() - Returns 1 if the char is valid for file name
+ * fs_get_slot_level() - This function returns the number of indirection 
+ *                       levels under a slot in the addr. array of a large 
+ *                       file
  *
- * Valid chars are:
- *   1. Alphabet
- *   2. Numeric digits
- *   3. Underline, dash and dot
- *   4. Space character
+ * The first logical sector mapped by the slot is stored into base_p. Slots
+ * before indir_slot_count are single indirection sectors, which are 
+ * followed by the double indirection sector, and the triple indirection 
+ * sector if the layout has one
  */
-int fs_is_valid_char(char ch) {
-  if(ch >= 'A' && ch <= 'Z') {
-    return 1;
-  } else if(ch >= 'a' && ch <= 'z') {
-    return 1;
-  } else if(ch >= '0' && ch <= '9') {
-    return 1;
-  } else if(ch == '.' || ch == '-' || ch == '_' || ch == ' ') {
+size_t fs_get_slot_level(size_t slot, size_t *base_p) {
+  assert(slot < FS_ADDR_ARRAY_MAX);
+  if(slot < context.indir_slot_count) {
+    *base_p = slot * context.id_per_indir_sector;
     return 1;
+  } else if(slot == context.indir_slot_count) {
+    *base_p = context.extra_large_start_sector;
+    return 2;
   }
 
-  return 0;
+  *base_p = context.triple_large_start_sector;
+  return 3;
 }
 
-#define FS_SET_DIR_NAME_DISALLOW_DOT 0
-#define FS_SET_DIR_NAME_ALLOW_DOT    1
-
 /*
- * fs_set_dir_name() - This function sets the directory name
- *
- * This function proceeds as follows:
- *   1. If the length of the name exceeds the maximum length then return 
- *      FS_ERR_NAME_TOO_LONG
- *      1.1 Defined by FS_DIR_ENTRY_NAME_MAX, not including any '\0' padding
- *      1.2 We do not use '\0' to terminate the file name either
- *   2. If there is any forbidden char, then we return FS_ERR_ILLEGAL_CHAR
- *      2.1 alphanumeric, underline, dash, and space are allowed
- *      2.2 All other characters are not allowed
- *   3. If the name itself is illegal, then we return FS_ERR_ILLEGAL_NAME
- *      3.1 Names that only has '.' character
- *      3.2 Names that only has space character
+ * fs_get_indir_path() - This function finds the slot in the addr. array of a
+ *                       large file that maps a logical sector, and the index
+ *                       in each level of indirection sectors under the slot
  *
- * If we need to allow names that only have dot, then the allow_all_dot should 
- * be set to 1. This feature is only used for initializing a directory
+ * index_list[0] is the index in the sector pointed to by the slot, and the 
+ * last one is the index in the leaf indirection sector. The offset of the
+ * logical sector from the first one mapped by the slot is stored into rel_p.
  *
- * This function will set the entry as dirty. This function does not check for
- * duplicated names
+ * Returns the number of levels, or 0 if the sector is beyond the largest 
+ * file of the layout
  */
-int fs_set_dir_name(Storage *disk_p, 
-                    DirEntry *entry_p, 
-                    const char *name, 
-                    int allow_all_dot) {
-  int len = strlen(name);
-  if(len > FS_DIR_ENTRY_NAME_MAX) {
-    return FS_ERR_NAME_TOO_LONG;
+size_t fs_get_indir_path(size_t logical, 
+                         size_t *slot_p, 
+                         size_t *rel_p, 
+                         size_t *index_list) {
+  size_t slot;
+  if(logical < context.extra_large_start_sector) {
+    slot = logical / context.id_per_indir_sector;
+  } else if(logical < context.triple_large_start_sector) {
+    slot = context.indir_slot_count;
+  } else {
+    slot = context.indir_slot_count + 1;
   }
 
-  const char *p = name;
-  // As long as any of the character is invalid, the entire name is invalid
-  while(*p != '\0') {
-    if(fs_is_valid_char(*p) == 0) {
-      return FS_ERR_ILLEGAL_CHAR;
-    }
-    p++;
+  // EARLY RETURN
+  if(slot >= FS_ADDR_ARRAY_MAX) {
+    return 0;
   }
 
-  p = name;
-  // Are set to 0 if we see anything other than a dot/space
-  int all_dots = 1;
-  int all_space = 1;
-  while(*p != '\0') {
-    if(*p != '.') {
-      all_dots = 0; 
-    }
+  size_t base;
+  const size_t level = fs_get_slot_level(slot, &base);
+  size_t rel = logical - base;
+  // EARLY RETURN
+  if(rel >= fs_get_indir_span(level)) {
+    return 0;
+  }
 
-    if(*p != ' ') {
-      all_space = 0;
-    }
+  *slot_p = slot;
+  *rel_p = rel;
+  for(size_t i = level;i > 0;i--) {
+    index_list[i - 1] = rel % context.id_per_indir_sector;
+    rel /= context.id_per_indir_sector;
+  }
 
-    p++;
+  return level;
+}
+
+/*
+ * fs_find_leaf_indir() - This function returns the leaf indirection sector
+ *                        that maps a logical sector of a large file
+ *
+ * Leaf sectors under the double and triple indirection sectors are looked up
+ * in the mapping cache first, such that upper levels are only walked once 
+ * per leaf. Returns FS_INVALID_SECTOR if the sector is in a hole without an
+ * indirection sector. In this case the number of logical sectors in the hole
+ * that starts at the sector is stored into hole_p, which is SIZE_MAX if the 
+ * sector is beyond the largest file. The inode should be pinned
+ */
+sector_t fs_find_leaf_indir(Storage *disk_p, 
+                            Inode *inode_p, 
+                            size_t logical, 
+                            size_t *hole_p) {
+  assert(fs_is_file_large(inode_p) == 1);
+  size_t slot, rel;
+  size_t index_list[FS_INDIR_LEVEL_MAX];
+  const size_t level = fs_get_indir_path(logical, &slot, &rel, index_list);
+  // EARLY RETURN
+  if(level == 0) {
+    *hole_p = SIZE_MAX;
+    return FS_INVALID_SECTOR;
   }
 
-  // Manually disable it if we allow names such as . and ..
-  if(allow_all_dot == FS_SET_DIR_NAME_ALLOW_DOT) {
-    all_dots = 0;
+  const inode_id_t inode = \
+    (level > 1) ? fs_get_inode_id(disk_p, inode_p) : FS_INVALID_INODE;
+  const sector_t group = \
+    (sector_t)(logical / context.id_per_indir_sector);
+  if(inode != FS_INVALID_INODE) {
+    const sector_t cached = fs_map_cache_lookup_indir(inode, group);
+    // EARLY RETURN
+    if(cached != FS_INVALID_SECTOR) {
+      return cached;
+    }
   }
 
-  // If any of these two are assigned 1
-  if(all_dots == 1 || all_space == 1) {
-    return FS_ERR_ILLEGAL_NAME;
+  sector_t sector = inode_p->addr[slot];
+  size_t span = fs_get_indir_span(level);
+  for(size_t i = 0;i < level - 1;i++) {
+    // EARLY RETURN
+    if(sector == FS_INVALID_SECTOR) {
+      *hole_p = span - rel % span;
+      return FS_INVALID_SECTOR;
+    }
+
+    span /= context.id_per_indir_sector;
+    sector = ((const sector_t *)read_lba(disk_p, sector))[index_list[i]];
   }
 
-  // Make the change available if we need to change the name
-  buffer_set_dirty(disk_p, entry_p);
-  // Set padding first (it's actually faster)
-  memset(entry_p->name, 0x00, FS_DIR_ENTRY_NAME_MAX);
-  // We do not use strcpy because we do not copy the trailing 0
-  memcpy(entry_p->name, name, len);
+  if(sector == FS_INVALID_SECTOR) {
+    *hole_p = span - rel % span;
+  } else if(inode != FS_INVALID_INODE) {
+    fs_map_cache_insert_indir(inode, group, sector);
+  }
 
-  return FS_SUCCESS;
+  return sector;
 }
 
 /*
- * fs_print_dir_name() - This function prints the name of a given directory
+ * fs_get_file_sector_p() - This function returns the pointer to the sector
+ *                          in the inode's addr. array
  *
- * We print the name without any modification. Just the name will be printed.
- * This function takes a pointer for printing to an FP. The fp could be
- * either stderr or stdout
+ * Returns NULL if the sector does not exist. Note that the returned value 
+ * may be inside another indirection sector. If there are interleaved
+ * sector operations, the caller should pin the returned value
  *
- * The length of the name will be returned
+ * If the caller modifies the entry through the pointer, the pointer's buffer
+ * must be marked as dirty, because the pointer may not point to the inode's
+ * buffer
+ *
+ * Extent-mapped files do not have a slot for each sector, so they are not
+ * accepted. Other properties are specified in fs_get_file_sector()
  */
-int fs_print_dir_name(DirEntry *entry_p, FILE *fp) {
-  const char *p = entry_p->name;
-  int count = 0;
-  // The first makes sure that we did not overflow the field
-  // The second makes sure we did not overflow the name
-  while(count < FS_DIR_ENTRY_NAME_MAX && *p != '\0') {
-    fputc(*p, fp);
-    p++;
-    count++;
+sector_t *fs_get_file_sector_p(Storage *disk_p, 
+                               Inode *inode_p, 
+                               size_t offset) {
+  assert(fs_is_file_extent(inode_p) == 0);
+  fs_pin(disk_p, inode_p);
+
+  // This is the linear ID in the file. Note that we can only address 16 bit
+  // sector size
+  sector_t sector = (sector_t)(offset / disk_p->sector_size);
+  // Make sure we did not overflow sector_t
+  assert(((size_t)sector * disk_p->sector_size) == offset);
+  sector_t *ret;
+  // If the file is small, then the sector ID must be less than 8
+  if(fs_is_file_large(inode_p) == 0) {
+    // Beyond the addr array of a small file nothing has been written yet.
+    // An inline file does not have any sector
+    if(sector >= FS_ADDR_ARRAY_MAX || fs_is_file_inline(inode_p) == 1) {
+      ret = NULL;
+    } else {
+      // This could be invalid sector
+      ret = &inode_p->addr[sector];
+    }
+  } else {
+    // Holes without an indirection sector are all zero, and beyond the 
+    // largest file nothing could have been written
+    size_t hole;
+    const sector_t indir_sector = \
+      fs_find_leaf_indir(disk_p, inode_p, sector, &hole);
+    if(indir_sector == FS_INVALID_SECTOR) {
+      ret = NULL;
+    } else {
+      sector_t *data_p = (sector_t *)read_lba(disk_p, indir_sector);
+      ret = &data_p[sector % context.id_per_indir_sector];
+    }
   }
 
-  return count;
+  fs_unpin(disk_p, inode_p);
+  return ret;
 }
 
 /*
- * fs_init_root() - This function initializes the root directory
+ * fs_get_file_sector() - This function returns the sector ID given an offset in
+ *                        the file
  *
- * This function must be called after the context is loaded
+ * This function returns invalid sector ID if the offset falls in a region
+ * that no data has been written. By default this should map to all-zero sector
+ *
+ * This function is for read. It does not allocate any sector or change the 
+ * layout of the inode's addr list.
+ *
+ * Resolved mappings are recorded in the per-inode mapping cache, such that
+ * sequential access hits the cache without walking indirection sectors
+ *
+ * This function pins the inode passed in, such that its buffer remains valid
+ * after return
  */
-void fs_init_root(Storage *disk_p) {
-  // Allocate a sector for inode 0 to hold its initial default dir
-  sector_t sector = fs_alloc_sector(disk_p);
-  if(sector == FS_INVALID_SECTOR) {
-    fatal_error("Failed to allocate sector for root directory");
+sector_t fs_get_file_sector(Storage *disk_p,
+                            Inode *inode_p,
+                            size_t offset) {
+  // Try the mapping cache first, which does not access the buffer pool
+  const inode_id_t inode = fs_get_inode_id(disk_p, inode_p);
+  const sector_t logical = (sector_t)(offset / disk_p->sector_size);
+  if(inode != FS_INVALID_INODE) {
+    sector_t cached = fs_map_cache_lookup(inode, logical);
+    if(cached != FS_INVALID_SECTOR) {
+      return cached;
+    }
   }
 
-  Inode *inode_p = \
-    fs_load_inode_sector(disk_p, FS_ROOT_INODE, FS_LOAD_INODE_SECTOR_WRITE);
-  inode_p->flags |= FS_INODE_IN_USE;
-  // Size of a directory is the number of sectors it occupies
-  fs_set_file_type(inode_p, FS_INODE_TYPE_DIR);
+  // EARLY RETURN
+  if(fs_is_file_extent(inode_p) == 1) {
+    sector_t start;
+    fs_pin(disk_p, inode_p);
+    const size_t count = fs_extent_map(disk_p, inode_p, logical, &start);
+    fs_unpin(disk_p, inode_p);
+    // The rest of the extent is cached as one run
+    if(inode != FS_INVALID_INODE && start != FS_INVALID_SECTOR) {
+      fs_map_cache_insert(inode, logical, start, (sector_count_t)count);
+    }
+    return start;
+  }
 
-  // Note that reference from . and .. does not contribute to this
-  assert(inode_p->nlinks = 1);
-  assert(fs_get_file_size(inode_p) == 0UL);
+  // Just dereference the pointer
+  sector_t *sector = fs_get_file_sector_p(disk_p, inode_p, offset);
+  if(sector == NULL) {
+    return FS_INVALID_SECTOR;
+  } else if(inode != FS_INVALID_INODE && *sector != FS_INVALID_SECTOR) {
+    // The following slots of the same array (addr array or indirection 
+    // sector) are already in memory. Cache the entire contiguous run that
+    // starts here, such that sequential access only misses once per run
+    sector_count_t slot_left;
+    if(fs_is_file_large(inode_p) == 0) {
+      slot_left = FS_ADDR_ARRAY_MAX - logical;
+    } else {
+      slot_left = context.id_per_indir_sector - \
+                  (logical % context.id_per_indir_sector);
+    }
 
-  DirEntry *entry_p_dot = fs_add_dir_entry(disk_p, inode_p);
-  if(entry_p_dot == NULL) {
-    fatal_error("Failed to allocate initial entries for root");
+    sector_count_t count = 1;
+    while(count < slot_left && 
+          sector[count] != FS_INVALID_SECTOR && 
+          sector[count] == sector[0] + count) {
+      count++;
+    }
+    fs_map_cache_insert(inode, logical, *sector, count);
   }
-  entry_p_dot->inode = FS_ROOT_INODE;
 
-  DirEntry *entry_p_dot_dot = fs_add_dir_entry(disk_p, inode_p);
-  entry_p_dot_dot->inode = FS_ROOT_INODE;
-  if(entry_p_dot_dot == NULL) {
-    fatal_error("Failed to allocate initial entries for root");
-  }
+  return *sector;
+}
 
-  int dir_name_ret;
-  // Set the name of these two entries
-  dir_name_ret = \
-    fs_set_dir_name(disk_p, entry_p_dot, ".", FS_SET_DIR_NAME_ALLOW_DOT);
-  assert(dir_name_ret == FS_SUCCESS);
-  dir_name_ret = \
-    fs_set_dir_name(disk_p, entry_p_dot_dot, "..", FS_SET_DIR_NAME_ALLOW_DOT);
-  assert(dir_name_ret == FS_SUCCESS);
+/*
+ * fs_map_chunk() - This function maps logical sectors that start at the 
+ *                  given one and are described by one slot array
+ *
+ * The slot array is either the addr. array or an indirection sector. The 
+ * returned chunk is either a hole or a run of contiguous sectors, and the 
+ * first sector of the run is stored into start_p. A missing indirection 
+ * sector is a hole that covers its entire range. The returned count may 
+ * exceed max_count if it is a hole. An extent of an extent-mapped file, or
+ * the hole before it, is returned as one chunk. The inode should be pinned
+ */
+size_t fs_map_chunk(Storage *disk_p, 
+                    Inode *inode_p, 
+                    size_t logical, 
+                    size_t max_count, 
+                    sector_t *start_p) {
+  const size_t id_count = context.id_per_indir_sector;
+  const sector_t *slot_p;
+  size_t slot_left;
+  *start_p = FS_INVALID_SECTOR;
+  if(fs_is_file_extent(inode_p) == 1) {
+    const size_t count = fs_extent_map(disk_p, inode_p, logical, start_p);
+    return (count > max_count) ? max_count : count;
+  } else if(fs_is_file_large(inode_p) == 0) {
+    // EARLY RETURN
+    if(logical >= FS_ADDR_ARRAY_MAX || fs_is_file_inline(inode_p) == 1) {
+      return max_count;
+    }
+    slot_p = &inode_p->addr[logical];
+    slot_left = FS_ADDR_ARRAY_MAX - logical;
+  } else {
+    size_t hole;
+    const sector_t indir_sector = \
+      fs_find_leaf_indir(disk_p, inode_p, logical, &hole);
+    // EARLY RETURN
+    if(indir_sector == FS_INVALID_SECTOR) {
+      return hole == SIZE_MAX ? max_count : hole;
+    }
+    slot_p = (sector_t *)read_lba(disk_p, indir_sector) + logical % id_count;
+    slot_left = id_count - logical % id_count;
+  }
 
-  info("Finished initializing root directory");
+  if(slot_left > max_count) {
+    slot_left = max_count;
+  }
+  *start_p = slot_p[0];
+  size_t count = 1;
+  if(*start_p == FS_INVALID_SECTOR) {
+    while(count < slot_left && slot_p[count] == FS_INVALID_SECTOR) {
+      count++;
+    }
+  } else {
+    while(count < slot_left && 
+          slot_p[count] != FS_INVALID_SECTOR && 
+          slot_p[count] == (size_t)*start_p + count) {
+      count++;
+    }
+  }
 
-  return;
+  return count;
 }
 
 /*
- * fs_init() - This function initializes an empty FS on a raw storage
+ * fs_map_range() - This function maps a range of logical sectors of a file,
+ *                  and returns the length of the first extent in the range
  *
- * The init_root flag is used for debugging purposes. It indicates whether
- * we initialize the root directory also. For debugging we do not wish
- * so, because it will disrupt sector and inode allocator
+ * The extent is either a hole, in which case FS_INVALID_SECTOR is stored 
+ * into start_p, or a run of sectors that are contiguous on the disk, in 
+ * which case the first sector is stored. The extent spans slot arrays, and 
+ * holes that are not backed by any indirection sector are skipped without
+ * reading the slots they would contain, so a sparse file is mapped in a 
+ * few calls
+ *
+ * Sectors waiting for delayed allocation are holes in the mapping. This 
+ * function pins the inode
  */
-void _fs_init(Storage *disk_p, size_t total_sector, size_t start_sector, 
-             int init_root) {
-  assert(start_sector < total_sector - 1);
-  assert(total_sector <= disk_p->sector_count);
-  size_t inode_start_sector = start_sector + 1;
-  // This is the number of total usable blocks for inode and file
-  size_t usable_sector_count = total_sector - start_sector - 1;
-  size_t inode_sector_count = \
-    fs_init_inode(disk_p, inode_start_sector, total_sector);
-  size_t free_sector_count = usable_sector_count - inode_sector_count;
-  info("  # of inode sectors: %lu; free sectors: %lu",
-       inode_sector_count,
-       free_sector_count);
-  // This is the absolute sector ID of the free start sector
-  size_t free_start_sector = inode_start_sector + inode_sector_count;
-  size_t free_list_size = \
-    fs_init_free_list(disk_p, free_start_sector, total_sector);
-  info("  Free list size: %lu; First free sector: %lu", 
-       free_list_size,
-       free_start_sector);
+size_t fs_map_range(Storage *disk_p, 
+                    Inode *inode_p, 
+                    size_t logical, 
+                    size_t max_count, 
+                    sector_t *start_p) {
+  assert(max_count != 0);
+  fs_pin(disk_p, inode_p);
+  size_t count = fs_map_chunk(disk_p, inode_p, logical, max_count, start_p);
+  while(count < max_count) {
+    sector_t next;
+    const size_t next_count = \
+      fs_map_chunk(disk_p, inode_p, logical + count, max_count - count, &next);
+    if(*start_p == FS_INVALID_SECTOR) {
+      if(next != FS_INVALID_SECTOR) {
+        break;
+      }
+    } else if(next == FS_INVALID_SECTOR || 
+              next != (size_t)*start_p + count) {
+      break;
+    }
+    count += next_count;
+  }
+  if(count > max_count) {
+    count = max_count;
+  }
 
-  // At last, we init the super block
-  SuperBlock *sb_p = (SuperBlock *)write_lba(disk_p, start_sector);
-  // We use the signature to verify the fs type
-  memcpy(sb_p->signature, FS_SIG, FS_SIG_SIZE);
-  sb_p->isize = (sector_t)inode_sector_count;
-  sb_p->fsize = (sector_t)free_sector_count;
-  // There is no cached free block and free inodes. The first write operation
-  // into the file system will find one
-  sb_p->free_array.nfree = 0;
-  memset(sb_p->free_array.free, 0x0, sizeof(sb_p->free_array.free));
-  // The first element is the sector ID for the sector that stores 
-  // the free list
-  sb_p->free_array.free[0] = (sector_t)free_start_sector;
-  sb_p->ninode = 0;
-  memset(sb_p->inode, 0x0, sizeof(sb_p->inode));
-  sb_p->flock = sb_p->ilock = 0;
-  sb_p->fmod = 0;
-  sb_p->time[0] = sb_p->time[1] = 0;
+  fs_unpin(disk_p, inode_p);
+  return count;
+}
 
-  // Make sure the super block goes to disk
-  buffer_flush_all_no_rm(disk_p);
-  info("Finished writing the super block");
+/*
+ * fs_convert_to_large() - Converts a given inode to large file and changes the
+ *                         inode addr layout accordingly
+ *
+ * The inode passed in must not be an inode itself. If this function fails 
+ * for lacking free sector, we return INVALID_SECTOR; otherwise return the
+ * sector for new indir sector.
+ *
+ * This function does not logically change the file
+ *
+ * inode_p should be pinned as we read another sector. The new indirection
+ * sector is allocated near the hint
+ */
+sector_t fs_convert_to_large(Storage *disk_p, Inode *inode_p, sector_t hint) {
+  assert(fs_is_file_large(inode_p) == 0);
+  assert(fs_is_pinned(disk_p, inode_p) == 1);
 
-  fs_load_context(disk_p);
-  if(init_root == 1) {
-    // Set up the root node (also allocate inode 0)
-    fs_init_root(disk_p);
+  sector_t ret;
+  // First use an indirection sector to hold all pointers
+  sector_t indir_sector = fs_alloc_sector_near(disk_p, hint);
+  // If allocation fail we return fail
+  if(indir_sector == FS_INVALID_SECTOR) {
+    ret = FS_INVALID_SECTOR;
+  } else {
+    ret = indir_sector;
+    // Copy the addr array into the indir sector
+    sector_t *data_p = (sector_t *)write_lba(disk_p, indir_sector);
+    // Fill the entire disk with INVALID SECTOR
+    for(int i = 0;i < context.id_per_indir_sector;i++) {
+      data_p[i] = FS_INVALID_SECTOR;
+    }
+    memcpy(data_p, inode_p->addr, sizeof(inode_p->addr));
+    // Reset all sectors of the array
+    fs_reset_addr(inode_p);
+    // It must be the first indir sector as we only have 8 in addr.
+    inode_p->addr[0] = indir_sector;
+    // If the offset is greater than the array size, then we should 
+    // convert it to a large block first
+    fs_set_file_large(inode_p);
+    fs_set_dirty(disk_p, inode_p);
   }
 
-  return;
+  return ret;
 }
 
-// This is called by non-debugging routines
-void fs_init(Storage *disk_p, size_t total_sector, size_t start_sector) {
-  _fs_init(disk_p, total_sector, start_sector, 1);
-}
+// These two are used to distinguish data and indir sector when allocating
+// a new sector
+#define FS_INDIR_SECTOR 1
+#define FS_DATA_SECTOR  0
 
 /*
- * fs_alloc_sector() - This function allocates a new sector using either the SB
- *                     or the linked list
+ * fs_addr_read_or_alloc() - This function either reads and returns a given
+ *                           sector pointer's value, or allocate a new block
+ *                           for it. 
  *
- * Returns 0 if allocation failed (0 is not a valid block ID)
+ * The return value is either the value read or allocated. Return 
+ * invalid sector if allocation fails
+ *
+ * If the indir flag is set to 1, then we also initialize it as an indirection
+ * sector. Otherwise the sector is not initialized
+ *
+ * Note that the pointer must be in the buffer area or in the inode cache 
+ * because we will pin it
+ *
+ * Also, the sector_p buffer could be loaded using read-only mode. We will set
+ * it as dirty if we truly write into it other than simply reading its value.
+ *
+ * The hint is passed to the sector allocator, such that new sectors are
+ * placed right after the previous sector of the file
  */
-sector_t fs_alloc_sector(Storage *disk_p) {
-  // First read the super block, setting dirty flag
-  SuperBlock *sb_p = (SuperBlock *)read_lba_for_write(disk_p, FS_SB_SECTOR);
-  buffer_pin(disk_p, sb_p);
-
-  sector_t ret = 0;
-  // If there are cached free values, then just get one
-  if(sb_p->free_array.nfree != 0) {
-    ret = sb_p->free_array.free[sb_p->free_array.nfree];
-    sb_p->free_array.nfree--;
-  } else {
-    sector_t free_list_head = sb_p->free_array.free[0];
-    // If there is no next block, then we have exhausted free blocks
-    if(free_list_head == FS_INVALID_SECTOR) {
-      ret = FS_INVALID_SECTOR;
-    } else {
-      // We use this sector as the free sector, and copy its free list into
-      // the super block
-      ret = free_list_head;
-      // Read the free list head, and copy the free array into the temp
-      // object (because the sb may have been evicted)
-      sector_t *data_p = (sector_t *)read_lba(disk_p, free_list_head);
-      memcpy(&sb_p->free_array, data_p, sizeof(FreeArray));
+sector_t fs_addr_read_or_alloc(Storage *disk_p, 
+                               sector_t *sector_p, 
+                               int type, 
+                               sector_t hint) {
+  assert(type == FS_INDIR_SECTOR || type == FS_DATA_SECTOR);
+  fs_pin(disk_p, sector_p);
+  sector_t sector = *sector_p;
+  if(sector == FS_INVALID_SECTOR) {
+    sector = fs_alloc_sector_near(disk_p, hint);
+    // This is valid even when the allocation fails, because we did not
+    // change the value by doing this when it fails.
+    *sector_p = sector;
+    // If allocation succeeds we set the buffer as dirty
+    if(sector != FS_INVALID_SECTOR) {
+      fs_set_dirty(disk_p, sector_p);
+    }
+    // If allocation succeeds and indir is 1 we also initialize it
+    if(type == FS_INDIR_SECTOR && sector != FS_INVALID_SECTOR) {
+      // Blind write
+      sector_t *data_p = (sector_t *)write_lba(disk_p, sector);
+      for(sector_t i = 0;i < context.id_per_indir_sector;i++) {
+        data_p[i] = FS_INVALID_SECTOR;
+      }
     }
   }
 
-  // Make sure no buffer is pinned at the end
-  buffer_unpin(disk_p, sb_p);
-  return ret;
+  fs_unpin(disk_p, sector_p);
+  return sector;
 }
 
 /*
- * fs_free_sector() - This function frees a sector.
+ * fs_get_leaf_indir_for_write() - This function finds or creates the leaf
+ *                                 indirection sector that maps a logical 
+ *                                 sector of a large file
+ *
+ * The inode should be pinned. The leaf may be cached or already exist, in
+ * which case upper levels are neither walked nor allocated. Any number of 
+ * levels may be allocated, from the single indirection sector of a slot to
+ * the triple indirection sector and the two levels under it. They are 
+ * allocated near the hint
  *
- * We first tries to add the freed sector into the super block's cache.
- * If the cache is full, we then move the array into the freed block, and 
- * then empty the super block's cache, and link the current block into
- * the free chain
+ * This function returns invalid sector if allocation fails, or if the 
+ * sector is beyond the largest file
  */
-void fs_free_sector(Storage *disk_p, sector_t sector) {
-  SuperBlock *sb_p = (SuperBlock *)read_lba_for_write(disk_p, FS_SB_SECTOR);
-  buffer_pin(disk_p, sb_p);
+sector_t fs_get_leaf_indir_for_write(Storage *disk_p, 
+                                     Inode *inode_p, 
+                                     size_t sector,
+                                     sector_t hint) {
+  assert(fs_is_pinned(disk_p, inode_p) == 1);
+  assert(fs_is_file_large(inode_p) == 1);
+  size_t hole;
+  sector_t indir_sector = fs_find_leaf_indir(disk_p, inode_p, sector, &hole);
+  // EARLY RETURN
+  if(indir_sector != FS_INVALID_SECTOR) {
+    return indir_sector;
+  }
 
-  assert(sb_p->free_array.nfree <= (FS_FREE_ARRAY_MAX - 1));
-  // If the free list is not full, we just put it into the sb and 
-  // increment nfree
-  if(sb_p->free_array.nfree < (FS_FREE_ARRAY_MAX - 1)) {
-    sb_p->free_array.nfree++;
-    sb_p->free_array.free[sb_p->free_array.nfree] = sector;
-  } else {
-    // Otherwise, we first copy the current free array object into the new block
-    FreeArray free_array;
-    memcpy(&free_array, &sb_p->free_array, sizeof(FreeArray));
-    // Then link the newly freed block into the super block
-    sb_p->free_array.nfree = 0;
-    sb_p->free_array.free[0] = sector;
-    // Create a buffer entry for the sector
-    void *data_p = write_lba(disk_p, sector);
-    memcpy(data_p, &free_array, sizeof(FreeArray));
+  size_t slot, rel;
+  size_t index_list[FS_INDIR_LEVEL_MAX];
+  const size_t level = fs_get_indir_path(sector, &slot, &rel, index_list);
+  // EARLY RETURN
+  if(level == 0) {
+    return FS_INVALID_SECTOR;
   }
 
-  buffer_unpin(disk_p, sb_p);
-  return;
+  // Read or allocate each level. The sector that holds the slot of the 
+  // next level is pinned while allocating, because allocation may evict
+  // buffers
+  indir_sector = fs_addr_read_or_alloc(disk_p,
+                                       &inode_p->addr[slot], 
+                                       FS_INDIR_SECTOR,
+                                       hint);
+  for(size_t i = 0;i < level - 1;i++) {
+    // EARLY RETURN
+    if(indir_sector == FS_INVALID_SECTOR) {
+      return FS_INVALID_SECTOR;
+    }
+
+    sector_t *data_p = (sector_t *)read_lba(disk_p, indir_sector);
+    buffer_pin(disk_p, data_p);
+    indir_sector = fs_addr_read_or_alloc(disk_p,
+                                         &data_p[index_list[i]], 
+                                         FS_INDIR_SECTOR,
+                                         hint);
+    buffer_unpin(disk_p, data_p);
+  }
+
+  // If we have set the double indirection slot then the file is also 
+  // extra large
+  assert(indir_sector == FS_INVALID_SECTOR || 
+         level == 1 || 
+         fs_is_file_extra_large(inode_p) == 1);
+  return indir_sector;
 }
 
 /*
- * fs_load_inode_sector() - This function loads the sector an inode is in
- *                          and returns the pointer to that inode
+ * fs_get_file_sector_for_write_large_file() - This function finds or creates a
+ *                                             sector for write in a large file
  *
- * Note that this function does not check whether the inode number is
- * valid or not (it may be out of range if programming error happens)
+ * The inode should be pinned. The inode must point to a large file
  *
- * If write_flag is 1, then we load the sector for write. Otherwise load it
- * for read.
+ * This function returns invalid sector if allocation fails when trying to
+ * add an indirection sector or a data sector, or if the sector is beyond 
+ * the largest file. Otherwise it returns the new data sector we added for 
+ * found.
  *
- * Note that we do not pin the inode. The caller should be responsible for this
+ * New indirection and data sectors are allocated near the hint
  */
-Inode *fs_load_inode_sector(Storage *disk_p, inode_id_t inode, int write_flag) {
-  sector_t sector_num = inode / context.inode_per_sector;
-  size_t offset = inode % context.inode_per_sector;
-  sector_num += (FS_SB_SECTOR + 1);
+sector_t fs_get_file_sector_for_write_large_file(Storage *disk_p, 
+                                                 Inode *inode_p, 
+                                                 sector_t sector,
+                                                 sector_t hint) {
+  const sector_t indir_sector = \
+    fs_get_leaf_indir_for_write(disk_p, inode_p, sector, hint);
+  // EARLY RETURN
+  if(indir_sector == FS_INVALID_SECTOR) {
+    return FS_INVALID_SECTOR;
+  }
 
-  Inode *inode_p = NULL;
-  if(write_flag == 1) {
-    inode_p = (Inode *)read_lba_for_write(disk_p, sector_num);
-  } else {
-    inode_p = (Inode *)read_lba(disk_p, sector_num);
+  // Should pin it because we may allocate a sector
+  sector_t *data_p = (sector_t *)read_lba(disk_p, indir_sector);
+  buffer_pin(disk_p, data_p);
+  // If the allocation fails then ret will naturally be invalid sector
+  const sector_t ret = \
+    fs_addr_read_or_alloc(disk_p,
+                          &data_p[sector % context.id_per_indir_sector], 
+                          FS_DATA_SECTOR,
+                          hint);
+  buffer_unpin(disk_p, data_p);
+
+  return ret;
+}
+
+/*
+ * fs_extent_spill() - This function moves the extents in the addr. array 
+ *                     into a new extent sector
+ *
+ * The extent sector is placed after the last extent, close to the data of 
+ * the file. Returns 0 if the sector could not be allocated, and 1 
+ * otherwise. The inode should be pinned
+ */
+int fs_extent_spill(Storage *disk_p, Inode *inode_p) {
+  assert(fs_is_file_extent(inode_p) == 1);
+  assert(inode_p->addr[FS_EXTENT_SECTOR_SLOT] == FS_INVALID_SECTOR);
+  const Extent *last_p = \
+    (const Extent *)inode_p->addr + FS_EXTENT_INODE_MAX - 1;
+  const sector_t extent_sector = \
+    fs_alloc_sector_near(disk_p, last_p->physical + last_p->count);
+  // EARLY RETURN
+  if(extent_sector == FS_INVALID_SECTOR) {
+    return 0;
   }
 
-  return inode_p + offset;
+  uint8_t *data_p = write_lba(disk_p, extent_sector);
+  memset(data_p, 0x00, disk_p->sector_size);
+  memcpy(data_p, inode_p->addr, FS_EXTENT_INODE_MAX * sizeof(Extent));
+  for(int i = 0;i < FS_EXTENT_COUNT_SLOT;i++) {
+    inode_p->addr[i] = FS_INVALID_SECTOR;
+  }
+  inode_p->addr[FS_EXTENT_SECTOR_SLOT] = extent_sector;
+  fs_set_dirty(disk_p, inode_p);
+
+  return 1;
 }
 
 /*
- * fill_inode_free_array() - This function fills the inode free array
+ * fs_extent_insert() - This function maps a logical sector in a hole of an
+ *                      extent-mapped file to a physical sector
  *
- * We start from the first sector after the sb, and scans until we reach
- * the last inode sector.
+ * The sector is merged into the extent before or after it if it is 
+ * contiguous with that extent both logically and physically, which may 
+ * also join the two extents. Otherwise a new extent is inserted, and the 
+ * extents in the addr. array are moved to an extent sector if they no 
+ * longer fit.
  *
- * Note that the passed super block must be a valid one, i.e. no other
- * buffer operation may happen between the load of the sb and the usage of
- * this sector.
+ * Returns 0 if a new extent is needed, but the extent sector is full or 
+ * could not be allocated. Returns 1 otherwise. The inode should be pinned
+ */
+int fs_extent_insert(Storage *disk_p, 
+                     Inode *inode_p, 
+                     size_t logical, 
+                     sector_t physical) {
+  size_t count;
+  Extent *extent_p = fs_extent_list(disk_p, inode_p, &count);
+  const size_t index = fs_extent_search(extent_p, count, logical);
+  Extent *prev_p = (index > 0) ? &extent_p[index - 1] : NULL;
+  Extent *next_p = (index < count) ? &extent_p[index] : NULL;
+  const size_t count_max = (sector_t)-1;
+  const int merge_prev = \
+    prev_p != NULL && 
+    prev_p->logical + prev_p->count == logical && 
+    prev_p->physical + prev_p->count == physical && 
+    prev_p->count < count_max;
+  const int merge_next = \
+    next_p != NULL && 
+    next_p->logical == logical + 1 && 
+    next_p->physical == physical + 1 && 
+    next_p->count < count_max;
+  if(merge_prev && merge_next && 
+     (size_t)prev_p->count + 1 + next_p->count <= count_max) {
+    prev_p->count += 1 + next_p->count;
+    memmove(next_p, next_p + 1, (count - index - 1) * sizeof(Extent));
+    count--;
+  } else if(merge_prev) {
+    prev_p->count++;
+  } else if(merge_next) {
+    next_p->logical--;
+    next_p->physical--;
+    next_p->count++;
+  } else {
+    const size_t capacity = \
+      (inode_p->addr[FS_EXTENT_SECTOR_SLOT] == FS_INVALID_SECTOR) ? \
+      FS_EXTENT_INODE_MAX : context.extent_per_sector;
+    if(count == capacity) {
+      // EARLY RETURN
+      if(capacity != FS_EXTENT_INODE_MAX || 
+         fs_extent_spill(disk_p, inode_p) == 0) {
+        return 0;
+      }
+      extent_p = fs_extent_list(disk_p, inode_p, &count);
+    }
+
+    memmove(extent_p + index + 1, 
+            extent_p + index, 
+            (count - index) * sizeof(Extent));
+    extent_p[index].logical = (sector_t)logical;
+    extent_p[index].physical = physical;
+    extent_p[index].count = 1;
+    count++;
+  }
+
+  inode_p->addr[FS_EXTENT_COUNT_SLOT] = (sector_t)count;
+  fs_set_dirty(disk_p, extent_p);
+  fs_set_dirty(disk_p, inode_p);
+
+  return 1;
+}
+
+/*
+ * fs_convert_to_extent() - Converts a small file to an extent-mapped file
  *
- * This function returns a pointer to the new SB block, which is read
- * for write. The caller could use this pointer to allocate inodes.
+ * Sectors in the addr. array become extents, and contiguous sectors share
+ * one extent. Returns 0 if they need an extent sector which could not be
+ * allocated, in which case the file is not changed. Returns 1 otherwise.
  *
- * sb should be pinned in the buffer
+ * This function does not logically change the file. The inode should be
+ * pinned
  */
-SuperBlock *fill_inode_free_array(Storage *disk_p, SuperBlock *sb_p) {
-  // Only call this function when the inode array is empty
-  assert(sb_p->ninode == 0);
-  assert(buffer_is_pinned(disk_p, sb_p));
-
-  // inode sector is just after the super block
-  sector_t current_sector = FS_SB_SECTOR + 1;
-  // Number of inodes we have scanned
-  int count = 0;
-  inode_id_t current_inode = 0;
-  // It can hold 100 inodes
-  inode_id_t free_inode_list[FS_FREE_ARRAY_MAX];
-  for(sector_t i = 0;i < context.inode_sector_count;i++) {
-    Inode *inode_p = (Inode *)read_lba(disk_p, current_sector);
-    for(size_t j = 0;j < context.inode_per_sector;j++) {
-      // If the inode is not in-use
-      if((inode_p[j].flags & FS_INODE_IN_USE) == 0) {
-        // The inode could not be the root inode, otherwise the fs is broken
-        //assert(current_inode != FS_ROOT_INODE);
-        // Also the inode could not be the invalid value, otherwise sector_t
-        // would overflow
-        //assert(current_inode != FS_INVALID_INODE);
-
-        // Otherwise just add the inode into the list of inodes
-        free_inode_list[count] = current_inode;
-        count++;
-        if(count == FS_FREE_ARRAY_MAX) {
-          break;
-        }
-      }
-      // Then go to check the next inode
-      current_inode++;
+int fs_convert_to_extent(Storage *disk_p, Inode *inode_p) {
+  assert(fs_is_file_large(inode_p) == 0);
+  assert(fs_is_file_inline(inode_p) == 0);
+  assert(fs_is_file_extent(inode_p) == 0);
+  Extent extent_list[FS_ADDR_ARRAY_MAX];
+  size_t count = 0;
+  for(int i = 0;i < FS_ADDR_ARRAY_MAX;i++) {
+    const sector_t sector = inode_p->addr[i];
+    if(sector == FS_INVALID_SECTOR) {
+      continue;
+    } else if(count != 0 && 
+              extent_list[count - 1].logical + \
+                extent_list[count - 1].count == i && 
+              extent_list[count - 1].physical + \
+                extent_list[count - 1].count == sector) {
+      extent_list[count - 1].count++;
+    } else {
+      extent_list[count].logical = (sector_t)i;
+      extent_list[count].physical = sector;
+      extent_list[count].count = 1;
+      count++;
     }
+  }
 
-    if(count == FS_FREE_ARRAY_MAX) {
-      break;
+  sector_t extent_sector = FS_INVALID_SECTOR;
+  if(count > FS_EXTENT_INODE_MAX) {
+    extent_sector = \
+      fs_alloc_sector_near(disk_p, 
+                           extent_list[count - 1].physical + 
+                             extent_list[count - 1].count);
+    // EARLY RETURN
+    if(extent_sector == FS_INVALID_SECTOR) {
+      return 0;
     }
-    current_sector++;
+
+    uint8_t *data_p = write_lba(disk_p, extent_sector);
+    memset(data_p, 0x00, disk_p->sector_size);
+    memcpy(data_p, extent_list, count * sizeof(Extent));
   }
 
-  // Then update the super block
-  sb_p->ninode = count;
-  // Just copy the inodes we have in the list
-  memcpy(sb_p->inode, free_inode_list, sizeof(free_inode_list[0]) * count);
+  fs_reset_addr(inode_p);
+  if(extent_sector == FS_INVALID_SECTOR) {
+    memcpy(inode_p->addr, extent_list, count * sizeof(Extent));
+  }
+  inode_p->addr[FS_EXTENT_COUNT_SLOT] = (sector_t)count;
+  inode_p->addr[FS_EXTENT_SECTOR_SLOT] = extent_sector;
+  inode_p->flags |= FS_INODE_EXTENT;
+  fs_set_dirty(disk_p, inode_p);
 
-  return sb_p;
+  return 1;
 }
 
 /*
- * fs_alloc_inode() - This function allocates an unused inode
- *
- * We first search the super block, and if the super block does not have
- * any cached inode, we need to scan the entire inode map and find one.
+ * fs_extent_to_large() - Converts an extent-mapped file to a large file
  *
- * This function will not set the type, size and time of the inode. But it
- * will always set the nlinks field to 1
+ * This is done when the extent sector is full. Mapped sectors are stored
+ * into indirection sectors, which are allocated near the hint. Returns 0 
+ * if there may not be enough free sectors for them, in which case the file
+ * is not changed. Returns 1 otherwise.
  *
- * This function returns the inode number. (-1) means allocation failure
+ * This function does not logically change the file. The inode should be
+ * pinned
  */
-inode_id_t fs_alloc_inode(Storage *disk_p) {
-  SuperBlock *sb_p = (SuperBlock *)read_lba(disk_p, FS_SB_SECTOR);
-  buffer_pin(disk_p, sb_p);
+int fs_extent_to_large(Storage *disk_p, Inode *inode_p, sector_t hint) {
+  const size_t id_count = context.id_per_indir_sector;
+  size_t count;
+  const Extent *extent_p = fs_extent_list(disk_p, inode_p, &count);
+  // The extent sector may be evicted while indirection sectors are written
+  Extent *extent_list = malloc(count * sizeof(Extent) + 1);
+  if(extent_list == NULL) {
+    fatal_error("Failed to allocate the extent list");
+  }
+  memcpy(extent_list, extent_p, count * sizeof(Extent));
 
-  inode_id_t ret;
-  // If the array is empty, we just fill it first
-  if(sb_p->ninode == 0) {
-    sb_p = fill_inode_free_array(disk_p, sb_p);
+  // An extent spans at most two leaf indirection sectors more than it 
+  // fills, and each leaf has at most one parent
+  size_t indir_count = FS_ADDR_ARRAY_MAX;
+  for(size_t i = 0;i < count;i++) {
+    indir_count += 2 * (extent_list[i].count / id_count + 2);
+  }
+  // EARLY RETURN
+  if(fs_count_free_sectors() < indir_count) {
+    free(extent_list);
+    return 0;
   }
 
-  // If the inode list is still empty, then we could not find 
-  // any more inodes, and return failure
-  if(sb_p->ninode == 0) {
-    ret = FS_INVALID_INODE;
-  } else {
-    // Note that here we decrement first and then get inode number
-    sb_p->ninode--;
-    ret = sb_p->inode[sb_p->ninode];
-    // Load the sector that holds the inode, and make it dirty because we 
-    // are writing into this inode
-    Inode *inode_p = \
-      fs_load_inode_sector(disk_p, ret, FS_LOAD_INODE_SECTOR_WRITE);
-    assert((inode_p->flags & FS_INODE_IN_USE) == 0);
-    // Clear its previous content
-    memset(inode_p, 0x0, sizeof(Inode));
-    // Mark it as in-use
-    inode_p->flags |= FS_INODE_IN_USE;
-    // This is the only field we initialize
-    inode_p->nlinks = 1;
+  const sector_t extent_sector = inode_p->addr[FS_EXTENT_SECTOR_SLOT];
+  fs_reset_addr(inode_p);
+  inode_p->flags &= (~FS_INODE_INLINE);
+  fs_set_dirty(disk_p, inode_p);
+  for(size_t i = 0;i < count;i++) {
+    for(size_t j = 0;j < extent_list[i].count;j++) {
+      const size_t logical = extent_list[i].logical + j;
+      const sector_t indir_sector = \
+        fs_get_leaf_indir_for_write(disk_p, inode_p, logical, hint);
+      assert(indir_sector != FS_INVALID_SECTOR);
+      sector_t *data_p = (sector_t *)read_lba_for_write(disk_p, indir_sector);
+      data_p[logical % id_count] = (sector_t)(extent_list[i].physical + j);
+    }
   }
 
-  buffer_unpin(disk_p, sb_p);
-  return ret;
+  if(extent_sector != FS_INVALID_SECTOR) {
+    fs_free_sector(disk_p, extent_sector);
+  }
+  free(extent_list);
+
+  return 1;
 }
 
 /*
- * fs_free_inode() - This function frees an inode
+ * fs_get_file_sector_for_write_extent() - This function finds or creates a
+ *                                         sector for write in an 
+ *                                         extent-mapped file
  *
- * If the inode free array in the sb is not yet full, we just add it
- * Otherwise we discard the inode number. Because the allocation information
- * is stored in the inode itself, we do not need to precisely track the 
- * inode usage in the sb
+ * The new sector is allocated near the hint, which usually makes it extend
+ * the extent before it. If the extent sector is full, the file is converted
+ * to a large file. The inode should be pinned
+ *
+ * This function returns invalid sector if allocation fails
  */
-void fs_free_inode(Storage *disk_p, inode_id_t inode) {
-  SuperBlock *sb_p = (SuperBlock *)read_lba(disk_p, FS_SB_SECTOR);
-  buffer_pin(disk_p, sb_p);
+sector_t fs_get_file_sector_for_write_extent(Storage *disk_p, 
+                                             Inode *inode_p, 
+                                             sector_t sector,
+                                             sector_t hint) {
+  sector_t ret;
+  fs_extent_map(disk_p, inode_p, sector, &ret);
+  // EARLY RETURN
+  if(ret != FS_INVALID_SECTOR) {
+    return ret;
+  }
 
-  // If it is not full, we just use it. Otherwise we ignore the free
-  // inode list in sb and directly mask off the flag
-  if(sb_p->ninode != FS_FREE_ARRAY_MAX) {
-    // Upgrade to write
-    sb_p = (SuperBlock *)read_lba_for_write(disk_p, FS_SB_SECTOR);
-    sb_p->inode[sb_p->ninode] = inode;
-    sb_p->ninode++;
+  ret = fs_alloc_sector_near(disk_p, hint);
+  // EARLY RETURN
+  if(ret == FS_INVALID_SECTOR || 
+     fs_extent_insert(disk_p, inode_p, sector, ret) == 1) {
+    return ret;
   }
 
-  // Load the sector containing this inode, and set it as dirty
-  Inode *inode_p = \
-    fs_load_inode_sector(disk_p, inode, FS_LOAD_INODE_SECTOR_WRITE);
-  // Make sure it is an allocated inode
-  assert(inode_p->flags & FS_INODE_IN_USE);
-  // Mask off the inodes
-  inode_p->flags &= (~FS_INODE_IN_USE);
+  // The sector is allocated again after the file is converted
+  fs_free_sector(disk_p, ret);
+  // EARLY RETURN
+  if(fs_extent_to_large(disk_p, inode_p, hint) == 0) {
+    return FS_INVALID_SECTOR;
+  }
 
-  buffer_unpin(disk_p, sb_p);
-  return;
+  return fs_get_file_sector_for_write_large_file(disk_p, 
+                                                 inode_p, 
+                                                 sector, 
+                                                 hint);
 }
 
-/////////////////////////////////////////////////////////////////////
-// Test Cases
-/////////////////////////////////////////////////////////////////////
-
-#define DEBUG
-#ifdef DEBUG
+/*
+ * fs_get_file_sector_for_write_near() - This function returns the sector ID
+ *                                       to write into.
+ *
+ * If the sector does not exist, or the offset exceeds the current file
+ * end, then we allocate sector for the indirection block, and then try again
+ *
+ * Note that this function may leave holes in the array of blocks or indirection
+ * blocks. In these cases, the slot has value invalid sector ID. Any read 
+ * operation to these ranges should return 0
+ *
+ * This function returns a sector ID for write. If it returns invalid ID then
+ * we have run out of blocks.
+ *
+ * New sectors, including indirection sectors, are allocated at or after the 
+ * hint. If the hint is invalid, they are placed right after the previous 
+ * sector of the file.
+ *
+ * This function will pin the inode such that its buffer remains valid
+ * after function return
+ */
+sector_t fs_get_file_sector_for_write_near(Storage *disk_p,
+                                           Inode *inode_p,
+                                           size_t offset, 
+                                           sector_t hint) {
+  // Inline files must be converted by the caller first
+  assert(fs_is_file_inline(inode_p) == 0);
+  sector_t ret;
+  sector_t sector = (sector_t)(offset / disk_p->sector_size);
+  assert(((size_t)sector * disk_p->sector_size) == offset);
+  // Existing sectors are most likely in the mapping cache
+  const inode_id_t inode = fs_get_inode_id(disk_p, inode_p);
+  if(inode != FS_INVALID_INODE) {
+    ret = fs_map_cache_lookup(inode, sector);
+    if(ret != FS_INVALID_SECTOR) {
+      return ret;
+    }
+  }
 
-void test_lba_rw(Storage *disk_p) {
-  info("=\n=Testing LBA r/w...\n=");
-  uint8_t buffer[DEFAULT_SECTOR_SIZE];
-  int prev_percent = 0;
-  for(size_t i = 0;i < disk_p->sector_count;i++) {
-    memset(buffer, (char)i, DEFAULT_SECTOR_SIZE);
-    disk_p->write(disk_p, i, buffer);
-    // Current progress
-    int current_percent = (int)(((double)i / disk_p->sector_count) * 100);
-    if(current_percent != prev_percent) {
-      fprintf(stderr, "\r  Write progress %d%%", current_percent);
-      prev_percent = current_percent;
+  // First pin the buffer, because we will read sectors
+  fs_pin(disk_p, inode_p);
+
+  // New sectors are placed right after the previous sector of the file, 
+  // which keeps files that grow sequentially contiguous
+  if(hint == FS_INVALID_SECTOR && sector != 0) {
+    hint = fs_get_file_sector(disk_p, 
+                              inode_p, 
+                              offset - disk_p->sector_size);
+    if(hint != FS_INVALID_SECTOR) {
+      hint++;
     }
   }
-  putchar('\n');
+  // Otherwise the data starts in the allocation group of the inode
+  if(hint == FS_INVALID_SECTOR && inode != FS_INVALID_INODE) {
+    hint = fs_group_get_hint(inode);
+  }
 
-  prev_percent = 0;
-  for(size_t i = 0;i < disk_p->sector_count;i++) {
-    disk_p->read(disk_p, i, buffer);
-    for(int j = 0;j < DEFAULT_SECTOR_SIZE;j++) {
-      if(buffer[j] != (uint8_t)i) {
-        fatal_error("LBA read fail (i = %lu, j = %d)", i, j);
+  if(fs_is_file_extent(inode_p) == 1) {
+    ret = fs_get_file_sector_for_write_extent(disk_p, inode_p, sector, hint);
+  } else if(fs_is_file_large(inode_p) == 0) {
+    // If it is not large, then check the sector offset
+    if(sector >= FS_ADDR_ARRAY_MAX && 
+       (context.features & FS_FEATURE_EXTENT) && 
+       fs_get_file_type(inode_p) == FS_INODE_TYPE_FILE) {
+      // Regular files are extent-mapped if the file system supports it.
+      // This does not logically change the file either
+      if(fs_convert_to_extent(disk_p, inode_p) == 0) {
+        ret = FS_INVALID_SECTOR;
+      } else {
+        ret = fs_get_file_sector_for_write_extent(disk_p, 
+                                                  inode_p, 
+                                                  sector, 
+                                                  hint);
+      }
+    } else if(sector >= FS_ADDR_ARRAY_MAX) {
+      // This does not logically change the file
+      sector_t indir_sector = fs_convert_to_large(disk_p, inode_p, hint);
+      if(indir_sector == FS_INVALID_SECTOR) {
+        ret = FS_INVALID_SECTOR;
+      } else {
+        ret = fs_get_file_sector_for_write_large_file(disk_p, 
+                                                      inode_p, 
+                                                      sector, 
+                                                      hint);
       }
+    } else {
+      // If it fails then ret will be invalid sector
+      ret = fs_addr_read_or_alloc(disk_p, 
+                                  &inode_p->addr[sector], 
+                                  FS_DATA_SECTOR,
+                                  hint);
     }
+  } else {
+    // Just forward it to the function
+    ret = fs_get_file_sector_for_write_large_file(disk_p, 
+                                                  inode_p, 
+                                                  sector, 
+                                                  hint);
+  }
 
-    int current_percent = (int)(((double)i / disk_p->sector_count) * 100);
-    if(current_percent != prev_percent) {
-      fprintf(stderr, "\r  Read progress %d%%", current_percent);
-      prev_percent = current_percent;
-    }
+  if(inode != FS_INVALID_INODE && ret != FS_INVALID_SECTOR) {
+    fs_map_cache_insert(inode, sector, ret, 1);
   }
-  putchar('\n');
+  
+  fs_unpin(disk_p, inode_p);
+  return ret;
+}
 
-  return;
+/*
+ * fs_get_file_sector_for_write() - This function returns the sector ID to 
+ *                                  write into, allocating it if necessary
+ *
+ * See fs_get_file_sector_for_write_near(). New sectors are placed right 
+ * after the previous sector of the file
+ */
+sector_t fs_get_file_sector_for_write(Storage *disk_p,
+                                      Inode *inode_p,
+                                      size_t offset) {
+  return fs_get_file_sector_for_write_near(disk_p, 
+                                           inode_p, 
+                                           offset, 
+                                           FS_INVALID_SECTOR);
 }
 
-void test_buffer(Storage *disk_p) {
-  info("=\n=Testing buffer...\n=");
-  for(int i = 0;i < MAX_BUFFER * 2;i++) {
-    void *p = read_lba(disk_p, (uint64_t)i);
-    memset(p, (char)i, disk_p->sector_size);
+// This is the maximum number of sectors we map and transfer in one batch
+// when reading or writing the aligned middle part of a request
+#define FS_IO_BATCH_MAX 64
 
-    buffer_print();
-  }
-  
-  info("Testing buffer and dirty flag...");
-  for(int i = 0;i < MAX_BUFFER * 2;i++) {
-    void *p = read_lba_for_write(disk_p, (uint64_t)i);
-    memset(p, (char)i, disk_p->sector_size);
+// Memory budget of data held by delayed allocation in bytes
+#define FS_DELALLOC_SIZE_MAX   (256 * 1024)
+#define FS_DELALLOC_SECTOR_MAX (FS_DELALLOC_SIZE_MAX / DEFAULT_SECTOR_SIZE)
+// Number of hash buckets. Must be a power of two
+#define FS_DELALLOC_BUCKET_MAX 64
 
-    buffer_print();
+// This is a sector of file data whose physical sector is not allocated yet
+typedef struct {
+  inode_id_t inode;
+  // Logical sector in the file
+  sector_t logical;
+  // Index of the next sector in the bucket, or -1
+  int next;
+} DelayedSector;
+
+// With delayed allocation, fs_write() keeps data written into unallocated 
+// sectors in memory. Physical sectors are allocated when the data is flushed,
+// such that each run of logical sectors gets a contiguous run of physical 
+// sectors, no matter how writes to different files were interleaved
+typedef struct {
+  int enabled;
+  size_t count;
+  // Number of free sectors reserved for the delayed sectors and the 
+  // indirection sectors they may need. Other allocations leave them free
+  size_t reserved;
+  DelayedSector sectors[FS_DELALLOC_SECTOR_MAX];
+  int bucket[FS_DELALLOC_BUCKET_MAX];
+  uint8_t data[FS_DELALLOC_SECTOR_MAX][DEFAULT_SECTOR_SIZE];
+} DelayedAlloc;
+
+DelayedAlloc delalloc;
+
+/*
+ * fs_delalloc_bucket() - Returns the bucket of a logical sector of an inode
+ */
+int *fs_delalloc_bucket(inode_id_t inode, sector_t logical) {
+  return &delalloc.bucket[((size_t)inode * 31 + logical) & 
+                          (FS_DELALLOC_BUCKET_MAX - 1)];
+}
+
+/*
+ * fs_delalloc_reset() - This function drops all delayed sectors
+ */
+void fs_delalloc_reset() {
+  delalloc.count = 0;
+  delalloc.reserved = 0;
+  for(int i = 0;i < FS_DELALLOC_BUCKET_MAX;i++) {
+    delalloc.bucket[i] = -1;
   }
 
   return;
 }
 
-void test_pin_buffer(Storage *disk_p) {
-  info("=\n=Testing buffer pin/unpin...\n=");
-  // First remove all buffers to make it into a known state
-  buffer_flush_all(disk_p);
+/*
+ * fs_delalloc_reserve_count() - Returns the number of sectors reserved for a
+ *                               delayed sector
+ *
+ * The first delayed sector of an inode under a leaf indirection sector 
+ * reserves the leaf and all levels above it, plus one in case the file is 
+ * converted to a large file. Other sectors under the same leaf only reserve
+ * themselves. Only the first count delayed sectors are checked
+ */
+size_t fs_delalloc_reserve_count(inode_id_t inode, 
+                                 sector_t logical, 
+                                 size_t count) {
+  const sector_t leaf = (sector_t)(logical / context.id_per_indir_sector);
+  for(size_t i = 0;i < count;i++) {
+    if(delalloc.sectors[i].inode == inode && 
+       delalloc.sectors[i].logical / context.id_per_indir_sector == leaf) {
+      return 1;
+    }
+  }
 
-  // First make sure there is no pinned buffer
-  assert(buffer_count_pinned() == 0UL);
+  return 1 + FS_INDIR_LEVEL_MAX + 1;
+}
 
-  const int pinned_count = 5;
-  // Then read 5 buffers
-  for(int i = 0;i < pinned_count;i++) {
-    uint8_t *p = (uint8_t *)read_lba(disk_p, (uint64_t)i);
-    // Pin the buffer using some pointer to the middle of the buffer
-    buffer_pin(disk_p, p + i * 20);
+/*
+ * fs_delalloc_can_alloc() - Returns 1 if a number of sectors could be 
+ *                           allocated without using the space reserved for
+ *                           delayed sectors
+ */
+int fs_delalloc_can_alloc(size_t count) {
+  // EARLY RETURN
+  if(delalloc.reserved == 0) {
+    return 1;
   }
 
-  // Print to see whether we have the pinned flag set
-  buffer_print();
-  assert(buffer_count_pinned() == (size_t)pinned_count);
+  return !!(fs_count_free_sectors() >= delalloc.reserved + count);
+}
 
-  // Read another 50 buffers and see whether the previous 5 are evicted
-  for(int i = 100;i < 150;i++) {
-    read_lba(disk_p, (uint64_t)i);
+/*
+ * fs_delalloc_find() - Returns the data of a delayed sector, or NULL if the
+ *                      sector is not delayed
+ */
+uint8_t *fs_delalloc_find(inode_id_t inode, sector_t logical) {
+  // EARLY RETURN
+  if(delalloc.count == 0 || inode == FS_INVALID_INODE) {
+    return NULL;
   }
 
-  // Print to see whether pinned buffer is still in the buffer list
-  buffer_print();
-  assert(buffer_count_pinned() == (size_t)pinned_count);
-
-  // Finally, unpin these buffers and then test the pinned count
-  for(int i = pinned_count - 1;i >= 0;i--) {
-    uint8_t *p = (uint8_t *)read_lba(disk_p, (uint64_t)i);
-    // Pin the buffer using some pointer to the middle of the buffer
-    buffer_unpin(disk_p, p + 511);
+  int index = *fs_delalloc_bucket(inode, logical);
+  while(index != -1) {
+    if(delalloc.sectors[index].inode == inode && 
+       delalloc.sectors[index].logical == logical) {
+      return delalloc.data[index];
+    }
+    index = delalloc.sectors[index].next;
   }
 
-  buffer_print();
-  assert(buffer_count_pinned() == 0UL);
+  return NULL;
+}
+
+/*
+ * fs_delalloc_overlay() - This function copies delayed sectors of an inode
+ *                         in a logical range into the buffer
+ *
+ * The buffer holds the range. Sectors that are not delayed are not changed
+ */
+void fs_delalloc_overlay(Storage *disk_p, 
+                         inode_id_t inode, 
+                         size_t logical, 
+                         size_t count, 
+                         uint8_t *buffer) {
+  for(size_t i = 0;i < delalloc.count;i++) {
+    const DelayedSector *sector_p = &delalloc.sectors[i];
+    if(sector_p->inode == inode && 
+       sector_p->logical >= logical && 
+       sector_p->logical < logical + count) {
+      memcpy(buffer + (sector_p->logical - logical) * disk_p->sector_size, 
+             delalloc.data[i], 
+             disk_p->sector_size);
+    }
+  }
 
   return;
 }
 
-void test_fs_init(Storage *disk_p) {
-  info("=\n=Testing fs initialization...\n=");
-
-  info("Inode size: %lu", sizeof(Inode));
-  info("SuperBlock size: %lu", sizeof(SuperBlock));
-  info("Entry size: %lu", sizeof(DirEntry));
+/*
+ * fs_delalloc_first() - Returns the first delayed logical sector of an inode
+ *                       in [logical, end), or end if there is none
+ */
+size_t fs_delalloc_first(inode_id_t inode, size_t logical, size_t end) {
+  size_t ret = end;
+  for(size_t i = 0;i < delalloc.count;i++) {
+    const DelayedSector *sector_p = &delalloc.sectors[i];
+    if(sector_p->inode == inode && 
+       sector_p->logical >= logical && 
+       sector_p->logical < ret) {
+      ret = sector_p->logical;
+    }
+  }
 
-  buffer_flush_all(disk_p);
-  assert(buffer_count_pinned() == 0UL);
+  return ret;
+}
 
-  // Note that we must put the super block on the given location
-  // Call the special version
-  _fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR, 0);
-  // Fill the parameters
-  fs_load_context(disk_p);
+/*
+ * fs_delalloc_load_inode() - This function returns an inode pointer for 
+ *                            allocating delayed sectors
+ *
+ * The returned inode is pinned
+ */
+Inode *fs_delalloc_load_inode(Storage *disk_p, inode_id_t inode) {
+  Inode *inode_p = \
+    fs_load_inode_sector(disk_p, inode, FS_LOAD_INODE_SECTOR_WRITE);
+  fs_pin(disk_p, inode_p);
+  return inode_p;
+}
 
-  buffer_flush_all(disk_p);
-  assert(buffer_count_pinned() == 0UL);
+int fs_delalloc_cmp(const void *a, const void *b) {
+  const DelayedSector *left_p = &delalloc.sectors[*(const int *)a];
+  const DelayedSector *right_p = &delalloc.sectors[*(const int *)b];
+  if(left_p->inode != right_p->inode) {
+    return left_p->inode < right_p->inode ? -1 : 1;
+  } else if(left_p->logical != right_p->logical) {
+    return left_p->logical < right_p->logical ? -1 : 1;
+  }
 
-  return;
+  return 0;
 }
 
-void test_alloc_sector(Storage *disk_p) {
-  info("=\n=Testing sector allocation...\n=");
-
-  buffer_flush_all(disk_p);
-  assert(buffer_count_pinned() == 0UL);
+/*
+ * fs_delalloc_flush() - This function allocates physical sectors for all 
+ *                       delayed sectors and writes their data
+ *
+ * Delayed sectors are sorted by inode and logical sector. For each run of
+ * consecutive logical sectors, a free extent large enough for the run and 
+ * the indirection sectors it may need is located first, right after the 
+ * previous sector of the file if possible. Sectors are then mapped in order
+ * with the extent as the hint, so indirection sectors are placed right 
+ * before the data they map. Data is written with one multi-sector request 
+ * per contiguous run
+ *
+ * The sectors are allocated from the space reserved for them, so this does
+ * not run out of free sectors
+ */
+void fs_delalloc_flush(Storage *disk_p) {
+  // EARLY RETURN
+  if(delalloc.count == 0) {
+    return;
+  }
 
-  const char *round_desp[] = {
-    "Low to high",
-    "High to low",
-    "Random",
-    "Verify"
-  };
+  // The reservation is released to the allocations below
+  delalloc.reserved = 0;
 
-  const size_t free_sector_start = context.free_start_sector;
-  const size_t total_sector_count = context.total_sector_count;
-  const size_t free_sector_count = context.free_sector_count;
-  // Make sure the result is correct
-  assert(total_sector_count == disk_p->sector_count);
+  int order[FS_DELALLOC_SECTOR_MAX];
+  for(size_t i = 0;i < delalloc.count;i++) {
+    order[i] = (int)i;
+  }
+  qsort(order, delalloc.count, sizeof(int), fs_delalloc_cmp);
 
-  // Allocate a bitmap to record which sector is good and which is not
-  uint8_t *sector_map = \
-    malloc(sizeof(uint8_t) * free_sector_count);
-  assert(sector_map != NULL);
-  int round = 0;
-  int prev_percent = 0;
-  while(1) {
-    memset(sector_map, 
-          0x00, 
-          sizeof(uint8_t) * free_sector_count);
+  const size_t sector_size = disk_p->sector_size;
+  uint8_t *batch_p = malloc(FS_IO_BATCH_MAX * sector_size);
+  if(batch_p == NULL) {
+    fatal_error("Failed to allocate the delayed allocation buffer");
+  }
 
-    sector_t sector;
-    size_t count = 0;
-    do { 
-      sector = fs_alloc_sector(disk_p);
-      if(sector != FS_INVALID_SECTOR) {
-        count++;
-        // Must be within free sector
-        assert(sector >= free_sector_start);
-        assert(sector < total_sector_count);
-        size_t index = sector - free_sector_start;
-        assert(sector_map[index] == 0);
-        sector_map[index] = 1;
+  size_t i = 0;
+  while(i < delalloc.count) {
+    const DelayedSector *first_p = &delalloc.sectors[order[i]];
+    size_t j = i + 1;
+    while(j < delalloc.count && 
+          j - i < FS_IO_BATCH_MAX && 
+          delalloc.sectors[order[j]].inode == first_p->inode && 
+          delalloc.sectors[order[j]].logical == 
+            delalloc.sectors[order[j - 1]].logical + 1) {
+      j++;
+    }
 
-        int current_percent = \
-          (int)(((double)count / context.free_sector_count) * 100);
-        if(current_percent != prev_percent) {
-          prev_percent = current_percent;
-          fprintf(stderr, "\r  Allocated %d%% of all free blocks", 
-                  prev_percent);
-        }
+    const size_t count = j - i;
+    Inode *inode_p = fs_delalloc_load_inode(disk_p, first_p->inode);
+    sector_t hint = FS_INVALID_SECTOR;
+    if(first_p->logical != 0) {
+      hint = fs_get_file_sector(disk_p, 
+                                inode_p, 
+                                (size_t)(first_p->logical - 1) * sector_size);
+      if(hint != FS_INVALID_SECTOR) {
+        hint++;
       }
-    } while(sector != FS_INVALID_SECTOR);
-    putchar('\n');
-    
-    info("Round %d (%s): Allocated %lu sectors. Now verifying...", 
-         round, 
-         round_desp[round],
-         count);
-
-    // Check whether all sectors are allocated
-    for(size_t i = free_sector_start;i < total_sector_count;i++) {
-      assert(sector_map[i - free_sector_start] == 1);
+    }
+    if(hint == FS_INVALID_SECTOR) {
+      hint = fs_group_get_hint(first_p->inode);
+    }
+    // At most one indirection sector per indirection sector worth of data,
+    // plus the first level of indirection and one for crossing
+    const sector_count_t reserve_count = \
+      (sector_count_t)(count + count / context.id_per_indir_sector + 2);
+    const sector_t start = fs_alloc_sectors(disk_p, reserve_count, hint);
+    if(start != FS_INVALID_SECTOR) {
+      fs_free_sectors(disk_p, start, reserve_count);
+      hint = start;
     }
 
-    info("  ...Pass");
-    info("  Free allocated sectors...");
-    if(round == 0) {
-      for(sector_t i = free_sector_start;i < total_sector_count;i++) {
-        fs_free_sector(disk_p, i);
+    sector_t sector_map[FS_IO_BATCH_MAX];
+    for(size_t k = 0;k < count;k++) {
+      const DelayedSector *sector_p = &delalloc.sectors[order[i + k]];
+      sector_map[k] = \
+        fs_get_file_sector_for_write_near(disk_p, 
+                                          inode_p, 
+                                          (size_t)sector_p->logical * 
+                                            sector_size, 
+                                          hint);
+      // Space was reserved when the data was written
+      if(sector_map[k] == FS_INVALID_SECTOR) {
+        fatal_error("Failed to allocate a delayed sector");
       }
-    } else if(round == 1) {
-      for(sector_t i = total_sector_count - 1;i >= free_sector_start;i--) {
-        fs_free_sector(disk_p, i);
+      memcpy(batch_p + k * sector_size, delalloc.data[order[i + k]], 
+             sector_size);
+      hint = sector_map[k] + 1;
+    }
+    fs_set_dirty(disk_p, inode_p);
+    fs_unpin(disk_p, inode_p);
+
+    size_t k = 0;
+    while(k < count) {
+      size_t l = k + 1;
+      while(l < count && sector_map[l] == sector_map[l - 1] + 1) {
+        l++;
       }
-    } else if(round == 2) {
-      srand(time(NULL));
-      for(int i = 0;i < free_sector_count;i++) {
-        // [free_sector_start, total_sector_count)
-        sector_t start = \
-          ((sector_t)rand() % free_sector_count) + free_sector_start;
-        // Use the map as a hash table to find sectors that are not yet
-        // freed
-        while(sector_map[start - free_sector_start] == 0) {
-          start++;
-          if(start == total_sector_count) {
-            start = free_sector_start;
-          }
+      write_lba_multi(disk_p, sector_map[k], l - k, batch_p + k * sector_size);
+      k = l;
+    }
+
+    i = j;
+  }
+
+  free(batch_p);
+  fs_delalloc_reset();
+
+  return;
+}
+
+/*
+ * fs_delalloc_get_for_write() - This function returns the in-memory data 
+ *                               of a sector to be written, if the sector is
+ *                               delayed or could be delayed
+ *
+ * A new delayed sector is zero-filled, and free sectors are reserved for it
+ * such that it could always be allocated when flushed. Returns NULL if 
+ * delayed allocation is disabled, the sector is already allocated, or there
+ * is not enough free space to reserve. In this case the caller writes the 
+ * sector as usual, which fails for lack of space in the latter case
+ *
+ * If the memory budget is used up, all delayed sectors are flushed first
+ */
+uint8_t *fs_delalloc_get_for_write(Storage *disk_p, 
+                                   Inode *inode_p, 
+                                   inode_id_t inode, 
+                                   size_t offset) {
+  // EARLY RETURN
+  if(delalloc.enabled == 0 || inode == FS_INVALID_INODE) {
+    return NULL;
+  }
+
+  const sector_t logical = (sector_t)(offset / disk_p->sector_size);
+  uint8_t *data_p = fs_delalloc_find(inode, logical);
+  // EARLY RETURN
+  if(data_p != NULL) {
+    return data_p;
+  } else if(fs_get_file_sector(disk_p, inode_p, offset) != FS_INVALID_SECTOR) {
+    return NULL;
+  }
+
+  if(delalloc.count == FS_DELALLOC_SECTOR_MAX) {
+    fs_delalloc_flush(disk_p);
+  }
+
+  // Reserve the data sector and indirection sectors it may need
+  const size_t reserve_count = \
+    fs_delalloc_reserve_count(inode, logical, delalloc.count);
+  // EARLY RETURN
+  if(fs_delalloc_can_alloc(reserve_count) == 0) {
+    return NULL;
+  }
+
+  delalloc.reserved += reserve_count;
+  const int index = (int)delalloc.count;
+  delalloc.count++;
+  delalloc.sectors[index].inode = inode;
+  delalloc.sectors[index].logical = logical;
+  int *bucket_p = fs_delalloc_bucket(inode, logical);
+  delalloc.sectors[index].next = *bucket_p;
+  *bucket_p = index;
+  memset(delalloc.data[index], 0x00, disk_p->sector_size);
+
+  return delalloc.data[index];
+}
+
+/*
+ * fs_delalloc_drop() - This function drops delayed sectors of an inode at or
+ *                      after a logical sector without writing them
+ *
+ * This is used when the inode is truncated or freed
+ */
+void fs_delalloc_drop(inode_id_t inode, sector_t first) {
+  // EARLY RETURN
+  if(delalloc.count == 0) {
+    return;
+  }
+
+  size_t i = 0;
+  while(i < delalloc.count) {
+    if(delalloc.sectors[i].inode != inode || 
+       delalloc.sectors[i].logical < first) {
+      i++;
+      continue;
+    }
+
+    // Move the last one into this slot, and then rebuild the buckets
+    delalloc.count--;
+    delalloc.sectors[i] = delalloc.sectors[delalloc.count];
+    memcpy(delalloc.data[i], delalloc.data[delalloc.count], DEFAULT_SECTOR_SIZE);
+  }
+
+  for(int j = 0;j < FS_DELALLOC_BUCKET_MAX;j++) {
+    delalloc.bucket[j] = -1;
+  }
+  // The reservation is counted again for the remaining sectors
+  delalloc.reserved = 0;
+  for(size_t j = 0;j < delalloc.count;j++) {
+    int *bucket_p = fs_delalloc_bucket(delalloc.sectors[j].inode, 
+                                       delalloc.sectors[j].logical);
+    delalloc.sectors[j].next = *bucket_p;
+    *bucket_p = (int)j;
+    delalloc.reserved += \
+      fs_delalloc_reserve_count(delalloc.sectors[j].inode, 
+                                delalloc.sectors[j].logical, 
+                                j);
+  }
+
+  return;
+}
+
+/*
+ * fs_set_delayed_alloc() - This function enables or disables delayed 
+ *                          allocation for fs_write()
+ *
+ * Delayed sectors are flushed when it is disabled. They are also flushed by 
+ * fs_sync()
+ */
+void fs_set_delayed_alloc(Storage *disk_p, int enabled) {
+  if(enabled == 0) {
+    fs_delalloc_flush(disk_p);
+  }
+  delalloc.enabled = enabled;
+
+  return;
+}
+
+/*
+ * fs_read_sectors() - This function reads a range of whole sectors of a file
+ *                     into the caller's buffer
+ *
+ * The range is mapped into extents using fs_map_range(). Runs of sectors 
+ * that are contiguous on the disk are read using a single multi-sector 
+ * request, and holes are filled with zero without any I/O, except for 
+ * sectors waiting for delayed allocation. The buffer pool is bypassed
+ *
+ * The offset must be sector aligned. The inode should be pinned
+ */
+void fs_read_sectors(Storage *disk_p, 
+                     Inode *inode_p, 
+                     size_t offset, 
+                     size_t count, 
+                     uint8_t *buffer) {
+  assert(offset % disk_p->sector_size == 0);
+  const size_t logical = offset / disk_p->sector_size;
+  size_t i = 0;
+  while(i < count) {
+    sector_t start;
+    const size_t run_count = \
+      fs_map_range(disk_p, inode_p, logical + i, count - i, &start);
+    uint8_t *dest_p = buffer + i * disk_p->sector_size;
+    if(start == FS_INVALID_SECTOR) {
+      memset(dest_p, 0x00, run_count * disk_p->sector_size);
+      if(delalloc.count != 0) {
+        fs_delalloc_overlay(disk_p, 
+                            fs_get_inode_id(disk_p, inode_p), 
+                            logical + i, 
+                            run_count, 
+                            dest_p);
+      }
+    } else {
+      read_lba_multi(disk_p, start, run_count, dest_p);
+    }
+
+    i += run_count;
+  }
+
+  return;
+}
+
+/*
+ * fs_write_sectors() - This function writes a batch of whole sectors of a file
+ *                      from the caller's buffer
+ *
+ * Sectors are mapped (and allocated if necessary) first, and then runs that 
+ * are contiguous on the disk are written as a single multi-sector request.
+ * The buffer pool is bypassed
+ *
+ * Returns the number of sectors that are written. If this is less than count
+ * then we have run out of free sectors. The inode should be pinned
+ */
+size_t fs_write_sectors(Storage *disk_p, 
+                        Inode *inode_p, 
+                        size_t offset, 
+                        size_t count, 
+                        const uint8_t *buffer) {
+  assert(offset % disk_p->sector_size == 0);
+  assert(count <= FS_IO_BATCH_MAX);
+  sector_t sector_map[FS_IO_BATCH_MAX];
+  size_t mapped = 0;
+  while(mapped < count) {
+    sector_t sector = \
+      fs_get_file_sector_for_write(disk_p, 
+                                   inode_p, 
+                                   offset + mapped * disk_p->sector_size);
+    if(sector == FS_INVALID_SECTOR) {
+      break;
+    }
+
+    sector_map[mapped] = sector;
+    mapped++;
+  }
+
+  size_t i = 0;
+  while(i < mapped) {
+    size_t j = i + 1;
+    while(j < mapped && sector_map[j] == sector_map[j - 1] + 1) {
+      j++;
+    }
+    write_lba_multi(disk_p, 
+                    sector_map[i], 
+                    j - i, 
+                    buffer + i * disk_p->sector_size);
+    i = j;
+  }
+
+  return mapped;
+}
+
+/*
+ * fs_read() - This function reads a range of bytes from a file
+ *
+ * The range is truncated at the end of the file. Unaligned head and tail are
+ * copied from the buffered sector, while the aligned middle part is read 
+ * using one multi-sector request per extent. Holes read as zero.
+ *
+ * Returns the number of bytes read. This function pins the inode while it
+ * performs I/O
+ */
+size_t fs_read(Storage *disk_p, 
+               Inode *inode_p, 
+               size_t offset, 
+               size_t len, 
+               void *buffer) {
+  fs_pin(disk_p, inode_p);
+  const size_t file_size = fs_get_file_size(inode_p);
+  if(offset >= file_size) {
+    fs_unpin(disk_p, inode_p);
+    return 0UL;
+  } else if(len > file_size - offset) {
+    len = file_size - offset;
+  }
+
+  // EARLY RETURN
+  if(fs_is_file_inline(inode_p) == 1) {
+    memcpy(buffer, (const uint8_t *)inode_p->addr + offset, len);
+    fs_unpin(disk_p, inode_p);
+    return len;
+  }
+
+  const size_t sector_size = disk_p->sector_size;
+  uint8_t *dest_p = (uint8_t *)buffer;
+  size_t remaining = len;
+  while(remaining != 0) {
+    size_t sector_offset = offset % sector_size;
+    if(sector_offset != 0 || remaining < sector_size) {
+      // Partial sector at the head or the tail
+      size_t copy_size = sector_size - sector_offset;
+      if(copy_size > remaining) {
+        copy_size = remaining;
+      }
+
+      sector_t sector = \
+        fs_get_file_sector(disk_p, inode_p, offset - sector_offset);
+      if(sector == FS_INVALID_SECTOR) {
+        const uint8_t *data_p = \
+          fs_delalloc_find(fs_get_inode_id(disk_p, inode_p), 
+                           offset / sector_size);
+        if(data_p == NULL) {
+          memset(dest_p, 0x00, copy_size);
+        } else {
+          memcpy(dest_p, data_p + sector_offset, copy_size);
         }
+      } else {
+        uint8_t *data_p = read_lba(disk_p, sector);
+        memcpy(dest_p, data_p + sector_offset, copy_size);
+      }
 
-        // Clear it and then free
-        sector_map[start - free_sector_start] = 0;
-        fs_free_sector(disk_p, start);
+      offset += copy_size;
+      dest_p += copy_size;
+      remaining -= copy_size;
+    } else {
+      // Aligned middle part. It is read by extents, such that holes are
+      // zero-filled at once no matter how large they are
+      const size_t count = remaining / sector_size;
+
+      fs_read_sectors(disk_p, inode_p, offset, count, dest_p);
+      offset += count * sector_size;
+      dest_p += count * sector_size;
+      remaining -= count * sector_size;
+    }
+  }
+
+  fs_unpin(disk_p, inode_p);
+  return len;
+}
+
+/*
+ * fs_can_inline() - Returns 1 if the file could be made inline
+ *
+ * The file must be empty, and must not map any sector. Directories are 
+ * never inline, because their entries are accessed as sectors
+ */
+int fs_can_inline(const Inode *inode_p) {
+  // EARLY RETURN
+  if(fs_get_file_type(inode_p) == FS_INODE_TYPE_DIR || 
+     fs_is_file_large(inode_p) == 1 || 
+     fs_is_file_extent(inode_p) == 1 || 
+     fs_get_file_size(inode_p) != 0) {
+    return 0;
+  }
+
+  for(int i = 0;i < FS_ADDR_ARRAY_MAX;i++) {
+    if(inode_p->addr[i] != FS_INVALID_SECTOR) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * fs_inline_expand() - This function moves the data of an inline file into
+ *                      a data sector
+ *
+ * Returns 1 if successful. If the sector could not be allocated, the file 
+ * stays inline and 0 is returned. The inode should be pinned
+ */
+int fs_inline_expand(Storage *disk_p, Inode *inode_p) {
+  assert(fs_is_file_inline(inode_p) == 1);
+  uint8_t data[FS_INLINE_SIZE_MAX];
+  const size_t size = fs_get_file_size(inode_p);
+  memcpy(data, inode_p->addr, FS_INLINE_SIZE_MAX);
+  inode_p->flags &= (~FS_INODE_INLINE);
+  fs_reset_addr(inode_p);
+  const inode_id_t inode = fs_get_inode_id(disk_p, inode_p);
+  if(inode != FS_INVALID_INODE) {
+    fs_map_cache_invalidate(inode);
+  }
+
+  // The file size is not zero, so it is not made inline again
+  if(size != 0 && fs_write(disk_p, inode_p, 0, size, data) != size) {
+    memcpy(inode_p->addr, data, FS_INLINE_SIZE_MAX);
+    inode_p->flags |= FS_INODE_INLINE;
+    return 0;
+  }
+  fs_set_dirty(disk_p, inode_p);
+
+  return 1;
+}
+
+/*
+ * fs_write() - This function writes a range of bytes into a file
+ *
+ * Sectors are allocated as needed. Unaligned head and tail are merged into
+ * the buffered sector (a newly allocated sector is zero-filled first), while 
+ * the aligned middle part is written in batches of contiguous multi-sector 
+ * requests. The file size is extended if the write goes past the end.
+ *
+ * An empty file that is written within FS_INLINE_SIZE_MAX bytes becomes an 
+ * inline file. Its data is moved into a sector when it grows further
+ *
+ * Returns the number of bytes written, which is less than len if we run out
+ * of free sectors or reach the maximum file size. This function pins the
+ * inode and marks its buffer as dirty
+ */
+size_t fs_write(Storage *disk_p, 
+                Inode *inode_p, 
+                size_t offset, 
+                size_t len, 
+                const void *buffer) {
+  if(offset >= FS_FILE_SIZE_MAX) {
+    return 0UL;
+  } else if(len > FS_FILE_SIZE_MAX - offset) {
+    len = FS_FILE_SIZE_MAX - offset;
+  }
+
+  fs_pin(disk_p, inode_p);
+  if(offset + len <= FS_INLINE_SIZE_MAX && fs_can_inline(inode_p) == 1) {
+    inode_p->flags |= FS_INODE_INLINE;
+  }
+  if(fs_is_file_inline(inode_p) == 1) {
+    // EARLY RETURN
+    if(offset + len <= FS_INLINE_SIZE_MAX) {
+      memcpy((uint8_t *)inode_p->addr + offset, buffer, len);
+      if(offset + len > fs_get_file_size(inode_p)) {
+        fs_set_file_size(inode_p, offset + len);
+      }
+      fs_set_dirty(disk_p, inode_p);
+      fs_unpin(disk_p, inode_p);
+      return len;
+    } else if(fs_inline_expand(disk_p, inode_p) == 0) {
+      fs_unpin(disk_p, inode_p);
+      return 0UL;
+    }
+  }
+
+  const size_t sector_size = disk_p->sector_size;
+  const uint8_t *src_p = (const uint8_t *)buffer;
+  const inode_id_t inode = \
+    delalloc.enabled ? fs_get_inode_id(disk_p, inode_p) : FS_INVALID_INODE;
+  size_t remaining = len;
+  while(remaining != 0) {
+    size_t sector_offset = offset % sector_size;
+    // With delayed allocation, data of unallocated sectors is kept in memory
+    uint8_t *delayed_p = \
+      fs_delalloc_get_for_write(disk_p, inode_p, inode, offset - sector_offset);
+    if(delayed_p != NULL) {
+      size_t copy_size = sector_size - sector_offset;
+      if(copy_size > remaining) {
+        copy_size = remaining;
+      }
+
+      memcpy(delayed_p + sector_offset, src_p, copy_size);
+      offset += copy_size;
+      src_p += copy_size;
+      remaining -= copy_size;
+    } else if(sector_offset != 0 || remaining < sector_size) {
+      size_t copy_size = sector_size - sector_offset;
+      if(copy_size > remaining) {
+        copy_size = remaining;
       }
+
+      // Check whether the sector exists before allocating it, because a new
+      // sector must be zero-filled rather than read
+      sector_t sector = \
+        fs_get_file_sector(disk_p, inode_p, offset - sector_offset);
+      uint8_t *data_p;
+      if(sector == FS_INVALID_SECTOR) {
+        sector = fs_get_file_sector_for_write(disk_p, 
+                                              inode_p, 
+                                              offset - sector_offset);
+        if(sector == FS_INVALID_SECTOR) {
+          break;
+        }
+
+        data_p = write_lba(disk_p, sector);
+        memset(data_p, 0x00, sector_size);
+      } else {
+        data_p = read_lba_for_write(disk_p, sector);
+      }
+      memcpy(data_p + sector_offset, src_p, copy_size);
+
+      offset += copy_size;
+      src_p += copy_size;
+      remaining -= copy_size;
     } else {
-      info("Cleaning up");
-      for(sector_t i = free_sector_start;i < total_sector_count;i++) {
-        fs_free_sector(disk_p, i);
+      size_t count = remaining / sector_size;
+      if(count > FS_IO_BATCH_MAX) {
+        count = FS_IO_BATCH_MAX;
+      }
+      // Following holes may still be delayed, so only the extent of 
+      // allocated sectors is written in the batch. A hole here could not be 
+      // reserved, and is allocated as usual
+      if(inode != FS_INVALID_INODE) {
+        sector_t start;
+        count = fs_map_range(disk_p, inode_p, offset / sector_size, count, 
+                             &start);
+        if(start == FS_INVALID_SECTOR) {
+          count = 1;
+        }
+      }
+
+      size_t written = \
+        fs_write_sectors(disk_p, inode_p, offset, count, src_p);
+      offset += written * sector_size;
+      src_p += written * sector_size;
+      remaining -= written * sector_size;
+      // Run out of sectors
+      if(written != count) {
+        break;
+      }
+    }
+  }
+
+  // Extend the file if we wrote past its end. Nothing is written if we run
+  // out of free sectors at once
+  if(remaining != len && offset > fs_get_file_size(inode_p)) {
+    fs_set_file_size(inode_p, offset);
+  }
+  fs_set_dirty(disk_p, inode_p);
+
+  fs_unpin(disk_p, inode_p);
+  return len - remaining;
+}
+
+// This is returned by fs_seek_data() and fs_seek_hole() if there is no 
+// such offset
+#define FS_SEEK_NONE ((size_t)-1)
+
+/*
+ * fs_seek_data() - This function returns the first offset at or after the 
+ *                  given one that is backed by data
+ *
+ * Data is tracked at sector granularity, and sectors waiting for delayed 
+ * allocation are data. Returns FS_SEEK_NONE if the offset is at or beyond 
+ * the end of the file, or if the rest of the file is a hole. Holes are 
+ * skipped by extent using fs_map_range()
+ *
+ * This function pins the inode
+ */
+size_t fs_seek_data(Storage *disk_p, Inode *inode_p, size_t offset) {
+  fs_pin(disk_p, inode_p);
+  const size_t sector_size = disk_p->sector_size;
+  const size_t file_size = fs_get_file_size(inode_p);
+  // EARLY RETURN
+  if(fs_is_file_inline(inode_p) == 1) {
+    fs_unpin(disk_p, inode_p);
+    return (offset < file_size) ? offset : FS_SEEK_NONE;
+  }
+
+  const size_t end = (file_size + sector_size - 1) / sector_size;
+  const inode_id_t inode = fs_get_inode_id(disk_p, inode_p);
+  size_t ret = FS_SEEK_NONE;
+  size_t logical = offset / sector_size;
+  while(offset < file_size && logical < end) {
+    sector_t start;
+    const size_t count = \
+      fs_map_range(disk_p, inode_p, logical, end - logical, &start);
+    if(start != FS_INVALID_SECTOR) {
+      ret = logical;
+      break;
+    } else if(delalloc.count != 0 && inode != FS_INVALID_INODE) {
+      const size_t delayed = \
+        fs_delalloc_first(inode, logical, logical + count);
+      if(delayed != logical + count) {
+        ret = delayed;
+        break;
+      }
+    }
+
+    logical += count;
+  }
+
+  if(ret != FS_SEEK_NONE) {
+    ret *= sector_size;
+    if(ret < offset) {
+      ret = offset;
+    }
+  }
+
+  fs_unpin(disk_p, inode_p);
+  return ret;
+}
+
+/*
+ * fs_seek_hole() - This function returns the first offset at or after the
+ *                  given one that is in a hole
+ *
+ * The end of the file counts as a hole, so this returns the file size if 
+ * the rest of the file is all data. Returns FS_SEEK_NONE if the offset is 
+ * at or beyond the end of the file
+ *
+ * This function pins the inode
+ */
+size_t fs_seek_hole(Storage *disk_p, Inode *inode_p, size_t offset) {
+  fs_pin(disk_p, inode_p);
+  const size_t sector_size = disk_p->sector_size;
+  const size_t file_size = fs_get_file_size(inode_p);
+  // EARLY RETURN
+  if(offset >= file_size) {
+    fs_unpin(disk_p, inode_p);
+    return FS_SEEK_NONE;
+  } else if(fs_is_file_inline(inode_p) == 1) {
+    fs_unpin(disk_p, inode_p);
+    return file_size;
+  }
+
+  const size_t end = (file_size + sector_size - 1) / sector_size;
+  const inode_id_t inode = fs_get_inode_id(disk_p, inode_p);
+  size_t ret = file_size;
+  size_t logical = offset / sector_size;
+  while(logical < end) {
+    sector_t start;
+    const size_t count = \
+      fs_map_range(disk_p, inode_p, logical, end - logical, &start);
+    if(start == FS_INVALID_SECTOR) {
+      // Skip delayed sectors at the beginning of the hole
+      size_t hole = logical;
+      while(hole < logical + count && 
+            fs_delalloc_find(inode, (sector_t)hole) != NULL) {
+        hole++;
+      }
+      if(hole != logical + count) {
+        ret = hole * sector_size;
+        break;
       }
+    }
+
+    logical += count;
+  }
+
+  if(ret < offset) {
+    ret = offset;
+  } else if(ret > file_size) {
+    ret = file_size;
+  }
+
+  fs_unpin(disk_p, inode_p);
+  return ret;
+}
+
+/*
+ * fs_alloc_sector_for_dir() - This function allocates a sector for holding
+ *                             directory entries
+ *
+ * We fill the sector with unused entries.
+ *
+ * If allocation fails we return invalid sector. The buffer should be pinned
+ */
+sector_t fs_alloc_sector_for_dir(Storage *disk_p, 
+                                 Inode *inode_p, 
+                                 sector_t alloc_for) {
+  assert(fs_is_pinned(disk_p, inode_p) == 1);
+  // Allocate for the linear sector specifid in the argument
+  sector_t sector = \
+    fs_get_file_sector_for_write(disk_p, 
+                                 inode_p, 
+                                 (size_t)alloc_for * disk_p->sector_size);
+  // If the sector is allocated then initialize its content
+  if(sector != FS_INVALID_SECTOR) {
+    DirEntry *entry_p = (DirEntry *)write_lba(disk_p, sector);
+    // Names are cleared such that no stale index header is seen in "."
+    memset(entry_p, 0x00, disk_p->sector_size);
+    for(int i = 0;i < context.dir_per_sector;i++) {
+      entry_p[i].inode = FS_INVALID_INODE;
+    }
+  }
+
+  return sector;
+}
+
+/*
+ * fs_free_dir_sector() - This function frees a directory's sector
+ *
+ * We did not check whether the sector is all empty. The caller should
+ * respect this.
+ *
+ * This function assumes that the inode has been pinned in the buffer
+ */
+void fs_free_dir_sector(Storage *disk_p, 
+                        Inode *inode_p, 
+                        void *free_sector_p, 
+                        int is_last_sector) {
+  assert(fs_is_pinned(disk_p, inode_p));
+  // Must pin as we read other sectors, and also must set to dirty
+  buffer_pin(disk_p, free_sector_p);
+  // The last sector is removed from the mapping
+  fs_map_cache_invalidate(fs_get_inode_id(disk_p, inode_p));
+  // Just decrease by sector size and the offset now points to the 
+  // last sector
+  const size_t last_offset = fs_get_file_size(inode_p) - disk_p->sector_size;
+  // The returned value may be inside an indirection sector, so we should
+  // change it before we read any sector
+  sector_t * const last_sector_slot_p = \
+    fs_get_file_sector_p(disk_p, inode_p, last_offset);
+  // Dereference to get the sector value
+  const sector_t last_sector = *last_sector_slot_p;
+  // Then remove it from the slot
+  *last_sector_slot_p = FS_INVALID_SECTOR;
+  // Make it dirty. Can be in either inode or indir. sector
+  fs_set_dirty(disk_p, last_sector_slot_p);
+  assert(last_sector != FS_INVALID_SECTOR);
+  // Only copy for the last sector
+  if(is_last_sector == 0) {
+    void *data_p = read_lba(disk_p, last_sector);
+    memcpy(free_sector_p, data_p, disk_p->sector_size);
+    buffer_set_dirty(disk_p, free_sector_p);
+  }
+  // Reduce the directory size by sector size
+  fs_set_file_size(inode_p, fs_get_file_size(inode_p) - disk_p->sector_size);
+  fs_set_dirty(disk_p, inode_p);
+  fs_free_sector(disk_p, last_sector);
+  buffer_unpin(disk_p, free_sector_p);
+  return;
+} 
+
+// Directories with at least this many sectors are indexed
+#define FS_DIR_INDEX_MIN_SECTORS 4
+// Set in the index header if the index reflects the directory
+#define FS_DIR_INDEX_VALID       0x01
+// Position value of an unused index slot
+#define FS_DIR_INDEX_EMPTY       ((uint32_t)-1)
+
+// Directories with many entries have an optional hash index, which maps 
+// the hash of a name to the position of its entry. The position is the 
+// linear sector of the entry times dir_per_sector plus its index in the 
+// sector. Entries themselves are stored in the usual linear layout, such 
+// that fs_next_dir() works whether or not the directory is indexed
+//
+// The index is an open-addressing hash table with linear probing, stored in 
+// a run of contiguous sectors outside of the directory's addr array. Entries
+// are deleted by shifting back later entries of the same cluster, so there 
+// is no tombstone and the table never degrades
+typedef struct {
+  uint32_t hash;
+  uint32_t pos;
+} __attribute__((packed)) DirIndexSlot;
+
+// The header is stored in the null padding of the "." entry, which is 
+// always the first entry of the directory. Since the name is still "." 
+// followed by '\0', code that does not know about the index still sees 
+// a normal "." entry. The padding is not null though, so "." is never 
+// compared on the full width: fs_dir_find() matches it by position, and it
+// is not in the index
+typedef struct {
+  char dot[2];
+  uint8_t flags;
+  // Number of slots is (1 << shift)
+  uint8_t shift;
+  // First sector of the index
+  sector_t start;
+  // Number of names in the index
+  uint32_t entry_count;
+} __attribute__((packed)) DirIndexHeader;
+
+/*
+ * fs_dir_pad_name() - This function copies a name into a null-padded key
+ *                     of FS_DIR_ENTRY_NAME_MAX bytes
+ *
+ * Keys are compared with memcmp() on the full width, which only matches 
+ * names of the same length. Returns 0 if the name is too long
+ */
+int fs_dir_pad_name(const char *name, char *key) {
+  size_t len = strlen(name);
+  if(len > FS_DIR_ENTRY_NAME_MAX) {
+    return 0;
+  }
+
+  memset(key, 0x00, FS_DIR_ENTRY_NAME_MAX);
+  memcpy(key, name, len);
+  return 1;
+}
+
+/*
+ * fs_dir_hash() - This function hashes a null-padded key using FNV-1a
+ */
+uint32_t fs_dir_hash(const char *key) {
+  uint32_t hash = 2166136261U;
+  for(int i = 0;i < FS_DIR_ENTRY_NAME_MAX;i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+/*
+ * fs_dir_entry_at() - This function returns the entry at the given position
+ *                     of a directory
+ *
+ * If write_flag is 1 then the sector is loaded for write
+ */
+DirEntry *fs_dir_entry_at(Storage *disk_p, 
+                          Inode *inode_p, 
+                          uint32_t pos, 
+                          int write_flag) {
+  const size_t offset = \
+    (size_t)(pos / context.dir_per_sector) * disk_p->sector_size;
+  sector_t sector = fs_get_file_sector(disk_p, inode_p, offset);
+  // There is no hole in the directory
+  assert(sector != FS_INVALID_SECTOR);
+  DirEntry *entry_p = NULL;
+  if(write_flag == 1) {
+    entry_p = (DirEntry *)read_lba_for_write(disk_p, sector);
+  } else {
+    entry_p = (DirEntry *)read_lba(disk_p, sector);
+  }
+
+  return entry_p + (pos % context.dir_per_sector);
+}
+
+// Entries are compared with a pattern of this size, which holds as many 
+// copies of the entry being searched as fit
+#define FS_DIR_PATTERN_SIZE 32
+// Maximum number of entries compared by fs_dir_scan_block()
+#define FS_DIR_SCAN_BLOCK   64
+// Number of entries compared by each step of the scan
+#if defined(__AVX2__)
+#define FS_DIR_SCAN_STEP    (FS_DIR_PATTERN_SIZE / sizeof(DirEntry))
+#else
+#define FS_DIR_SCAN_STEP    1
+#endif
+
+// Bits of the byte-wise comparison of an entry that cover the inode, the
+// name and the entire entry
+#define FS_DIR_EQ_ENTRY ((uint32_t)((1ULL << sizeof(DirEntry)) - 1))
+#define FS_DIR_EQ_INODE ((uint32_t)((1ULL << sizeof(inode_id_t)) - 1))
+#define FS_DIR_EQ_NAME  (FS_DIR_EQ_ENTRY & ~FS_DIR_EQ_INODE)
+
+/*
+ * fs_dir_make_pattern() - This function fills the pattern of a directory 
+ *                         scan
+ *
+ * Each copy is a free entry whose name is the given key, which should be 
+ * padded to FS_DIR_ENTRY_NAME_MAX bytes. If the key is NULL the name is 
+ * left empty, which is enough to look for free entries
+ */
+void fs_dir_make_pattern(uint8_t *pattern_p, const char *key) {
+  assert(FS_DIR_PATTERN_SIZE % sizeof(DirEntry) == 0);
+  DirEntry *entry_p = (DirEntry *)pattern_p;
+  for(size_t i = 0;i < FS_DIR_PATTERN_SIZE / sizeof(DirEntry);i++) {
+    entry_p[i].inode = FS_INVALID_INODE;
+    if(key != NULL) {
+      memcpy(entry_p[i].name, key, FS_DIR_ENTRY_NAME_MAX);
+    } else {
+      memset(entry_p[i].name, 0x00, FS_DIR_ENTRY_NAME_MAX);
+    }
+  }
+
+  return;
+}
+
+/*
+ * fs_dir_scan_block() - This function compares up to 64 entries with the 
+ *                       pattern
+ *
+ * Bit i of the return value is set if entry i is free, and bit i of the 
+ * match mask is set if the name of entry i is the key, regardless of 
+ * whether it is free. 
+ *
+ * With SSE2 each 16 bytes of the entries are compared with the pattern by 
+ * one instruction, such that a 16-byte entry takes one comparison and a 
+ * 32-byte entry takes two. With AVX2 32 bytes are compared at once. The 
+ * byte mask of each entry is then checked against the inode and name bits.
+ * The scalar version compares fields instead. The count should be a 
+ * multiple of FS_DIR_SCAN_STEP, which is the case for a sector
+ */
+uint64_t fs_dir_scan_block(const DirEntry *entry_p, 
+                           int count, 
+                           const uint8_t *pattern_p, 
+                           uint64_t *match_p) {
+  assert(count <= FS_DIR_SCAN_BLOCK && count % FS_DIR_SCAN_STEP == 0);
+  uint64_t free_mask = 0;
+  uint64_t match_mask = 0;
+#if defined(__AVX2__)
+  const __m256i pattern = _mm256_loadu_si256((const __m256i *)pattern_p);
+  for(int i = 0;i < count;i += FS_DIR_SCAN_STEP) {
+    const __m256i data = _mm256_loadu_si256((const __m256i *)(entry_p + i));
+    const uint32_t eq = \
+      (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(data, pattern));
+    for(int j = 0;j < FS_DIR_SCAN_STEP;j++) {
+      const uint32_t entry_eq = \
+        (eq >> (j * sizeof(DirEntry))) & FS_DIR_EQ_ENTRY;
+      free_mask |= \
+        (uint64_t)((entry_eq & FS_DIR_EQ_INODE) == FS_DIR_EQ_INODE) << (i + j);
+      match_mask |= \
+        (uint64_t)((entry_eq & FS_DIR_EQ_NAME) == FS_DIR_EQ_NAME) << (i + j);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i pattern_lo = _mm_loadu_si128((const __m128i *)pattern_p);
+#if WORD_SIZE == 4
+  const __m128i pattern_hi = _mm_loadu_si128((const __m128i *)pattern_p + 1);
+#endif
+  for(int i = 0;i < count;i++) {
+    const __m128i *data_p = (const __m128i *)(entry_p + i);
+    uint32_t eq = (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_loadu_si128(data_p), pattern_lo));
+#if WORD_SIZE == 4
+    eq |= (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_loadu_si128(data_p + 1), pattern_hi)) << 16;
+#endif
+    free_mask |= (uint64_t)((eq & FS_DIR_EQ_INODE) == FS_DIR_EQ_INODE) << i;
+    match_mask |= (uint64_t)((eq & FS_DIR_EQ_NAME) == FS_DIR_EQ_NAME) << i;
+  }
+#else
+  const DirEntry *pattern_entry_p = (const DirEntry *)pattern_p;
+  for(int i = 0;i < count;i++) {
+    free_mask |= (uint64_t)(entry_p[i].inode == FS_INVALID_INODE) << i;
+    match_mask |= (uint64_t)(memcmp(entry_p[i].name, 
+                                    pattern_entry_p->name, 
+                                    FS_DIR_ENTRY_NAME_MAX) == 0) << i;
+  }
+#endif
+
+  *match_p = match_mask;
+  return free_mask;
+}
+
+/*
+ * fs_dir_scan_name() - This function returns the index of the first entry 
+ *                      in use whose name is the key of the pattern
+ *
+ * Returns count if there is no such entry
+ */
+int fs_dir_scan_name(const DirEntry *entry_p, 
+                     int count, 
+                     const uint8_t *pattern_p) {
+  for(int i = 0;i < count;i += FS_DIR_SCAN_BLOCK) {
+    const int block_count = \
+      (count - i < FS_DIR_SCAN_BLOCK) ? count - i : FS_DIR_SCAN_BLOCK;
+    uint64_t match_mask;
+    const uint64_t free_mask = \
+      fs_dir_scan_block(entry_p + i, block_count, pattern_p, &match_mask);
+    match_mask &= ~free_mask;
+    if(match_mask != 0) {
+      return i + __builtin_ctzll(match_mask);
+    }
+  }
+
+  return count;
+}
+
+/*
+ * fs_dir_scan_free() - This function returns the index of the first free 
+ *                      entry, or count if all entries are in use
+ *
+ * If count_p is not NULL, all entries are scanned and the number of free 
+ * entries is returned through it
+ */
+int fs_dir_scan_free(const DirEntry *entry_p, int count, int *count_p) {
+  uint8_t pattern[FS_DIR_PATTERN_SIZE];
+  fs_dir_make_pattern(pattern, NULL);
+  int ret = count;
+  int free_count = 0;
+  for(int i = 0;i < count;i += FS_DIR_SCAN_BLOCK) {
+    const int block_count = \
+      (count - i < FS_DIR_SCAN_BLOCK) ? count - i : FS_DIR_SCAN_BLOCK;
+    uint64_t match_mask;
+    const uint64_t free_mask = \
+      fs_dir_scan_block(entry_p + i, block_count, pattern, &match_mask);
+    if(free_mask != 0 && ret == count) {
+      ret = i + __builtin_ctzll(free_mask);
+    }
+    free_count += __builtin_popcountll(free_mask);
+    // EARLY RETURN
+    if(ret != count && count_p == NULL) {
+      return ret;
+    }
+  }
+
+  if(count_p != NULL) {
+    *count_p = free_count;
+  }
+
+  return ret;
+}
+
+/*
+ * fs_dir_index_load() - This function copies the index header of a 
+ *                       directory
+ *
+ * Returns 1 if the directory has a valid index, 0 otherwise. The header is
+ * only returned if it is valid
+ */
+int fs_dir_index_load(Storage *disk_p, 
+                      Inode *inode_p, 
+                      DirIndexHeader *header_p) {
+  assert(sizeof(DirIndexHeader) <= FS_DIR_ENTRY_NAME_MAX);
+  // EARLY RETURN
+  if(fs_get_file_size(inode_p) == 0UL) {
+    return 0;
+  }
+
+  const DirEntry *entry_p = fs_dir_entry_at(disk_p, inode_p, 0, 0);
+  const DirIndexHeader *stored_p = (const DirIndexHeader *)entry_p->name;
+  if(entry_p->inode == FS_INVALID_INODE || 
+     memcmp(stored_p->dot, ".", 2) != 0 || 
+     (stored_p->flags & FS_DIR_INDEX_VALID) == 0) {
+    return 0;
+  }
+
+  memcpy(header_p, stored_p, sizeof(DirIndexHeader));
+  return 1;
+}
+
+/*
+ * fs_dir_index_store() - This function writes back the index header
+ */
+void fs_dir_index_store(Storage *disk_p, 
+                        Inode *inode_p, 
+                        const DirIndexHeader *header_p) {
+  DirEntry *entry_p = fs_dir_entry_at(disk_p, inode_p, 0, 1);
+  assert(memcmp(entry_p->name, ".", 2) == 0);
+  memcpy(entry_p->name, header_p, sizeof(DirIndexHeader));
+
+  return;
+}
+
+/*
+ * fs_dir_index_sector_count() - Returns the number of sectors of an index
+ */
+sector_count_t fs_dir_index_sector_count(Storage *disk_p, 
+                                         const DirIndexHeader *header_p) {
+  const size_t slot_per_sector = disk_p->sector_size / sizeof(DirIndexSlot);
+  assert(header_p->shift < sizeof(size_t) * 8);
+  return (sector_count_t)(((size_t)1 << header_p->shift) / slot_per_sector);
+}
+
+/*
+ * fs_dir_index_drop() - This function frees the index of a directory
+ *
+ * The directory falls back to linear scan until the index is rebuilt
+ */
+void fs_dir_index_drop(Storage *disk_p, Inode *inode_p) {
+  DirIndexHeader header;
+  // EARLY RETURN
+  if(fs_dir_index_load(disk_p, inode_p, &header) == 0) {
+    return;
+  }
+
+  fs_free_sectors(disk_p, 
+                  header.start, 
+                  fs_dir_index_sector_count(disk_p, &header));
+  memset(&header, 0x00, sizeof(DirIndexHeader));
+  memcpy(header.dot, ".", 2);
+  fs_dir_index_store(disk_p, inode_p, &header);
+
+  return;
+}
+
+/*
+ * fs_dir_index_get_slot() - This function returns a copy of the i-th slot
+ */
+DirIndexSlot fs_dir_index_get_slot(Storage *disk_p, 
+                                   const DirIndexHeader *header_p, 
+                                   size_t index) {
+  const size_t slot_per_sector = disk_p->sector_size / sizeof(DirIndexSlot);
+  const DirIndexSlot *slot_p = \
+    (const DirIndexSlot *)read_lba(disk_p, 
+                                   header_p->start + index / slot_per_sector);
+  return slot_p[index % slot_per_sector];
+}
+
+/*
+ * fs_dir_index_set_slot() - This function writes the i-th slot
+ */
+void fs_dir_index_set_slot(Storage *disk_p, 
+                           const DirIndexHeader *header_p, 
+                           size_t index, 
+                           DirIndexSlot slot) {
+  const size_t slot_per_sector = disk_p->sector_size / sizeof(DirIndexSlot);
+  DirIndexSlot *slot_p = \
+    (DirIndexSlot *)read_lba_for_write(disk_p, 
+                                       header_p->start + 
+                                       index / slot_per_sector);
+  slot_p[index % slot_per_sector] = slot;
+
+  return;
+}
+
+/*
+ * fs_dir_index_put() - This function adds a (hash, position) pair into the
+ *                      first unused slot of its probe sequence
+ *
+ * The caller should make sure the table has an unused slot and the name is 
+ * not already in the index. The header is not updated
+ */
+void fs_dir_index_put(Storage *disk_p, 
+                      const DirIndexHeader *header_p, 
+                      uint32_t hash, 
+                      uint32_t pos) {
+  const size_t mask = ((size_t)1 << header_p->shift) - 1;
+  size_t index = hash & mask;
+  while(fs_dir_index_get_slot(disk_p, header_p, index).pos != 
+        FS_DIR_INDEX_EMPTY) {
+    index = (index + 1) & mask;
+  }
+
+  DirIndexSlot slot = {hash, pos};
+  fs_dir_index_set_slot(disk_p, header_p, index, slot);
+
+  return;
+}
+
+/*
+ * fs_dir_index_build() - This function (re)builds the index of a directory
+ *
+ * The table is sized to keep the load factor no more than 1/2 after the 
+ * given number of names are added. Sectors of the table are allocated as a
+ * contiguous run, and sectors of the previous index, if any, are freed.
+ *
+ * Returns 0 if sectors could not be allocated. In this case the directory 
+ * is left without an index, and linear scan is used. The inode should be 
+ * pinned
+ */
+int fs_dir_index_build(Storage *disk_p, Inode *inode_p, size_t extra_count) {
+  assert(fs_is_pinned(disk_p, inode_p));
+  fs_dir_index_drop(disk_p, inode_p);
+
+  const sector_count_t dir_sector_count = \
+    (sector_count_t)(fs_get_file_size(inode_p) / disk_p->sector_size);
+  // Count names first, which determines the size of the table. The "." 
+  // entry is not counted
+  uint32_t entry_count = 0;
+  for(sector_t i = 0;i < dir_sector_count;i++) {
+    const DirEntry *entry_p = \
+      fs_dir_entry_at(disk_p, inode_p, i * context.dir_per_sector, 0);
+    int free_count;
+    fs_dir_scan_free(entry_p, context.dir_per_sector, &free_count);
+    entry_count += context.dir_per_sector - free_count;
+  }
+  entry_count--;
+
+  const size_t slot_per_sector = disk_p->sector_size / sizeof(DirIndexSlot);
+  DirIndexHeader header;
+  memset(&header, 0x00, sizeof(DirIndexHeader));
+  memcpy(header.dot, ".", 2);
+  header.shift = 0;
+  while(((size_t)1 << header.shift) < slot_per_sector || 
+        ((size_t)1 << header.shift) < (entry_count + extra_count) * 2) {
+    header.shift++;
+  }
+
+  const sector_count_t sector_count = \
+    fs_dir_index_sector_count(disk_p, &header);
+  header.start = fs_alloc_sectors(disk_p, sector_count, FS_INVALID_SECTOR);
+  // EARLY RETURN
+  if(header.start == FS_INVALID_SECTOR) {
+    return 0;
+  }
+
+  for(sector_count_t i = 0;i < sector_count;i++) {
+    // Sectors of the index need not be read
+    memset(write_lba(disk_p, header.start + i), 0xFF, disk_p->sector_size);
+  }
+
+  for(sector_t i = 0;i < dir_sector_count;i++) {
+    DirEntry *entry_p = \
+      fs_dir_entry_at(disk_p, inode_p, i * context.dir_per_sector, 0);
+    // Reading index sectors below must not evict the entries
+    buffer_pin(disk_p, entry_p);
+    for(int j = (i == 0) ? 1 : 0;j < context.dir_per_sector;j++) {
+      if(entry_p[j].inode != FS_INVALID_INODE) {
+        fs_dir_index_put(disk_p, 
+                         &header, 
+                         fs_dir_hash(entry_p[j].name), 
+                         i * context.dir_per_sector + j);
+      }
+    }
+    buffer_unpin(disk_p, entry_p);
+  }
+
+  header.flags = FS_DIR_INDEX_VALID;
+  header.entry_count = entry_count;
+  fs_dir_index_store(disk_p, inode_p, &header);
+
+  return 1;
+}
+
+/*
+ * fs_dir_index_find() - This function finds the slot of a name in the index
+ *
+ * Returns the index of the slot, or (size_t)-1 if the name is not found. 
+ * The position of the entry is returned through pos_p if found
+ */
+size_t fs_dir_index_find(Storage *disk_p, 
+                         Inode *inode_p, 
+                         const DirIndexHeader *header_p, 
+                         const char *key, 
+                         uint32_t *pos_p) {
+  const size_t mask = ((size_t)1 << header_p->shift) - 1;
+  const uint32_t hash = fs_dir_hash(key);
+  size_t index = hash & mask;
+  while(1) {
+    DirIndexSlot slot = fs_dir_index_get_slot(disk_p, header_p, index);
+    if(slot.pos == FS_DIR_INDEX_EMPTY) {
+      return (size_t)-1;
+    } else if(slot.hash == hash) {
+      const DirEntry *entry_p = \
+        fs_dir_entry_at(disk_p, inode_p, slot.pos, 0);
+      if(memcmp(entry_p->name, key, FS_DIR_ENTRY_NAME_MAX) == 0) {
+        *pos_p = slot.pos;
+        return index;
+      }
+    }
+
+    index = (index + 1) & mask;
+  }
+
+  assert(0);
+  return (size_t)-1;
+}
+
+/*
+ * fs_dir_index_remove() - This function removes a slot from the index
+ *
+ * Later slots in the same cluster are shifted back if their probe sequence 
+ * passes the removed slot, such that lookups never stop early. The header 
+ * is not updated
+ */
+void fs_dir_index_remove(Storage *disk_p, 
+                         const DirIndexHeader *header_p, 
+                         size_t index) {
+  const size_t mask = ((size_t)1 << header_p->shift) - 1;
+  size_t next = index;
+  while(1) {
+    next = (next + 1) & mask;
+    DirIndexSlot slot = fs_dir_index_get_slot(disk_p, header_p, next);
+    if(slot.pos == FS_DIR_INDEX_EMPTY) {
+      break;
+    }
+
+    // The slot can stay if its home is cyclically in (index, next]
+    const size_t home = slot.hash & mask;
+    if(index <= next ? 
+       (index < home && home <= next) : 
+       (index < home || home <= next)) {
+      continue;
+    }
+
+    fs_dir_index_set_slot(disk_p, header_p, index, slot);
+    index = next;
+  }
+
+  DirIndexSlot empty = {0, FS_DIR_INDEX_EMPTY};
+  fs_dir_index_set_slot(disk_p, header_p, index, empty);
+
+  return;
+}
+
+/*
+ * fs_dir_index_move() - This function updates the position of an entry
+ *                       that is moved within the directory
+ */
+void fs_dir_index_move(Storage *disk_p, 
+                       const DirIndexHeader *header_p, 
+                       const char *key, 
+                       uint32_t old_pos, 
+                       uint32_t new_pos) {
+  const size_t mask = ((size_t)1 << header_p->shift) - 1;
+  size_t index = fs_dir_hash(key) & mask;
+  while(1) {
+    DirIndexSlot slot = fs_dir_index_get_slot(disk_p, header_p, index);
+    // The entry must be in the index
+    assert(slot.pos != FS_DIR_INDEX_EMPTY);
+    if(slot.pos == old_pos) {
+      slot.pos = new_pos;
+      fs_dir_index_set_slot(disk_p, header_p, index, slot);
+      break;
+    }
+
+    index = (index + 1) & mask;
+  }
+
+  return;
+}
+
+/*
+ * fs_dir_find() - This function returns the position of an entry in a 
+ *                 directory, or FS_DIR_INDEX_EMPTY if not found
+ *
+ * The "." entry is always the first one, and only its first two bytes are 
+ * compared, since the rest may hold the index header. Other names are found
+ * using the index if the directory has one. Otherwise all sectors are 
+ * scanned. The directory is never written. The inode should be pinned
+ */
+uint32_t fs_dir_find(Storage *disk_p, Inode *inode_p, const char *key) {
+  // EARLY RETURN
+  if(memcmp(key, ".", 2) == 0) {
+    if(fs_get_file_size(inode_p) == 0UL) {
+      return FS_DIR_INDEX_EMPTY;
+    }
+    const DirEntry *entry_p = fs_dir_entry_at(disk_p, inode_p, 0, 0);
+    return (entry_p->inode != FS_INVALID_INODE && 
+            memcmp(entry_p->name, ".", 2) == 0) ? 0 : FS_DIR_INDEX_EMPTY;
+  }
+
+  DirIndexHeader header;
+  uint32_t pos = FS_DIR_INDEX_EMPTY;
+  if(fs_dir_index_load(disk_p, inode_p, &header) == 1) {
+    fs_dir_index_find(disk_p, inode_p, &header, key, &pos);
+    return pos;
+  }
+
+  uint8_t pattern[FS_DIR_PATTERN_SIZE];
+  fs_dir_make_pattern(pattern, key);
+  const sector_count_t sector_count = \
+    (sector_count_t)(fs_get_file_size(inode_p) / disk_p->sector_size);
+  for(sector_t i = 0;i < sector_count;i++) {
+    const DirEntry *entry_p = \
+      fs_dir_entry_at(disk_p, inode_p, i * context.dir_per_sector, 0);
+    const int j = fs_dir_scan_name(entry_p, context.dir_per_sector, pattern);
+    if(j != context.dir_per_sector) {
+      return i * context.dir_per_sector + j;
+    }
+  }
+
+  return FS_DIR_INDEX_EMPTY;
+}
+
+// Memory budget of the directory entry cache in bytes
+#define FS_DCACHE_SIZE_MAX   (64 * 1024)
+// Number of hash buckets. Must be a power of two
+#define FS_DCACHE_BUCKET_MAX 256
+
+// This is an entry of the directory entry cache, which maps a name in a 
+// directory to the inode of the name. If the child is FS_INVALID_INODE then
+// the name is known not to exist in the directory (negative entry)
+//
+// Entries are hashed by the name only, such that fs_set_dir_name(), which 
+// does not know the directory of the entry, could still find all cached 
+// entries of a name
+typedef struct DCacheEntry_t {
+  inode_id_t parent;
+  inode_id_t child;
+  char name[FS_DIR_ENTRY_NAME_MAX];
+  // Next entry in the bucket, or in the free list
+  struct DCacheEntry_t *hash_next_p;
+  struct DCacheEntry_t *lru_prev_p;
+  struct DCacheEntry_t *lru_next_p;
+} DCacheEntry;
+
+#define FS_DCACHE_ENTRY_MAX (FS_DCACHE_SIZE_MAX / sizeof(DCacheEntry))
+
+typedef struct {
+  DCacheEntry entries[FS_DCACHE_ENTRY_MAX];
+  DCacheEntry *bucket_p[FS_DCACHE_BUCKET_MAX];
+  DCacheEntry *free_p;
+  // Most recently used entry is at the head
+  DCacheEntry *lru_head_p;
+  DCacheEntry *lru_tail_p;
+  size_t count;
+  uint64_t hit;
+  uint64_t miss;
+} DCache;
+
+DCache dcache;
+
+/*
+ * fs_dcache_init() - This function clears the directory entry cache
+ *
+ * This must be called when a new file system is loaded
+ */
+void fs_dcache_init() {
+  memset(&dcache, 0x00, sizeof(DCache));
+  for(size_t i = 0;i < FS_DCACHE_ENTRY_MAX;i++) {
+    dcache.entries[i].hash_next_p = dcache.free_p;
+    dcache.free_p = &dcache.entries[i];
+  }
+
+  return;
+}
+
+/*
+ * fs_dcache_lru_unlink() - This function removes an entry from the LRU list
+ */
+void fs_dcache_lru_unlink(DCacheEntry *entry_p) {
+  if(entry_p->lru_prev_p == NULL) {
+    dcache.lru_head_p = entry_p->lru_next_p;
+  } else {
+    entry_p->lru_prev_p->lru_next_p = entry_p->lru_next_p;
+  }
+
+  if(entry_p->lru_next_p == NULL) {
+    dcache.lru_tail_p = entry_p->lru_prev_p;
+  } else {
+    entry_p->lru_next_p->lru_prev_p = entry_p->lru_prev_p;
+  }
+
+  return;
+}
+
+/*
+ * fs_dcache_lru_push() - This function adds an entry to the head of the LRU
+ *                        list
+ */
+void fs_dcache_lru_push(DCacheEntry *entry_p) {
+  entry_p->lru_prev_p = NULL;
+  entry_p->lru_next_p = dcache.lru_head_p;
+  if(dcache.lru_head_p == NULL) {
+    dcache.lru_tail_p = entry_p;
+  } else {
+    dcache.lru_head_p->lru_prev_p = entry_p;
+  }
+  dcache.lru_head_p = entry_p;
+
+  return;
+}
+
+/*
+ * fs_dcache_bucket() - Returns the bucket head pointer of a padded name
+ */
+DCacheEntry **fs_dcache_bucket(const char *key) {
+  return &dcache.bucket_p[fs_dir_hash(key) & (FS_DCACHE_BUCKET_MAX - 1)];
+}
+
+/*
+ * fs_dcache_unlink() - This function removes an entry from the cache
+ *
+ * The pointer to the entry's slot in the bucket chain is given by the 
+ * caller, which is the previous entry's next pointer or the bucket head
+ */
+void fs_dcache_unlink(DCacheEntry **link_p) {
+  DCacheEntry *entry_p = *link_p;
+  *link_p = entry_p->hash_next_p;
+  fs_dcache_lru_unlink(entry_p);
+  entry_p->hash_next_p = dcache.free_p;
+  dcache.free_p = entry_p;
+  dcache.count--;
+
+  return;
+}
+
+/*
+ * fs_dcache_find() - This function returns the slot of the cached entry of
+ *                    a name in a directory, or NULL if not cached
+ */
+DCacheEntry **fs_dcache_find(inode_id_t parent, const char *key) {
+  DCacheEntry **link_p = fs_dcache_bucket(key);
+  while(*link_p != NULL) {
+    if((*link_p)->parent == parent && 
+       memcmp((*link_p)->name, key, FS_DIR_ENTRY_NAME_MAX) == 0) {
+      return link_p;
+    }
+    link_p = &(*link_p)->hash_next_p;
+  }
+
+  return NULL;
+}
+
+/*
+ * fs_dcache_lookup() - This function looks up a name in the cache
+ *
+ * Returns 1 if the name is cached, and the child inode is returned through
+ * child_p, which is FS_INVALID_INODE if the name is known not to exist. 
+ * Returns 0 if the name is not cached
+ */
+int fs_dcache_lookup(inode_id_t parent, const char *key, inode_id_t *child_p) {
+  DCacheEntry **link_p = fs_dcache_find(parent, key);
+  // EARLY RETURN
+  if(link_p == NULL) {
+    dcache.miss++;
+    return 0;
+  }
+
+  DCacheEntry *entry_p = *link_p;
+  fs_dcache_lru_unlink(entry_p);
+  fs_dcache_lru_push(entry_p);
+  *child_p = entry_p->child;
+  dcache.hit++;
+
+  return 1;
+}
+
+/*
+ * fs_dcache_insert() - This function caches a name in a directory
+ *
+ * The child could be FS_INVALID_INODE to cache a negative entry. If the
+ * budget is reached then the least recently used entry is evicted
+ */
+void fs_dcache_insert(inode_id_t parent, const char *key, inode_id_t child) {
+  // EARLY RETURN
+  if(parent == FS_INVALID_INODE) {
+    return;
+  }
+
+  DCacheEntry **link_p = fs_dcache_find(parent, key);
+  if(link_p != NULL) {
+    fs_dcache_unlink(link_p);
+  } else if(dcache.free_p == NULL) {
+    // Evict the tail, whose slot is found in its own bucket
+    DCacheEntry *victim_p = dcache.lru_tail_p;
+    fs_dcache_unlink(fs_dcache_find(victim_p->parent, victim_p->name));
+  }
+
+  DCacheEntry *entry_p = dcache.free_p;
+  dcache.free_p = entry_p->hash_next_p;
+  entry_p->parent = parent;
+  entry_p->child = child;
+  memcpy(entry_p->name, key, FS_DIR_ENTRY_NAME_MAX);
+  link_p = fs_dcache_bucket(key);
+  entry_p->hash_next_p = *link_p;
+  *link_p = entry_p;
+  fs_dcache_lru_push(entry_p);
+  dcache.count++;
+
+  return;
+}
+
+/*
+ * fs_dcache_rename() - This function invalidates cached entries affected
+ *                      by changing the name of a dir entry
+ *
+ * Since the directory is unknown, we drop positive entries of the old name 
+ * that point to the child, and negative entries of the new name in any 
+ * directory. Both are found in a single bucket each
+ */
+void fs_dcache_rename(const char *old_key, 
+                      const char *new_key, 
+                      inode_id_t child) {
+  DCacheEntry **link_p = NULL;
+  if(child != FS_INVALID_INODE) {
+    link_p = fs_dcache_bucket(old_key);
+    while(*link_p != NULL) {
+      if((*link_p)->child == child && 
+         memcmp((*link_p)->name, old_key, FS_DIR_ENTRY_NAME_MAX) == 0) {
+        fs_dcache_unlink(link_p);
+      } else {
+        link_p = &(*link_p)->hash_next_p;
+      }
+    }
+  }
+
+  link_p = fs_dcache_bucket(new_key);
+  while(*link_p != NULL) {
+    if((*link_p)->child == FS_INVALID_INODE && 
+       memcmp((*link_p)->name, new_key, FS_DIR_ENTRY_NAME_MAX) == 0) {
+      fs_dcache_unlink(link_p);
+    } else {
+      link_p = &(*link_p)->hash_next_p;
+    }
+  }
+
+  return;
+}
+
+/*
+ * fs_dcache_invalidate_inode() - This function drops all entries in or to
+ *                                a freed inode
+ *
+ * The inode number could be reused for another directory or file, so none 
+ * of the entries is valid anymore
+ */
+void fs_dcache_invalidate_inode(inode_id_t inode) {
+  DCacheEntry *entry_p = dcache.lru_head_p;
+  while(entry_p != NULL) {
+    DCacheEntry *next_p = entry_p->lru_next_p;
+    if(entry_p->parent == inode || entry_p->child == inode) {
+      fs_dcache_unlink(fs_dcache_find(entry_p->parent, entry_p->name));
+    }
+    entry_p = next_p;
+  }
+
+  return;
+}
+
+// Number of directories whose free slot summary is kept in memory
+#define FS_DIR_SLOT_CACHE_MAX 8
+
+// This is the free slot summary of a directory. It holds the number of 
+// unused entries of each sector, such that an insert goes straight to a 
+// sector with space. It is built by scanning the directory on first use, 
+// and then kept up-to-date as entries are taken and freed
+typedef struct {
+  // FS_INVALID_INODE if the entry is not used
+  inode_id_t inode;
+  // Number of sectors in the directory
+  size_t sector_count;
+  size_t capacity;
+  uint16_t *free_count_p;
+  // Sectors before this one are full
+  size_t hint;
+  // Used to find the least recently used directory
+  uint64_t last_access;
+} DirSlotEntry;
+
+DirSlotEntry dir_slot_cache[FS_DIR_SLOT_CACHE_MAX];
+// Logical clock for LRU
+uint64_t dir_slot_clock = 0;
+
+/*
+ * fs_dir_slot_init() - This function clears the free slot summaries
+ *
+ * It must be called whenever a file system is initialized or loaded
+ */
+void fs_dir_slot_init() {
+  for(int i = 0;i < FS_DIR_SLOT_CACHE_MAX;i++) {
+    free(dir_slot_cache[i].free_count_p);
+    memset(dir_slot_cache + i, 0x00, sizeof(DirSlotEntry));
+    dir_slot_cache[i].inode = FS_INVALID_INODE;
+  }
+
+  dir_slot_clock = 0;
+
+  return;
+}
+
+/*
+ * fs_dir_slot_find() - Returns the free slot summary of a directory, or NULL
+ *                      if it is not cached
+ */
+DirSlotEntry *fs_dir_slot_find(inode_id_t inode) {
+  for(int i = 0;i < FS_DIR_SLOT_CACHE_MAX;i++) {
+    if(dir_slot_cache[i].inode == inode) {
+      dir_slot_cache[i].last_access = ++dir_slot_clock;
+      return dir_slot_cache + i;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * fs_dir_slot_invalidate() - This function drops the free slot summary of a 
+ *                            directory
+ *
+ * This must be called when the directory is truncated or freed
+ */
+void fs_dir_slot_invalidate(inode_id_t inode) {
+  DirSlotEntry *entry_p = fs_dir_slot_find(inode);
+  if(entry_p != NULL) {
+    free(entry_p->free_count_p);
+    memset(entry_p, 0x00, sizeof(DirSlotEntry));
+    entry_p->inode = FS_INVALID_INODE;
+  }
+
+  return;
+}
+
+/*
+ * fs_dir_slot_append() - This function adds a sector to the end of the 
+ *                        summary
+ */
+void fs_dir_slot_append(DirSlotEntry *entry_p, size_t free_count) {
+  if(entry_p->sector_count == entry_p->capacity) {
+    entry_p->capacity = (entry_p->capacity == 0) ? 16 : entry_p->capacity * 2;
+    entry_p->free_count_p = \
+      realloc(entry_p->free_count_p, entry_p->capacity * sizeof(uint16_t));
+    if(entry_p->free_count_p == NULL) {
+      fatal_error("Failed to allocate the free slot summary");
+    }
+  }
+
+  entry_p->free_count_p[entry_p->sector_count] = (uint16_t)free_count;
+  if(free_count != 0 && entry_p->hint > entry_p->sector_count) {
+    entry_p->hint = entry_p->sector_count;
+  }
+  entry_p->sector_count++;
+
+  return;
+}
+
+/*
+ * fs_dir_slot_load() - This function returns the free slot summary of a 
+ *                      directory, and builds it if it is not cached
+ *
+ * Building the summary reads every sector of the directory once. The LRU 
+ * summary is evicted if all are used
+ */
+DirSlotEntry *fs_dir_slot_load(Storage *disk_p, 
+                               Inode *inode_p, 
+                               inode_id_t inode) {
+  DirSlotEntry *entry_p = fs_dir_slot_find(inode);
+  // EARLY RETURN
+  if(entry_p != NULL) {
+    return entry_p;
+  }
+
+  entry_p = dir_slot_cache;
+  for(int i = 1;i < FS_DIR_SLOT_CACHE_MAX;i++) {
+    if(dir_slot_cache[i].last_access < entry_p->last_access) {
+      entry_p = dir_slot_cache + i;
+    }
+  }
+  free(entry_p->free_count_p);
+  memset(entry_p, 0x00, sizeof(DirSlotEntry));
+  entry_p->inode = inode;
+  entry_p->last_access = ++dir_slot_clock;
+
+  fs_pin(disk_p, inode_p);
+  const size_t sector_count = fs_get_file_size(inode_p) / disk_p->sector_size;
+  for(size_t i = 0;i < sector_count;i++) {
+    const DirEntry *dir_entry_p = \
+      fs_dir_entry_at(disk_p, inode_p, i * context.dir_per_sector, 0);
+    int free_count;
+    fs_dir_scan_free(dir_entry_p, context.dir_per_sector, &free_count);
+    fs_dir_slot_append(entry_p, free_count);
+  }
+  fs_unpin(disk_p, inode_p);
+
+  return entry_p;
+}
+
+/*
+ * fs_dir_slot_next() - Returns the first sector that has a free entry 
+ *                      according to the summary, or the number of sectors if
+ *                      all are full
+ */
+size_t fs_dir_slot_next(DirSlotEntry *entry_p) {
+  while(entry_p->hint < entry_p->sector_count && 
+        entry_p->free_count_p[entry_p->hint] == 0) {
+    entry_p->hint++;
+  }
+
+  return entry_p->hint;
+}
+
+/*
+ * fs_dir_slot_release() - This function records that an entry of the given 
+ *                         sector is freed
+ */
+void fs_dir_slot_release(DirSlotEntry *entry_p, size_t sector) {
+  assert(sector < entry_p->sector_count);
+  entry_p->free_count_p[sector]++;
+  if(sector < entry_p->hint) {
+    entry_p->hint = sector;
+  }
+
+  return;
+}
+
+/*
+ * fs_dir_slot_remove_sector() - This function records that the last sector
+ *                               is moved into the given one, which is empty,
+ *                               and then freed
+ */
+void fs_dir_slot_remove_sector(DirSlotEntry *entry_p, size_t sector) {
+  assert(sector < entry_p->sector_count);
+  entry_p->sector_count--;
+  entry_p->free_count_p[sector] = \
+    entry_p->free_count_p[entry_p->sector_count];
+  if(entry_p->free_count_p[sector] != 0 && sector < entry_p->hint) {
+    entry_p->hint = sector;
+  }
+
+  return;
+}
+
+/*
+ * fs_free_dir_entry() - This function removes a dir entry from a directory's
+ *                       inode
+ *
+ * This function proceeds as follows:
+ *   1. If the name length is greather than the maximum allowed name length
+ *      then we directly return FS_ERR_NAME_NOT_FOUND
+ *   2. If the name is '.' or '..' then we return FS_ERR_ILLEGAL_NAME
+ *   3. If the name is not found in the directory, then we return
+ *      FS_ERR_NAME_NOT_FOUND
+ *
+ * The entry is found using the index if the directory has one. If the sector
+ * of the entry becomes empty, the last sector is moved into its place, and 
+ * the index is updated for the moved entries.
+ *
+ * Note that this function only removes a directory entry, and does not check
+ * its type (e.g. whether it is a non-empty directory) or does not free sectors
+ * of the dir entry.
+ *
+ * This function pins the inode in the buffer.
+ */
+int fs_free_dir_entry(Storage *disk_p, Inode *inode_p, const char *name) {
+  // If length exceeds the maximum file name length then we know we will
+  // not have a match
+  char key[FS_DIR_ENTRY_NAME_MAX];
+  if(fs_dir_pad_name(name, key) == 0) {
+    return FS_ERR_NAME_NOT_FOUND;
+  }
+
+  // We could not delete . or ..
+  if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return FS_ERR_ILLEGAL_NAME;
+  }
+
+  fs_pin(disk_p, inode_p);
+  const size_t dir_size = fs_get_file_size(inode_p);
+  assert(dir_size != 0);
+  assert(dir_size % disk_p->sector_size == 0);
+  const sector_t sector_count = dir_size / disk_p->sector_size;
+
+  const uint32_t pos = fs_dir_find(disk_p, inode_p, key);
+  // EARLY RETURN
+  if(pos == FS_DIR_INDEX_EMPTY) {
+    fs_unpin(disk_p, inode_p);
+    return FS_ERR_NAME_NOT_FOUND;
+  }
+
+  DirIndexHeader header;
+  const int indexed = fs_dir_index_load(disk_p, inode_p, &header);
+  if(indexed == 1) {
+    uint32_t found_pos;
+    const size_t index = \
+      fs_dir_index_find(disk_p, inode_p, &header, key, &found_pos);
+    assert(index != (size_t)-1 && found_pos == pos);
+    fs_dir_index_remove(disk_p, &header, index);
+    header.entry_count--;
+    fs_dir_index_store(disk_p, inode_p, &header);
+  }
+
+  const inode_id_t inode = fs_get_inode_id(disk_p, inode_p);
+  const sector_t sector = pos / context.dir_per_sector;
+  DirSlotEntry *slot_p = \
+    (inode != FS_INVALID_INODE) ? fs_dir_slot_find(inode) : NULL;
+  if(slot_p != NULL) {
+    fs_dir_slot_release(slot_p, sector);
+  }
+
+  DirEntry *entry_p = fs_dir_entry_at(disk_p, inode_p, pos, 1);
+  entry_p->inode = FS_INVALID_INODE;
+  // The name is now known not to exist
+  fs_dcache_insert(inode, key, FS_INVALID_INODE);
+  // Points to the first entry of the sector
+  entry_p -= pos % context.dir_per_sector;
+  // Count how many invalid sectors are there
+  int invalid_count;
+  fs_dir_scan_free(entry_p, context.dir_per_sector, &invalid_count);
+
+  // If the invalid count equals the number of directories per sector
+  // then the current sector is empty. We just copy the last sector to
+  // this location, and frees the last sector
+  if(invalid_count == context.dir_per_sector) {
+    // The first sector can never be invalid
+    assert(sector != 0);
+    buffer_pin(disk_p, entry_p);
+    int is_last_sector = 0;
+    if(sector == (sector_count - 1)) {
+      is_last_sector = 1;
+    } else if(indexed == 1) {
+      // Entries of the last sector will be at the same index of this sector
+      const uint32_t last_pos = (sector_count - 1) * context.dir_per_sector;
+      DirEntry *last_entry_p = \
+        fs_dir_entry_at(disk_p, inode_p, last_pos, 0);
+      buffer_pin(disk_p, last_entry_p);
+      for(int j = 0;j < context.dir_per_sector;j++) {
+        if(last_entry_p[j].inode != FS_INVALID_INODE) {
+          fs_dir_index_move(disk_p, 
+                            &header, 
+                            last_entry_p[j].name, 
+                            last_pos + j, 
+                            sector * context.dir_per_sector + j);
+        }
+      }
+      buffer_unpin(disk_p, last_entry_p);
+    }
+    // Free the sector by copying the last sector to
+    // the i-th sector, and frees the last sector
+    fs_free_dir_sector(disk_p, inode_p, entry_p, is_last_sector);
+    if(slot_p != NULL) {
+      fs_dir_slot_remove_sector(slot_p, sector);
+    }
+    buffer_unpin(disk_p, entry_p);
+  }
+
+  fs_unpin(disk_p, inode_p);
+  return FS_SUCCESS;
+}
+
+/*
+ * fs_find_free_dir_entry() - This function finds an unused entry in the given
+ *                            inode, and allocates a new sector if all are 
+ *                            used
+ *
+ * The position of the entry is returned through pos_p. This function does not
+ * update the index of the directory.
+ *
+ * This function will pin the inode, and unpins it before return. Returns NULL
+ * if sector allocation fails, and the dirty buffer of the entry otherwise.
+ */
+DirEntry *fs_find_free_dir_entry(Storage *disk_p, 
+                                 Inode *inode_p, 
+                                 uint32_t *pos_p) {
+  // Make sure we are operating on inode that represents dir
+  assert(fs_get_file_type(inode_p) == FS_INODE_TYPE_DIR);
+
+  fs_pin(disk_p, inode_p);
+  DirEntry *ret = NULL;
+  const inode_id_t inode = fs_get_inode_id(disk_p, inode_p);
+  // Find the sector. Note that size of the directory is always a
+  // multiple of sectors
+  size_t dir_size = fs_get_file_size(inode_p);
+  // If the dir size is 0 then we allocate the first sector to it
+  if(dir_size == 0UL) {
+    if(inode != FS_INVALID_INODE) {
+      fs_dir_slot_invalidate(inode);
+    }
+
+    // Allocate first sector
+    sector_t new_sector = fs_alloc_sector_for_dir(disk_p, inode_p, 0);
+    // EARLY RETURN
+    if(new_sector == FS_INVALID_SECTOR) {
+      fs_unpin(disk_p, inode_p);
+      return NULL;
+    }
+
+    fs_set_file_size(inode_p, disk_p->sector_size);
+    fs_set_dirty(disk_p, inode_p);
+    dir_size = disk_p->sector_size;
+  }
+  assert(dir_size != 0);
+  assert(dir_size % disk_p->sector_size == 0);
+  const sector_t last_sector = (sector_t)(dir_size / disk_p->sector_size) - 1;
+  assert(last_sector != (sector_t)-1);
+
+  // Go straight to a sector with free entries using the free slot summary
+  DirSlotEntry *slot_p = \
+    (inode != FS_INVALID_INODE) ? fs_dir_slot_load(disk_p, inode_p, inode) : \
+                                  NULL;
+  while(slot_p != NULL) {
+    const size_t sector = fs_dir_slot_next(slot_p);
+    if(sector == slot_p->sector_count) {
+      break;
+    }
+
+    DirEntry *entry_p = \
+      fs_dir_entry_at(disk_p, inode_p, sector * context.dir_per_sector, 0);
+    const int i = fs_dir_scan_free(entry_p, context.dir_per_sector, NULL);
+    if(i != context.dir_per_sector) {
+      ret = entry_p + i;
+      *pos_p = sector * context.dir_per_sector + i;
+      buffer_set_dirty(disk_p, ret);
+    }
+
+    if(ret != NULL) {
+      slot_p->free_count_p[sector]--;
+      break;
+    }
+    // The entries were taken without going through the summary
+    slot_p->free_count_p[sector] = 0;
+  }
+
+  // Tentatively read it. If we do need to modify the sector we just
+  // set dirty later
+  // Without the summary we scan all sectors from the last sector
+  for(sector_t sector = last_sector;
+      slot_p == NULL && sector != (sector_t)-1;
+      sector--) {
+    sector_t actual_sector = \
+      fs_get_file_sector(disk_p, inode_p, sector * disk_p->sector_size);
+    // We do not allow holes in the directory
+    assert(actual_sector != FS_INVALID_SECTOR);
+    DirEntry *entry_p = (DirEntry *)read_lba(disk_p, actual_sector);
+    // Check every dir entry
+    const int i = fs_dir_scan_free(entry_p, context.dir_per_sector, NULL);
+    if(i != context.dir_per_sector) {
+      // This is the entry we are looking for
+      ret = entry_p + i;
+      *pos_p = sector * context.dir_per_sector + i;
+      // Set buffer as dirty because we intend to write it back
+      buffer_set_dirty(disk_p, ret);
+    }
+
+    if(ret != NULL) {
+      break;
+    }
+  }
+
+  // If still could not find entry, then allocate one
+  if(ret == NULL) {
+    // Allocate the next sector
+    sector_t new_sector = \
+      fs_alloc_sector_for_dir(disk_p, inode_p, last_sector + 1);
+    // EARLY RETURN
+    if(new_sector == FS_INVALID_SECTOR) {
+      fs_unpin(disk_p, inode_p);
+      return NULL;
+    }
+
+    // Update the sector size. We will write this back later
+    dir_size += disk_p->sector_size;
+    // Update the dir size
+    fs_set_file_size(inode_p, dir_size);
+    fs_set_dirty(disk_p, inode_p);
+    // This is the first entry, and it must be not used
+    // Also this buffer is set to dirty when we load it
+    DirEntry *entry_p = (DirEntry *)read_lba_for_write(disk_p, new_sector);
+    ret = entry_p;
+    *pos_p = (last_sector + 1) * context.dir_per_sector;
+    if(slot_p != NULL) {
+      fs_dir_slot_append(slot_p, context.dir_per_sector - 1);
+    }
+  }
+
+  fs_unpin(disk_p, inode_p);
+  return ret;
+}
+
+/*
+ * fs_add_dir_entry() - This function adds a new dir entry for finds an unused 
+ *                      entry in the given inode
+ *
+ * This function will pin the inode, and unpins it before return. In order for
+ * the dir entry to remain valid, the caller should be responsible not to
+ * invalidate it.
+ *
+ * This function sets the buffer as dirty. The caller could directly write into
+ * it.
+ *
+ * If sector allocation fails, this function returns NULL. Otherwise returns the
+ * pointer from the buffer.
+ *
+ * Since the name is only known after this function returns, the index of the
+ * directory is dropped. Lookups then use linear scan, until the next 
+ * fs_insert_dir_entry() builds a new index. Use fs_insert_dir_entry() to 
+ * keep the index. The directory entry cache is updated when the caller sets
+ * the name with fs_set_dir_name().
+ */
+DirEntry *fs_add_dir_entry(Storage *disk_p, Inode *inode_p) {
+  fs_pin(disk_p, inode_p);
+  fs_dir_index_drop(disk_p, inode_p);
+  uint32_t pos;
+  DirEntry *ret = fs_find_free_dir_entry(disk_p, inode_p, &pos);
+  fs_unpin(disk_p, inode_p);
+
+  return ret;
+}
+
+/*
+ * fs_open_dir() - This function returns a structure that supports iterating on
+ *                 the directory's content
+ *
+ * Note that we only stores the inode number in the iterator. This allows us
+ * to iterate while the buffer is unpinned.
+ *
+ * The dir does not need to be closed. Once finished the caller could just
+ * discard the dir structure
+ *
+ * If the inode is not a directory this function will report error. The caller
+ * should check this error condition
+ */
+Dir fs_open_dir(Storage *disk_p, inode_id_t inode) {
+  Dir dir;
+  dir.inode = inode;
+  // Read the inode for its file size
+  Inode *inode_p = fs_iget(disk_p, inode);
+  // Must be an inode
+  assert(fs_get_file_type(inode_p) == FS_INODE_TYPE_DIR);
+  // Number of sectors in the directory
+  dir.sector_count = \
+    (sector_count_t)(fs_get_file_size(inode_p) / disk_p->sector_size);
+  fs_iput(disk_p, inode_p);
+  dir.current_sector = 0;
+  dir.current_index = 0;
+
+  return dir;
+}
+
+/*
+ * fs_dir_next_entry() - This function advances the given dir object
+ *                       and loads the next sector if we have reached
+ *                       the end of the current sector
+ *
+ * It takes the current entry pointer, and will return the next entry by
+ * incrementing this pointer if we have not finished the current sector
+ */
+void fs_dir_next_entry(Storage *disk_p, Dir *dir_p, DirEntry *entry_p) {
+
+}
+ 
+/*
+ * fs_next_dir() - This function returns the next directory entry for the 
+ *                 current iterator
+ *
+ * If there is no next dir then we return the NULL pointer. Otherwise the 
+ * const pointer is returned, and we increment the iterator structure
+ *
+ * The returned value is not pinned. The caller should pin it if necessary
+ */
+const DirEntry *fs_next_dir(Storage *disk_p, Dir *dir_p) {
+  // If we are not already at the end of the sector
+  if(dir_p->current_index == context.dir_per_sector) {
+    dir_p->current_index = 0;
+    dir_p->current_sector++;
+    if(dir_p->current_sector == dir_p->sector_count) {
+      return NULL;
+    }
+  }
+
+  // The cached inode stays valid while sectors are read below
+  Inode *inode_p = fs_iget(disk_p, dir_p->inode);
+
+  // This is the linear offset inside the directory
+  size_t next_offset = dir_p->current_sector * disk_p->sector_size;
+  // Then translate the linear sector to global sector
+  sector_t sector = fs_get_file_sector(disk_p, inode_p, next_offset);
+  DirEntry *entry_p = \
+    (DirEntry *)read_lba(disk_p, sector) + dir_p->current_index;
+  // Then start searching at current index in current sector
+  while(1) {
+    // If the current one is valid and if it is reserved names then return it
+    // Note that entry_p already points to the current index. The names
+    // are compared with their padding to only skip "." and ".."
+    if(dir_p->current_index != context.dir_per_sector &&
+       entry_p->inode != FS_INVALID_INODE && 
+       memcmp(entry_p->name, ".", 2) != 0 && 
+       memcmp(entry_p->name, "..", 3) != 0) {
+      dir_p->current_index++;
+      break;
+    }
+
+    dir_p->current_index++;
+    entry_p++;
+
+    // If the index overflows then go to the next sector
+    if(dir_p->current_index == context.dir_per_sector) {
+      dir_p->current_index = 0;
+      dir_p->current_sector++;
+      // If sector overflows then that's all
+      if(dir_p->current_sector == dir_p->sector_count) {
+        entry_p = NULL;
+        break;
+      } else {
+        // Otherwise load the next sector
+        next_offset += disk_p->sector_size;
+        sector = fs_get_file_sector(disk_p, inode_p, next_offset);
+        entry_p = (DirEntry *)read_lba(disk_p, sector);
+      }
+    }
+  }
+
+  fs_iput(disk_p, inode_p);
+  return entry_p;
+}
+
+/*
+ * fs_readdir_bulk() - This function copies up to max_count entries of a 
+ *                     directory into the caller's array
+ *
+ * The inode is loaded once per call, and each directory sector is read once,
+ * with all live entries of the sector copied in a single pass. "." and ".." 
+ * are skipped as in fs_next_dir().
+ *
+ * The iterator is advanced past the entries returned, and is the resume 
+ * cookie for the next call. It could also be saved as a number using 
+ * fs_dir_tell(). Calls could be mixed with fs_next_dir().
+ *
+ * Returns the number of entries copied, which is 0 after the last entry
+ */
+size_t fs_readdir_bulk(Storage *disk_p, 
+                       Dir *dir_p, 
+                       DirEntry *entry_list, 
+                       size_t max_count) {
+  size_t count = 0;
+  // EARLY RETURN
+  if(dir_p->current_sector >= dir_p->sector_count || max_count == 0) {
+    return 0;
+  }
+
+  Inode *inode_p = fs_iget(disk_p, dir_p->inode);
+  while(dir_p->current_sector < dir_p->sector_count && count < max_count) {
+    if(dir_p->current_index == context.dir_per_sector) {
+      dir_p->current_index = 0;
+      dir_p->current_sector++;
+      continue;
+    }
+
+    const sector_t sector = \
+      fs_get_file_sector(disk_p, 
+                         inode_p, 
+                         (size_t)dir_p->current_sector * disk_p->sector_size);
+    assert(sector != FS_INVALID_SECTOR);
+    const DirEntry *entry_p = (const DirEntry *)read_lba(disk_p, sector);
+    while(dir_p->current_index < context.dir_per_sector && 
+          count < max_count) {
+      const DirEntry *current_p = entry_p + dir_p->current_index;
+      if(current_p->inode != FS_INVALID_INODE && 
+         memcmp(current_p->name, ".", 2) != 0 && 
+         memcmp(current_p->name, "..", 3) != 0) {
+        entry_list[count] = *current_p;
+        count++;
+      }
+      dir_p->current_index++;
+    }
+  }
+
+  fs_iput(disk_p, inode_p);
+  return count;
+}
+
+/*
+ * fs_dir_tell() - This function returns the position of an iterator as a
+ *                 resume cookie
+ */
+uint32_t fs_dir_tell(const Dir *dir_p) {
+  return (uint32_t)dir_p->current_sector * context.dir_per_sector + 
+         dir_p->current_index;
+}
+
+/*
+ * fs_dir_seek() - This function moves an iterator to the position of a 
+ *                 cookie returned by fs_dir_tell()
+ */
+void fs_dir_seek(Dir *dir_p, uint32_t cookie) {
+  dir_p->current_sector = (sector_t)(cookie / context.dir_per_sector);
+  dir_p->current_index = (dir_count_t)(cookie % context.dir_per_sector);
+
+  return;
+}
+
+/*
+ * fs_is_valid_char() - Returns 1 if the char is valid for file name
+ *
+ * Valid chars are:
+ *   1. Alphabet
+ *   2. Numeric digits
+ *   3. Underline, dash and dot
+ *   4. Space character
+ */
+int fs_is_valid_char(char ch) {
+  if(ch >= 'A' && ch <= 'Z') {
+    return 1;
+  } else if(ch >= 'a' && ch <= 'z') {
+    return 1;
+  } else if(ch >= '0' && ch <= '9') {
+    return 1;
+  } else if(ch == '.' || ch == '-' || ch == '_' || ch == ' ') {
+    return 1;
+  }
+
+  return 0;
+}
+
+#define FS_SET_DIR_NAME_DISALLOW_DOT 0
+#define FS_SET_DIR_NAME_ALLOW_DOT    1
+
+/*
+ * fs_check_dir_name() - This function checks whether a name can be used as
+ *                       a directory name
+ *
+ * This function proceeds as follows:
+ *   1. If the length of the name exceeds the maximum length then return 
+ *      FS_ERR_NAME_TOO_LONG
+ *      1.1 Defined by FS_DIR_ENTRY_NAME_MAX, not including any '\0' padding
+ *      1.2 We do not use '\0' to terminate the file name either
+ *   2. If there is any forbidden char, then we return FS_ERR_ILLEGAL_CHAR
+ *      2.1 alphanumeric, underline, dash, and space are allowed
+ *      2.2 All other characters are not allowed
+ *   3. If the name itself is illegal, then we return FS_ERR_ILLEGAL_NAME
+ *      3.1 Names that only has '.' character
+ *      3.2 Names that only has space character
+ *
+ * If we need to allow names that only have dot, then the allow_all_dot should 
+ * be set to 1. This feature is only used for initializing a directory
+ *
+ * Returns FS_SUCCESS if the name is valid. This function does not check for
+ * duplicated names
+ */
+int fs_check_dir_name(const char *name, int allow_all_dot) {
+  int len = strlen(name);
+  if(len > FS_DIR_ENTRY_NAME_MAX) {
+    return FS_ERR_NAME_TOO_LONG;
+  }
+
+  const char *p = name;
+  // As long as any of the character is invalid, the entire name is invalid
+  while(*p != '\0') {
+    if(fs_is_valid_char(*p) == 0) {
+      return FS_ERR_ILLEGAL_CHAR;
+    }
+    p++;
+  }
+
+  p = name;
+  // Are set to 0 if we see anything other than a dot/space
+  int all_dots = 1;
+  int all_space = 1;
+  while(*p != '\0') {
+    if(*p != '.') {
+      all_dots = 0; 
+    }
+
+    if(*p != ' ') {
+      all_space = 0;
+    }
+
+    p++;
+  }
+
+  // Manually disable it if we allow names such as . and ..
+  if(allow_all_dot == FS_SET_DIR_NAME_ALLOW_DOT) {
+    all_dots = 0;
+  }
+
+  // If any of these two are assigned 1
+  if(all_dots == 1 || all_space == 1) {
+    return FS_ERR_ILLEGAL_NAME;
+  }
+
+  return FS_SUCCESS;
+}
+
+/*
+ * fs_set_dir_name() - This function sets the directory name
+ *
+ * The name is checked by fs_check_dir_name(), and its error code is returned
+ * if the name is invalid. Cached entries of the old name and negative entries
+ * of the new name are dropped from the directory entry cache.
+ *
+ * This function will set the entry as dirty. This function does not check for
+ * duplicated names
+ */
+int fs_set_dir_name(Storage *disk_p, 
+                    DirEntry *entry_p, 
+                    const char *name, 
+                    int allow_all_dot) {
+  int ret = fs_check_dir_name(name, allow_all_dot);
+  if(ret != FS_SUCCESS) {
+    return ret;
+  }
+
+  int len = strlen(name);
+  char key[FS_DIR_ENTRY_NAME_MAX];
+  fs_dir_pad_name(name, key);
+  fs_dcache_rename(entry_p->name, key, entry_p->inode);
+  // Make the change available if we need to change the name
+  buffer_set_dirty(disk_p, entry_p);
+  // Set padding first (it's actually faster)
+  memset(entry_p->name, 0x00, FS_DIR_ENTRY_NAME_MAX);
+  // We do not use strcpy because we do not copy the trailing 0
+  memcpy(entry_p->name, name, len);
+
+  return FS_SUCCESS;
+}
+
+/*
+ * fs_print_dir_name() - This function prints the name of a given directory
+ *
+ * We print the name without any modification. Just the name will be printed.
+ * This function takes a pointer for printing to an FP. The fp could be
+ * either stderr or stdout
+ *
+ * The length of the name will be returned
+ */
+int fs_print_dir_name(DirEntry *entry_p, FILE *fp) {
+  const char *p = entry_p->name;
+  int count = 0;
+  // The first makes sure that we did not overflow the field
+  // The second makes sure we did not overflow the name
+  while(count < FS_DIR_ENTRY_NAME_MAX && *p != '\0') {
+    fputc(*p, fp);
+    p++;
+    count++;
+  }
+
+  return count;
+}
+
+/*
+ * fs_dir_lookup_uncached() - This function looks up a padded name in the 
+ *                            given directory, and caches the result
+ *
+ * The directory entry cache should have been checked by the caller
+ */
+inode_id_t fs_dir_lookup_uncached(Storage *disk_p, 
+                                  Inode *inode_p, 
+                                  inode_id_t parent, 
+                                  const char *key) {
+  inode_id_t ret = FS_INVALID_INODE;
+  fs_pin(disk_p, inode_p);
+  const uint32_t pos = fs_dir_find(disk_p, inode_p, key);
+  if(pos != FS_DIR_INDEX_EMPTY) {
+    ret = fs_dir_entry_at(disk_p, inode_p, pos, 0)->inode;
+  }
+  fs_dcache_insert(parent, key, ret);
+
+  fs_unpin(disk_p, inode_p);
+  return ret;
+}
+
+/*
+ * fs_lookup_dir_entry() - This function returns the inode of a name in the 
+ *                         given directory
+ *
+ * Names are matched exactly. Results, including names that are not found, 
+ * are kept in the directory entry cache, and a cached name is returned 
+ * without accessing any buffer. Otherwise directories are looked up using 
+ * their index if they have one, and by linear scan if not. Lookups never 
+ * build an index: fs_insert_dir_entry() builds it once the directory has
+ * FS_DIR_INDEX_MIN_SECTORS sectors.
+ *
+ * Returns FS_INVALID_INODE if the name is not found. This function pins the
+ * inode in the buffer
+ */
+inode_id_t fs_lookup_dir_entry(Storage *disk_p, 
+                               Inode *inode_p, 
+                               const char *name) {
+  char key[FS_DIR_ENTRY_NAME_MAX];
+  // EARLY RETURN
+  if(fs_dir_pad_name(name, key) == 0) {
+    return FS_INVALID_INODE;
+  }
+
+  inode_id_t ret = FS_INVALID_INODE;
+  const inode_id_t parent = fs_get_inode_id(disk_p, inode_p);
+  // EARLY RETURN
+  if(parent != FS_INVALID_INODE && fs_dcache_lookup(parent, key, &ret) == 1) {
+    return ret;
+  }
+
+  return fs_dir_lookup_uncached(disk_p, inode_p, parent, key);
+}
+
+/*
+ * fs_lookup_name() - This function returns the inode of a name in the 
+ *                    directory with the given inode number
+ *
+ * The directory inode is only loaded if the name is not cached. Returns 
+ * FS_INVALID_INODE if the name is not found, or if the inode is not a 
+ * directory in use
+ */
+inode_id_t fs_lookup_name(Storage *disk_p, inode_id_t parent, const char *name) {
+  char key[FS_DIR_ENTRY_NAME_MAX];
+  inode_id_t ret = FS_INVALID_INODE;
+  // EARLY RETURN
+  if(parent >= context.total_inode_count || 
+     fs_dir_pad_name(name, key) == 0) {
+    return FS_INVALID_INODE;
+  } else if(fs_dcache_lookup(parent, key, &ret) == 1) {
+    return ret;
+  }
+
+  Inode *inode_p = fs_iget(disk_p, parent);
+  if((inode_p->flags & FS_INODE_IN_USE) != 0 && 
+     fs_get_file_type(inode_p) == FS_INODE_TYPE_DIR) {
+    ret = fs_dir_lookup_uncached(disk_p, inode_p, parent, key);
+  }
+
+  fs_iput(disk_p, inode_p);
+  return ret;
+}
+
+// Number of path components whose inode is remembered by fs_lookup_paths()
+#define FS_PATH_DEPTH_MAX 32
+
+// This records the inode of each leading component of the last resolved
+// path, such that the next path could start after the common components
+typedef struct {
+  // Offset just after the i-th component in the path
+  size_t end[FS_PATH_DEPTH_MAX];
+  // Inode of the i-th component
+  inode_id_t inode[FS_PATH_DEPTH_MAX];
+  // Number of valid components
+  int depth;
+} PathCursor;
+
+/*
+ * fs_lookup_path_from() - This function resolves the remaining components
+ *                         of a path, starting at the given offset and inode
+ *
+ * If the cursor is not NULL, components resolved are appended to it
+ */
+inode_id_t fs_lookup_path_from(Storage *disk_p, 
+                               const char *path, 
+                               size_t offset, 
+                               inode_id_t inode, 
+                               PathCursor *cursor_p) {
+  char name[FS_DIR_ENTRY_NAME_MAX + 1];
+  while(1) {
+    // Skip separators, which also allows "//" and the trailing '/'
+    while(path[offset] == '/') {
+      offset++;
+    }
+    if(path[offset] == '\0') {
+      break;
+    }
+
+    size_t len = 0;
+    while(path[offset + len] != '/' && path[offset + len] != '\0') {
+      len++;
+    }
+    // EARLY RETURN
+    if(len > FS_DIR_ENTRY_NAME_MAX) {
+      return FS_INVALID_INODE;
+    }
+
+    memcpy(name, path + offset, len);
+    name[len] = '\0';
+    offset += len;
+    inode = fs_lookup_name(disk_p, inode, name);
+    // EARLY RETURN
+    if(inode == FS_INVALID_INODE) {
+      return FS_INVALID_INODE;
+    }
+
+    if(cursor_p != NULL && cursor_p->depth < FS_PATH_DEPTH_MAX) {
+      cursor_p->end[cursor_p->depth] = offset;
+      cursor_p->inode[cursor_p->depth] = inode;
+      cursor_p->depth++;
+    }
+  }
+
+  return inode;
+}
+
+/*
+ * fs_lookup_path() - This function resolves a path to its inode
+ *
+ * Paths are resolved from the root directory, and the leading '/' is 
+ * optional. Components are separated by one or more '/', and "." and ".." 
+ * are resolved using the entries of the directory. Each component is looked
+ * up with fs_lookup_name(), so cached components do not access any buffer.
+ *
+ * Returns FS_INVALID_INODE if any component is not found, is too long, or
+ * if a non-final component is not a directory
+ */
+inode_id_t fs_lookup_path(Storage *disk_p, const char *path) {
+  return fs_lookup_path_from(disk_p, path, 0, FS_ROOT_INODE, NULL);
+}
+
+// This is used for sorting paths while remembering their original index
+typedef struct {
+  const char *path;
+  size_t index;
+} PathSortEntry;
+
+int fs_path_sort_cmp(const void *a, const void *b) {
+  return strcmp(((const PathSortEntry *)a)->path, 
+                ((const PathSortEntry *)b)->path);
+}
+
+/*
+ * fs_lookup_paths() - This function resolves a batch of paths
+ *
+ * Paths are sorted first such that paths with common leading components are
+ * adjacent. Each path then starts from the deepest component it shares with 
+ * the previous path, which is only resolved once for the whole run. The 
+ * inode of path_list[i] is written into inode_list[i], using the same rules 
+ * as fs_lookup_path().
+ *
+ * Returns the number of paths that are found
+ */
+size_t fs_lookup_paths(Storage *disk_p, 
+                       const char * const *path_list, 
+                       size_t count, 
+                       inode_id_t *inode_list) {
+  PathSortEntry *sort_p = malloc(sizeof(PathSortEntry) * count);
+  if(sort_p == NULL) {
+    fatal_error("Failed to allocate the path array");
+  }
+  for(size_t i = 0;i < count;i++) {
+    sort_p[i].path = path_list[i];
+    sort_p[i].index = i;
+  }
+  qsort(sort_p, count, sizeof(PathSortEntry), fs_path_sort_cmp);
+
+  PathCursor cursor;
+  cursor.depth = 0;
+  const char *prev_path = "";
+  size_t found_count = 0;
+  for(size_t i = 0;i < count;i++) {
+    const char *path = sort_p[i].path;
+    size_t common = 0;
+    while(path[common] != '\0' && path[common] == prev_path[common]) {
+      common++;
+    }
+
+    // Keep components of the previous path that are fully inside the 
+    // common prefix, and also end a component in this path
+    while(cursor.depth > 0) {
+      const size_t end = cursor.end[cursor.depth - 1];
+      if(end <= common && (path[end] == '/' || path[end] == '\0')) {
+        break;
+      }
+      cursor.depth--;
+    }
+
+    size_t offset = 0;
+    inode_id_t inode = FS_ROOT_INODE;
+    if(cursor.depth > 0) {
+      offset = cursor.end[cursor.depth - 1];
+      inode = cursor.inode[cursor.depth - 1];
+    }
+
+    inode = fs_lookup_path_from(disk_p, path, offset, inode, &cursor);
+    inode_list[sort_p[i].index] = inode;
+    if(inode != FS_INVALID_INODE) {
+      found_count++;
+    }
+    prev_path = path;
+  }
+
+  free(sort_p);
+  return found_count;
+}
+
+/*
+ * fs_insert_dir_entry() - This function adds a named entry into the given 
+ *                         directory
+ *
+ * This function proceeds as follows:
+ *   1. If the name is invalid, the error code of fs_check_dir_name() is 
+ *      returned
+ *   2. If the name already exists, then we return FS_ERR_NAME_EXISTS
+ *   3. If a new sector is needed but could not be allocated, then we return
+ *      FS_ERR_NO_SPACE
+ *
+ * Unlike fs_add_dir_entry(), the index of the directory is kept up-to-date. 
+ * The index is built once the directory has FS_DIR_INDEX_MIN_SECTORS 
+ * sectors, and if it becomes half full, it is rebuilt with twice the number
+ * of slots. This function does not change the link count of the inode.
+ *
+ * This function pins the inode in the buffer
+ */
+int fs_insert_dir_entry(Storage *disk_p, 
+                        Inode *inode_p, 
+                        const char *name, 
+                        inode_id_t inode) {
+  int ret = fs_check_dir_name(name, FS_SET_DIR_NAME_DISALLOW_DOT);
+  // EARLY RETURN
+  if(ret != FS_SUCCESS) {
+    return ret;
+  }
+
+  char key[FS_DIR_ENTRY_NAME_MAX];
+  fs_dir_pad_name(name, key);
+  fs_pin(disk_p, inode_p);
+  // EARLY RETURN
+  if(fs_dir_find(disk_p, inode_p, key) != FS_DIR_INDEX_EMPTY) {
+    fs_unpin(disk_p, inode_p);
+    return FS_ERR_NAME_EXISTS;
+  }
+
+  uint32_t pos;
+  DirEntry *entry_p = fs_find_free_dir_entry(disk_p, inode_p, &pos);
+  // EARLY RETURN
+  if(entry_p == NULL) {
+    fs_unpin(disk_p, inode_p);
+    return FS_ERR_NO_SPACE;
+  }
+
+  entry_p->inode = inode;
+  ret = fs_set_dir_name(disk_p, entry_p, name, FS_SET_DIR_NAME_DISALLOW_DOT);
+  assert(ret == FS_SUCCESS);
+
+  DirIndexHeader header;
+  if(fs_dir_index_load(disk_p, inode_p, &header) == 1) {
+    if((size_t)(header.entry_count + 1) * 2 > ((size_t)1 << header.shift)) {
+      // The new entry is already in the directory, and is indexed by the
+      // rebuild. If it fails the directory is just not indexed
+      fs_dir_index_build(disk_p, inode_p, header.entry_count);
+    } else {
+      fs_dir_index_put(disk_p, &header, fs_dir_hash(key), pos);
+      header.entry_count++;
+      fs_dir_index_store(disk_p, inode_p, &header);
+    }
+  } else if(fs_get_file_size(inode_p) >= 
+            (size_t)FS_DIR_INDEX_MIN_SECTORS * disk_p->sector_size) {
+    // The directory has grown large enough. The new entry is indexed by 
+    // the build
+    fs_dir_index_build(disk_p, inode_p, 0);
+  }
+  fs_dcache_insert(fs_get_inode_id(disk_p, inode_p), key, inode);
+
+  fs_unpin(disk_p, inode_p);
+  return FS_SUCCESS;
+}
+
+/*
+ * fs_init_root() - This function initializes the root directory
+ *
+ * This function must be called after the context is loaded
+ */
+void fs_init_root(Storage *disk_p) {
+  Inode *inode_p = \
+    fs_load_inode_sector(disk_p, FS_ROOT_INODE, FS_LOAD_INODE_SECTOR_WRITE);
+  inode_p->flags |= FS_INODE_IN_USE;
+  fs_inode_map_set(FS_ROOT_INODE, 1);
+  __atomic_fetch_sub(&inode_free_count, 1, __ATOMIC_RELAXED);
+  // Size of a directory is the number of sectors it occupies
+  fs_set_file_type(inode_p, FS_INODE_TYPE_DIR);
+
+  // Note that reference from . and .. does not contribute to this
+  assert(inode_p->nlinks = 1);
+  assert(fs_get_file_size(inode_p) == 0UL);
+
+  // The first sector of the directory is allocated with the first entry
+  DirEntry *entry_p_dot = fs_add_dir_entry(disk_p, inode_p);
+  if(entry_p_dot == NULL) {
+    fatal_error("Failed to allocate initial entries for root");
+  }
+  entry_p_dot->inode = FS_ROOT_INODE;
+
+  DirEntry *entry_p_dot_dot = fs_add_dir_entry(disk_p, inode_p);
+  entry_p_dot_dot->inode = FS_ROOT_INODE;
+  if(entry_p_dot_dot == NULL) {
+    fatal_error("Failed to allocate initial entries for root");
+  }
+
+  int dir_name_ret;
+  // Set the name of these two entries
+  dir_name_ret = \
+    fs_set_dir_name(disk_p, entry_p_dot, ".", FS_SET_DIR_NAME_ALLOW_DOT);
+  assert(dir_name_ret == FS_SUCCESS);
+  dir_name_ret = \
+    fs_set_dir_name(disk_p, entry_p_dot_dot, "..", FS_SET_DIR_NAME_ALLOW_DOT);
+  assert(dir_name_ret == FS_SUCCESS);
+
+  info("Finished initializing root directory");
+
+  return;
+}
+
+/*
+ * fs_init_super_block() - This function writes the super block of a newly
+ *                         created file system
+ *
+ * If the free extent map feature is not set, the super block points to the
+ * first sector of the free list
+ */
+void fs_init_super_block(Storage *disk_p,
+                         size_t sb_sector,
+                         size_t inode_sector_count,
+                         size_t free_sector_count,
+                         size_t reserved_sector_count,
+                         word_t features,
+                         size_t map_start,
+                         size_t map_size,
+                         size_t map_count) {
+  SuperBlock *sb_p = (SuperBlock *)write_lba(disk_p, sb_sector);
+  memset(sb_p, 0x00, disk_p->sector_size);
+  // We use the signature to verify the fs type
+  memcpy(sb_p->signature, FS_SIG, FS_SIG_SIZE);
+  sb_p->signature[FS_SIG_VERSION_INDEX] = FS_SIG_VERSION;
+  sb_p->isize = (sector_t)inode_sector_count;
+  sb_p->fsize = (sector_t)free_sector_count;
+  // There is no cached free block and free inodes. The first write operation
+  // into the file system will find one
+  sb_p->free_array.nfree = 0;
+  memset(sb_p->free_array.free, 0x0, sizeof(sb_p->free_array.free));
+  if(features & FS_FEATURE_FREE_EXTENT) {
+    sb_p->free_array.free[0] = FS_INVALID_SECTOR;
+  } else {
+    // The first element is the sector ID for the sector that stores 
+    // the free list
+    sb_p->free_array.free[0] = \
+      (sector_t)(sb_sector + 1 + inode_sector_count + reserved_sector_count);
+  }
+  sb_p->ninode = 0;
+  memset(sb_p->inode, 0x0, sizeof(sb_p->inode));
+  sb_p->flock = sb_p->ilock = 0;
+  sb_p->fmod = 0;
+  sb_p->time[0] = sb_p->time[1] = 0;
+  sb_p->features = features;
+  sb_p->rsize = (sector_count_t)reserved_sector_count;
+  sb_p->fmap_start = (sector_t)map_start;
+  sb_p->fmap_size = (sector_count_t)map_size;
+  sb_p->fmap_count = (sector_count_t)map_count;
+  // No inode sector is initialized if they are initialized lazily
+  sb_p->iinit = 0;
+  // All sectors of the file storage and all inodes are free
+  sb_p->nfree_sector = (sector_count_t)free_sector_count;
+  sb_p->nfree_inode = \
+    (inode_count_t)(inode_sector_count * (disk_p->sector_size / sizeof(Inode)));
+
+  // Make sure the super block goes to disk
+  buffer_flush_all_no_rm(disk_p);
+
+  return;
+}
+
+/*
+ * fs_init() - This function initializes an empty FS on a raw storage
+ *
+ * The init_root flag is used for debugging purposes. It indicates whether
+ * we initialize the root directory also. For debugging we do not wish
+ * so, because it will disrupt sector and inode allocator
+ *
+ * The features argument selects the on-disk format. With the free extent 
+ * map feature, the map is placed between the inode sectors and the file 
+ * storage. Otherwise the free list is built in the file storage (such images
+ * are converted to the extent map when they are loaded)
+ */
+void _fs_init(Storage *disk_p, size_t total_sector, size_t start_sector, 
+             int init_root, word_t features) {
+  assert(start_sector < total_sector - 1);
+  assert(total_sector <= disk_p->sector_count);
+  size_t inode_start_sector = start_sector + 1;
+  // This is the number of total usable blocks for inode and file
+  size_t usable_sector_count = total_sector - start_sector - 1;
+  size_t inode_sector_count;
+  if(features & FS_FEATURE_LAZY_INODE) {
+    // Inode sectors are initialized on first use
+    inode_sector_count = \
+      fs_get_inode_sector_count(disk_p, inode_start_sector, total_sector);
+  } else {
+    inode_sector_count = \
+      fs_init_inode(disk_p, inode_start_sector, total_sector);
+  }
+  size_t free_sector_count = usable_sector_count - inode_sector_count;
+  // This is the absolute sector ID of the free start sector
+  size_t free_start_sector = inode_start_sector + inode_sector_count;
+  size_t reserved_sector_count = 0;
+  size_t map_start = FS_INVALID_SECTOR;
+  size_t map_count = 0;
+  if(features & FS_FEATURE_FREE_EXTENT) {
+    // The map is right after the inode sectors
+    map_start = free_start_sector;
+    reserved_sector_count = fs_get_free_map_size(disk_p, free_sector_count);
+    free_start_sector += reserved_sector_count;
+    free_sector_count -= reserved_sector_count;
+    map_count = fs_init_free_map(disk_p, 
+                                 map_start, 
+                                 reserved_sector_count, 
+                                 free_start_sector, 
+                                 total_sector);
+    info("  Free map size: %lu; First free sector: %lu", 
+         reserved_sector_count,
+         free_start_sector);
+  } else {
+    size_t free_list_size = \
+      fs_init_free_list(disk_p, free_start_sector, total_sector);
+    info("  Free list size: %lu; First free sector: %lu", 
+         free_list_size,
+         free_start_sector);
+  }
+  info("  # of inode sectors: %lu; free sectors: %lu",
+       inode_sector_count,
+       free_sector_count);
+
+  // At last, we init the super block
+  fs_init_super_block(disk_p, 
+                      start_sector, 
+                      inode_sector_count, 
+                      free_sector_count, 
+                      reserved_sector_count,
+                      features,
+                      map_start,
+                      reserved_sector_count,
+                      map_count);
+  info("Finished writing the super block");
+
+  fs_load_context(disk_p);
+  if(init_root == 1) {
+    // Set up the root node (also allocate inode 0)
+    fs_init_root(disk_p);
+  }
+
+  fs_sync(disk_p);
+
+  return;
+}
+
+// This is called by non-debugging routines
+void fs_init(Storage *disk_p, size_t total_sector, size_t start_sector) {
+  _fs_init(disk_p, total_sector, start_sector, 1, FS_DEFAULT_FEATURES);
+}
+
+/*
+ * fs_alloc_sector_free_list() - This function allocates a new sector using 
+ *                               either the SB or the linked list
+ *
+ * This is the allocator of the old free list format. It is only used to 
+ * drain the free list when converting an old image to the free extent map
+ *
+ * Returns 0 if allocation failed (0 is not a valid block ID)
+ */
+sector_t fs_alloc_sector_free_list(Storage *disk_p) {
+  // First read the super block, setting dirty flag
+  SuperBlock *sb_p = (SuperBlock *)read_lba_for_write(disk_p, FS_SB_SECTOR);
+  buffer_pin(disk_p, sb_p);
+
+  sector_t ret = 0;
+  // If there are cached free values, then just get one
+  if(sb_p->free_array.nfree != 0) {
+    ret = sb_p->free_array.free[sb_p->free_array.nfree];
+    sb_p->free_array.nfree--;
+  } else {
+    sector_t free_list_head = sb_p->free_array.free[0];
+    // If there is no next block, then we have exhausted free blocks
+    if(free_list_head == FS_INVALID_SECTOR) {
+      ret = FS_INVALID_SECTOR;
+    } else {
+      // We use this sector as the free sector, and copy its free list into
+      // the super block
+      ret = free_list_head;
+      // Read the free list head, and copy the free array into the temp
+      // object (because the sb may have been evicted)
+      sector_t *data_p = (sector_t *)read_lba(disk_p, free_list_head);
+      memcpy(&sb_p->free_array, data_p, sizeof(FreeArray));
+    }
+  }
+
+  // Make sure no buffer is pinned at the end
+  buffer_unpin(disk_p, sb_p);
+  return ret;
+}
+
+/*
+ * fs_free_map_find() - This function returns the index of the first extent
+ *                      that ends after the given sector
+ *
+ * If the sector is free, the returned extent contains it. Returns the number
+ * of extents if there is no such extent
+ */
+size_t fs_free_map_find(const FreeMap *map_p, size_t sector) {
+  size_t low = 0;
+  size_t high = map_p->count;
+  while(low < high) {
+    size_t mid = low + (high - low) / 2;
+    const FreeExtent *extent_p = map_p->extent_p + mid;
+    if((size_t)extent_p->start + extent_p->count <= sector) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  return low;
+}
+
+/*
+ * fs_free_map_remove() - This function removes a range from an extent
+ *
+ * The range must be inside the extent. The extent is shrunk, split or
+ * removed
+ */
+void fs_free_map_remove(FreeMap *map_p, 
+                        size_t index, 
+                        sector_t start, 
+                        sector_count_t count) {
+  FreeExtent *extent_p = map_p->extent_p + index;
+  assert(start >= extent_p->start);
+  assert((size_t)start + count <= (size_t)extent_p->start + extent_p->count);
+  const sector_t end = start + count;
+  const sector_t extent_end = extent_p->start + extent_p->count;
+  if(start == extent_p->start && end == extent_end) {
+    // The entire extent is used
+    memmove(extent_p, 
+            extent_p + 1, 
+            (map_p->count - index - 1) * sizeof(FreeExtent));
+    map_p->count--;
+  } else if(start == extent_p->start) {
+    extent_p->start = end;
+    extent_p->count -= count;
+  } else if(end == extent_end) {
+    extent_p->count -= count;
+  } else {
+    // Split the extent into two
+    if(map_p->count == map_p->capacity) {
+      fatal_error("Free extent map overflow");
+    }
+    memmove(extent_p + 1, 
+            extent_p, 
+            (map_p->count - index) * sizeof(FreeExtent));
+    map_p->count++;
+    extent_p->count = start - extent_p->start;
+    extent_p[1].start = end;
+    extent_p[1].count = extent_end - end;
+  }
+
+  map_p->dirty = 1;
+
+  return;
+}
+
+/*
+ * fs_free_map_insert() - This function inserts a free range into the map
+ *
+ * The range is merged with the extents before and after it if they are
+ * adjacent. Inserting a range that overlaps a free extent is a fatal error
+ */
+void fs_free_map_insert(FreeMap *map_p, sector_t start, sector_count_t count) {
+  const sector_t end = start + count;
+  // This is the first extent that ends after start, and it must begin after
+  // the inserted range
+  const size_t index = fs_free_map_find(map_p, start);
+  FreeExtent *next_p = \
+    (index < map_p->count) ? map_p->extent_p + index : NULL;
+  FreeExtent *prev_p = (index > 0) ? map_p->extent_p + index - 1 : NULL;
+  if(next_p != NULL && next_p->start < end) {
+    fatal_error("Double free of sector range %u (%u sectors)", 
+                (uint32_t)start, 
+                (uint32_t)count);
+  }
+
+  int merge_prev = (prev_p != NULL && prev_p->start + prev_p->count == start);
+  int merge_next = (next_p != NULL && next_p->start == end);
+  if(merge_prev && merge_next) {
+    prev_p->count += count + next_p->count;
+    memmove(next_p, 
+            next_p + 1, 
+            (map_p->count - index - 1) * sizeof(FreeExtent));
+    map_p->count--;
+  } else if(merge_prev) {
+    prev_p->count += count;
+  } else if(merge_next) {
+    next_p->start = start;
+    next_p->count += count;
+  } else {
+    if(map_p->count == map_p->capacity) {
+      fatal_error("Free extent map overflow");
+    }
+    memmove(map_p->extent_p + index + 1, 
+            map_p->extent_p + index,
+            (map_p->count - index) * sizeof(FreeExtent));
+    map_p->count++;
+    map_p->extent_p[index].start = start;
+    map_p->extent_p[index].count = count;
+  }
+
+  map_p->dirty = 1;
+
+  return;
+}
+
+/*
+ * fs_group_init() - This function splits the file storage and the inode 
+ *                   table into allocation groups
+ *
+ * Groups have at least FS_GROUP_SECTOR_MIN sectors unless there is only one.
+ * All free extent maps are empty after this function returns
+ */
+void fs_group_init() {
+  for(size_t i = 0;i < group_table.count;i++) {
+    free(group_table.group_p[i].map.extent_p);
+    pthread_mutex_destroy(&group_table.group_p[i].lock);
+  }
+  free(group_table.group_p);
+
+  size_t count = context.free_sector_count / FS_GROUP_SECTOR_MIN;
+  if(count > FS_GROUP_MAX) {
+    count = FS_GROUP_MAX;
+  }
+  if(count > context.total_inode_count) {
+    count = context.total_inode_count;
+  }
+  if(count == 0) {
+    count = 1;
+  }
+
+  group_table.count = count;
+  group_table.sector_per_group = context.free_sector_count / count;
+  group_table.inode_per_group = context.total_inode_count / count;
+  group_table.rotor = context.free_start_sector;
+  // Magazines are empty when the groups are initialized
+  free_sector_total = 0;
+  group_table.group_p = calloc(count, sizeof(AllocGroup));
+  if(group_table.group_p == NULL) {
+    fatal_error("Failed to allocate allocation groups");
+  }
+
+  for(size_t i = 0;i < count;i++) {
+    AllocGroup *group_p = group_table.group_p + i;
+    group_p->start = \
+      context.free_start_sector + i * group_table.sector_per_group;
+    group_p->end = (i == count - 1) ? 
+                   context.free_end_sector : 
+                   group_p->start + group_table.sector_per_group;
+    group_p->inode_start = i * group_table.inode_per_group;
+    group_p->inode_end = (i == count - 1) ? 
+                         context.total_inode_count : 
+                         group_p->inode_start + group_table.inode_per_group;
+    // Free and used sectors alternate in the worst case
+    group_p->map.capacity = (group_p->end - group_p->start) / 2 + 1;
+    group_p->map.extent_p = malloc(group_p->map.capacity * sizeof(FreeExtent));
+    if(group_p->map.extent_p == NULL) {
+      fatal_error("Failed to allocate the free extent map");
+    }
+    group_p->rotor = group_p->start;
+    group_p->inode_rotor = group_p->inode_start;
+    pthread_mutex_init(&group_p->lock, NULL);
+  }
+
+  return;
+}
+
+/*
+ * fs_group_of_sector() - This function returns the allocation group of a 
+ *                        sector in the file storage
+ */
+size_t fs_group_of_sector(size_t sector) {
+  assert(sector >= context.free_start_sector);
+  assert(sector < context.free_end_sector);
+  const size_t index = \
+    (sector - context.free_start_sector) / group_table.sector_per_group;
+  return (index < group_table.count) ? index : group_table.count - 1;
+}
+
+/*
+ * fs_group_of_inode() - This function returns the allocation group of an
+ *                       inode
+ */
+size_t fs_group_of_inode(inode_id_t inode) {
+  assert((size_t)inode < context.total_inode_count);
+  const size_t index = (size_t)inode / group_table.inode_per_group;
+  return (index < group_table.count) ? index : group_table.count - 1;
+}
+
+/*
+ * fs_group_lock_all() - This function locks all allocation groups
+ *
+ * Groups are always locked in ascending order
+ */
+void fs_group_lock_all() {
+  for(size_t i = 0;i < group_table.count;i++) {
+    pthread_mutex_lock(&group_table.group_p[i].lock);
+  }
+
+  return;
+}
+
+/*
+ * fs_group_unlock_all() - This function unlocks all allocation groups
+ */
+void fs_group_unlock_all() {
+  for(size_t i = 0;i < group_table.count;i++) {
+    pthread_mutex_unlock(&group_table.group_p[i].lock);
+  }
+
+  return;
+}
+
+/*
+ * fs_group_alloc() - This function allocates a run of sectors next-fit from 
+ *                    the hint, without leaving the group of the hint
+ *
+ * The group should be locked. Returns FS_INVALID_SECTOR if there is no run 
+ * of the requested size between the hint and the end of the group
+ */
+sector_t fs_group_alloc(AllocGroup *group_p, 
+                        sector_count_t count, 
+                        sector_t hint) {
+  FreeMap *map_p = &group_p->map;
+  for(size_t i = fs_free_map_find(map_p, hint);i < map_p->count;i++) {
+    const FreeExtent *extent_p = map_p->extent_p + i;
+    const size_t extent_end = (size_t)extent_p->start + extent_p->count;
+    sector_t start = FS_INVALID_SECTOR;
+    // If the hint is inside the extent, try to start there
+    if(hint >= extent_p->start && extent_end - hint >= count) {
+      start = hint;
+    } else if(hint >= extent_p->start && extent_end == group_p->end) {
+      // The free run may continue in the next group
+      break;
+    } else if(extent_p->count >= count) {
+      start = extent_p->start;
+    }
+
+    if(start != FS_INVALID_SECTOR) {
+      fs_free_map_remove(map_p, i, start, count);
+      group_p->free_sector_count -= count;
+      __atomic_fetch_sub(&free_sector_total, count, __ATOMIC_RELAXED);
+      group_p->rotor = (size_t)start + count;
+      return start;
+    }
+  }
+
+  return FS_INVALID_SECTOR;
+}
+
+// This is the state of a search over the free runs of all groups. Extents 
+// that touch at a group boundary form a single run
+typedef struct {
+  size_t hint;
+  size_t count;
+  // Next-fit result at or after the hint
+  size_t start;
+  // Next-fit result before the hint, which is used when wrapping around
+  size_t wrap;
+  // Best-fit result and its length
+  size_t best;
+  size_t best_count;
+  int done;
+} FreeRunSearch;
+
+/*
+ * fs_free_run_search() - This function checks a free run [start, end) for 
+ *                        a slow-path allocation
+ *
+ * Runs must be checked in address order
+ */
+void fs_free_run_search(FreeRunSearch *search_p, size_t start, size_t end) {
+  const size_t len = end - start;
+  // EARLY RETURN
+  if(search_p->done == 1 || len < search_p->count) {
+    return;
+  }
+
+  if(search_p->hint == FS_INVALID_SECTOR) {
+    if(search_p->best == FS_INVALID_SECTOR || len < search_p->best_count) {
+      search_p->best = start;
+      search_p->best_count = len;
+      // Exact fit cannot be improved
+      search_p->done = (len == search_p->count);
+    }
+  } else if(end <= search_p->hint) {
+    if(search_p->wrap == FS_INVALID_SECTOR) {
+      search_p->wrap = start;
+    }
+  } else {
+    // If the hint is inside the run, try to start there
+    if(search_p->hint > start && end - search_p->hint >= search_p->count) {
+      search_p->start = search_p->hint;
+    } else {
+      search_p->start = start;
+    }
+    search_p->done = 1;
+  }
+
+  return;
+}
+
+/*
+ * fs_group_remove_run() - This function removes a free run from the maps of
+ *                         all groups it covers
+ *
+ * All groups should be locked
+ */
+void fs_group_remove_run(size_t start, sector_count_t count) {
+  const size_t end = start + count;
+  while(start < end) {
+    AllocGroup *group_p = group_table.group_p + fs_group_of_sector(start);
+    const size_t piece_end = (end < group_p->end) ? end : group_p->end;
+    const size_t index = fs_free_map_find(&group_p->map, start);
+    assert(index < group_p->map.count);
+    fs_free_map_remove(&group_p->map, 
+                       index, 
+                       (sector_t)start, 
+                       (sector_count_t)(piece_end - start));
+    group_p->free_sector_count -= piece_end - start;
+    __atomic_fetch_sub(&free_sector_total, 
+                       piece_end - start, 
+                       __ATOMIC_RELAXED);
+    group_p->rotor = piece_end;
+    start = piece_end;
+  }
+
+  return;
+}
+
+/*
+ * fs_alloc_sectors_slow() - This function allocates a run of sectors from 
+ *                           any group
+ *
+ * All groups are locked, and free runs may cross group boundaries. 
+ * Allocation is next-fit from the hint with wrap-around, or best-fit without
+ * a hint
+ */
+sector_t fs_alloc_sectors_slow(sector_count_t count, sector_t hint) {
+  FreeRunSearch search;
+  search.hint = hint;
+  search.count = count;
+  search.start = FS_INVALID_SECTOR;
+  search.wrap = FS_INVALID_SECTOR;
+  search.best = FS_INVALID_SECTOR;
+  search.best_count = 0;
+  search.done = 0;
+
+  fs_group_lock_all();
+  size_t run_start = 0;
+  size_t run_end = 0;
+  for(size_t i = 0;i < group_table.count && search.done == 0;i++) {
+    const FreeMap *map_p = &group_table.group_p[i].map;
+    for(size_t j = 0;j < map_p->count && search.done == 0;j++) {
+      const FreeExtent *extent_p = map_p->extent_p + j;
+      if(run_end != run_start && run_end == extent_p->start) {
+        run_end += extent_p->count;
+      } else {
+        fs_free_run_search(&search, run_start, run_end);
+        run_start = extent_p->start;
+        run_end = run_start + extent_p->count;
+      }
+    }
+  }
+  fs_free_run_search(&search, run_start, run_end);
+
+  sector_t ret = FS_INVALID_SECTOR;
+  if(hint == FS_INVALID_SECTOR) {
+    ret = (sector_t)search.best;
+  } else if(search.start != FS_INVALID_SECTOR) {
+    ret = (sector_t)search.start;
+  } else {
+    ret = (sector_t)search.wrap;
+  }
+
+  if(ret != FS_INVALID_SECTOR) {
+    fs_group_remove_run(ret, count);
+  }
+  fs_group_unlock_all();
+
+  return ret;
+}
+
+/*
+ * fs_magazine_key_init() - This function creates the key of the per-thread
+ *                          magazines
+ */
+void fs_magazine_key_init() {
+  if(pthread_key_create(&magazine_key, fs_magazine_release) != 0) {
+    fatal_error("Failed to create the magazine key");
+  }
+
+  return;
+}
+
+/*
+ * fs_magazine_get() - This function returns the magazine of the calling 
+ *                     thread, creating it on first use
+ *
+ * A magazine released by an exited thread is reused if there is one
+ */
+Magazine *fs_magazine_get() {
+  // EARLY RETURN
+  if(thread_magazine_p != NULL) {
+    return thread_magazine_p;
+  }
+
+  pthread_once(&magazine_key_once, fs_magazine_key_init);
+  pthread_mutex_lock(&magazine_lock);
+  Magazine *magazine_p = magazine_list_p;
+  while(magazine_p != NULL && magazine_p->in_use != 0) {
+    magazine_p = magazine_p->next_p;
+  }
+  if(magazine_p == NULL) {
+    magazine_p = calloc(1, sizeof(Magazine));
+    if(magazine_p == NULL) {
+      fatal_error("Failed to allocate the magazine");
+    }
+    magazine_p->group = magazine_count;
+    magazine_p->next_p = magazine_list_p;
+    magazine_list_p = magazine_p;
+    magazine_count++;
+  }
+  magazine_p->in_use = 1;
+  pthread_mutex_unlock(&magazine_lock);
+  if(pthread_setspecific(magazine_key, magazine_p) != 0) {
+    fatal_error("Failed to set the magazine of the thread");
+  }
+  thread_magazine_p = magazine_p;
+
+  return magazine_p;
+}
+
+/*
+ * fs_magazine_spill_sector() - This function returns the given number of 
+ *                              oldest sectors in a magazine to the groups
+ */
+void fs_magazine_spill_sector(Storage *disk_p, 
+                              Magazine *magazine_p, 
+                              size_t count) {
+  assert(count <= magazine_p->sector_count);
+  for(size_t i = 0;i < count;i++) {
+    fs_free_sectors(disk_p, magazine_p->sector_list[i], 1);
+  }
+  // The sectors are counted again by fs_free_sectors()
+  __atomic_fetch_sub(&free_sector_total, count, __ATOMIC_RELAXED);
+
+  magazine_p->sector_count -= count;
+  memmove(magazine_p->sector_list, 
+          magazine_p->sector_list + count, 
+          magazine_p->sector_count * sizeof(sector_t));
+
+  return;
+}
+
+/*
+ * fs_group_alloc_top() - This function allocates a run of sectors from the 
+ *                        end of the last large enough free extent in a group
+ *
+ * The group should be locked. The rotor is not changed. Returns 
+ * FS_INVALID_SECTOR if there is no such extent
+ */
+sector_t fs_group_alloc_top(AllocGroup *group_p, sector_count_t count) {
+  FreeMap *map_p = &group_p->map;
+  for(size_t i = map_p->count;i > 0;i--) {
+    const FreeExtent *extent_p = map_p->extent_p + i - 1;
+    if(extent_p->count >= count) {
+      const sector_t start = extent_p->start + extent_p->count - count;
+      fs_free_map_remove(map_p, i - 1, start, count);
+      group_p->free_sector_count -= count;
+      __atomic_fetch_sub(&free_sector_total, count, __ATOMIC_RELAXED);
+      return start;
+    }
+  }
+
+  return FS_INVALID_SECTOR;
+}
+
+/*
+ * fs_magazine_refill_sector() - This function refills an empty magazine 
+ *                               with up to a batch of sectors
+ *
+ * Sectors allocated without a hint are mostly metadata, so a contiguous run
+ * is taken from the end of the free space of the magazine's group, away from
+ * the rotor where file data grows. Other groups are tried if the group has 
+ * no such run, and single sectors are allocated if no group has one
+ */
+void fs_magazine_refill_sector(Storage *disk_p, Magazine *magazine_p) {
+  assert(magazine_p->sector_count == 0);
+  sector_t sector_list[FS_MAGAZINE_BATCH];
+  size_t count = 0;
+  for(size_t i = 0;i < group_table.count && count == 0;i++) {
+    AllocGroup *group_p = \
+      group_table.group_p + (magazine_p->group + i) % group_table.count;
+    pthread_mutex_lock(&group_p->lock);
+    const sector_t start = fs_group_alloc_top(group_p, FS_MAGAZINE_BATCH);
+    pthread_mutex_unlock(&group_p->lock);
+    if(start != FS_INVALID_SECTOR) {
+      for(count = 0;count < FS_MAGAZINE_BATCH;count++) {
+        sector_list[count] = start + count;
+      }
+    }
+  }
+
+  while(count < FS_MAGAZINE_BATCH) {
+    const sector_t sector = fs_alloc_sector_near(disk_p, FS_INVALID_SECTOR);
+    if(sector == FS_INVALID_SECTOR) {
+      break;
+    }
+    sector_list[count++] = sector;
+  }
+
+  // The first sector is allocated first
+  for(size_t i = 0;i < count;i++) {
+    magazine_p->sector_list[i] = sector_list[count - 1 - i];
+  }
+  magazine_p->sector_count = count;
+  // Sectors in the magazine are still free
+  __atomic_fetch_add(&free_sector_total, count, __ATOMIC_RELAXED);
+
+  return;
+}
+
+/*
+ * fs_alloc_sectors() - This function allocates a run of contiguous sectors
+ *
+ * If the hint is a valid sector, we allocate next-fit starting from the hint:
+ * if the hint itself begins a large enough free range then the run starts 
+ * exactly at the hint (this is how files grow contiguously), otherwise we use
+ * the first extent after the hint that is large enough, wrapping around at
+ * the end of the disk. Without a hint we allocate best-fit, i.e. from the 
+ * smallest extent that is large enough, to keep large extents intact
+ *
+ * Only the group of the hint is locked if the run can be found in the rest 
+ * of that group. Otherwise all groups are searched
+ *
+ * The allocation is all-or-nothing. Returns the first sector of the run, or 
+ * FS_INVALID_SECTOR if there is no run of the requested size, or if the run
+ * would use sectors reserved for delayed allocation
+ */
+sector_t fs_alloc_sectors(Storage *disk_p, sector_count_t count, sector_t hint) {
+  assert(count != 0);
+  assert(context.features & FS_FEATURE_FREE_EXTENT);
+  // EARLY RETURN
+  if(fs_delalloc_can_alloc(count) == 0) {
+    return FS_INVALID_SECTOR;
+  }
+  sector_t start = FS_INVALID_SECTOR;
+  if(hint >= context.free_start_sector && hint < context.free_end_sector) {
+    AllocGroup *group_p = group_table.group_p + fs_group_of_sector(hint);
+    pthread_mutex_lock(&group_p->lock);
+    start = fs_group_alloc(group_p, count, hint);
+    pthread_mutex_unlock(&group_p->lock);
+  }
+
+  if(start == FS_INVALID_SECTOR) {
+    start = fs_alloc_sectors_slow(count, hint);
+  }
+
+  // Sectors cached by this thread may complete a run
+  Magazine *magazine_p = thread_magazine_p;
+  if(start == FS_INVALID_SECTOR && 
+     magazine_p != NULL && 
+     magazine_p->sector_count != 0) {
+    fs_magazine_spill_sector(disk_p, magazine_p, magazine_p->sector_count);
+    start = fs_alloc_sectors_slow(count, hint);
+  }
+
+  if(start != FS_INVALID_SECTOR) {
+    __atomic_store_n(&group_table.rotor, 
+                     (size_t)start + count, 
+                     __ATOMIC_RELAXED);
+  }
+
+  return start;
+}
+
+/*
+ * fs_alloc_sector_near() - This function allocates a sector as close as 
+ *                          possible after the hint
+ *
+ * If the hint is invalid, we continue from where the last allocation ended
+ *
+ * Returns FS_INVALID_SECTOR if allocation failed
+ */
+sector_t fs_alloc_sector_near(Storage *disk_p, sector_t hint) {
+  if(hint == FS_INVALID_SECTOR || 
+     hint < context.free_start_sector || 
+     hint >= context.free_end_sector) {
+    hint = (sector_t)__atomic_load_n(&group_table.rotor, __ATOMIC_RELAXED);
+  }
+
+  return fs_alloc_sectors(disk_p, 1, hint);
+}
+
+/*
+ * fs_alloc_sector() - This function allocates a new sector
+ *
+ * The sector is taken from the magazine of the calling thread, which is 
+ * refilled with a run of sectors from its group if it is empty. Sectors 
+ * reserved for delayed allocation are not allocated
+ *
+ * Returns 0 if allocation failed (0 is not a valid block ID)
+ */
+sector_t fs_alloc_sector(Storage *disk_p) {
+  // EARLY RETURN
+  if(fs_delalloc_can_alloc(1) == 0) {
+    return FS_INVALID_SECTOR;
+  }
+
+  Magazine *magazine_p = fs_magazine_get();
+  if(magazine_p->sector_count == 0) {
+    fs_magazine_refill_sector(disk_p, magazine_p);
+  }
+
+  // EARLY RETURN
+  if(magazine_p->sector_count == 0) {
+    return FS_INVALID_SECTOR;
+  }
+
+  magazine_p->sector_count--;
+  __atomic_fetch_sub(&free_sector_total, 1, __ATOMIC_RELAXED);
+  return magazine_p->sector_list[magazine_p->sector_count];
+}
+
+/*
+ * fs_group_get_hint() - This function returns the allocation hint for new
+ *                       data of an inode
+ *
+ * Data is placed in the group of the inode, after the last allocation in 
+ * that group
+ */
+sector_t fs_group_get_hint(inode_id_t inode) {
+  AllocGroup *group_p = group_table.group_p + fs_group_of_inode(inode);
+  pthread_mutex_lock(&group_p->lock);
+  const size_t hint = group_p->rotor;
+  pthread_mutex_unlock(&group_p->lock);
+
+  return (sector_t)hint;
+}
+
+/*
+ * fs_free_sectors() - This function frees a run of contiguous sectors
+ *
+ * The run is split at group boundaries, and each piece is merged with the 
+ * free extents before and after it in its group if they are adjacent. 
+ * Freeing a sector that is already free is a fatal error
+ */
+void fs_free_sectors(Storage *disk_p, sector_t start, sector_count_t count) {
+  assert(count != 0);
+  assert(start >= context.free_start_sector);
+  assert((size_t)start + count <= context.free_end_sector);
+  size_t current = start;
+  const size_t end = (size_t)start + count;
+  while(current < end) {
+    AllocGroup *group_p = group_table.group_p + fs_group_of_sector(current);
+    const size_t piece_end = (end < group_p->end) ? end : group_p->end;
+    pthread_mutex_lock(&group_p->lock);
+    fs_free_map_insert(&group_p->map, 
+                       (sector_t)current, 
+                       (sector_count_t)(piece_end - current));
+    group_p->free_sector_count += piece_end - current;
+    __atomic_fetch_add(&free_sector_total, 
+                       piece_end - current, 
+                       __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&group_p->lock);
+    current = piece_end;
+  }
+
+  return;
+}
+
+/*
+ * fs_free_sector() - This function frees a sector.
+ *
+ * The sector is put into the magazine of the calling thread, and the oldest
+ * sectors are returned to the groups if the magazine is full. Freeing a 
+ * sector that is already in the magazine is a fatal error
+ */
+void fs_free_sector(Storage *disk_p, sector_t sector) {
+  assert(sector >= context.free_start_sector);
+  assert(sector < context.free_end_sector);
+  Magazine *magazine_p = fs_magazine_get();
+  for(size_t i = 0;i < magazine_p->sector_count;i++) {
+    if(magazine_p->sector_list[i] == sector) {
+      fatal_error("Double free of sector range %u (1 sectors)", 
+                  (uint32_t)sector);
+    }
+  }
+
+  if(magazine_p->sector_count == FS_MAGAZINE_SIZE) {
+    fs_magazine_spill_sector(disk_p, magazine_p, FS_MAGAZINE_BATCH);
+  }
+  magazine_p->sector_list[magazine_p->sector_count] = sector;
+  magazine_p->sector_count++;
+  __atomic_fetch_add(&free_sector_total, 1, __ATOMIC_RELAXED);
+
+  return;
+}
+
+/*
+ * fs_count_free_sectors() - This function returns the number of free sectors
+ *                           in all groups and magazines
+ *
+ * The total is kept in a single counter, which is updated by other threads,
+ * so the result is a snapshot. No lock is taken, because this is called on
+ * the allocation path while sectors are reserved for delayed allocation
+ */
+size_t fs_count_free_sectors() {
+  return __atomic_load_n(&free_sector_total, __ATOMIC_RELAXED);
+}
+
+/*
+ * fs_count_free_extents() - This function returns the number of extents in 
+ *                           the on-disk free extent map
+ *
+ * Extents that touch at a group boundary are counted once, because they are
+ * merged when the map is written back
+ */
+size_t fs_count_free_extents() {
+  size_t count = 0;
+  size_t prev_end = 0;
+  for(size_t i = 0;i < group_table.count;i++) {
+    const FreeMap *map_p = &group_table.group_p[i].map;
+    for(size_t j = 0;j < map_p->count;j++) {
+      if(map_p->extent_p[j].start != prev_end || count == 0) {
+        count++;
+      }
+      prev_end = (size_t)map_p->extent_p[j].start + map_p->extent_p[j].count;
+    }
+  }
+
+  return count;
+}
+
+/*
+ * fs_is_sector_free() - This function returns whether a sector in the file 
+ *                       storage is in the free extent map
+ */
+int fs_is_sector_free(sector_t sector) {
+  AllocGroup *group_p = group_table.group_p + fs_group_of_sector(sector);
+  pthread_mutex_lock(&group_p->lock);
+  const size_t index = fs_free_map_find(&group_p->map, sector);
+  const int ret = (index < group_p->map.count && 
+                   group_p->map.extent_p[index].start <= sector);
+  pthread_mutex_unlock(&group_p->lock);
+
+  return ret;
+}
+
+/*
+ * fs_group_is_dirty() - This function returns whether the free extent map
+ *                       of any group is newer than the on-disk copy
+ */
+int fs_group_is_dirty() {
+  for(size_t i = 0;i < group_table.count;i++) {
+    if(group_table.group_p[i].map.dirty == 1) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * fs_group_clear_dirty() - This function marks the free extent maps of all
+ *                          groups as clean
+ */
+void fs_group_clear_dirty() {
+  for(size_t i = 0;i < group_table.count;i++) {
+    group_table.group_p[i].map.dirty = 0;
+  }
+
+  return;
+}
+
+/*
+ * fs_load_free_map() - This function loads the free extent map from the disk
+ *
+ * The map sectors are read using a single multi-sector request, and the 
+ * extents are split into the maps of the allocation groups
+ */
+void fs_load_free_map(Storage *disk_p) {
+  const sector_t map_start = super_block.fmap_start;
+  const sector_count_t map_size = super_block.fmap_size;
+  const sector_count_t map_count = super_block.fmap_count;
+
+  FreeExtent *extent_p = malloc((size_t)map_size * disk_p->sector_size);
+  if(extent_p == NULL) {
+    fatal_error("Failed to allocate the free extent map");
+  }
+  assert(map_count <= 
+         (size_t)map_size * disk_p->sector_size / sizeof(FreeExtent));
+  read_lba_multi(disk_p, map_start, map_size, extent_p);
+
+  fs_group_init();
+  for(size_t i = 0;i < map_count;i++) {
+    fs_free_sectors(disk_p, extent_p[i].start, extent_p[i].count);
+  }
+  fs_group_clear_dirty();
+  free(extent_p);
+
+  return;
+}
+
+/*
+ * fs_store_free_map() - This function writes the free extent map back to 
+ *                       the disk
+ *
+ * Extents of all groups are merged into the single on-disk map. The extent 
+ * count is only updated in the resident super block
+ */
+void fs_store_free_map(Storage *disk_p) {
+  const size_t map_bytes = \
+    (size_t)super_block.fmap_size * disk_p->sector_size;
+  const size_t capacity = map_bytes / sizeof(FreeExtent);
+  // Clear the unused part such that the on-disk map is deterministic
+  FreeExtent *extent_p = calloc(1, map_bytes);
+  if(extent_p == NULL) {
+    fatal_error("Failed to allocate the free extent map");
+  }
+
+  size_t count = 0;
+  fs_group_lock_all();
+  for(size_t i = 0;i < group_table.count;i++) {
+    const FreeMap *map_p = &group_table.group_p[i].map;
+    for(size_t j = 0;j < map_p->count;j++) {
+      const FreeExtent *current_p = map_p->extent_p + j;
+      if(count != 0 && 
+         (size_t)extent_p[count - 1].start + extent_p[count - 1].count == 
+           current_p->start) {
+        extent_p[count - 1].count += current_p->count;
+        continue;
+      }
+      if(count == capacity) {
+        fatal_error("Free extent map overflow");
+      }
+      extent_p[count++] = *current_p;
+    }
+    group_table.group_p[i].map.dirty = 0;
+  }
+  fs_group_unlock_all();
+
+  super_block.fmap_count = (sector_count_t)count;
+  super_block_dirty = 1;
+  write_lba_multi(disk_p, 
+                  super_block.fmap_start, 
+                  super_block.fmap_size, 
+                  extent_p);
+  free(extent_p);
+
+  return;
+}
+
+/*
+ * fs_convert_free_list() - This function converts the free list of an old
+ *                          image into the free extent map
+ *
+ * The free list is drained into a bitmap, which is then turned into extents.
+ * The map sectors are allocated from the file storage using best-fit, and 
+ * the super block is upgraded to the current version
+ */
+void fs_convert_free_list(Storage *disk_p) {
+  info("Converting the free list into the free extent map");
+  uint8_t *free_bitmap = calloc(context.free_sector_count, sizeof(uint8_t));
+  if(free_bitmap == NULL) {
+    fatal_error("Failed to allocate the free sector bitmap");
+  }
+
+  sector_t sector;
+  while((sector = fs_alloc_sector_free_list(disk_p)) != FS_INVALID_SECTOR) {
+    assert(sector >= context.free_start_sector);
+    assert(sector < context.free_end_sector);
+    free_bitmap[sector - context.free_start_sector] = 1;
+  }
+
+  const size_t map_size = \
+    fs_get_free_map_size(disk_p, context.free_sector_count);
+  fs_group_init();
+  context.features |= FS_FEATURE_FREE_EXTENT;
+
+  for(size_t i = 0;i < context.free_sector_count;i++) {
+    if(free_bitmap[i] == 0) {
+      continue;
+    }
+    // Start of a run of free sectors
+    size_t j = i + 1;
+    while(j < context.free_sector_count && free_bitmap[j] == 1) {
+      j++;
+    }
+    fs_free_sectors(disk_p, 
+                    (sector_t)(context.free_start_sector + i), 
+                    (sector_count_t)(j - i));
+    i = j;
+  }
+  free(free_bitmap);
+
+  const sector_t map_start = \
+    fs_alloc_sectors(disk_p, (sector_count_t)map_size, FS_INVALID_SECTOR);
+  if(map_start == FS_INVALID_SECTOR) {
+    fatal_error("Not enough contiguous space to convert the free list");
+  }
+
+  super_block.signature[FS_SIG_VERSION_INDEX] = FS_SIG_VERSION;
+  super_block.features = context.features;
+  super_block.rsize = 0;
+  super_block.fmap_start = map_start;
+  super_block.fmap_size = (sector_count_t)map_size;
+  super_block.free_array.nfree = 0;
+  super_block.free_array.free[0] = FS_INVALID_SECTOR;
+  fs_store_free_map(disk_p);
+  fs_store_super_block(disk_p);
+  buffer_flush_all_no_rm(disk_p);
+
+  info("  Free extents: %lu; map sectors: %lu (at sector %u)", 
+       fs_count_free_extents(), 
+       map_size,
+       (uint32_t)map_start);
+
+  return;
+}
+
+/*
+ * fs_sync() - This function writes all in-memory file system state back to
+ *             the disk
+ *
+ * This includes data waiting for delayed allocation, dirty cached inodes, 
+ * sectors and inodes in magazines, the free extent map, the super block and
+ * all dirty buffers. Inodes stay in the inode cache, and buffers in the 
+ * buffer pool. The free sector and inode counters in the super block are 
+ * refreshed as well.
+ * Magazines must not be used by other threads at the same time
+ */
+void fs_sync(Storage *disk_p) {
+  fs_delalloc_flush(disk_p);
+  fs_icache_sync(disk_p);
+  fs_magazine_drain(disk_p);
+  if(fs_group_is_dirty() == 1) {
+    fs_store_free_map(disk_p);
+  }
+  // Magazines are drained, so the group counters are exact
+  const size_t free_sector_count = fs_count_free_sectors();
+  if((context.features & FS_FEATURE_SUMMARY) && 
+     (super_block.nfree_sector != free_sector_count || 
+      super_block.nfree_inode != inode_free_count)) {
+    super_block.nfree_sector = (sector_count_t)free_sector_count;
+    super_block.nfree_inode = (inode_count_t)inode_free_count;
+    super_block_dirty = 1;
+  }
+  if(super_block_dirty == 1) {
+    fs_store_super_block(disk_p);
+  }
+
+  buffer_flush_all_no_rm(disk_p);
+
+  return;
+}
+
+/*
+ * fs_inode_init_upto() - This function initializes inode sectors until the 
+ *                        given number of sectors are initialized
+ *
+ * The sectors are written before the high-water mark in the super block is 
+ * moved, such that the mark never covers an uninitialized sector
+ */
+void fs_inode_init_upto(Storage *disk_p, size_t count) {
+  // EARLY RETURN
+  if(count <= context.inode_init_sector_count) {
+    return;
+  }
+
+  assert(count <= context.inode_sector_count);
+  fs_write_inode_sectors(disk_p, 
+                         context.inode_start_sector + 
+                           context.inode_init_sector_count, 
+                         count - context.inode_init_sector_count);
+  context.inode_init_sector_count = (sector_count_t)count;
+  super_block.iinit = (sector_count_t)count;
+  super_block_dirty = 1;
+
+  return;
+}
+
+/*
+ * fs_inode_init_step() - This function initializes at most the given number
+ *                        of inode sectors after the high-water mark
+ *
+ * This is meant to be called when the file system is idle, such that the 
+ * inode table is eventually initialized. Returns the number of sectors that
+ * are still not initialized
+ */
+size_t fs_inode_init_step(Storage *disk_p, size_t max_count) {
+  size_t count = context.inode_sector_count - context.inode_init_sector_count;
+  if(count > max_count) {
+    count = max_count;
+  }
+  fs_inode_init_upto(disk_p, context.inode_init_sector_count + count);
+
+  return context.inode_sector_count - context.inode_init_sector_count;
+}
+
+/*
+ * fs_load_inode_sector() - This function loads the sector an inode is in
+ *                          and returns the pointer to that inode
+ *
+ * Note that this function does not check whether the inode number is
+ * valid or not (it may be out of range if programming error happens)
+ *
+ * If write_flag is 1, then we load the sector for write. Otherwise load it
+ * for read.
+ *
+ * Note that we do not pin the inode. The caller should be responsible for this
+ *
+ * If the inode is in the inode cache, the cached copy is returned instead,
+ * because it is the latest one. The caller uses fs_pin() and fs_set_dirty()
+ * on the returned pointer, which work for both
+ */
+Inode *fs_load_inode_sector(Storage *disk_p, inode_id_t inode, int write_flag) {
+  sector_t sector_num = inode / context.inode_per_sector;
+  size_t offset = inode % context.inode_per_sector;
+  // Inode sectors after the high-water mark are initialized on first use
+  if(sector_num >= context.inode_init_sector_count) {
+    fs_inode_init_upto(disk_p, sector_num + 1);
+  }
+  sector_num += (FS_SB_SECTOR + 1);
+
+  ICacheEntry *entry_p = fs_icache_find(inode);
+  // EARLY RETURN
+  if(entry_p != NULL) {
+    if(write_flag == 1) {
+      entry_p->dirty = 1;
+    }
+    return &entry_p->inode;
+  }
+
+  Inode *inode_p = NULL;
+  if(write_flag == 1) {
+    inode_p = (Inode *)read_lba_for_write(disk_p, sector_num);
+  } else {
+    inode_p = (Inode *)read_lba(disk_p, sector_num);
+  }
+
+  return inode_p + offset;
+}
+
+// Number of inodes in each word of the inode bitmap
+#define FS_INODE_MAP_WORD_BITS 64
+
+// This is the in-memory inode allocation bitmap. Bit i is set if inode i is
+// in use, or if it is free in a magazine. Bits after the last inode are 
+// always set, such that they are never considered free
+//
+// The bitmap is built from the inode sectors the first time it is needed
+// after the file system is loaded, and kept up-to-date by fs_alloc_inode()
+// and fs_free_inode(). Magazines only hold inodes while the bitmap is 
+// valid, so they are empty whenever it is built
+typedef struct {
+  uint64_t *bits_p;
+  size_t word_count;
+  // Scanning for free inodes continues from this word
+  size_t rotor;
+  // Whether the bitmap has been built for the current file system
+  int valid;
+} InodeMap;
+
+InodeMap inode_map;
+
+/*
+ * fs_inode_map_reset() - This function invalidates the inode bitmap
+ *
+ * It will be rebuilt the next time it is used
+ */
+void fs_inode_map_reset() {
+  free(inode_map.bits_p);
+  memset(&inode_map, 0x00, sizeof(InodeMap));
+
+  return;
+}
+
+/*
+ * fs_inode_map_set() - This function sets or clears the bit of an inode
+ *
+ * The free inode count of the inode's group is updated if the bit changes.
+ * Bits and counts are updated atomically, because the groups sharing a word
+ * may be locked by different threads. Does nothing if the bitmap has not 
+ * been built
+ *
+ * Returns 1 if the bit is changed, 0 otherwise
+ */
+int fs_inode_map_set(inode_id_t inode, int in_use) {
+  // EARLY RETURN
+  if(inode_map.valid == 0) {
+    return 0;
+  }
+
+  assert(inode < context.total_inode_count);
+  const uint64_t mask = 1ULL << (inode % FS_INODE_MAP_WORD_BITS);
+  uint64_t *word_p = inode_map.bits_p + inode / FS_INODE_MAP_WORD_BITS;
+  uint64_t old_word;
+  if(in_use == 1) {
+    old_word = __atomic_fetch_or(word_p, mask, __ATOMIC_RELAXED);
+  } else {
+    old_word = __atomic_fetch_and(word_p, ~mask, __ATOMIC_RELAXED);
+  }
+
+  // EARLY RETURN
+  if(((old_word & mask) != 0) == (in_use == 1)) {
+    return 0;
+  } else if(group_table.count == 0) {
+    return 1;
+  }
+
+  AllocGroup *group_p = group_table.group_p + fs_group_of_inode(inode);
+  if(in_use == 1) {
+    __atomic_fetch_sub(&group_p->free_inode_count, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_add(&group_p->free_inode_count, 1, __ATOMIC_RELAXED);
+  }
+
+  return 1;
+}
+
+/*
+ * fs_inode_map_build() - This function builds the inode bitmap by scanning
+ *                        the inode sectors once
+ *
+ * Inode sectors are read in batches using multi-sector requests, bypassing
+ * the buffer pool
+ */
+void fs_inode_map_build(Storage *disk_p) {
+  fs_inode_map_reset();
+  inode_map.word_count = \
+    (context.total_inode_count + FS_INODE_MAP_WORD_BITS - 1) / 
+      FS_INODE_MAP_WORD_BITS;
+  // Start with all ones, and clear bits of inodes that are free
+  inode_map.bits_p = malloc(inode_map.word_count * sizeof(uint64_t));
+  uint8_t *batch_p = malloc(FS_IO_BATCH_MAX * disk_p->sector_size);
+  if(inode_map.bits_p == NULL || batch_p == NULL) {
+    fatal_error("Failed to allocate the inode bitmap");
+  }
+  memset(inode_map.bits_p, 0xFF, inode_map.word_count * sizeof(uint64_t));
+  inode_map.valid = 1;
+  for(size_t i = 0;i < group_table.count;i++) {
+    group_table.group_p[i].free_inode_count = 0;
+  }
+
+  // Inodes in sectors that are not yet initialized are free
+  for(size_t i = (size_t)context.inode_init_sector_count * 
+                   context.inode_per_sector;
+      i < context.total_inode_count;
+      i++) {
+    fs_inode_map_set((inode_id_t)i, 0);
+  }
+
+  inode_id_t inode = 0;
+  for(sector_t i = 0;i < context.inode_init_sector_count;i += FS_IO_BATCH_MAX) {
+    size_t count = context.inode_init_sector_count - i;
+    if(count > FS_IO_BATCH_MAX) {
+      count = FS_IO_BATCH_MAX;
+    }
+
+    read_lba_multi(disk_p, context.inode_start_sector + i, count, batch_p);
+    const Inode *inode_p = (const Inode *)batch_p;
+    for(size_t j = 0;j < count * context.inode_per_sector;j++) {
+      if((inode_p[j].flags & FS_INODE_IN_USE) == 0) {
+        fs_inode_map_set(inode, 0);
+      }
+      inode++;
+    }
+  }
+
+  free(batch_p);
+
+  return;
+}
+
+/*
+ * fs_inode_map_scan() - This function finds up to max_count free inodes
+ *
+ * The scan starts at the rotor and checks 64 inodes at a time: full words
+ * are skipped with a single comparison, and free bits are extracted with
+ * count-trailing-zero. The rotor is left at the word where the scan stops,
+ * such that the next scan does not revisit full words
+ *
+ * Returns the number of inodes found
+ */
+int fs_inode_map_scan(inode_id_t *inode_list, int max_count) {
+  assert(inode_map.valid == 1);
+  int count = 0;
+  const size_t start = inode_map.rotor;
+  for(size_t i = 0;i < inode_map.word_count && count < max_count;i++) {
+    const size_t word = (start + i) % inode_map.word_count;
+    uint64_t free_bits = ~inode_map.bits_p[word];
+    while(free_bits != 0 && count < max_count) {
+      const int bit = __builtin_ctzll(free_bits);
+      free_bits &= (free_bits - 1);
+      inode_list[count] = (inode_id_t)(word * FS_INODE_MAP_WORD_BITS + bit);
+      count++;
+    }
+
+    inode_map.rotor = word;
+  }
+
+  return count;
+}
+
+/*
+ * fs_inode_map_find() - This function returns the first free inode in 
+ *                       [first, end)
+ *
+ * Returns end if all inodes in the range are in use
+ */
+size_t fs_inode_map_find(size_t first, size_t end) {
+  assert(inode_map.valid == 1);
+  size_t i = first;
+  while(i < end) {
+    const size_t word = i / FS_INODE_MAP_WORD_BITS;
+    const uint64_t free_bits = \
+      ~inode_map.bits_p[word] >> (i % FS_INODE_MAP_WORD_BITS);
+    if(free_bits != 0) {
+      i += __builtin_ctzll(free_bits);
+      break;
+    }
+
+    i = (word + 1) * FS_INODE_MAP_WORD_BITS;
+  }
+
+  return (i < end) ? i : end;
+}
+
+/*
+ * fill_inode_free_array() - This function fills the inode free array
+ *
+ * Free inodes are found using the inode bitmap, which is built on the first 
+ * call after the file system is loaded. This does not read any inode sector
+ * once the bitmap is built.
+ *
+ * The array in the resident super block is filled. The caller should hold
+ * the inode depot lock
+ */
+void fill_inode_free_array(Storage *disk_p) {
+  // Only call this function when the inode array is empty
+  assert(super_block.ninode == 0);
+
+  if(inode_map.valid == 0) {
+    fs_inode_map_build(disk_p);
+  }
+
+  // It can hold 100 inodes
+  inode_id_t free_inode_list[FS_FREE_ARRAY_MAX];
+  int count = fs_inode_map_scan(free_inode_list, FS_FREE_ARRAY_MAX);
+
+  // Then update the super block
+  super_block.ninode = count;
+  // Just copy the inodes we have in the list
+  memcpy(super_block.inode, 
+         free_inode_list, 
+         sizeof(free_inode_list[0]) * count);
+  super_block_dirty = 1;
+
+  return;
+}
+
+/*
+ * fs_init_new_inode() - This function initializes a newly allocated inode
+ *
+ * This function will not set the type, size and time of the inode. But it
+ * will always set the nlinks field to 1
+ */
+void fs_init_new_inode(Storage *disk_p, inode_id_t inode) {
+  fs_map_cache_invalidate(inode);
+  // Load the sector that holds the inode, and make it dirty because we 
+  // are writing into this inode
+  Inode *inode_p = \
+    fs_load_inode_sector(disk_p, inode, FS_LOAD_INODE_SECTOR_WRITE);
+  assert((inode_p->flags & FS_INODE_IN_USE) == 0);
+  // Clear its previous content
+  memset(inode_p, 0x0, sizeof(Inode));
+  // Mark it as in-use
+  inode_p->flags |= FS_INODE_IN_USE;
+  // This is the only field we initialize
+  inode_p->nlinks = 1;
+  __atomic_fetch_sub(&inode_free_count, 1, __ATOMIC_RELAXED);
+
+  return;
+}
+
+/*
+ * fs_magazine_refill_inode() - This function refills an empty magazine with
+ *                              up to a batch of inodes from the super block
+ *
+ * The inodes at the end of the inode free array are moved in the same order,
+ * such that they are allocated in the same order as from the array. Each 
+ * inode is marked in use in the bitmap as it is moved. Inodes that are 
+ * already marked, i.e. allocated by fs_alloc_inode_near() or already moved
+ * into a magazine, are stale entries of the array and are dropped
+ */
+void fs_magazine_refill_inode(Storage *disk_p, Magazine *magazine_p) {
+  assert(magazine_p->inode_count == 0);
+  pthread_mutex_lock(&inode_depot_lock);
+  if(inode_map.valid == 0) {
+    fs_inode_map_build(disk_p);
+  }
+
+  inode_id_t inode_list[FS_MAGAZINE_BATCH];
+  size_t count = 0;
+  while(count < FS_MAGAZINE_BATCH) {
+    // If the array is empty, we just fill it first
+    if(super_block.ninode == 0) {
+      fill_inode_free_array(disk_p);
+      if(super_block.ninode == 0) {
+        break;
+      }
+    }
+
+    super_block.ninode--;
+    super_block_dirty = 1;
+    const inode_id_t inode = super_block.inode[super_block.ninode];
+    if(fs_inode_map_set(inode, 1) == 1) {
+      inode_list[count++] = inode;
+    }
+  }
+  pthread_mutex_unlock(&inode_depot_lock);
+
+  // The last inode of the array is allocated first
+  for(size_t i = 0;i < count;i++) {
+    magazine_p->inode_list[i] = inode_list[count - 1 - i];
+  }
+  magazine_p->inode_count = count;
+
+  return;
+}
+
+/*
+ * fs_magazine_spill_inode() - This function returns the given number of 
+ *                             oldest inodes in a magazine to the super block
+ *
+ * Inodes that do not fit into the inode free array are discarded, because 
+ * they are free in the inode sectors anyway. All of them are marked free in
+ * the bitmap again
+ */
+void fs_magazine_spill_inode(Storage *disk_p, 
+                             Magazine *magazine_p, 
+                             size_t count) {
+  assert(count <= magazine_p->inode_count);
+  pthread_mutex_lock(&inode_depot_lock);
+  for(size_t i = 0;i < count;i++) {
+    const inode_id_t inode = magazine_p->inode_list[i];
+    if(super_block.ninode != FS_FREE_ARRAY_MAX) {
+      super_block.inode[super_block.ninode] = inode;
+      super_block.ninode++;
+      super_block_dirty = 1;
+    }
+    fs_inode_map_set(inode, 0);
+  }
+  pthread_mutex_unlock(&inode_depot_lock);
+
+  magazine_p->inode_count -= count;
+  memmove(magazine_p->inode_list, 
+          magazine_p->inode_list + count, 
+          magazine_p->inode_count * sizeof(inode_id_t));
+
+  return;
+}
+
+/*
+ * fs_magazine_release() - This function returns the content of the magazine
+ *                         of an exiting thread to the depot
+ *
+ * This is the destructor of the magazine key. The magazine could then be 
+ * used by a new thread. Spilling only changes the depot in memory, so the 
+ * storage is not needed
+ */
+void fs_magazine_release(void *arg) {
+  Magazine *magazine_p = (Magazine *)arg;
+  pthread_mutex_lock(&magazine_lock);
+  fs_magazine_spill_sector(NULL, magazine_p, magazine_p->sector_count);
+  if(magazine_p->inode_count != 0) {
+    fs_magazine_spill_inode(NULL, magazine_p, magazine_p->inode_count);
+  }
+  magazine_p->in_use = 0;
+  pthread_mutex_unlock(&magazine_lock);
+
+  return;
+}
+
+/*
+ * fs_magazine_reset() - This function empties all magazines without 
+ *                       returning their content
+ *
+ * This is called when a file system is loaded, because the content belongs
+ * to the previous one
+ */
+void fs_magazine_reset() {
+  pthread_mutex_lock(&magazine_lock);
+  for(Magazine *magazine_p = magazine_list_p;
+      magazine_p != NULL;
+      magazine_p = magazine_p->next_p) {
+    magazine_p->sector_count = 0;
+    magazine_p->inode_count = 0;
+  }
+  pthread_mutex_unlock(&magazine_lock);
+
+  return;
+}
+
+/*
+ * fs_magazine_drain() - This function returns the content of all magazines
+ *                       to the depot
+ *
+ * The magazines must not be used by other threads at the same time
+ */
+void fs_magazine_drain(Storage *disk_p) {
+  pthread_mutex_lock(&magazine_lock);
+  for(Magazine *magazine_p = magazine_list_p;
+      magazine_p != NULL;
+      magazine_p = magazine_p->next_p) {
+    fs_magazine_spill_sector(disk_p, magazine_p, magazine_p->sector_count);
+    if(magazine_p->inode_count != 0) {
+      fs_magazine_spill_inode(disk_p, magazine_p, magazine_p->inode_count);
+    }
+  }
+  pthread_mutex_unlock(&magazine_lock);
+
+  return;
+}
+
+/*
+ * fs_alloc_inode() - This function allocates an unused inode
+ *
+ * The inode is taken from the magazine of the calling thread, which is 
+ * refilled from the inode free array in the super block if it is empty. The
+ * array itself is refilled from the inode bitmap. Inodes in the magazine are
+ * already marked in use in the bitmap, so they are known to be free without
+ * reading the inode sector
+ *
+ * The new inode is initialized through the buffer pool, so this function 
+ * must not run in several threads at the same time
+ *
+ * This function returns the inode number. (-1) means allocation failure
+ */
+inode_id_t fs_alloc_inode(Storage *disk_p) {
+  Magazine *magazine_p = fs_magazine_get();
+  if(magazine_p->inode_count == 0) {
+    fs_magazine_refill_inode(disk_p, magazine_p);
+  }
+
+  // EARLY RETURN
+  // If the magazine is still empty, then we could not find any more inodes
+  if(magazine_p->inode_count == 0) {
+    return FS_INVALID_INODE;
+  }
+
+  magazine_p->inode_count--;
+  const inode_id_t ret = magazine_p->inode_list[magazine_p->inode_count];
+  fs_init_new_inode(disk_p, ret);
+
+  return ret;
+}
+
+/*
+ * fs_group_find_dir() - This function returns the group for a new directory
+ *
+ * Directories are spread over the groups, such that their files are spread
+ * as well: we use the group with the most free sectors among those that 
+ * have free inodes. The counters are read without locks, because this is 
+ * only a heuristic
+ */
+size_t fs_group_find_dir() {
+  size_t ret = 0;
+  size_t max_count = 0;
+  for(size_t i = 0;i < group_table.count;i++) {
+    const AllocGroup *group_p = group_table.group_p + i;
+    const size_t free_count = \
+      __atomic_load_n(&group_p->free_sector_count, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&group_p->free_inode_count, __ATOMIC_RELAXED) != 0 &&
+       free_count > max_count) {
+      ret = i;
+      max_count = free_count;
+    }
+  }
+
+  return ret;
+}
+
+/*
+ * fs_alloc_inode_near() - This function allocates an unused inode for a new
+ *                         file in the given parent directory
+ *
+ * Regular files are placed in the group of the parent, and directories in 
+ * the group chosen by fs_group_find_dir(). If the group has no free inode, 
+ * the next groups are tried. Only the group being searched is locked, and 
+ * the inode free array in the super block is not used
+ *
+ * This function returns the inode number. (-1) means allocation failure
+ */
+inode_id_t fs_alloc_inode_near(Storage *disk_p, inode_id_t parent, int is_dir) {
+  if(inode_map.valid == 0) {
+    fs_inode_map_build(disk_p);
+  }
+
+  size_t first = 0;
+  if(is_dir == 1) {
+    first = fs_group_find_dir();
+  } else if(parent != FS_INVALID_INODE) {
+    first = fs_group_of_inode(parent);
+  }
+
+  inode_id_t ret = FS_INVALID_INODE;
+  for(size_t i = 0;i < group_table.count && ret == FS_INVALID_INODE;i++) {
+    AllocGroup *group_p = group_table.group_p + (first + i) % group_table.count;
+    pthread_mutex_lock(&group_p->lock);
+    size_t inode = fs_inode_map_find(group_p->inode_rotor, group_p->inode_end);
+    if(inode == group_p->inode_end) {
+      inode = fs_inode_map_find(group_p->inode_start, group_p->inode_rotor);
+      if(inode == group_p->inode_rotor) {
+        inode = group_p->inode_end;
+      }
+    }
+    if(inode != group_p->inode_end) {
+      ret = (inode_id_t)inode;
+      fs_inode_map_set(ret, 1);
+      group_p->inode_rotor = inode + 1;
+    }
+    pthread_mutex_unlock(&group_p->lock);
+  }
+
+  if(ret != FS_INVALID_INODE) {
+    fs_init_new_inode(disk_p, ret);
+  }
+
+  return ret;
+}
+
+/*
+ * fs_free_inode() - This function frees an inode
+ *
+ * The inode is put into the magazine of the calling thread. If the magazine
+ * is full, the oldest inodes are moved to the inode free array in the sb, or
+ * discarded if the array is full as well. Because the allocation information
+ * is stored in the inode itself, we do not need to precisely track the 
+ * inode usage in the sb. The bit of the inode in the bitmap stays set while
+ * it is in the magazine
+ *
+ * Like fs_alloc_inode(), this must not run in several threads at the same 
+ * time
+ */
+void fs_free_inode(Storage *disk_p, inode_id_t inode) {
+  // Magazines only hold inodes while the bitmap is valid
+  if(inode_map.valid == 0) {
+    fs_inode_map_build(disk_p);
+  }
+  Magazine *magazine_p = fs_magazine_get();
+  if(magazine_p->inode_count == FS_MAGAZINE_SIZE) {
+    fs_magazine_spill_inode(disk_p, magazine_p, FS_MAGAZINE_BATCH);
+  }
+  magazine_p->inode_list[magazine_p->inode_count] = inode;
+  magazine_p->inode_count++;
+
+  // Load the sector containing this inode, and set it as dirty
+  Inode *inode_p = \
+    fs_load_inode_sector(disk_p, inode, FS_LOAD_INODE_SECTOR_WRITE);
+  // Make sure it is an allocated inode
+  assert(inode_p->flags & FS_INODE_IN_USE);
+  // Mask off the inodes
+  inode_p->flags &= (~FS_INODE_IN_USE);
+  __atomic_fetch_add(&inode_free_count, 1, __ATOMIC_RELAXED);
+  fs_map_cache_invalidate(inode);
+  fs_dcache_invalidate_inode(inode);
+  fs_delalloc_drop(inode, 0);
+  fs_dir_slot_invalidate(inode);
+
+  return;
+}
+
+/*
+ * fs_load_summary() - This function loads the free inode counter when the
+ *                     file system is loaded
+ *
+ * With FS_FEATURE_SUMMARY, the counter is taken from the super block. The 
+ * free sector counter in the super block is checked against the free extent
+ * map, which is already loaded, and corrected if it does not match. 
+ * Otherwise, or if the counter is out of range, the inode bitmap is built 
+ * to count free inodes
+ */
+void fs_load_summary(Storage *disk_p) {
+  // EARLY RETURN
+  if((context.features & FS_FEATURE_SUMMARY) == 0 || 
+     super_block.nfree_inode > context.total_inode_count) {
+    fs_inode_map_build(disk_p);
+    inode_free_count = 0;
+    for(size_t i = 0;i < group_table.count;i++) {
+      inode_free_count += group_table.group_p[i].free_inode_count;
+    }
+    return;
+  }
+
+  inode_free_count = super_block.nfree_inode;
+  const size_t free_sector_count = fs_count_free_sectors();
+  if(super_block.nfree_sector != free_sector_count) {
+    info("  Free sector counter %lu does not match the map (%lu)", 
+         (size_t)super_block.nfree_sector, 
+         free_sector_count);
+    super_block.nfree_sector = (sector_count_t)free_sector_count;
+    super_block_dirty = 1;
+  }
+
+  return;
+}
+
+// This is the result of fs_statfs(). Sector counts only include the file 
+// storage
+typedef struct {
+  size_t sector_size;
+  size_t total_sector_count;
+  size_t free_sector_count;
+  size_t total_inode_count;
+  size_t free_inode_count;
+} StatFs;
+
+/*
+ * fs_statfs() - This function reports the size and free space of the loaded
+ *               file system
+ *
+ * No sector is read. The free sector count is the sum of the group counters
+ * and the magazines, and the free inode count is a single counter, so the 
+ * cost does not depend on the size of the file system
+ */
+void fs_statfs(Storage *disk_p, StatFs *stat_p) {
+  stat_p->sector_size = disk_p->sector_size;
+  stat_p->total_sector_count = context.free_sector_count;
+  stat_p->free_sector_count = fs_count_free_sectors();
+  stat_p->total_inode_count = context.total_inode_count;
+  stat_p->free_inode_count = \
+    __atomic_load_n(&inode_free_count, __ATOMIC_RELAXED);
+
+  return;
+}
+
+/*
+ * fs_statfs_image() - This function reports the size and free space of a 
+ *                     file system that is not loaded
+ *
+ * Only the super block is read, directly from the storage. The counters are
+ * those written by the last fs_sync(). Returns FS_ERR_NO_SUMMARY if the 
+ * file system does not keep the counters, in which case fs_recount() 
+ * should be run on it first
+ */
+int fs_statfs_image(Storage *disk_p, StatFs *stat_p) {
+  assert(sizeof(SuperBlock) <= disk_p->sector_size);
+  SuperBlock *sb_p = malloc(disk_p->sector_size);
+  if(sb_p == NULL) {
+    fatal_error("Failed to allocate the super block buffer");
+  }
+  disk_p->read(disk_p, FS_SB_SECTOR, sb_p);
+  if(memcmp(sb_p->signature, FS_SIG, FS_SIG_VERSION_INDEX) != 0) {
+    fatal_error("Invalid file system signature");
+  }
+
+  int ret = FS_ERR_NO_SUMMARY;
+  if(sb_p->signature[FS_SIG_VERSION_INDEX] >= 1 && 
+     (sb_p->features & FS_FEATURE_SUMMARY)) {
+    stat_p->sector_size = disk_p->sector_size;
+    stat_p->total_sector_count = sb_p->fsize;
+    stat_p->free_sector_count = sb_p->nfree_sector;
+    stat_p->total_inode_count = \
+      (size_t)sb_p->isize * (disk_p->sector_size / sizeof(Inode));
+    stat_p->free_inode_count = sb_p->nfree_inode;
+    ret = FS_SUCCESS;
+  }
+  free(sb_p);
+
+  return ret;
+}
+
+/*
+ * fs_recount() - This function recounts free inodes and repairs the 
+ *                counters in the super block
+ *
+ * This is meant to be called right after the file system is loaded. The 
+ * file system is synced first, because the inode table is scanned directly 
+ * from the storage. FS_FEATURE_SUMMARY is turned on, and the counters are 
+ * written.
+ *
+ * Returns the number of counters on the disk that were wrong or missing
+ */
+size_t fs_recount(Storage *disk_p) {
+  // The on-disk counters are overwritten by fs_sync()
+  SuperBlock on_disk;
+  memcpy(&on_disk, read_lba(disk_p, FS_SB_SECTOR), sizeof(SuperBlock));
+  fs_sync(disk_p);
+
+  fs_inode_map_build(disk_p);
+  size_t free_inode_count = 0;
+  for(size_t i = 0;i < group_table.count;i++) {
+    free_inode_count += group_table.group_p[i].free_inode_count;
+  }
+  size_t ret = 2;
+  if(context.features & FS_FEATURE_SUMMARY) {
+    ret = (on_disk.nfree_sector != fs_count_free_sectors()) + 
+          (on_disk.nfree_inode != free_inode_count);
+  }
+  if(free_inode_count != inode_free_count) {
+    info("  Free inode counter %lu does not match the table (%lu)", 
+         inode_free_count, 
+         free_inode_count);
+  }
+
+  inode_free_count = free_inode_count;
+  context.features |= FS_FEATURE_SUMMARY;
+  super_block.features = context.features;
+  super_block_dirty = 1;
+  fs_sync(disk_p);
+
+  return ret;
+}
+
+// This is a list of sector runs to be freed. Consecutive sectors are merged
+// into the last run when added, such that a sequentially allocated file 
+// only needs a few runs
+typedef struct {
+  FreeExtent *run_p;
+  size_t count;
+  size_t capacity;
+} SectorRunList;
+
+/*
+ * fs_run_list_add_run() - This function adds a run of sectors to the run list
+ */
+void fs_run_list_add_run(SectorRunList *list_p, 
+                         sector_t start, 
+                         sector_count_t count) {
+  assert(start != FS_INVALID_SECTOR);
+  assert(count != 0);
+  if(list_p->count != 0) {
+    FreeExtent *last_p = &list_p->run_p[list_p->count - 1];
+    // EARLY RETURN
+    if(last_p->start + last_p->count == start && 
+       (size_t)last_p->count + count <= (sector_count_t)-1) {
+      last_p->count += count;
+      return;
+    }
+  }
+
+  if(list_p->count == list_p->capacity) {
+    list_p->capacity = (list_p->capacity == 0) ? 16 : list_p->capacity * 2;
+    list_p->run_p = realloc(list_p->run_p, 
+                            list_p->capacity * sizeof(FreeExtent));
+    if(list_p->run_p == NULL) {
+      fatal_error("Failed to allocate the sector run list");
+    }
+  }
+
+  list_p->run_p[list_p->count].start = start;
+  list_p->run_p[list_p->count].count = count;
+  list_p->count++;
+
+  return;
+}
+
+/*
+ * fs_run_list_add() - This function adds a sector to the run list
+ */
+void fs_run_list_add(SectorRunList *list_p, sector_t sector) {
+  fs_run_list_add_run(list_p, sector, 1);
+  return;
+}
+
+int fs_run_list_cmp(const void *a, const void *b) {
+  const sector_t left = ((const FreeExtent *)a)->start;
+  const sector_t right = ((const FreeExtent *)b)->start;
+  return (left < right) ? -1 : (left > right);
+}
+
+/*
+ * fs_run_list_free() - This function frees all sectors in the run list, and 
+ *                      the list itself
+ *
+ * Runs are sorted and adjacent runs are merged first, such that each 
+ * extent is returned to the free extent map only once
+ */
+void fs_run_list_free(Storage *disk_p, SectorRunList *list_p) {
+  // EARLY RETURN
+  if(list_p->count == 0) {
+    free(list_p->run_p);
+    memset(list_p, 0x00, sizeof(SectorRunList));
+    return;
+  }
+
+  qsort(list_p->run_p, list_p->count, sizeof(FreeExtent), fs_run_list_cmp);
+  size_t i = 0;
+  while(i < list_p->count) {
+    const sector_t start = list_p->run_p[i].start;
+    size_t count = list_p->run_p[i].count;
+    i++;
+    while(i < list_p->count && 
+          list_p->run_p[i].start == start + count && 
+          count + list_p->run_p[i].count <= (sector_count_t)-1) {
+      count += list_p->run_p[i].count;
+      i++;
+    }
+    fs_free_sectors(disk_p, start, (sector_count_t)count);
+  }
+
+  free(list_p->run_p);
+  memset(list_p, 0x00, sizeof(SectorRunList));
+
+  return;
+}
+
+/*
+ * fs_truncate_indir() - This function collects data sectors mapped by an 
+ *                       indirection sector, starting from the given slot
+ *
+ * If the slot is 0, the indirection sector is also collected, and it is not
+ * changed. Otherwise the collected slots are reset to invalid sector
+ */
+void fs_truncate_indir(Storage *disk_p, 
+                       sector_t indir_sector, 
+                       size_t first, 
+                       SectorRunList *list_p) {
+  sector_t *data_p;
+  if(first == 0) {
+    data_p = (sector_t *)read_lba(disk_p, indir_sector);
+  } else {
+    data_p = (sector_t *)read_lba_for_write(disk_p, indir_sector);
+  }
+
+  for(size_t i = first;i < context.id_per_indir_sector;i++) {
+    if(data_p[i] != FS_INVALID_SECTOR) {
+      fs_run_list_add(list_p, data_p[i]);
+      if(first != 0) {
+        data_p[i] = FS_INVALID_SECTOR;
+      }
+    }
+  }
+
+  if(first == 0) {
+    fs_run_list_add(list_p, indir_sector);
+  }
+
+  return;
+}
+
+/*
+ * fs_truncate_tree() - This function collects sectors mapped by an 
+ *                      indirection sector with the given number of levels,
+ *                      starting from the given logical sector under it
+ *
+ * If the logical sector is 0, the indirection sector is also collected, and
+ * it is not changed. Otherwise slots of lower level sectors that are 
+ * collected entirely are reset to invalid sector
+ */
+void fs_truncate_tree(Storage *disk_p, 
+                      sector_t indir_sector, 
+                      size_t level,
+                      size_t first, 
+                      SectorRunList *list_p) {
+  // EARLY RETURN
+  if(level == 1) {
+    fs_truncate_indir(disk_p, indir_sector, first, list_p);
+    return;
+  }
+
+  sector_t *data_p;
+  if(first == 0) {
+    data_p = (sector_t *)read_lba(disk_p, indir_sector);
+  } else {
+    data_p = (sector_t *)read_lba_for_write(disk_p, indir_sector);
+  }
+  buffer_pin(disk_p, data_p);
+
+  // Number of logical sectors under each slot
+  const size_t span = fs_get_indir_span(level - 1);
+  for(size_t i = first / span;i < context.id_per_indir_sector;i++) {
+    const sector_t child_sector = data_p[i];
+    if(child_sector == FS_INVALID_SECTOR) {
+      continue;
+    }
+
+    const size_t base = i * span;
+    const size_t child_first = (first > base) ? (first - base) : 0;
+    fs_truncate_tree(disk_p, child_sector, level - 1, child_first, list_p);
+    if(child_first == 0 && first != 0) {
+      data_p[i] = FS_INVALID_SECTOR;
+    }
+  }
+
+  if(first == 0) {
+    fs_run_list_add(list_p, indir_sector);
+  }
+  buffer_unpin(disk_p, data_p);
+
+  return;
+}
+
+/*
+ * fs_truncate_extent() - This function collects sectors of an extent-mapped
+ *                        file after the given logical sector
+ *
+ * Extents are removed or shortened. If the remaining extents fit into the 
+ * addr. array, they are moved back and the extent sector is also collected.
+ * The file becomes a small file if no extent is left
+ */
+void fs_truncate_extent(Storage *disk_p, 
+                        Inode *inode_p, 
+                        size_t first, 
+                        SectorRunList *list_p) {
+  size_t count;
+  Extent *extent_p = fs_extent_list(disk_p, inode_p, &count);
+  size_t index = fs_extent_search(extent_p, count, first);
+  // The extent before the index may cross the new end
+  if(index > 0) {
+    Extent *prev_p = &extent_p[index - 1];
+    if(prev_p->logical + prev_p->count > first) {
+      const size_t keep = first - prev_p->logical;
+      if(keep == 0) {
+        index--;
+      } else {
+        fs_run_list_add_run(list_p, 
+                            (sector_t)(prev_p->physical + keep), 
+                            (sector_count_t)(prev_p->count - keep));
+        prev_p->count = (sector_t)keep;
+      }
+    }
+  }
+  for(size_t i = index;i < count;i++) {
+    fs_run_list_add_run(list_p, 
+                        extent_p[i].physical, 
+                        (sector_count_t)extent_p[i].count);
+  }
+
+  count = index;
+  fs_set_dirty(disk_p, extent_p);
+  const sector_t extent_sector = inode_p->addr[FS_EXTENT_SECTOR_SLOT];
+  if(extent_sector != FS_INVALID_SECTOR && count <= FS_EXTENT_INODE_MAX) {
+    memcpy(inode_p->addr, extent_p, count * sizeof(Extent));
+    inode_p->addr[FS_EXTENT_SECTOR_SLOT] = FS_INVALID_SECTOR;
+    fs_run_list_add(list_p, extent_sector);
+  }
+  if(inode_p->addr[FS_EXTENT_SECTOR_SLOT] == FS_INVALID_SECTOR) {
+    memset((Extent *)inode_p->addr + count, 
+           0x00, 
+           (FS_EXTENT_INODE_MAX - count) * sizeof(Extent));
+  }
+  inode_p->addr[FS_EXTENT_COUNT_SLOT] = (sector_t)count;
+  // A file without any extent has the same layout as a small one
+  if(count == 0) {
+    fs_reset_addr(inode_p);
+    inode_p->flags &= (~FS_INODE_EXTENT);
+  }
+
+  return;
+}
+
+/*
+ * fs_truncate() - This function changes the size of a file
+ *
+ * If the file is shrunk, all data and indirection sectors that are entirely
+ * beyond the new end are freed. The addr. array and indirection tree are 
+ * walked once, and only indirection sectors are read, so the cost is 
+ * proportional to the size of the mapping rather than the data. Freed 
+ * sectors are merged into runs and returned to the free extent map as a 
+ * batch. The remaining bytes of the last sector are zeroed, such that they 
+ * read as zero if the file is extended again
+ *
+ * If the file is extended, the new range is a hole. A directory loses its 
+ * index when it is shrunk. A new index is built by fs_insert_dir_entry() 
+ * once the directory grows to FS_DIR_INDEX_MIN_SECTORS sectors again
+ *
+ * An inline file stays inline unless it is extended beyond the inline area.
+ * Returns FS_ERR_NO_SPACE if it could not be moved into a sector, and 
+ * FS_SUCCESS otherwise. This function pins the inode in the buffer
+ */
+int fs_truncate(Storage *disk_p, Inode *inode_p, size_t new_size) {
+  assert(new_size <= FS_FILE_SIZE_MAX);
+  fs_pin(disk_p, inode_p);
+  const size_t sector_size = disk_p->sector_size;
+  const size_t old_size = fs_get_file_size(inode_p);
+  if(fs_is_file_inline(inode_p) == 1) {
+    // EARLY RETURN
+    if(new_size <= FS_INLINE_SIZE_MAX) {
+      if(new_size < old_size) {
+        memset((uint8_t *)inode_p->addr + new_size, 
+               0x00, 
+               old_size - new_size);
+      }
+      // An empty file no longer needs to be inline
+      if(new_size == 0) {
+        inode_p->flags &= (~FS_INODE_INLINE);
+      }
+      fs_set_file_size(inode_p, new_size);
+      fs_set_dirty(disk_p, inode_p);
+      fs_unpin(disk_p, inode_p);
+      return FS_SUCCESS;
+    } else if(fs_inline_expand(disk_p, inode_p) == 0) {
+      fs_unpin(disk_p, inode_p);
+      return FS_ERR_NO_SPACE;
+    }
+  }
+
+  // EARLY RETURN
+  if(new_size >= old_size) {
+    fs_set_file_size(inode_p, new_size);
+    fs_set_dirty(disk_p, inode_p);
+    fs_unpin(disk_p, inode_p);
+    return FS_SUCCESS;
+  }
+
+  const inode_id_t inode = fs_get_inode_id(disk_p, inode_p);
+  if(fs_get_file_type(inode_p) == FS_INODE_TYPE_DIR) {
+    fs_dir_index_drop(disk_p, inode_p);
+    fs_dcache_invalidate_inode(inode);
+    fs_dir_slot_invalidate(inode);
+  }
+
+  // Zero the tail of the last sector
+  const size_t tail_offset = new_size % sector_size;
+  if(tail_offset != 0) {
+    const size_t offset = new_size - tail_offset;
+    const sector_t sector = fs_get_file_sector(disk_p, inode_p, offset);
+    uint8_t *data_p;
+    if(sector != FS_INVALID_SECTOR) {
+      data_p = read_lba_for_write(disk_p, sector);
+    } else {
+      data_p = fs_delalloc_find(inode, (sector_t)(offset / sector_size));
+    }
+    if(data_p != NULL) {
+      memset(data_p + tail_offset, 0x00, sector_size - tail_offset);
+    }
+  }
+
+  // Number of logical sectors that are kept
+  const size_t keep = (new_size + sector_size - 1) / sector_size;
+  if(inode != FS_INVALID_INODE) {
+    fs_delalloc_drop(inode, (sector_t)keep);
+    fs_map_cache_invalidate(inode);
+  }
+
+  SectorRunList list;
+  memset(&list, 0x00, sizeof(SectorRunList));
+  if(fs_is_file_extent(inode_p) == 1) {
+    fs_truncate_extent(disk_p, inode_p, keep, &list);
+  } else if(fs_is_file_large(inode_p) == 0) {
+    for(size_t i = keep;i < FS_ADDR_ARRAY_MAX;i++) {
+      if(inode_p->addr[i] != FS_INVALID_SECTOR) {
+        fs_run_list_add(&list, inode_p->addr[i]);
+        inode_p->addr[i] = FS_INVALID_SECTOR;
+      }
+    }
+  } else {
+    int empty = 1;
+    for(size_t i = 0;i < FS_ADDR_ARRAY_MAX;i++) {
+      size_t base;
+      const size_t level = fs_get_slot_level(i, &base);
+      if(inode_p->addr[i] == FS_INVALID_SECTOR) {
+        continue;
+      } else if(base + fs_get_indir_span(level) <= keep) {
+        empty = 0;
+        continue;
+      }
+
+      const size_t first = (keep > base) ? (keep - base) : 0;
+      fs_truncate_tree(disk_p, inode_p->addr[i], level, first, &list);
+      if(first == 0) {
+        inode_p->addr[i] = FS_INVALID_SECTOR;
+      } else {
+        empty = 0;
+      }
+    }
+
+    // A large file without any sector has the same layout as a small one
+    if(empty == 1) {
+      inode_p->flags &= (~FS_INODE_LARGE);
+    }
+  }
+
+  fs_run_list_free(disk_p, &list);
+  fs_set_file_size(inode_p, new_size);
+  fs_set_dirty(disk_p, inode_p);
+
+  fs_unpin(disk_p, inode_p);
+  return FS_SUCCESS;
+}
+
+/*
+ * fs_release_inode() - This function drops a link to an inode, and frees the
+ *                      inode and all its sectors if it was the last link
+ */
+void fs_release_inode(Storage *disk_p, inode_id_t inode) {
+  Inode *inode_p = \
+    fs_load_inode_sector(disk_p, inode, FS_LOAD_INODE_SECTOR_WRITE);
+  assert(inode_p->flags & FS_INODE_IN_USE);
+  fs_pin(disk_p, inode_p);
+  if(inode_p->nlinks > 1) {
+    inode_p->nlinks--;
+  } else {
+    inode_p->nlinks = 0;
+    fs_truncate(disk_p, inode_p, 0);
+    fs_free_inode(disk_p, inode);
+  }
+
+  fs_unpin(disk_p, inode_p);
+  return;
+}
+
+/*
+ * fs_unlink() - This function removes a name from a directory, and releases
+ *               the inode it refers to
+ *
+ * The error codes are those of fs_free_dir_entry(). The caller should check
+ * that a directory is empty before unlinking it.
+ *
+ * This function pins the inode in the buffer
+ */
+int fs_unlink(Storage *disk_p, Inode *inode_p, const char *name) {
+  fs_pin(disk_p, inode_p);
+  const inode_id_t child = fs_lookup_dir_entry(disk_p, inode_p, name);
+  int ret = fs_free_dir_entry(disk_p, inode_p, name);
+  if(ret == FS_SUCCESS) {
+    assert(child != FS_INVALID_INODE);
+    fs_release_inode(disk_p, child);
+  }
+
+  fs_unpin(disk_p, inode_p);
+  return ret;
+}
+
+/////////////////////////////////////////////////////////////////////
+// File System Check
+/////////////////////////////////////////////////////////////////////
+
+// The inode table and directories are read in requests of this size
+#define FS_FSCK_CHUNK_SIZE (4 * 1024 * 1024)
+// Maximum number of worker threads of a check
+#define FS_FSCK_THREAD_MAX 64
+// Only this many problems are printed. The rest are only counted
+#define FS_FSCK_REPORT_MAX 64
+
+// Flags of the per-inode state
+#define FS_FSCK_INODE_IN_USE    0x01
+#define FS_FSCK_INODE_DIR       0x02
+#define FS_FSCK_INODE_REACHABLE 0x04
+
+// This is the result of a check. Each problem is counted once
+typedef struct {
+  // Number of in-use inodes and directories
+  size_t inode_count;
+  size_t dir_count;
+  // Number of sectors of the file storage that are referenced or free
+  size_t used_sector_count;
+  size_t free_sector_count;
+  // Sectors that are referenced more than once, or both referenced and free
+  size_t dup_sector_count;
+  // Sectors that are neither referenced nor free
+  size_t leaked_sector_count;
+  // References to sectors outside of the file storage and bad free extents
+  size_t bad_sector_count;
+  // Inodes with invalid flags or size
+  size_t bad_inode_count;
+  // Directory entries that refer to an invalid or free inode
+  size_t bad_entry_count;
+  // In-use inodes that could not be reached from the root directory
+  size_t unreachable_inode_count;
+  // Inodes whose link count is not the number of names referring to them
+  size_t bad_link_count;
+  // Counters in the super block that do not match the free sectors or inodes
+  size_t bad_summary_count;
+  // Sum of all problems above
+  size_t error_count;
+} FsckResult;
+
+// This is a directory found in the inode table. Its data sectors are read
+// after the entire table is scanned
+typedef struct {
+  inode_id_t inode;
+  size_t sector_count;
+  // Data sectors in logical order. Holes are invalid sectors
+  sector_t *sector_p;
+} FsckDir;
+
+// This is a named entry from a directory to an inode
+typedef struct {
+  inode_id_t parent;
+  inode_id_t child;
+} FsckEdge;
+
+// This is the state shared by all workers of a check
+typedef struct {
+  Storage *disk_p;
+  SuperBlock sb;
+  // One bit for each sector of the file storage
+  uint8_t *used_bitmap;
+  uint8_t *dup_bitmap;
+  uint8_t *free_bitmap;
+  // FS_FSCK_INODE_* flags, link count and the number of names of each inode
+  uint8_t *inode_state_p;
+  halfword_t *nlinks_p;
+  uint32_t *ref_count_p;
+  // Phase 0 scans free space and the inode table, and phase 1 scans 
+  // directories
+  int phase;
+  // Work is handed out by atomically advancing these cursors. The first 
+  // worker that takes the free space task scans the free extent map or the
+  // free list, and then joins the others on the inode table
+  int free_taken;
+  size_t next_chunk;
+  size_t chunk_count;
+  size_t chunk_sector_count;
+  FsckDir *dir_p;
+  size_t dir_count;
+  size_t next_dir;
+  // Protects the result and the report count
+  pthread_mutex_t lock;
+  size_t report_count;
+  FsckResult result;
+} FsckState;
+
+// This is the private state of a worker thread
+typedef struct {
+  FsckState *state_p;
+  pthread_t thread;
+  // Buffers of chunk reads and each level of indirection sectors
+  uint8_t *chunk_p;
+  sector_t *indir_p[FS_INDIR_LEVEL_MAX];
+  // Directories found by this worker
+  FsckDir *dir_p;
+  size_t dir_count;
+  size_t dir_capacity;
+  // Named entries found by this worker
+  FsckEdge *edge_p;
+  size_t edge_count;
+  size_t edge_capacity;
+} FsckWorker;
+
+/*
+ * fs_fsck_report() - This function counts a problem, and prints it unless 
+ *                    too many have been printed
+ */
+void fs_fsck_report(FsckState *state_p, size_t *count_p, const char *fmt, ...) {
+  pthread_mutex_lock(&state_p->lock);
+  (*count_p)++;
+  state_p->result.error_count++;
+  if(state_p->report_count < FS_FSCK_REPORT_MAX) {
+    va_list args;
+    va_start(args, fmt);
+    fputs("  fsck: ", stderr);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+  }
+  state_p->report_count++;
+  pthread_mutex_unlock(&state_p->lock);
+
+  return;
+}
+
+/*
+ * fs_fsck_test_bit() - Returns whether the bit of a storage sector is set
+ */
+int fs_fsck_test_bit(const uint8_t *bitmap, sector_t sector) {
+  const size_t index = sector - context.free_start_sector;
+  return (bitmap[index / 8] >> (index % 8)) & 0x1;
+}
+
+/*
+ * fs_fsck_claim() - This function marks a sector as referenced
+ *
+ * Bits are set atomically, such that a sector referenced by two workers at 
+ * the same time is found as well. Returns 1 if the sector could be read as
+ * an indirection or directory sector, i.e. it is inside of the file storage
+ */
+int fs_fsck_claim(FsckState *state_p, inode_id_t inode, sector_t sector) {
+  // EARLY RETURN
+  if(sector < context.free_start_sector || sector >= context.free_end_sector) {
+    fs_fsck_report(state_p, 
+                   &state_p->result.bad_sector_count, 
+                   "Inode %u refers to sector %u outside of the file storage",
+                   (uint32_t)inode, 
+                   (uint32_t)sector);
+    return 0;
+  }
+
+  const size_t index = sector - context.free_start_sector;
+  const uint8_t mask = (uint8_t)(0x1 << (index % 8));
+  const uint8_t old = \
+    __atomic_fetch_or(&state_p->used_bitmap[index / 8], mask, __ATOMIC_RELAXED);
+  if(old & mask) {
+    __atomic_fetch_or(&state_p->dup_bitmap[index / 8], mask, __ATOMIC_RELAXED);
+  }
+
+  return 1;
+}
+
+/*
+ * fs_fsck_mark_free() - This function marks a run of free sectors
+ *
+ * Only the free space task writes the bitmap of free sectors. Returns 0 if 
+ * the run is invalid or already free, in which case it is not marked
+ */
+int fs_fsck_mark_free(FsckState *state_p, sector_t start, size_t count) {
+  // EARLY RETURN
+  if(count == 0 || 
+     start < context.free_start_sector || 
+     start + count > context.free_end_sector) {
+    fs_fsck_report(state_p, 
+                   &state_p->result.bad_sector_count, 
+                   "Free run of %lu sectors at %u is outside of the storage",
+                   count, 
+                   (uint32_t)start);
+    return 0;
+  }
+
+  for(size_t i = 0;i < count;i++) {
+    const size_t index = start + i - context.free_start_sector;
+    const uint8_t mask = (uint8_t)(0x1 << (index % 8));
+    // EARLY RETURN
+    if(state_p->free_bitmap[index / 8] & mask) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.dup_sector_count, 
+                     "Sector %u is free more than once",
+                     (uint32_t)(start + i));
+      return 0;
+    }
+    state_p->free_bitmap[index / 8] |= mask;
+  }
+
+  return 1;
+}
+
+/*
+ * fs_fsck_scan_free() - This function marks all free sectors, using either 
+ *                       the free extent map or the chained free list
+ *
+ * The extent map is read with a single request. Extents must be sorted and 
+ * must not overlap. The free list is a chain, and is read sector by sector
+ */
+void fs_fsck_scan_free(FsckWorker *worker_p) {
+  FsckState *state_p = worker_p->state_p;
+  Storage *disk_p = state_p->disk_p;
+  const SuperBlock *sb_p = &state_p->sb;
+  if(context.features & FS_FEATURE_FREE_EXTENT) {
+    const size_t map_bytes = (size_t)sb_p->fmap_size * disk_p->sector_size;
+    // EARLY RETURN
+    if(sb_p->fmap_count > map_bytes / sizeof(FreeExtent) || 
+       (size_t)sb_p->fmap_start + sb_p->fmap_size > disk_p->sector_count) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.bad_sector_count, 
+                     "Invalid free extent map (%u extents at sector %u)",
+                     (uint32_t)sb_p->fmap_count, 
+                     (uint32_t)sb_p->fmap_start);
+      return;
+    }
+
+    FreeExtent *extent_p = malloc(map_bytes);
+    if(extent_p == NULL) {
+      fatal_error("Failed to allocate the free extent map");
+    }
+    disk_p->read_multi(disk_p, sb_p->fmap_start, sb_p->fmap_size, extent_p);
+    size_t prev_end = context.free_start_sector;
+    for(size_t i = 0;i < sb_p->fmap_count;i++) {
+      if(extent_p[i].start < prev_end) {
+        fs_fsck_report(state_p, 
+                       &state_p->result.bad_sector_count, 
+                       "Free extent %lu at sector %u is out of order",
+                       i, 
+                       (uint32_t)extent_p[i].start);
+      } else if(fs_fsck_mark_free(state_p, 
+                                  extent_p[i].start, 
+                                  extent_p[i].count) == 1) {
+        prev_end = (size_t)extent_p[i].start + extent_p[i].count;
+      }
+    }
+    free(extent_p);
+  } else {
+    FreeArray free_array = sb_p->free_array;
+    while(1) {
+      if(free_array.nfree >= FS_FREE_ARRAY_MAX) {
+        fs_fsck_report(state_p, 
+                       &state_p->result.bad_sector_count, 
+                       "Invalid free array of %u sectors", 
+                       (uint32_t)free_array.nfree);
+        break;
+      }
+      for(size_t i = 1;i <= free_array.nfree;i++) {
+        fs_fsck_mark_free(state_p, free_array.free[i], 1);
+      }
+
+      // The sector that holds the next part of the list is also free. If
+      // it was already free, then the chain has a loop
+      const sector_t next = free_array.free[0];
+      if(next == FS_INVALID_SECTOR || 
+         fs_fsck_mark_free(state_p, next, 1) == 0) {
+        break;
+      }
+      disk_p->read(disk_p, next, worker_p->indir_p[0]);
+      memcpy(&free_array, worker_p->indir_p[0], sizeof(FreeArray));
+    }
+  }
+
+  return;
+}
+
+/*
+ * fs_fsck_walk_indir() - This function claims the sectors of an indirection
+ *                        sector with the given number of levels
+ *
+ * The logical sector of the first slot is given. Level 1 is a leaf whose 
+ * slots are data sectors. Data sectors of directories are also stored into 
+ * the sector list of the directory
+ */
+void fs_fsck_walk_indir(FsckWorker *worker_p, 
+                        inode_id_t inode, 
+                        sector_t indir_sector, 
+                        size_t base,
+                        FsckDir *dir_p, 
+                        size_t level) {
+  FsckState *state_p = worker_p->state_p;
+  // EARLY RETURN
+  if(fs_fsck_claim(state_p, inode, indir_sector) == 0) {
+    return;
+  }
+
+  // Each level has its own buffer, since upper levels are still being
+  // iterated
+  sector_t *data_p = worker_p->indir_p[level - 1];
+  state_p->disk_p->read(state_p->disk_p, indir_sector, data_p);
+  const size_t span = fs_get_indir_span(level - 1);
+  for(size_t i = 0;i < context.id_per_indir_sector;i++) {
+    const sector_t sector = data_p[i];
+    const size_t logical = base + i;
+    if(sector == FS_INVALID_SECTOR) {
+      continue;
+    } else if(level > 1) {
+      fs_fsck_walk_indir(worker_p, 
+                         inode, 
+                         sector, 
+                         base + i * span, 
+                         dir_p, 
+                         level - 1);
+    } else if(fs_fsck_claim(state_p, inode, sector) == 1 && 
+              dir_p != NULL && logical < dir_p->sector_count) {
+      dir_p->sector_p[logical] = sector;
+    }
+  }
+
+  return;
+}
+
+/*
+ * fs_fsck_check_extents() - This function checks the extents of an 
+ *                           extent-mapped file and claims their sectors
+ *
+ * Extents must be sorted, must not be empty or overlap, and must be inside
+ * the file storage. Directories are never extent-mapped
+ */
+void fs_fsck_check_extents(FsckWorker *worker_p, 
+                           inode_id_t inode, 
+                           const Inode *inode_p) {
+  FsckState *state_p = worker_p->state_p;
+  const size_t count = inode_p->addr[FS_EXTENT_COUNT_SLOT];
+  const sector_t extent_sector = inode_p->addr[FS_EXTENT_SECTOR_SLOT];
+  const Extent *extent_p = (const Extent *)inode_p->addr;
+  size_t capacity = FS_EXTENT_INODE_MAX;
+  if(fs_get_file_type(inode_p) != FS_INODE_TYPE_FILE) {
+    fs_fsck_report(state_p, 
+                   &state_p->result.bad_inode_count, 
+                   "Inode %u is extent-mapped but not a regular file", 
+                   (uint32_t)inode);
+  }
+  if(extent_sector != FS_INVALID_SECTOR) {
+    // EARLY RETURN
+    if(fs_fsck_claim(state_p, inode, extent_sector) == 0) {
+      return;
+    }
+    state_p->disk_p->read(state_p->disk_p, 
+                          extent_sector, 
+                          worker_p->indir_p[0]);
+    extent_p = (const Extent *)worker_p->indir_p[0];
+    capacity = context.extent_per_sector;
+  }
+
+  // EARLY RETURN
+  if(count > capacity) {
+    fs_fsck_report(state_p, 
+                   &state_p->result.bad_inode_count, 
+                   "Inode %u has %lu extents (at most %lu)", 
+                   (uint32_t)inode, 
+                   count, 
+                   capacity);
+    return;
+  }
+
+  size_t end = 0;
+  for(size_t i = 0;i < count;i++) {
+    const Extent *e_p = &extent_p[i];
+    if(e_p->count == 0 || e_p->logical < end) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.bad_inode_count, 
+                     "Inode %u has an empty or unsorted extent at %u", 
+                     (uint32_t)inode, 
+                     (uint32_t)e_p->logical);
+      continue;
+    } else if(e_p->physical < context.free_start_sector || 
+              (size_t)e_p->physical + e_p->count > context.free_end_sector) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.bad_sector_count, 
+                     "Inode %u maps %u sectors at %u outside of the storage", 
+                     (uint32_t)inode, 
+                     (uint32_t)e_p->count, 
+                     (uint32_t)e_p->physical);
+      continue;
+    }
+
+    end = (size_t)e_p->logical + e_p->count;
+    for(size_t j = 0;j < e_p->count;j++) {
+      fs_fsck_claim(state_p, inode, (sector_t)(e_p->physical + j));
+    }
+  }
+
+  return;
+}
+
+/*
+ * fs_fsck_check_inode() - This function checks an in-use inode and claims
+ *                         all its sectors
+ *
+ * Directories are added to the worker's list, and their entries are checked
+ * after the inode table is scanned
+ */
+void fs_fsck_check_inode(FsckWorker *worker_p, 
+                         inode_id_t inode, 
+                         const Inode *inode_p) {
+  FsckState *state_p = worker_p->state_p;
+  const size_t sector_size = state_p->disk_p->sector_size;
+  const size_t size = fs_get_file_size(inode_p);
+  const int is_dir = fs_get_file_type(inode_p) == FS_INODE_TYPE_DIR;
+  __atomic_fetch_add(&state_p->result.inode_count, 1, __ATOMIC_RELAXED);
+  state_p->inode_state_p[inode] = \
+    FS_FSCK_INODE_IN_USE | (is_dir ? FS_FSCK_INODE_DIR : 0);
+  state_p->nlinks_p[inode] = inode_p->nlinks;
+
+  // EARLY RETURN
+  if(fs_is_file_extent(inode_p) == 1) {
+    fs_fsck_check_extents(worker_p, inode, inode_p);
+    return;
+  } else if(inode_p->flags & FS_INODE_INLINE) {
+    if(is_dir || fs_is_file_large(inode_p) || size > FS_INLINE_SIZE_MAX) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.bad_inode_count, 
+                     "Inode %u has invalid inline data (%lu bytes)", 
+                     (uint32_t)inode, 
+                     size);
+    }
+    return;
+  }
+
+  FsckDir *dir_p = NULL;
+  if(is_dir) {
+    __atomic_fetch_add(&state_p->result.dir_count, 1, __ATOMIC_RELAXED);
+    if(size % sector_size != 0) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.bad_inode_count, 
+                     "Directory %u has a partial sector (%lu bytes)", 
+                     (uint32_t)inode, 
+                     size);
+    }
+  }
+  // Directories have no hole, so they are never larger than the file 
+  // storage. A corrupt size is reported before the sector list is 
+  // allocated, and the sectors are still claimed
+  if(is_dir && 
+     (size > FS_FILE_SIZE_MAX || 
+      size / sector_size > 
+        (size_t)(context.free_end_sector - context.free_start_sector))) {
+    fs_fsck_report(state_p, 
+                   &state_p->result.bad_inode_count, 
+                   "Directory %u is larger than the storage (%lu bytes)", 
+                   (uint32_t)inode, 
+                   size);
+  } else if(is_dir) {
+    if(worker_p->dir_count == worker_p->dir_capacity) {
+      worker_p->dir_capacity = worker_p->dir_capacity * 2 + 16;
+      worker_p->dir_p = realloc(worker_p->dir_p, 
+                                worker_p->dir_capacity * sizeof(FsckDir));
+      if(worker_p->dir_p == NULL) {
+        fatal_error("Failed to allocate the directory list");
+      }
+    }
+    dir_p = &worker_p->dir_p[worker_p->dir_count++];
+    dir_p->inode = inode;
+    dir_p->sector_count = size / sector_size;
+    dir_p->sector_p = malloc((dir_p->sector_count + 1) * sizeof(sector_t));
+    if(dir_p->sector_p == NULL) {
+      fatal_error("Failed to allocate the sector list of a directory");
+    }
+    for(size_t i = 0;i < dir_p->sector_count;i++) {
+      dir_p->sector_p[i] = FS_INVALID_SECTOR;
+    }
+  }
+
+  for(size_t i = 0;i < FS_ADDR_ARRAY_MAX;i++) {
+    const sector_t sector = inode_p->addr[i];
+    if(sector == FS_INVALID_SECTOR) {
+      continue;
+    } else if(fs_is_file_large(inode_p) == 0) {
+      if(fs_fsck_claim(state_p, inode, sector) == 1 && 
+         dir_p != NULL && i < dir_p->sector_count) {
+        dir_p->sector_p[i] = sector;
+      }
+    } else {
+      size_t base;
+      const size_t level = fs_get_slot_level(i, &base);
+      fs_fsck_walk_indir(worker_p, inode, sector, base, dir_p, level);
+    }
+  }
+
+  return;
+}
+
+/*
+ * fs_fsck_scan_inodes() - This function scans the initialized part of the 
+ *                         inode table in chunks
+ *
+ * Each chunk is read with a single request. Inode sectors after the 
+ * high-water mark of lazily initialized images are not read, because all 
+ * inodes in them are free
+ */
+void fs_fsck_scan_inodes(FsckWorker *worker_p) {
+  FsckState *state_p = worker_p->state_p;
+  Storage *disk_p = state_p->disk_p;
+  while(1) {
+    const size_t chunk = \
+      __atomic_fetch_add(&state_p->next_chunk, 1, __ATOMIC_RELAXED);
+    if(chunk >= state_p->chunk_count) {
+      break;
+    }
+
+    const size_t first = chunk * state_p->chunk_sector_count;
+    size_t count = context.inode_init_sector_count - first;
+    if(count > state_p->chunk_sector_count) {
+      count = state_p->chunk_sector_count;
+    }
+    disk_p->read_multi(disk_p, 
+                       context.inode_start_sector + first, 
+                       count, 
+                       worker_p->chunk_p);
+    const Inode *inode_p = (const Inode *)worker_p->chunk_p;
+    for(size_t i = 0;i < count * context.inode_per_sector;i++) {
+      if(inode_p[i].flags & FS_INODE_IN_USE) {
+        fs_fsck_check_inode(worker_p, 
+                            (inode_id_t)(first * context.inode_per_sector + i), 
+                            &inode_p[i]);
+      }
+    }
+  }
+
+  return;
+}
+
+/*
+ * fs_fsck_check_index() - This function checks the index header of a 
+ *                         directory and claims the sectors of the index
+ *
+ * The header is checked before the size of the table is derived from it.
+ * The table has at least one sector and is at most half full, and names in
+ * it cannot outnumber entries of the directory. The table may still be 
+ * larger than the directory needs, since empty sectors are removed without
+ * rebuilding the index, but it must be inside the file storage
+ */
+void fs_fsck_check_index(FsckWorker *worker_p, 
+                         const FsckDir *dir_p, 
+                         const DirIndexHeader *header_p) {
+  FsckState *state_p = worker_p->state_p;
+  const size_t slot_per_sector = \
+    state_p->disk_p->sector_size / sizeof(DirIndexSlot);
+  const size_t storage_count = \
+    (size_t)(context.free_end_sector - context.free_start_sector);
+  const size_t entry_max = dir_p->sector_count * context.dir_per_sector;
+  // EARLY RETURN
+  if(header_p->shift >= sizeof(size_t) * 8 || 
+     ((size_t)1 << header_p->shift) < slot_per_sector || 
+     ((size_t)1 << header_p->shift) / slot_per_sector > storage_count || 
+     (size_t)header_p->entry_count >= entry_max || 
+     (size_t)header_p->entry_count * 2 > ((size_t)1 << header_p->shift)) {
+    fs_fsck_report(state_p, 
+                   &state_p->result.bad_inode_count, 
+                   "Directory %u has an invalid index header (shift %u, "
+                   "%u names)", 
+                   (uint32_t)dir_p->inode, 
+                   (uint32_t)header_p->shift, 
+                   (uint32_t)header_p->entry_count);
+    return;
+  }
+
+  const sector_count_t count = \
+    fs_dir_index_sector_count(state_p->disk_p, header_p);
+  // EARLY RETURN
+  if(header_p->start < context.free_start_sector || 
+     (size_t)header_p->start + count > context.free_end_sector) {
+    fs_fsck_report(state_p, 
+                   &state_p->result.bad_inode_count, 
+                   "Directory %u has an index of %u sectors at %u outside "
+                   "of the storage", 
+                   (uint32_t)dir_p->inode, 
+                   (uint32_t)count, 
+                   (uint32_t)header_p->start);
+    return;
+  }
+
+  for(sector_count_t i = 0;i < count;i++) {
+    fs_fsck_claim(state_p, dir_p->inode, header_p->start + i);
+  }
+
+  return;
+}
+
+/*
+ * fs_fsck_check_entry() - This function checks a directory entry
+ *
+ * The index header in the "." entry is checked, and the sectors of the 
+ * index are claimed. Names other than "." and ".." are counted as links of
+ * the inode they refer to
+ */
+void fs_fsck_check_entry(FsckWorker *worker_p, 
+                         const FsckDir *dir_p, 
+                         size_t pos, 
+                         const DirEntry *entry_p) {
+  FsckState *state_p = worker_p->state_p;
+  const inode_id_t inode = entry_p->inode;
+  const int valid = inode < context.total_inode_count && 
+                    (state_p->inode_state_p[inode] & FS_FSCK_INODE_IN_USE);
+  if(memcmp(entry_p->name, ".", 2) == 0) {
+    if(inode != dir_p->inode) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.bad_entry_count, 
+                     "Directory %u has \".\" entry for inode %u",
+                     (uint32_t)dir_p->inode, 
+                     (uint32_t)inode);
+    }
+
+    const DirIndexHeader *header_p = (const DirIndexHeader *)entry_p->name;
+    if(pos == 0 && (header_p->flags & FS_DIR_INDEX_VALID)) {
+      fs_fsck_check_index(worker_p, dir_p, header_p);
+    }
+  } else if(memcmp(entry_p->name, "..", 3) == 0) {
+    if(valid == 0 || 
+       (state_p->inode_state_p[inode] & FS_FSCK_INODE_DIR) == 0) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.bad_entry_count, 
+                     "Directory %u has \"..\" entry for non-directory %u",
+                     (uint32_t)dir_p->inode, 
+                     (uint32_t)inode);
+    }
+  } else if(valid == 0) {
+    fs_fsck_report(state_p, 
+                   &state_p->result.bad_entry_count, 
+                   "Directory %u has entry at %lu for free inode %u",
+                   (uint32_t)dir_p->inode, 
+                   pos,
+                   (uint32_t)inode);
+  } else {
+    __atomic_fetch_add(&state_p->ref_count_p[inode], 1, __ATOMIC_RELAXED);
+    if(worker_p->edge_count == worker_p->edge_capacity) {
+      worker_p->edge_capacity = worker_p->edge_capacity * 2 + 64;
+      worker_p->edge_p = realloc(worker_p->edge_p, 
+                                 worker_p->edge_capacity * sizeof(FsckEdge));
+      if(worker_p->edge_p == NULL) {
+        fatal_error("Failed to allocate the entry list");
+      }
+    }
+    worker_p->edge_p[worker_p->edge_count].parent = dir_p->inode;
+    worker_p->edge_p[worker_p->edge_count].child = inode;
+    worker_p->edge_count++;
+  }
+
+  return;
+}
+
+/*
+ * fs_fsck_scan_dirs() - This function checks the entries of directories
+ *
+ * Runs of contiguous directory sectors are read with a single request
+ */
+void fs_fsck_scan_dirs(FsckWorker *worker_p) {
+  FsckState *state_p = worker_p->state_p;
+  Storage *disk_p = state_p->disk_p;
+  while(1) {
+    const size_t index = \
+      __atomic_fetch_add(&state_p->next_dir, 1, __ATOMIC_RELAXED);
+    if(index >= state_p->dir_count) {
+      break;
+    }
+
+    const FsckDir *dir_p = &state_p->dir_p[index];
+    size_t i = 0;
+    while(i < dir_p->sector_count) {
+      const sector_t start = dir_p->sector_p[i];
+      if(start == FS_INVALID_SECTOR) {
+        fs_fsck_report(state_p, 
+                       &state_p->result.bad_inode_count, 
+                       "Directory %u has a hole at sector %lu",
+                       (uint32_t)dir_p->inode, 
+                       i);
+        i++;
+        continue;
+      }
+
+      size_t count = 1;
+      while(i + count < dir_p->sector_count && 
+            count < FS_FSCK_CHUNK_SIZE / disk_p->sector_size && 
+            dir_p->sector_p[i + count] == start + count) {
+        count++;
+      }
+      disk_p->read_multi(disk_p, start, count, worker_p->chunk_p);
+      const DirEntry *entry_p = (const DirEntry *)worker_p->chunk_p;
+      for(size_t j = 0;j < count * context.dir_per_sector;j++) {
+        if(entry_p[j].inode != FS_INVALID_INODE) {
+          fs_fsck_check_entry(worker_p, 
+                              dir_p, 
+                              i * context.dir_per_sector + j, 
+                              &entry_p[j]);
+        }
+      }
+      i += count;
+    }
+  }
+
+  return;
+}
+
+/*
+ * fs_fsck_worker() - This is the body of a worker thread
+ *
+ * The argument is the worker. The first phase scans free space and the 
+ * inode table. After all workers finish it, the main thread starts them
+ * again to scan the directories that were found
+ */
+void *fs_fsck_worker(void *arg) {
+  FsckWorker *worker_p = (FsckWorker *)arg;
+  FsckState *state_p = worker_p->state_p;
+  if(state_p->phase == 0) {
+    if(__atomic_exchange_n(&state_p->free_taken, 1, __ATOMIC_RELAXED) == 0) {
+      fs_fsck_scan_free(worker_p);
+    }
+    fs_fsck_scan_inodes(worker_p);
+  } else {
+    fs_fsck_scan_dirs(worker_p);
+  }
+
+  return NULL;
+}
+
+/*
+ * fs_fsck_run() - This function runs the workers until they all return
+ *
+ * The last worker runs in the calling thread
+ */
+void fs_fsck_run(FsckWorker *worker_list, int thread_count) {
+  for(int i = 0;i < thread_count - 1;i++) {
+    if(pthread_create(&worker_list[i].thread, 
+                      NULL, 
+                      fs_fsck_worker, 
+                      &worker_list[i]) != 0) {
+      fatal_error("Failed to create a worker thread");
+    }
+  }
+  fs_fsck_worker(&worker_list[thread_count - 1]);
+  for(int i = 0;i < thread_count - 1;i++) {
+    pthread_join(worker_list[i].thread, NULL);
+  }
+
+  return;
+}
+
+/*
+ * fs_fsck_check_sectors() - This function compares referenced sectors with
+ *                           free sectors
+ */
+void fs_fsck_check_sectors(FsckState *state_p) {
+  for(size_t sector = context.free_start_sector;
+      sector < context.free_end_sector;
+      sector++) {
+    const int used = fs_fsck_test_bit(state_p->used_bitmap, sector);
+    const int is_free = fs_fsck_test_bit(state_p->free_bitmap, sector);
+    state_p->result.used_sector_count += used;
+    state_p->result.free_sector_count += is_free;
+    if(fs_fsck_test_bit(state_p->dup_bitmap, sector) == 1) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.dup_sector_count, 
+                     "Sector %lu is referenced more than once", 
+                     sector);
+    } else if(used == 1 && is_free == 1) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.dup_sector_count, 
+                     "Sector %lu is referenced and free", 
+                     sector);
+    } else if(used == 0 && is_free == 0) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.leaked_sector_count, 
+                     "Sector %lu is leaked", 
+                     sector);
+    }
+  }
+
+  return;
+}
+
+/*
+ * fs_fsck_check_links() - This function checks that every in-use inode is 
+ *                         reachable from the root, and has the same number 
+ *                         of links as names
+ *
+ * Named entries are grouped by the parent, and the tree is walked in 
+ * breadth-first order from the root directory
+ */
+void fs_fsck_check_links(FsckState *state_p, 
+                         FsckWorker *worker_list, 
+                         int thread_count) {
+  const size_t inode_count = context.total_inode_count;
+  size_t edge_count = 0;
+  for(int i = 0;i < thread_count;i++) {
+    edge_count += worker_list[i].edge_count;
+  }
+
+  // Children of inode i are child_p[offset_p[i]] to child_p[offset_p[i + 1]]
+  size_t *offset_p = calloc(inode_count + 1, sizeof(size_t));
+  inode_id_t *child_p = malloc((edge_count + 1) * sizeof(inode_id_t));
+  inode_id_t *queue_p = malloc((inode_count + 1) * sizeof(inode_id_t));
+  if(offset_p == NULL || child_p == NULL || queue_p == NULL) {
+    fatal_error("Failed to allocate the directory tree");
+  }
+  for(int i = 0;i < thread_count;i++) {
+    for(size_t j = 0;j < worker_list[i].edge_count;j++) {
+      offset_p[worker_list[i].edge_p[j].parent + 1]++;
+    }
+  }
+  for(size_t i = 0;i < inode_count;i++) {
+    offset_p[i + 1] += offset_p[i];
+  }
+  for(int i = 0;i < thread_count;i++) {
+    for(size_t j = 0;j < worker_list[i].edge_count;j++) {
+      const FsckEdge *edge_p = &worker_list[i].edge_p[j];
+      child_p[offset_p[edge_p->parent]++] = edge_p->child;
+    }
+  }
+  // Offsets were moved to the end of each group by the above
+  for(size_t i = inode_count;i > 0;i--) {
+    offset_p[i] = offset_p[i - 1];
+  }
+  offset_p[0] = 0;
+
+  uint8_t *state_list = state_p->inode_state_p;
+  size_t head = 0, tail = 0;
+  if((state_list[FS_ROOT_INODE] & FS_FSCK_INODE_DIR) == 0) {
+    fs_fsck_report(state_p, 
+                   &state_p->result.bad_inode_count, 
+                   "Root inode is not a directory");
+  } else {
+    state_list[FS_ROOT_INODE] |= FS_FSCK_INODE_REACHABLE;
+    queue_p[tail++] = FS_ROOT_INODE;
+  }
+  while(head < tail) {
+    const inode_id_t parent = queue_p[head++];
+    for(size_t i = offset_p[parent];i < offset_p[parent + 1];i++) {
+      const inode_id_t child = child_p[i];
+      if((state_list[child] & FS_FSCK_INODE_REACHABLE) == 0) {
+        state_list[child] |= FS_FSCK_INODE_REACHABLE;
+        queue_p[tail++] = child;
+      }
+    }
+  }
+
+  for(size_t inode = 0;inode < inode_count;inode++) {
+    if((state_list[inode] & FS_FSCK_INODE_IN_USE) == 0) {
+      continue;
+    } else if((state_list[inode] & FS_FSCK_INODE_REACHABLE) == 0) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.unreachable_inode_count, 
+                     "Inode %lu is not reachable from the root", 
+                     inode);
+    }
+
+    // The root directory has one link, which is not a name
+    const size_t expected = \
+      state_p->ref_count_p[inode] + (inode == FS_ROOT_INODE);
+    if(state_p->nlinks_p[inode] != expected) {
+      fs_fsck_report(state_p, 
+                     &state_p->result.bad_link_count, 
+                     "Inode %lu has %u links but %lu names", 
+                     inode, 
+                     (uint32_t)state_p->nlinks_p[inode], 
+                     expected);
+    }
+  }
+
+  free(offset_p);
+  free(child_p);
+  free(queue_p);
+
+  return;
+}
+
+/*
+ * fs_fsck_check_summary() - This function compares the free sector and inode
+ *                           counters in the super block with the check
+ */
+void fs_fsck_check_summary(FsckState *state_p) {
+  const size_t free_inode_count = \
+    context.total_inode_count - state_p->result.inode_count;
+  if(state_p->sb.nfree_sector != state_p->result.free_sector_count) {
+    fs_fsck_report(state_p, 
+                   &state_p->result.bad_summary_count, 
+                   "Super block has %lu free sectors but %lu are free", 
+                   (size_t)state_p->sb.nfree_sector, 
+                   state_p->result.free_sector_count);
+  }
+  if(state_p->sb.nfree_inode != free_inode_count) {
+    fs_fsck_report(state_p, 
+                   &state_p->result.bad_summary_count, 
+                   "Super block has %lu free inodes but %lu are free", 
+                   (size_t)state_p->sb.nfree_inode, 
+                   free_inode_count);
+  }
+
+  return;
+}
+
+/*
+ * fs_fsck() - This function checks the consistency of a file system
+ *
+ * The check is offline. The storage is read directly instead of through 
+ * the buffer pool, and is never written. Sectors waiting for delayed 
+ * allocation only exist in memory, so the file system should be synced 
+ * before it is checked. The context object is loaded from the super block,
+ * and restored when the check is done, so another storage could be checked
+ * while a file system is mounted.
+ *
+ * The check builds a bitmap of referenced sectors and a bitmap of free 
+ * sectors, and proceeds as follows:
+ *   1. Free space and the initialized part of the inode table are scanned
+ *      by the given number of threads in parallel. Sectors of each in-use
+ *      inode, including indirection sectors, are marked as referenced
+ *   2. Entries of the directories found in step 1 are scanned in parallel,
+ *      which also marks the sectors of directory indexes
+ *   3. Sectors that are referenced twice, or both referenced and free, and 
+ *      sectors that are neither are reported. In-use inodes that are not 
+ *      reachable from the root, or whose link count is not the number of 
+ *      names referring to them are also reported
+ *   4. With FS_FEATURE_SUMMARY, the free sector and inode counters in the
+ *      super block are compared with the result
+ *
+ * The inode table and directories are read in large sequential requests.
+ * The result is copied to the given object if it is not NULL. Returns the 
+ * number of problems found
+ */
+size_t fs_fsck(Storage *disk_p, int thread_count, FsckResult *result_p) {
+  assert(sizeof(SuperBlock) <= disk_p->sector_size);
+  FsckState state;
+  memset(&state, 0x00, sizeof(FsckState));
+  state.disk_p = disk_p;
+  uint8_t *sb_buffer = malloc(disk_p->sector_size);
+  if(sb_buffer == NULL) {
+    fatal_error("Failed to allocate the super block buffer");
+  }
+  disk_p->read(disk_p, FS_SB_SECTOR, sb_buffer);
+  memcpy(&state.sb, sb_buffer, sizeof(SuperBlock));
+  free(sb_buffer);
+  if(memcmp(state.sb.signature, FS_SIG, FS_SIG_VERSION_INDEX) != 0) {
+    fatal_error("Invalid file system signature");
+  }
+
+  const Context saved_context = context;
+  fs_load_geometry(disk_p, &state.sb);
+  if(context.total_sector_count > disk_p->sector_count) {
+    fatal_error("File system has %lu sectors but the storage has %lu", 
+                (size_t)context.total_sector_count, 
+                disk_p->sector_count);
+  } else if(context.inode_init_sector_count > context.inode_sector_count) {
+    fs_fsck_report(&state, 
+                   &state.result.bad_inode_count, 
+                   "Initialized inode sectors (%u) exceed the table (%u)",
+                   (uint32_t)context.inode_init_sector_count, 
+                   (uint32_t)context.inode_sector_count);
+    context.inode_init_sector_count = context.inode_sector_count;
+  }
+
+  if(thread_count < 1) {
+    thread_count = 1;
+  } else if(thread_count > FS_FSCK_THREAD_MAX) {
+    thread_count = FS_FSCK_THREAD_MAX;
+  }
+
+  const size_t bitmap_size = (context.free_sector_count + 7) / 8 + 1;
+  const size_t inode_count = context.total_inode_count;
+  state.used_bitmap = calloc(bitmap_size, sizeof(uint8_t));
+  state.dup_bitmap = calloc(bitmap_size, sizeof(uint8_t));
+  state.free_bitmap = calloc(bitmap_size, sizeof(uint8_t));
+  state.inode_state_p = calloc(inode_count + 1, sizeof(uint8_t));
+  state.nlinks_p = calloc(inode_count + 1, sizeof(halfword_t));
+  state.ref_count_p = calloc(inode_count + 1, sizeof(uint32_t));
+  if(state.used_bitmap == NULL || state.dup_bitmap == NULL || 
+     state.free_bitmap == NULL || state.inode_state_p == NULL || 
+     state.nlinks_p == NULL || state.ref_count_p == NULL) {
+    fatal_error("Failed to allocate the check bitmaps");
+  }
+  pthread_mutex_init(&state.lock, NULL);
+
+  // Every worker should get at least one chunk of the inode table
+  const size_t init_count = context.inode_init_sector_count;
+  state.chunk_sector_count = FS_FSCK_CHUNK_SIZE / disk_p->sector_size;
+  if(state.chunk_sector_count * thread_count > init_count) {
+    state.chunk_sector_count = (init_count + thread_count - 1) / thread_count;
+  }
+  if(state.chunk_sector_count == 0) {
+    state.chunk_sector_count = 1;
+  }
+  state.chunk_count = \
+    (init_count + state.chunk_sector_count - 1) / state.chunk_sector_count;
+
+  // Images that were converted from the free list keep the free extent map
+  // in the file storage
+  if((context.features & FS_FEATURE_FREE_EXTENT) && 
+     state.sb.fmap_start >= context.free_start_sector) {
+    for(size_t i = 0;i < state.sb.fmap_size;i++) {
+      fs_fsck_claim(&state, 
+                    FS_INVALID_INODE, 
+                    (sector_t)(state.sb.fmap_start + i));
+    }
+  }
+
+  FsckWorker *worker_list = calloc(thread_count, sizeof(FsckWorker));
+  if(worker_list == NULL) {
+    fatal_error("Failed to allocate the workers");
+  }
+  for(int i = 0;i < thread_count;i++) {
+    worker_list[i].state_p = &state;
+    worker_list[i].chunk_p = malloc(FS_FSCK_CHUNK_SIZE);
+    if(worker_list[i].chunk_p == NULL) {
+      fatal_error("Failed to allocate the buffers of a worker");
+    }
+    for(int j = 0;j < FS_INDIR_LEVEL_MAX;j++) {
+      worker_list[i].indir_p[j] = malloc(disk_p->sector_size);
+      if(worker_list[i].indir_p[j] == NULL) {
+        fatal_error("Failed to allocate the buffers of a worker");
+      }
+    }
+  }
+  fs_fsck_run(worker_list, thread_count);
+
+  // Directories found by all workers are checked in the next phase
+  for(int i = 0;i < thread_count;i++) {
+    state.dir_count += worker_list[i].dir_count;
+  }
+  state.dir_p = malloc((state.dir_count + 1) * sizeof(FsckDir));
+  if(state.dir_p == NULL) {
+    fatal_error("Failed to allocate the directory list");
+  }
+  state.dir_count = 0;
+  for(int i = 0;i < thread_count;i++) {
+    // Workers that found no directory have no list
+    if(worker_list[i].dir_count == 0) {
+      continue;
+    }
+
+    memcpy(state.dir_p + state.dir_count, 
+           worker_list[i].dir_p, 
+           worker_list[i].dir_count * sizeof(FsckDir));
+    state.dir_count += worker_list[i].dir_count;
+  }
+  state.phase = 1;
+  fs_fsck_run(worker_list, thread_count);
+
+  fs_fsck_check_sectors(&state);
+  fs_fsck_check_links(&state, worker_list, thread_count);
+  if(context.features & FS_FEATURE_SUMMARY) {
+    fs_fsck_check_summary(&state);
+  }
+  if(state.report_count > FS_FSCK_REPORT_MAX) {
+    info("  fsck: %lu more problems are not printed", 
+         state.report_count - FS_FSCK_REPORT_MAX);
+  }
+
+  for(size_t i = 0;i < state.dir_count;i++) {
+    free(state.dir_p[i].sector_p);
+  }
+  for(int i = 0;i < thread_count;i++) {
+    free(worker_list[i].chunk_p);
+    for(int j = 0;j < FS_INDIR_LEVEL_MAX;j++) {
+      free(worker_list[i].indir_p[j]);
+    }
+    free(worker_list[i].dir_p);
+    free(worker_list[i].edge_p);
+  }
+  free(worker_list);
+  free(state.dir_p);
+  free(state.used_bitmap);
+  free(state.dup_bitmap);
+  free(state.free_bitmap);
+  free(state.inode_state_p);
+  free(state.nlinks_p);
+  free(state.ref_count_p);
+  pthread_mutex_destroy(&state.lock);
+  context = saved_context;
+
+  if(result_p != NULL) {
+    memcpy(result_p, &state.result, sizeof(FsckResult));
+  }
+
+  return state.result.error_count;
+}
+
+/*
+ * fs_fsck_print() - This function prints the summary of a check
+ */
+void fs_fsck_print(const FsckResult *result_p) {
+  info("Inodes: %lu (%lu directories)", 
+       result_p->inode_count, 
+       result_p->dir_count);
+  info("Sectors: %lu used; %lu free", 
+       result_p->used_sector_count, 
+       result_p->free_sector_count);
+  info("Duplicate sectors: %lu; leaked sectors: %lu; bad sectors: %lu", 
+       result_p->dup_sector_count, 
+       result_p->leaked_sector_count, 
+       result_p->bad_sector_count);
+  info("Bad inodes: %lu; bad entries: %lu; unreachable inodes: %lu; "
+       "bad link counts: %lu", 
+       result_p->bad_inode_count, 
+       result_p->bad_entry_count, 
+       result_p->unreachable_inode_count, 
+       result_p->bad_link_count);
+  info("Bad summary counters: %lu", result_p->bad_summary_count);
+  info("Problems found: %lu", result_p->error_count);
+
+  return;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Import and Export
+/////////////////////////////////////////////////////////////////////
+
+// File data is read from the host and written to the storage in batches of
+// this size
+#define FS_IMPORT_BATCH_SIZE (16 * 1024 * 1024)
+// Number of bytes of a file read in each request when it is exported
+#define FS_EXPORT_CHUNK_SIZE (1024 * 1024)
+// Maximum number of threads reading host files
+#define FS_IMPORT_THREAD_MAX 64
+// Permission bits of the inode flags word, which match the host mode bits
+#define FS_INODE_MODE_MASK   0x01FF
+
+// This is a host file or directory to be imported
+typedef struct {
+  char *host_path;
+  char name[FS_DIR_ENTRY_NAME_MAX + 1];
+  int is_dir;
+  word_t mode;
+  size_t size;
+  inode_id_t inode;
+  // Index of the parent directory in the node list
+  size_t parent;
+  // Children of a directory are a contiguous range of the node list
+  size_t child_first;
+  size_t child_count;
+  // Data sectors of a file are a contiguous range of the sector map
+  size_t map_index;
+  size_t map_count;
+} FsImportNode;
+
+// This is a range of a file that is read into the batch buffer
+typedef struct {
+  size_t node;
+  // First logical sector and the number of sectors
+  size_t first;
+  size_t count;
+  // Sector offset in the batch buffer
+  size_t offset;
+} FsImportPiece;
+
+// This is the state of an import. Nodes are in breadth-first order, and 
+// the data sectors of all files are in the sector map in the same order
+typedef struct {
+  Storage *disk_p;
+  FsImportNode *node_p;
+  size_t node_count;
+  size_t node_capacity;
+  sector_t *sector_map;
+  size_t map_count;
+  // Pieces of the current batch, handed out by advancing the cursor
+  FsImportPiece *piece_p;
+  size_t piece_count;
+  size_t next_piece;
+  uint8_t *batch_p;
+  // Set if a host file could not be read
+  int error;
+} FsImportState;
+
+// This is a data sector of a batch and its slot in the batch buffer
+typedef struct {
+  sector_t sector;
+  size_t slot;
+} FsImportSlot;
+
+/*
+ * fs_import_add_node() - This function appends a node to the node list
+ */
+FsImportNode *fs_import_add_node(FsImportState *state_p, 
+                                 const char *host_path, 
+                                 const struct stat *stat_p) {
+  if(state_p->node_count == state_p->node_capacity) {
+    state_p->node_capacity = state_p->node_capacity * 2 + 64;
+    state_p->node_p = realloc(state_p->node_p, 
+                              state_p->node_capacity * sizeof(FsImportNode));
+    if(state_p->node_p == NULL) {
+      fatal_error("Failed to allocate the import node list");
+    }
+  }
+
+  FsImportNode *node_p = &state_p->node_p[state_p->node_count++];
+  memset(node_p, 0x00, sizeof(FsImportNode));
+  node_p->host_path = strdup(host_path);
+  if(node_p->host_path == NULL) {
+    fatal_error("Failed to allocate a host path");
+  }
+  node_p->is_dir = S_ISDIR(stat_p->st_mode);
+  node_p->mode = (word_t)(stat_p->st_mode & FS_INODE_MODE_MASK);
+  node_p->size = node_p->is_dir ? 0 : (size_t)stat_p->st_size;
+  node_p->inode = FS_INVALID_INODE;
+
+  return node_p;
+}
+
+/*
+ * fs_import_name_cmp() - Compares two host names for sorting
+ */
+int fs_import_name_cmp(const void *a, const void *b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * fs_import_scan() - This function scans a host directory tree into the 
+ *                    node list in breadth-first order
+ *
+ * Children of each directory are sorted by name. Names that are not valid
+ * in the file system, files that are too large and special files are 
+ * skipped with a warning. Returns FS_ERR_HOST_IO if the root could not be 
+ * read
+ */
+int fs_import_scan(FsImportState *state_p, const char *host_path) {
+  struct stat st;
+  // EARLY RETURN
+  if(stat(host_path, &st) != 0 || S_ISDIR(st.st_mode) == 0) {
+    info("Not a directory: %s", host_path);
+    return FS_ERR_HOST_IO;
+  }
+  fs_import_add_node(state_p, host_path, &st);
+
+  for(size_t i = 0;i < state_p->node_count;i++) {
+    if(state_p->node_p[i].is_dir == 0) {
+      continue;
+    }
+
+    DIR *dir_p = opendir(state_p->node_p[i].host_path);
+    if(dir_p == NULL) {
+      info("Could not open directory %s", state_p->node_p[i].host_path);
+      continue;
+    }
+    char **name_list = NULL;
+    size_t name_count = 0;
+    struct dirent *dirent_p;
+    while((dirent_p = readdir(dir_p)) != NULL) {
+      if(strcmp(dirent_p->d_name, ".") == 0 || 
+         strcmp(dirent_p->d_name, "..") == 0) {
+        continue;
+      }
+      name_list = realloc(name_list, (name_count + 1) * sizeof(char *));
+      if(name_list == NULL) {
+        fatal_error("Failed to allocate the host name list");
+      }
+      name_list[name_count] = strdup(dirent_p->d_name);
+      if(name_list[name_count] == NULL) {
+        fatal_error("Failed to allocate a host name");
+      }
+      name_count++;
+    }
+    closedir(dir_p);
+    qsort(name_list, name_count, sizeof(char *), fs_import_name_cmp);
+
+    state_p->node_p[i].child_first = state_p->node_count;
+    for(size_t j = 0;j < name_count;j++) {
+      const char *parent_path = state_p->node_p[i].host_path;
+      char *path = malloc(strlen(parent_path) + strlen(name_list[j]) + 2);
+      if(path == NULL) {
+        fatal_error("Failed to allocate a host path");
+      }
+      sprintf(path, "%s/%s", parent_path, name_list[j]);
+      if(lstat(path, &st) != 0 || 
+         (S_ISDIR(st.st_mode) == 0 && S_ISREG(st.st_mode) == 0)) {
+        info("Skipping special file %s", path);
+      } else if(fs_check_dir_name(name_list[j], 
+                                  FS_SET_DIR_NAME_DISALLOW_DOT) != 
+                FS_SUCCESS) {
+        info("Skipping invalid name %s", path);
+      } else if(S_ISREG(st.st_mode) && 
+                (size_t)st.st_size > FS_FILE_SIZE_MAX) {
+        info("Skipping large file %s", path);
+      } else {
+        FsImportNode *node_p = fs_import_add_node(state_p, path, &st);
+        strcpy(node_p->name, name_list[j]);
+        node_p->parent = i;
+        state_p->node_p[i].child_count++;
+      }
+      free(path);
+      free(name_list[j]);
+    }
+    free(name_list);
+  }
+
+  return FS_SUCCESS;
+}
+
+/*
+ * fs_import_map_file() - This function allocates the data sectors of a 
+ *                        file, and records them in the sector map
+ *
+ * A run of free sectors that is large enough for the data and indirection
+ * sectors is found first, such that the file is contiguous. Tiny files are
+ * read here and stored inline. Returns FS_ERR_NO_SPACE if a sector could 
+ * not be allocated
+ */
+int fs_import_map_file(FsImportState *state_p, FsImportNode *node_p) {
+  Storage *disk_p = state_p->disk_p;
+  const size_t sector_size = disk_p->sector_size;
+  Inode *inode_p = fs_iget(disk_p, node_p->inode);
+  // EARLY RETURN
+  if(node_p->size <= FS_INLINE_SIZE_MAX) {
+    uint8_t data[FS_INLINE_SIZE_MAX];
+    FILE *fp = fopen(node_p->host_path, "rb");
+    size_t len = 0;
+    if(fp == NULL) {
+      info("Could not read %s", node_p->host_path);
+      state_p->error = 1;
+    } else {
+      len = fread(data, 1, node_p->size, fp);
+      fclose(fp);
+      if(len != node_p->size) {
+        info("Could not read %s", node_p->host_path);
+        state_p->error = 1;
+      }
+    }
+    if(len != 0) {
+      fs_write(disk_p, inode_p, 0, len, data);
+    }
+    fs_iput(disk_p, inode_p);
+    return FS_SUCCESS;
+  }
+
+  const size_t count = (node_p->size + sector_size - 1) / sector_size;
+  node_p->map_index = state_p->map_count;
+  node_p->map_count = count;
+  // The data is placed in the allocation group of the inode
+  sector_t hint = fs_group_get_hint(node_p->inode);
+  const sector_count_t reserve_count = \
+    (sector_count_t)(count + count / context.id_per_indir_sector + 2);
+  const sector_t start = fs_alloc_sectors(disk_p, reserve_count, hint);
+  if(start != FS_INVALID_SECTOR) {
+    fs_free_sectors(disk_p, start, reserve_count);
+    hint = start;
+  }
+
+  for(size_t i = 0;i < count;i++) {
+    const sector_t sector = \
+      fs_get_file_sector_for_write_near(disk_p, 
+                                        inode_p, 
+                                        i * sector_size, 
+                                        hint);
+    // EARLY RETURN
+    if(sector == FS_INVALID_SECTOR) {
+      fs_set_dirty(disk_p, inode_p);
+      fs_iput(disk_p, inode_p);
+      return FS_ERR_NO_SPACE;
+    }
+    state_p->sector_map[state_p->map_count++] = sector;
+    hint = sector + 1;
+  }
+  fs_set_file_size(inode_p, node_p->size);
+  fs_set_dirty(disk_p, inode_p);
+  fs_iput(disk_p, inode_p);
+
+  return FS_SUCCESS;
+}
+
+/*
+ * fs_import_build() - This function allocates inodes, directory entries 
+ *                     and data sectors of all nodes
+ *
+ * Inodes are allocated in breadth-first order near their parent, then 
+ * directories are filled in the same order, and at last file data sectors 
+ * are allocated in the group of each inode. The data of each file is 
+ * contiguous.
+ * Returns FS_ERR_NO_INODE or FS_ERR_NO_SPACE if the file system is full
+ */
+int fs_import_build(FsImportState *state_p) {
+  Storage *disk_p = state_p->disk_p;
+  for(size_t i = 0;i < state_p->node_count;i++) {
+    FsImportNode *node_p = &state_p->node_p[i];
+    if(i == 0) {
+      node_p->inode = FS_ROOT_INODE;
+    } else {
+      const inode_id_t parent = state_p->node_p[node_p->parent].inode;
+      node_p->inode = fs_alloc_inode_near(disk_p, parent, node_p->is_dir);
+    }
+    // EARLY RETURN
+    if(node_p->inode == FS_INVALID_INODE) {
+      return FS_ERR_NO_INODE;
+    }
+    Inode *inode_p = fs_iget(disk_p, node_p->inode);
+    inode_p->flags = \
+      (inode_p->flags & (~FS_INODE_MODE_MASK)) | node_p->mode;
+    if(node_p->is_dir) {
+      fs_set_file_type(inode_p, FS_INODE_TYPE_DIR);
+    }
+    fs_set_dirty(disk_p, inode_p);
+    fs_iput(disk_p, inode_p);
+  }
+
+  for(size_t i = 0;i < state_p->node_count;i++) {
+    const FsImportNode *node_p = &state_p->node_p[i];
+    if(node_p->is_dir == 0) {
+      continue;
+    }
+
+    Inode *inode_p = fs_iget(disk_p, node_p->inode);
+    int ret = FS_SUCCESS;
+    // The root directory already has "." and ".."
+    if(i != 0) {
+      const char *name_list[2] = {".", ".."};
+      for(int j = 0;j < 2 && ret == FS_SUCCESS;j++) {
+        DirEntry *entry_p = fs_add_dir_entry(disk_p, inode_p);
+        if(entry_p == NULL) {
+          ret = FS_ERR_NO_SPACE;
+        } else {
+          entry_p->inode = \
+            (j == 0) ? node_p->inode : state_p->node_p[node_p->parent].inode;
+          fs_set_dir_name(disk_p, 
+                          entry_p, 
+                          name_list[j], 
+                          FS_SET_DIR_NAME_ALLOW_DOT);
+        }
+      }
+    }
+    for(size_t j = 0;j < node_p->child_count && ret == FS_SUCCESS;j++) {
+      const FsImportNode *child_p = &state_p->node_p[node_p->child_first + j];
+      ret = fs_insert_dir_entry(disk_p, inode_p, child_p->name, child_p->inode);
+    }
+    fs_iput(disk_p, inode_p);
+    // EARLY RETURN
+    if(ret != FS_SUCCESS) {
+      return ret;
+    }
+  }
+
+  for(size_t i = 0;i < state_p->node_count;i++) {
+    if(state_p->node_p[i].is_dir == 0) {
+      int ret = fs_import_map_file(state_p, &state_p->node_p[i]);
+      // EARLY RETURN
+      if(ret != FS_SUCCESS) {
+        return ret;
+      }
+    }
+  }
+
+  return FS_SUCCESS;
+}
+
+/*
+ * fs_import_slot_cmp() - Compares two batch slots by their sector ID
+ */
+int fs_import_slot_cmp(const void *a, const void *b) {
+  const sector_t sector_a = ((const FsImportSlot *)a)->sector;
+  const sector_t sector_b = ((const FsImportSlot *)b)->sector;
+  return (sector_a > sector_b) - (sector_a < sector_b);
+}
+
+/*
+ * fs_import_worker() - This is the body of a thread that reads pieces of
+ *                      host files into the batch buffer
+ *
+ * Bytes after the end of a host file are left as zero. If a piece could not
+ * be read entirely, the error of the import is set
+ */
+void *fs_import_worker(void *arg) {
+  FsImportState *state_p = (FsImportState *)arg;
+  const size_t sector_size = state_p->disk_p->sector_size;
+  while(1) {
+    const size_t index = \
+      __atomic_fetch_add(&state_p->next_piece, 1, __ATOMIC_RELAXED);
+    if(index >= state_p->piece_count) {
+      break;
+    }
+
+    const FsImportPiece *piece_p = &state_p->piece_p[index];
+    const char *path = state_p->node_p[piece_p->node].host_path;
+    const int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+      info("Could not read %s", path);
+      __atomic_store_n(&state_p->error, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    uint8_t *buffer_p = state_p->batch_p + piece_p->offset * sector_size;
+    // The last piece of a file ends with the file
+    const size_t file_size = state_p->node_p[piece_p->node].size;
+    size_t size = piece_p->count * sector_size;
+    if(size > file_size - piece_p->first * sector_size) {
+      size = file_size - piece_p->first * sector_size;
+    }
+    size_t done = 0;
+    while(done < size) {
+      ssize_t ret = pread(fd, 
+                          buffer_p + done, 
+                          size - done, 
+                          (off_t)(piece_p->first * sector_size + done));
+      if(ret <= 0) {
+        break;
+      }
+      done += (size_t)ret;
+    }
+    close(fd);
+    if(done != size) {
+      info("Could not read %s", path);
+      __atomic_store_n(&state_p->error, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * fs_import_write_batch() - This function writes a batch of data sectors 
+ *                           in the order of their sector ID
+ *
+ * The batch covers a range of the sector map. Runs of contiguous sectors 
+ * are written with a single request
+ */
+void fs_import_write_batch(FsImportState *state_p, 
+                           size_t map_first, 
+                           size_t count, 
+                           uint8_t *sorted_p) {
+  Storage *disk_p = state_p->disk_p;
+  const size_t sector_size = disk_p->sector_size;
+  const sector_t *map_p = state_p->sector_map + map_first;
+  uint8_t *data_p = state_p->batch_p;
+  int sorted = 1;
+  for(size_t i = 1;i < count;i++) {
+    if(map_p[i] < map_p[i - 1]) {
+      sorted = 0;
+      break;
+    }
+  }
+
+  // Sectors of a file are almost always in order. Otherwise the batch is 
+  // copied in sector order
+  sector_t *order_p = NULL;
+  if(sorted == 0) {
+    FsImportSlot *slot_p = malloc(count * sizeof(FsImportSlot));
+    order_p = malloc(count * sizeof(sector_t));
+    if(slot_p == NULL || order_p == NULL) {
+      fatal_error("Failed to allocate the batch order");
+    }
+    for(size_t i = 0;i < count;i++) {
+      slot_p[i].sector = map_p[i];
+      slot_p[i].slot = i;
+    }
+    qsort(slot_p, count, sizeof(FsImportSlot), fs_import_slot_cmp);
+    for(size_t i = 0;i < count;i++) {
+      order_p[i] = slot_p[i].sector;
+      memcpy(sorted_p + i * sector_size, 
+             data_p + slot_p[i].slot * sector_size, 
+             sector_size);
+    }
+    free(slot_p);
+    map_p = order_p;
+    data_p = sorted_p;
+  }
+
+  size_t i = 0;
+  while(i < count) {
+    size_t j = i + 1;
+    while(j < count && map_p[j] == map_p[j - 1] + 1) {
+      j++;
+    }
+    write_lba_multi(disk_p, map_p[i], j - i, data_p + i * sector_size);
+    i = j;
+  }
+  free(order_p);
+
+  return;
+}
+
+/*
+ * fs_import() - This function imports a host directory tree into the root
+ *               directory of an empty file system
+ *
+ * The import proceeds as follows:
+ *   1. The host tree is scanned, and the number of inodes and sectors it 
+ *      needs is computed. If it does not fit, nothing is changed
+ *   2. Inodes, directories and data sectors are allocated, and the metadata
+ *      is synced. Data sectors of each file are contiguous
+ *   3. File data is read in batches. Each batch is read by the given number
+ *      of threads in parallel, and written in sector order using large 
+ *      sequential requests
+ *
+ * Permission bits of host files are kept. Returns FS_SUCCESS, or the error
+ * of the step that failed
+ */
+int fs_import(Storage *disk_p, const char *host_path, int thread_count) {
+  FsImportState state;
+  memset(&state, 0x00, sizeof(FsImportState));
+  state.disk_p = disk_p;
+  int ret = fs_import_scan(&state, host_path);
+  const size_t sector_size = disk_p->sector_size;
+
+  // Data sectors plus at most one indirection sector per indirection sector
+  // of data and two for each file, and directory sectors with their index
+  size_t data_count = 0;
+  size_t need_count = 0;
+  for(size_t i = 0;i < state.node_count;i++) {
+    const FsImportNode *node_p = &state.node_p[i];
+    if(node_p->is_dir) {
+      const size_t count = \
+        (node_p->child_count + 2 + context.dir_per_sector - 1) / 
+        context.dir_per_sector;
+      need_count += count * 3;
+    } else if(node_p->size > FS_INLINE_SIZE_MAX) {
+      const size_t count = (node_p->size + sector_size - 1) / sector_size;
+      data_count += count;
+      need_count += count + count / context.id_per_indir_sector + 2;
+    }
+  }
+  if(ret == FS_SUCCESS && need_count > fs_count_free_sectors()) {
+    ret = FS_ERR_NO_SPACE;
+  } else if(ret == FS_SUCCESS && state.node_count > context.total_inode_count) {
+    ret = FS_ERR_NO_INODE;
+  }
+
+  if(ret == FS_SUCCESS) {
+    info("Importing %lu files and directories (%lu data sectors)", 
+         state.node_count, 
+         data_count);
+    state.sector_map = malloc((data_count + 1) * sizeof(sector_t));
+    if(state.sector_map == NULL) {
+      fatal_error("Failed to allocate the import sector map");
+    }
+    ret = fs_import_build(&state);
+    fs_sync(disk_p);
+  }
+
+  if(thread_count < 1) {
+    thread_count = 1;
+  } else if(thread_count > FS_IMPORT_THREAD_MAX) {
+    thread_count = FS_IMPORT_THREAD_MAX;
+  }
+
+  const size_t batch_count = FS_IMPORT_BATCH_SIZE / sector_size;
+  uint8_t *sorted_p = NULL;
+  if(ret == FS_SUCCESS) {
+    state.batch_p = malloc(FS_IMPORT_BATCH_SIZE);
+    sorted_p = malloc(FS_IMPORT_BATCH_SIZE);
+    state.piece_p = malloc(batch_count * sizeof(FsImportPiece));
+    if(state.batch_p == NULL || sorted_p == NULL || state.piece_p == NULL) {
+      fatal_error("Failed to allocate the import batch");
+    }
+  }
+
+  // Pieces are consecutive ranges of the sector map. Import stops at the
+  // first batch that could not be read
+  size_t node = 0, first = 0, map_first = 0;
+  while(ret == FS_SUCCESS && state.error == 0 && map_first < state.map_count) {
+    size_t count = 0;
+    state.piece_count = 0;
+    state.next_piece = 0;
+    while(count < batch_count && node < state.node_count) {
+      const FsImportNode *node_p = &state.node_p[node];
+      if(first == node_p->map_count) {
+        node++;
+        first = 0;
+        continue;
+      }
+      FsImportPiece *piece_p = &state.piece_p[state.piece_count++];
+      piece_p->node = node;
+      piece_p->first = first;
+      piece_p->count = node_p->map_count - first;
+      if(piece_p->count > batch_count - count) {
+        piece_p->count = batch_count - count;
+      }
+      piece_p->offset = count;
+      count += piece_p->count;
+      first += piece_p->count;
+    }
+
+    memset(state.batch_p, 0x00, count * sector_size);
+    pthread_t thread_list[FS_IMPORT_THREAD_MAX];
+    for(int i = 0;i < thread_count - 1;i++) {
+      if(pthread_create(&thread_list[i], NULL, fs_import_worker, &state) != 0) {
+        fatal_error("Failed to create an import thread");
+      }
+    }
+    fs_import_worker(&state);
+    for(int i = 0;i < thread_count - 1;i++) {
+      pthread_join(thread_list[i], NULL);
+    }
+
+    fs_import_write_batch(&state, map_first, count, sorted_p);
+    map_first += count;
+  }
+
+  if(ret == FS_SUCCESS && state.error != 0) {
+    ret = FS_ERR_HOST_IO;
+  }
+  for(size_t i = 0;i < state.node_count;i++) {
+    free(state.node_p[i].host_path);
+  }
+  free(state.node_p);
+  free(state.sector_map);
+  free(state.piece_p);
+  free(state.batch_p);
+  free(sorted_p);
+
+  return ret;
+}
+
+/*
+ * fs_export() - This function exports a file or a directory tree to the 
+ *               host
+ *
+ * Directories are created if they do not exist, and files are overwritten.
+ * File data is read in large requests, one per extent. Permission bits are
+ * restored after the content is written. Special files are skipped. 
+ * Returns FS_ERR_HOST_IO if a host file could not be written
+ */
+int fs_export(Storage *disk_p, inode_id_t inode, const char *host_path) {
+  Inode *inode_p = fs_iget(disk_p, inode);
+  const word_t type = fs_get_file_type(inode_p);
+  const word_t mode = inode_p->flags & FS_INODE_MODE_MASK;
+  int ret = FS_SUCCESS;
+  if(type == FS_INODE_TYPE_DIR) {
+    fs_iput(disk_p, inode_p);
+    struct stat st;
+    // EARLY RETURN
+    if(mkdir(host_path, 0777) != 0 && 
+       (stat(host_path, &st) != 0 || S_ISDIR(st.st_mode) == 0)) {
+      info("Could not create directory %s", host_path);
+      return FS_ERR_HOST_IO;
+    }
+
+    Dir dir = fs_open_dir(disk_p, inode);
+    const DirEntry *entry_p;
+    while((entry_p = fs_next_dir(disk_p, &dir)) != NULL) {
+      char name[FS_DIR_ENTRY_NAME_MAX + 1];
+      memcpy(name, entry_p->name, FS_DIR_ENTRY_NAME_MAX);
+      name[FS_DIR_ENTRY_NAME_MAX] = '\0';
+      const inode_id_t child = entry_p->inode;
+      if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        continue;
+      }
+
+      char *path = malloc(strlen(host_path) + strlen(name) + 2);
+      if(path == NULL) {
+        fatal_error("Failed to allocate a host path");
+      }
+      sprintf(path, "%s/%s", host_path, name);
+      if(fs_export(disk_p, child, path) != FS_SUCCESS) {
+        ret = FS_ERR_HOST_IO;
+      }
+      free(path);
+    }
+  } else if(type == FS_INODE_TYPE_FILE) {
+    FILE *fp = fopen(host_path, "wb");
+    uint8_t *buffer_p = malloc(FS_EXPORT_CHUNK_SIZE);
+    if(buffer_p == NULL) {
+      fatal_error("Failed to allocate the export buffer");
+    }
+    size_t offset = 0;
+    size_t len;
+    while(fp != NULL && 
+          (len = fs_read(disk_p, 
+                         inode_p, 
+                         offset, 
+                         FS_EXPORT_CHUNK_SIZE, 
+                         buffer_p)) != 0) {
+      if(fwrite(buffer_p, 1, len, fp) != len) {
+        break;
+      }
+      offset += len;
+    }
+    if(fp == NULL || offset != fs_get_file_size(inode_p)) {
+      info("Could not write %s", host_path);
+      ret = FS_ERR_HOST_IO;
+    }
+    if(fp != NULL && fclose(fp) != 0) {
+      ret = FS_ERR_HOST_IO;
+    }
+    free(buffer_p);
+    fs_iput(disk_p, inode_p);
+  } else {
+    fs_iput(disk_p, inode_p);
+    info("Skipping special file %s", host_path);
+    // EARLY RETURN
+    return FS_SUCCESS;
+  }
+
+  if(mode != 0) {
+    chmod(host_path, mode);
+  }
+
+  return ret;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Test Cases
+/////////////////////////////////////////////////////////////////////
+
+// Test cases are built by default. The command line utility is built
+// instead with -DOFS_CLI.
+#ifndef OFS_CLI
+#define DEBUG
+#endif
+#ifdef DEBUG
+
+void test_lba_rw(Storage *disk_p) {
+  info("=\n=Testing LBA r/w...\n=");
+  uint8_t buffer[DEFAULT_SECTOR_SIZE];
+  int prev_percent = 0;
+  for(size_t i = 0;i < disk_p->sector_count;i++) {
+    memset(buffer, (char)i, DEFAULT_SECTOR_SIZE);
+    disk_p->write(disk_p, i, buffer);
+    // Current progress
+    int current_percent = (int)(((double)i / disk_p->sector_count) * 100);
+    if(current_percent != prev_percent) {
+      fprintf(stderr, "\r  Write progress %d%%", current_percent);
+      prev_percent = current_percent;
+    }
+  }
+  putchar('\n');
+
+  prev_percent = 0;
+  for(size_t i = 0;i < disk_p->sector_count;i++) {
+    disk_p->read(disk_p, i, buffer);
+    for(int j = 0;j < DEFAULT_SECTOR_SIZE;j++) {
+      if(buffer[j] != (uint8_t)i) {
+        fatal_error("LBA read fail (i = %lu, j = %d)", i, j);
+      }
+    }
+
+    int current_percent = (int)(((double)i / disk_p->sector_count) * 100);
+    if(current_percent != prev_percent) {
+      fprintf(stderr, "\r  Read progress %d%%", current_percent);
+      prev_percent = current_percent;
+    }
+  }
+  putchar('\n');
+
+  return;
+}
+
+void test_buffer(Storage *disk_p) {
+  info("=\n=Testing buffer...\n=");
+  for(int i = 0;i < MAX_BUFFER * 2;i++) {
+    void *p = read_lba(disk_p, (uint64_t)i);
+    memset(p, (char)i, disk_p->sector_size);
+
+    buffer_print();
+  }
+  
+  info("Testing buffer and dirty flag...");
+  for(int i = 0;i < MAX_BUFFER * 2;i++) {
+    void *p = read_lba_for_write(disk_p, (uint64_t)i);
+    memset(p, (char)i, disk_p->sector_size);
+
+    buffer_print();
+  }
+
+  return;
+}
+
+void test_pin_buffer(Storage *disk_p) {
+  info("=\n=Testing buffer pin/unpin...\n=");
+  // First remove all buffers to make it into a known state
+  buffer_flush_all(disk_p);
+
+  // First make sure there is no pinned buffer
+  assert(buffer_count_pinned() == 0UL);
+
+  const int pinned_count = 5;
+  // Then read 5 buffers
+  for(int i = 0;i < pinned_count;i++) {
+    uint8_t *p = (uint8_t *)read_lba(disk_p, (uint64_t)i);
+    // Pin the buffer using some pointer to the middle of the buffer
+    buffer_pin(disk_p, p + i * 20);
+  }
+
+  // Print to see whether we have the pinned flag set
+  buffer_print();
+  assert(buffer_count_pinned() == (size_t)pinned_count);
+
+  // Read another 50 buffers and see whether the previous 5 are evicted
+  for(int i = 100;i < 150;i++) {
+    read_lba(disk_p, (uint64_t)i);
+  }
+
+  // Print to see whether pinned buffer is still in the buffer list
+  buffer_print();
+  assert(buffer_count_pinned() == (size_t)pinned_count);
+
+  // Finally, unpin these buffers and then test the pinned count
+  for(int i = pinned_count - 1;i >= 0;i--) {
+    uint8_t *p = (uint8_t *)read_lba(disk_p, (uint64_t)i);
+    // Pin the buffer using some pointer to the middle of the buffer
+    buffer_unpin(disk_p, p + 511);
+  }
+
+  buffer_print();
+  assert(buffer_count_pinned() == 0UL);
+
+  return;
+}
+
+// This records the progress of the inode region being written, and the 
+// number of inode sectors in regions that are completed
+size_t test_mkfs_inode_done = 0;
+size_t test_mkfs_inode_total = 0;
+size_t test_mkfs_inode_sum = 0;
+
+void test_mkfs_progress(const char *stage, 
+                        size_t done, 
+                        size_t total, 
+                        void *arg) {
+  assert(arg == &test_mkfs_inode_sum);
+  assert(done <= total);
+  if(strcmp(stage, "inode") == 0) {
+    // Progress must be monotonic within a region
+    assert(done > test_mkfs_inode_done || 
+           test_mkfs_inode_done == test_mkfs_inode_total);
+    test_mkfs_inode_done = done;
+    test_mkfs_inode_total = total;
+    if(done == total) {
+      test_mkfs_inode_sum += total;
+    }
+  }
+
+  return;
+}
+
+void test_fs_init(Storage *disk_p) {
+  info("=\n=Testing fs initialization...\n=");
+
+  info("Inode size: %lu", sizeof(Inode));
+  info("SuperBlock size: %lu", sizeof(SuperBlock));
+  info("Entry size: %lu", sizeof(DirEntry));
+
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  // Note that we must put the super block on the given location
+  // Call the special version
+  fs_set_mkfs_progress(test_mkfs_progress, &test_mkfs_inode_sum);
+  _fs_init(disk_p, 
+           disk_p->sector_count, 
+           FS_SB_SECTOR, 
+           0, 
+           FS_DEFAULT_FEATURES);
+  // Fill the parameters
+  fs_load_context(disk_p);
+  // Inode sectors are initialized later in steps
+  assert(context.inode_init_sector_count == 0);
+  assert(test_mkfs_inode_sum == 0);
+  while(fs_inode_init_step(disk_p, 50) != 0);
+  fs_set_mkfs_progress(NULL, NULL);
+  assert(test_mkfs_inode_sum == context.inode_sector_count);
+  // Inode sectors are written directly to the storage
+  for(size_t i = context.inode_start_sector;i < context.inode_end_sector;i++) {
+    const Inode *inode_p = (const Inode *)read_lba(disk_p, i);
+    for(size_t j = 0;j < context.inode_per_sector;j++) {
+      assert(inode_p[j].flags == 0);
+      assert(inode_p[j].addr[0] == FS_INVALID_SECTOR);
+    }
+  }
+
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  return;
+}
+
+void test_alloc_sector(Storage *disk_p) {
+  info("=\n=Testing sector allocation...\n=");
+
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  const char *round_desp[] = {
+    "Low to high",
+    "High to low",
+    "Random",
+    "Verify"
+  };
+
+  const size_t free_sector_start = context.free_start_sector;
+  const size_t total_sector_count = context.total_sector_count;
+  const size_t free_sector_count = context.free_sector_count;
+  // Make sure the result is correct
+  assert(total_sector_count == disk_p->sector_count);
+
+  // Allocate a bitmap to record which sector is good and which is not
+  uint8_t *sector_map = \
+    malloc(sizeof(uint8_t) * free_sector_count);
+  assert(sector_map != NULL);
+  int round = 0;
+  int prev_percent = 0;
+  while(1) {
+    memset(sector_map, 
+          0x00, 
+          sizeof(uint8_t) * free_sector_count);
+
+    sector_t sector;
+    size_t count = 0;
+    do { 
+      sector = fs_alloc_sector(disk_p);
+      if(sector != FS_INVALID_SECTOR) {
+        count++;
+        // Must be within free sector
+        assert(sector >= free_sector_start);
+        assert(sector < total_sector_count);
+        size_t index = sector - free_sector_start;
+        assert(sector_map[index] == 0);
+        sector_map[index] = 1;
+
+        int current_percent = \
+          (int)(((double)count / context.free_sector_count) * 100);
+        if(current_percent != prev_percent) {
+          prev_percent = current_percent;
+          fprintf(stderr, "\r  Allocated %d%% of all free blocks", 
+                  prev_percent);
+        }
+      }
+    } while(sector != FS_INVALID_SECTOR);
+    putchar('\n');
+    
+    info("Round %d (%s): Allocated %lu sectors. Now verifying...", 
+         round, 
+         round_desp[round],
+         count);
+
+    // Check whether all sectors are allocated
+    for(size_t i = free_sector_start;i < total_sector_count;i++) {
+      assert(sector_map[i - free_sector_start] == 1);
+    }
+
+    info("  ...Pass");
+    info("  Free allocated sectors...");
+    if(round == 0) {
+      for(sector_t i = free_sector_start;i < total_sector_count;i++) {
+        fs_free_sector(disk_p, i);
+      }
+    } else if(round == 1) {
+      for(sector_t i = total_sector_count - 1;i >= free_sector_start;i--) {
+        fs_free_sector(disk_p, i);
+      }
+    } else if(round == 2) {
+      srand(time(NULL));
+      for(int i = 0;i < free_sector_count;i++) {
+        // [free_sector_start, total_sector_count)
+        sector_t start = \
+          ((sector_t)rand() % free_sector_count) + free_sector_start;
+        // Use the map as a hash table to find sectors that are not yet
+        // freed
+        while(sector_map[start - free_sector_start] == 0) {
+          start++;
+          if(start == total_sector_count) {
+            start = free_sector_start;
+          }
+        }
+
+        // Clear it and then free
+        sector_map[start - free_sector_start] = 0;
+        fs_free_sector(disk_p, start);
+      }
+    } else {
+      info("Cleaning up");
+      for(sector_t i = free_sector_start;i < total_sector_count;i++) {
+        fs_free_sector(disk_p, i);
+      }
+
+      break;
+    }
+
+    info("  ...Done");
+
+    round++;
+  } // while(1)
+
+  free(sector_map);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  return;
+}
+
+void test_alloc_inode(Storage *disk_p) {
+  info("=\n=Testing allocating inode...\n=");
+
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  const char *round_desp[] = {
+    "Low to high",
+    "High to low",
+    "Random",
+    "Verify"
+  };
+
+  // Number of rounds
+  int round_count = sizeof(round_desp) / sizeof(round_desp[0]);
+  
+  // Preparing the array for recording which inode is allocated
+  const size_t alloc_size = sizeof(uint8_t) * context.total_inode_count;
+  uint8_t *flag_p = (uint8_t *)malloc(alloc_size);
+  int round = 0;
+
+  while(1) {
+    memset(flag_p, 0x00, alloc_size);
+    inode_id_t inode;
+    int count = 0;
+    int prev_percent = 0;
+    do {
+      // Starts from 0 and ends at max inode
+      inode = fs_alloc_inode(disk_p);
+      // If allocation is a success we set it to 1
+      if(inode != FS_INVALID_INODE) {
+        assert(inode < context.total_inode_count);
+        assert(flag_p[inode] == 0);
+        flag_p[inode] = 1;
+        count++;
+
+        // Also check that the inode is indeed allocated (do not write)
+        Inode *inode_p = fs_load_inode_sector(disk_p, inode, 0);
+        assert(inode_p->flags & FS_INODE_IN_USE);
+
+        // This also tests get/set size for inode
+        // We use size max to cover both bytes
+        size_t test_size = FS_FILE_SIZE_MAX - count;
+        fs_set_file_size(inode_p, test_size);
+        assert(fs_get_file_size(inode_p) == test_size);
+
+        int current_percent = \
+          (int)(((double)count / context.total_inode_count) * 100);
+        if(current_percent != prev_percent) {
+          prev_percent = current_percent;
+          fprintf(stderr, "\r  Allocated %d%% inodes", current_percent);
+        }
+      }
+    } while(inode != FS_INVALID_INODE);
+    putchar('\n');
+
+    info("Round %d (%s): Allocated %lu inodes. Now verifying...", 
+         round, 
+         round_desp[round],
+         count);
+
+    for(int i = 0;i < context.total_inode_count;i++) {
+      if(flag_p[i] == 0) {
+        fatal_error("Inode %d is not allocated", i);
+      }
+    }
+
+    info("  ...Pass");
+    if(round < round_count - 1) {
+      info("  Free allocated sectors...");
+    }
+
+    if(round == 0) {
+      for(int i = 0;i < context.total_inode_count;i++) {
+        fs_free_inode(disk_p, i);
+      }
+    } else if(round == 1) {
+      for(int i = context.total_inode_count - 1;i >= 0;i--) {
+        fs_free_inode(disk_p, i);
+      }
+    } else if(round == 2) {
+      srand(time(NULL));
+      for(int i = 0;i < context.total_inode_count;i++) {
+        inode_id_t start = (inode_id_t)rand() % context.total_inode_count;
+        // Use the map as a hash table to find sectors that are not yet
+        // freed
+        while(flag_p[start] == 0) {
+          start++;
+          if(start == context.total_inode_count) {
+            start = 0;
+          }
+        }
+
+        // Clear it and then free
+        flag_p[start] = 0;
+        fs_free_inode(disk_p, start);
+      }
+    } else {
+      info("Cleaning up");
+      for(int i = 0;i < context.total_inode_count;i++) {
+        fs_free_inode(disk_p, i);
+      }
+      break;
+    }
+
+    info("  ...Done");
+    round++;
+  }
+
+  free(flag_p);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+void test_get_sector(Storage *disk_p) {
+  info("=\n=Testing getting sector for read/write...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  // Allocate an inode object and then try filling its sectors
+  inode_id_t inode = fs_alloc_inode(disk_p);
+  assert(inode != FS_INVALID_INODE);
+  Inode *inode_p = fs_load_inode_sector(disk_p, inode, 1);
+  //buffer_pin(disk_p, inode_p);
+  assert(fs_is_file_large(inode_p) == 0 && 
+         fs_is_file_extra_large(inode_p) == 0);
+  // This is the maximum number of sectors we could support in one file
+  const size_t sector_count_for_test = \
+    context.id_per_indir_sector * \
+      (FS_ADDR_ARRAY_MAX - 1 + context.id_per_indir_sector);
+  info("# of sector ID per indirection sector: %u", 
+       (uint32_t)context.id_per_indir_sector); 
+  info("Allocating %u sectors for a single file...", 
+       (uint32_t)sector_count_for_test);
+  // Index is the sector in the file and content is the sector ID on the disk
+  sector_t *file_sector_map = malloc(sizeof(sector_t) * sector_count_for_test);
+  // Index is the sector on the disk - free start sector, and content is 1
+  // or 0
+  uint8_t *disk_sector_map = \
+    malloc(sizeof(uint8_t) * context.free_sector_count);
+  memset(disk_sector_map, 0x00, sizeof(uint8_t) * context.free_sector_count);
+
+  int count = 0;
+  for(size_t i = 0;i < sector_count_for_test;i++) {
+    // Note that this function requires byte offset
+    sector_t sector = \
+      fs_get_file_sector_for_write(disk_p, inode_p, i * disk_p->sector_size);
+    
+    // Run out of blocks
+    if(sector == FS_INVALID_SECTOR) {
+      break;
+    } else {
+      count++;
+    }
+    //assert(sector != FS_INVALID_SECTOR);
+    assert(sector >= context.free_start_sector);
+    assert(sector < context.free_end_sector);
+    file_sector_map[i] = sector;
+    // The sector must not be allocated
+    assert(disk_sector_map[sector - context.free_start_sector] == 0);
+    disk_sector_map[sector - context.free_start_sector] = 1;
+  }
+  
+  info("  Allocated %d sectors to the inode", count);
+  info("  (total free sector: %u)", context.free_sector_count);
+  assert(fs_is_file_large(inode_p) == 1);
+  assert(fs_is_file_extra_large(inode_p) == 1);
+
+  info("Checking whether indirection sectors are allocated...");
+  // We first evict all buffers to expose problems if any
+  // and then re-read the inode
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  inode_p = fs_load_inode_sector(disk_p, inode, 0);
+
+  fs_pin(disk_p, inode_p);
+  // Iterate to find indirection sectors and also set it
+  for(int i = 0;i < FS_ADDR_ARRAY_MAX;i++) {
+    sector_t sector = inode_p->addr[i];
+    // All must be set
+    assert(sector != FS_INVALID_SECTOR);
+    sector -= context.free_start_sector;
+    assert(disk_sector_map[sector] == 0);
+    disk_sector_map[sector] = 1;
+  }
+
+  // Set the last double-indirection sector
+  sector_t *data_p = \
+    (sector_t *)read_lba(disk_p, inode_p->addr[FS_ADDR_ARRAY_MAX - 1]);
+  for(sector_count_t i = 0;i < context.id_per_indir_sector;i++) {
+    // The last sector is not full
+    if(data_p[i] == FS_INVALID_SECTOR) {
+      break;
+    }
+    sector_t sector = data_p[i] - context.free_start_sector;
+    assert(disk_sector_map[sector] == 0);
+    disk_sector_map[sector] = 1;
+  }
+  fs_unpin(disk_p, inode_p);
+  info("  ...Pass");
+
+  info("Checking whether all sectors are used...");
+  // Validate the disk map to make sure that the entire disk is full
+  for(sector_count_t i = 0;i < context.free_sector_count;i++) {
+    assert(disk_sector_map[i] == 1);
+  }
+  info("  ...Pass");
+
+  info("Reading the sector to verify...");
+  int read_count = 0;
+  // We can only read that many sectors
+  for(size_t i = 0;i < sector_count_for_test;i++) {
+    // If we exceed the maximum size
+    if(i >= (size_t)((sector_t)-1)) {
+      break;
+    } else {
+      read_count++;
+    }
+
+    sector_t sector = \
+      fs_get_file_sector(disk_p, inode_p, i * disk_p->sector_size);
+    if(i < count) {
+      assert(sector == file_sector_map[i]);
+    } else {
+      assert(sector == FS_INVALID_SECTOR);
+    }
+  }
+  info("  Verified %d sectors for read", read_count);
+  info("  ...Pass");
+  
+  //buffer_unpin(disk_p, inode_p);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  free(file_sector_map);
+  free(disk_sector_map);
+  return;
+}
+
+void test_init_root(Storage *disk_p) {
+  info("=\n=Testing init the root directory...\n=");
+  // This is the complete version of fs_init
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+
+  return;
+}
+
+void test_add_dir_entry(Storage *disk_p) {
+  info("=\n=Testing init the root directory...\n=");
+  
+  // We will write into this inode's addr array for allocating
+  // sectors
+  Inode *inode_p = fs_load_inode_sector(disk_p, FS_ROOT_INODE, 1);
+  const int total_entry = 200;
+  const char *fmt = "File %d";
+  info("Allocating %d entries to the root directory...", total_entry);
+  for(int i = 0;i < 200;i++) {
+    DirEntry *entry_p = fs_add_dir_entry(disk_p, inode_p);
+    assert(entry_p != NULL);
+    // Make it occupied otherwise we will allocate this one on the next round
+    entry_p->inode = FS_ROOT_INODE;
+    char name_buffer[128];
+    sprintf(name_buffer, fmt, i);
+    int ret = fs_set_dir_name(disk_p, 
+                              entry_p, 
+                              name_buffer, 
+                              FS_SET_DIR_NAME_DISALLOW_DOT);
+    assert(ret == FS_SUCCESS);  
+  }
+  info("  Done");
+
+  buffer_flush_all(disk_p);
+  inode_p = fs_load_inode_sector(disk_p, FS_ROOT_INODE, 0);
+  size_t expected_size = \
+    disk_p->sector_size * 
+    (size_t)((total_entry / context.dir_per_sector) + 
+             ((total_entry % context.dir_per_sector == 0) ? 0 : 1));
+  info("Expecting %lu bytes (%lu sectors) for the entry. Actual %lu",
+       expected_size,
+       expected_size / disk_p->sector_size,
+       fs_get_file_size(inode_p));
+  info("  Number of entries per sector: %lu", context.dir_per_sector);
+  assert(fs_get_file_size(inode_p) == expected_size);
+
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  info("Read all entries");
+  // Open the directory and get back an opaque handler
+  Dir dir = fs_open_dir(disk_p, FS_ROOT_INODE);
+  // Allocate a map to record the state of each file
+  //char *dir_map = malloc(sizeof(char) * 200);
+  //memset(dir_map, 0x00, sizeof(char) * 200);
+  for(int i = 0;i < 200;i++) {
+    char name_buffer[128];
+    sprintf(name_buffer, fmt, i);
+    int len = strlen(name_buffer);
+    // Get the current dir and next dir
+    const DirEntry *entry_p = fs_next_dir(disk_p, &dir);
+    if(memcmp(entry_p->name, name_buffer, len) != 0) {
+      info("FAIL: i = %d; Expect \"%s\" actual \"%s\"", 
+           i, 
+           name_buffer, 
+           entry_p->name);
+      assert(0);
+    }
+  }
+
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  info("Removing all entries");
+  inode_p = fs_load_inode_sector(disk_p, FS_ROOT_INODE, 0);
+  // Then test removing
+  for(int i = 0;i < 200;i++) {
+    char name_buffer[128];
+    sprintf(name_buffer, fmt, i);
+    int ret = fs_free_dir_entry(disk_p, inode_p, name_buffer);
+    if(ret != FS_SUCCESS) {
+      info("Error: ret = %d", ret);
+      assert(ret == FS_SUCCESS);
+    }
+  }
+  info("  Done");
+  info("Directory size after deletion: %lu", fs_get_file_size(inode_p));
+
+  // This is the size of the directory
+  size_t dir_size = fs_get_file_size(inode_p);
+  assert(dir_size == disk_p->sector_size);
+
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  return;
+}
+
+void test_file_rw(Storage *disk_p) {
+  info("=\n=Testing file read/write...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  inode_id_t inode = fs_alloc_inode(disk_p);
+  assert(inode != FS_INVALID_INODE);
+  Inode *inode_p = fs_load_inode_sector(disk_p, inode, 1);
+  fs_pin(disk_p, inode_p);
+
+  // Use a size that is not a multiple of sectors and spans the large file
+  // range
+  const size_t test_size = disk_p->sector_size * 300 + 123;
+  uint8_t *src_p = malloc(test_size);
+  uint8_t *dest_p = malloc(test_size);
+  assert(src_p != NULL && dest_p != NULL);
+  for(size_t i = 0;i < test_size;i++) {
+    src_p[i] = (uint8_t)(i * 7 + i / 251);
+  }
+
+  info("Writing %lu bytes using unaligned chunks...", test_size);
+  // Chunk sizes are chosen to create unaligned heads and tails as well as
+  // multi-batch aligned middles
+  const size_t chunk_list[] = {1, 100, 511, 4096, 513, 40000, 7};
+  size_t offset = 0;
+  int chunk_index = 0;
+  while(offset < test_size) {
+    size_t chunk = chunk_list[chunk_index % (sizeof(chunk_list) / 
+                                             sizeof(chunk_list[0]))];
+    if(chunk > test_size - offset) {
+      chunk = test_size - offset;
+    }
+    size_t written = fs_write(disk_p, inode_p, offset, chunk, src_p + offset);
+    assert(written == chunk);
+    offset += chunk;
+    chunk_index++;
+  }
+  assert(fs_get_file_size(inode_p) == test_size);
+  assert(fs_is_file_large(inode_p) == 1);
+  info("  ...Pass");
+
+  info("Reading back the file...");
+  buffer_flush_all_no_rm(disk_p);
+  memset(dest_p, 0xFF, test_size);
+  assert(fs_read(disk_p, inode_p, 0, test_size, dest_p) == test_size);
+  assert(memcmp(src_p, dest_p, test_size) == 0);
+  // Unaligned read in the middle
+  memset(dest_p, 0xFF, test_size);
+  assert(fs_read(disk_p, inode_p, 1000, 70000, dest_p) == 70000);
+  assert(memcmp(src_p + 1000, dest_p, 70000) == 0);
+  // Read past the end is truncated
+  assert(fs_read(disk_p, inode_p, test_size - 10, 100, dest_p) == 10);
+  assert(memcmp(src_p + test_size - 10, dest_p, 10) == 0);
+  assert(fs_read(disk_p, inode_p, test_size, 100, dest_p) == 0);
+  info("  ...Pass");
+
+  info("Writing after a hole...");
+  const size_t hole_end = test_size + disk_p->sector_size * 20 + 17;
+  assert(fs_write(disk_p, inode_p, hole_end, 5, "ABCDE") == 5);
+  assert(fs_get_file_size(inode_p) == hole_end + 5);
+  memset(dest_p, 0xFF, test_size);
+  assert(fs_read(disk_p, inode_p, test_size, hole_end + 5 - test_size, dest_p) 
+         == hole_end + 5 - test_size);
+  for(size_t i = 0;i < hole_end - test_size;i++) {
+    assert(dest_p[i] == 0x00);
+  }
+  assert(memcmp(dest_p + hole_end - test_size, "ABCDE", 5) == 0);
+  info("  ...Pass");
+
+  fs_unpin(disk_p, inode_p);
+  free(src_p);
+  free(dest_p);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+void test_map_cache(Storage *disk_p) {
+  info("=\n=Testing mapping cache...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  inode_id_t inode = fs_alloc_inode(disk_p);
+  assert(inode != FS_INVALID_INODE);
+  Inode *inode_p = fs_load_inode_sector(disk_p, inode, 1);
+  fs_pin(disk_p, inode_p);
+  assert(fs_get_inode_id(disk_p, inode_p) == inode);
+
+  const sector_t sector_count = 100;
+  uint8_t *data_p = malloc(disk_p->sector_size * sector_count);
+  memset(data_p, 0x5A, disk_p->sector_size * sector_count);
+  assert(fs_write(disk_p, inode_p, 0, disk_p->sector_size * sector_count, 
+                  data_p) == disk_p->sector_size * sector_count);
+
+  // Resolve all sectors without the cache to count the runs. A run also
+  // ends at the boundary of the addr array or an indirection sector
+  fs_map_cache_invalidate(inode);
+  sector_t *sector_map = malloc(sizeof(sector_t) * sector_count);
+  size_t run_count = 0;
+  for(sector_t i = 0;i < sector_count;i++) {
+    sector_map[i] = \
+      *fs_get_file_sector_p(disk_p, inode_p, i * disk_p->sector_size);
+    if(i == 0 || 
+       i % context.id_per_indir_sector == 0 || 
+       sector_map[i] != sector_map[i - 1] + 1) {
+      run_count++;
+    }
+  }
+  info("File has %lu physical runs", run_count);
+
+  // First pass: one miss per run
+  uint64_t prev_miss = map_cache_miss;
+  for(sector_t i = 0;i < sector_count;i++) {
+    assert(fs_get_file_sector(disk_p, inode_p, i * disk_p->sector_size) == 
+           sector_map[i]);
+  }
+  info("  First pass misses: %lu", map_cache_miss - prev_miss);
+  assert(map_cache_miss - prev_miss == run_count);
+
+  // Second pass hits entirely if all runs fit into the cache. Otherwise 
+  // evicted runs miss again, but never more than once per run
+  prev_miss = map_cache_miss;
+  for(sector_t i = 0;i < sector_count;i++) {
+    assert(fs_get_file_sector(disk_p, inode_p, i * disk_p->sector_size) == 
+           sector_map[i]);
+  }
+  info("  Second pass misses: %lu", map_cache_miss - prev_miss);
+  if(run_count <= FS_MAP_CACHE_RUN_MAX) {
+    assert(map_cache_miss == prev_miss);
+  } else {
+    assert(map_cache_miss - prev_miss <= run_count);
+  }
+  info("  ...Pass");
+
+  // After freeing the inode its mappings must be dropped
+  fs_unpin(disk_p, inode_p);
+  fs_free_inode(disk_p, inode);
+  assert(fs_map_cache_find(inode) == NULL);
+
+  free(sector_map);
+  free(data_p);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+void test_free_extent(Storage *disk_p) {
+  info("=\n=Testing free extent map...\n=");
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  assert(context.features & FS_FEATURE_FREE_EXTENT);
+
+  const size_t free_count = fs_count_free_sectors();
+  const size_t extent_count = fs_count_free_extents();
+  info("Allocating contiguous runs...");
+  sector_t run1 = fs_alloc_sectors(disk_p, 100, FS_INVALID_SECTOR);
+  sector_t run2 = fs_alloc_sectors(disk_p, 50, FS_INVALID_SECTOR);
+  assert(run1 != FS_INVALID_SECTOR && run2 != FS_INVALID_SECTOR);
+  assert(run2 >= run1 + 100 || run2 + 50 <= run1);
+  assert(fs_count_free_sectors() == free_count - 150);
+  // Allocating at a hint inside a free extent starts exactly there
+  sector_t run3 = fs_alloc_sectors(disk_p, 10, run2 + 50 + 20);
+  assert(run3 == run2 + 50 + 20);
+  // A request that is too large fails without changing anything
+  assert(fs_alloc_sectors(disk_p, 
+                          (sector_count_t)context.free_sector_count, 
+                          FS_INVALID_SECTOR) == FS_INVALID_SECTOR);
+  fs_free_sectors(disk_p, run3, 10);
+  fs_free_sectors(disk_p, run1, 100);
+  fs_free_sectors(disk_p, run2, 50);
+  assert(fs_count_free_sectors() == free_count);
+  assert(fs_count_free_extents() == extent_count);
+  info("  ...Pass");
+
+  info("Fragmenting free space...");
+  // Small holes are preferred by best-fit
+  sector_t big = fs_alloc_sectors(disk_p, 200, FS_INVALID_SECTOR);
+  fs_free_sectors(disk_p, big + 10, 3);
+  assert(fs_alloc_sectors(disk_p, 3, FS_INVALID_SECTOR) == big + 10);
+  fs_free_sectors(disk_p, big + 10, 3);
+  fs_free_sectors(disk_p, big, 10);
+  fs_free_sectors(disk_p, big + 13, 187);
+  assert(fs_count_free_sectors() == free_count);
+  info("  ...Pass");
+
+  info("Sequential growth is contiguous...");
+  inode_id_t inode = fs_alloc_inode(disk_p);
+  Inode *inode_p = fs_load_inode_sector(disk_p, inode, 1);
+  fs_pin(disk_p, inode_p);
+  sector_t first = FS_INVALID_SECTOR;
+  for(sector_t i = 0;i < 8;i++) {
+    sector_t sector = \
+      fs_get_file_sector_for_write(disk_p, inode_p, i * disk_p->sector_size);
+    if(first == FS_INVALID_SECTOR) {
+      first = sector;
+    }
+    assert(sector == first + i);
+  }
+  fs_unpin(disk_p, inode_p);
+  info("  ...Pass");
+
+  info("Converting an old free list image...");
+  buffer_flush_all(disk_p);
+  // Build an image in the free list format by hand
+  const size_t inode_sector_count = \
+    fs_init_inode(disk_p, FS_SB_SECTOR + 1, disk_p->sector_count);
+  const size_t free_start = FS_SB_SECTOR + 1 + inode_sector_count;
+  fs_init_free_list(disk_p, free_start, disk_p->sector_count);
+  fs_init_super_block(disk_p, 
+                      FS_SB_SECTOR, 
+                      inode_sector_count, 
+                      disk_p->sector_count - free_start,
+                      0, 
+                      0, 
+                      FS_INVALID_SECTOR, 
+                      0, 
+                      0);
+  // Allocate a few sectors using the old allocator, which must not become
+  // free after conversion
+  sector_t used_list[10];
+  for(int i = 0;i < 10;i++) {
+    used_list[i] = fs_alloc_sector_free_list(disk_p);
+    assert(used_list[i] != FS_INVALID_SECTOR);
+  }
+  fs_load_context(disk_p);
+  assert(context.features & FS_FEATURE_FREE_EXTENT);
+  const size_t map_size = \
+    fs_get_free_map_size(disk_p, context.free_sector_count);
+  assert(fs_count_free_sectors() == context.free_sector_count - 10 - map_size);
+  for(int i = 0;i < 10;i++) {
+    assert(fs_is_sector_free(used_list[i]) == 0);
+  }
+
+  // Reload the map from the disk and compare
+  const size_t converted_count = fs_count_free_extents();
+  buffer_flush_all(disk_p);
+  fs_load_context(disk_p);
+  assert(fs_count_free_extents() == converted_count);
+  assert(fs_count_free_sectors() == context.free_sector_count - 10 - map_size);
+  info("  ...Pass");
+
+  // Leave a clean file system for other tests
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+/*
+ * test_inode_in_magazine() - Returns 1 if the inode is in any magazine
+ */
+int test_inode_in_magazine(inode_id_t inode) {
+  for(Magazine *magazine_p = magazine_list_p;
+      magazine_p != NULL;
+      magazine_p = magazine_p->next_p) {
+    for(size_t i = 0;i < magazine_p->inode_count;i++) {
+      if(magazine_p->inode_list[i] == inode) {
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * test_inode_map_verify() - Checks the inode bitmap against the inode table
+ *
+ * Inodes in magazines are marked in use as well
+ */
+void test_inode_map_verify(Storage *disk_p) {
+  assert(inode_map.valid == 1);
+  for(inode_id_t i = 0;i < context.total_inode_count;i++) {
+    const Inode *inode_p = fs_load_inode_sector(disk_p, i, 0);
+    const int in_use = !!(inode_p->flags & FS_INODE_IN_USE) || 
+                       test_inode_in_magazine(i);
+    const uint64_t word = inode_map.bits_p[i / FS_INODE_MAP_WORD_BITS];
+    assert(!!(word & (1ULL << (i % FS_INODE_MAP_WORD_BITS))) == in_use);
+  }
+
+  return;
+}
+
+void test_inode_map(Storage *disk_p) {
+  info("=\n=Testing inode bitmap...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  // Allocate a few hundred inodes, and free every third of them, such that
+  // the refill has to skip over allocated inodes
+  const int alloc_count = 300;
+  inode_id_t *inode_list = malloc(sizeof(inode_id_t) * alloc_count);
+  for(int i = 0;i < alloc_count;i++) {
+    inode_list[i] = fs_alloc_inode(disk_p);
+    assert(inode_list[i] != FS_INVALID_INODE);
+  }
+  for(int i = 0;i < alloc_count;i += 3) {
+    fs_free_inode(disk_p, inode_list[i]);
+  }
+  test_inode_map_verify(disk_p);
+  info("Bitmap matches the inode table after alloc/free");
+
+  // The bitmap is rebuilt from scratch after loading the fs again
+  buffer_flush_all(disk_p);
+  fs_load_context(disk_p);
+  assert(inode_map.valid == 0);
+  fs_inode_map_build(disk_p);
+  test_inode_map_verify(disk_p);
+  info("Bitmap matches the inode table after reload");
+
+  // Drain all inodes, which must return every free inode exactly once
+  int expected_count = 0;
+  for(size_t i = 0;i < inode_map.word_count;i++) {
+    expected_count += __builtin_popcountll(~inode_map.bits_p[i]);
+  }
+  inode_id_t inode;
+  int free_count = 0;
+  while((inode = fs_alloc_inode(disk_p)) != FS_INVALID_INODE) {
+    free_count++;
+  }
+  for(inode_id_t i = 0;i < context.total_inode_count;i++) {
+    assert(inode_map.bits_p[i / FS_INODE_MAP_WORD_BITS] & 
+           (1ULL << (i % FS_INODE_MAP_WORD_BITS)));
+  }
+  info("Drained %d free inodes", free_count);
+  assert(free_count == expected_count);
+  test_inode_map_verify(disk_p);
+  info("  ...Pass");
+
+  free(inode_list);
+  // Start from a clean file system again
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+void test_dir_index(Storage *disk_p) {
+  info("=\n=Testing directory index...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  const size_t free_count = fs_count_free_sectors();
+  Inode *inode_p = fs_load_inode_sector(disk_p, FS_ROOT_INODE, 1);
+  fs_pin(disk_p, inode_p);
+
+  const int total_entry = 1500;
+  char name_buffer[128];
+  info("Inserting %d entries...", total_entry);
+  for(int i = 0;i < total_entry;i++) {
+    sprintf(name_buffer, "e%d", i);
+    int ret = fs_insert_dir_entry(disk_p, inode_p, name_buffer, 
+                                  (inode_id_t)(i % context.total_inode_count));
+    assert(ret == FS_SUCCESS);
+  }
+  assert(fs_insert_dir_entry(disk_p, inode_p, "e1", 0) == FS_ERR_NAME_EXISTS);
+  assert(fs_insert_dir_entry(disk_p, inode_p, "e/", 0) == FS_ERR_ILLEGAL_CHAR);
+
+  DirIndexHeader header;
+  assert(fs_dir_index_load(disk_p, inode_p, &header) == 1);
+  // ".." is also indexed, but not "." which holds the header
+  assert(header.entry_count == total_entry + 1);
+  info("  Index has %lu slots in %lu sectors", 
+       (size_t)1 << header.shift, 
+       (size_t)fs_dir_index_sector_count(disk_p, &header));
+
+  // Start with an empty directory entry cache such that the index is used
+  fs_dcache_init();
+  // Prefixes of existing names must not match
+  assert(fs_lookup_dir_entry(disk_p, inode_p, "e") == FS_INVALID_INODE);
+  assert(fs_lookup_dir_entry(disk_p, inode_p, "e15000") == FS_INVALID_INODE);
+  // The padding of "." is not null in an indexed directory
+  assert(fs_lookup_dir_entry(disk_p, inode_p, ".") == FS_ROOT_INODE);
+  assert(fs_lookup_dir_entry(disk_p, inode_p, "..") == FS_ROOT_INODE);
+  for(int i = 0;i < total_entry;i++) {
+    sprintf(name_buffer, "e%d", i);
+    assert(fs_lookup_dir_entry(disk_p, inode_p, name_buffer) == 
+           (inode_id_t)(i % context.total_inode_count));
+  }
+  info("  ...Pass");
+
+  // Removing entries moves the last sector into emptied sectors, which
+  // must also move their positions in the index
+  info("Removing even entries...");
+  for(int i = 0;i < total_entry;i += 2) {
+    const int victim = (i * 7) % total_entry;
+    sprintf(name_buffer, "e%d", victim);
+    assert(fs_free_dir_entry(disk_p, inode_p, name_buffer) == FS_SUCCESS);
+    assert(fs_free_dir_entry(disk_p, inode_p, name_buffer) == 
+           FS_ERR_NAME_NOT_FOUND);
+  }
+
+  // Verify with the index, with a rebuilt index, and with linear scan
+  for(int round = 0;round < 3;round++) {
+    fs_dcache_init();
+    for(int i = 0;i < total_entry;i++) {
+      sprintf(name_buffer, "e%d", i);
+      inode_id_t expected = FS_INVALID_INODE;
+      if(i % 2 == 1) {
+        expected = (inode_id_t)(i % context.total_inode_count);
+      }
+      assert(fs_lookup_dir_entry(disk_p, inode_p, name_buffer) == expected);
+    }
+    assert(fs_lookup_dir_entry(disk_p, inode_p, ".") == FS_ROOT_INODE);
+    assert(fs_lookup_dir_entry(disk_p, inode_p, "..") == FS_ROOT_INODE);
+    fs_dir_index_drop(disk_p, inode_p);
+    if(round == 0) {
+      assert(fs_dir_index_build(disk_p, inode_p, 0) == 1);
+    }
+  }
+  // Lookups do not build the index
+  assert(fs_dir_index_load(disk_p, inode_p, &header) == 0);
+
+  // Old iteration still sees every entry except "." and ".."
+  Dir dir = fs_open_dir(disk_p, FS_ROOT_INODE);
+  int iter_count = 0;
+  while(fs_next_dir(disk_p, &dir) != NULL) {
+    iter_count++;
+  }
+  assert(iter_count == total_entry / 2);
+  info("  ...Pass");
+
+  info("Removing all entries");
+  for(int i = 1;i < total_entry;i += 2) {
+    sprintf(name_buffer, "e%d", i);
+    assert(fs_free_dir_entry(disk_p, inode_p, name_buffer) == FS_SUCCESS);
+  }
+  assert(fs_get_file_size(inode_p) == disk_p->sector_size);
+  fs_dir_index_drop(disk_p, inode_p);
+  // Shrinking a directory keeps its indirection sector
+  assert(fs_count_free_sectors() + fs_is_file_large(inode_p) == free_count);
+  info("  ...Pass");
+
+  fs_unpin(disk_p, inode_p);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+void test_dcache(Storage *disk_p) {
+  info("=\n=Testing directory entry cache...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  Inode *inode_p = fs_load_inode_sector(disk_p, FS_ROOT_INODE, 1);
+  fs_pin(disk_p, inode_p);
+
+  assert(fs_insert_dir_entry(disk_p, inode_p, "alpha", 11) == FS_SUCCESS);
+  assert(fs_insert_dir_entry(disk_p, inode_p, "beta", 12) == FS_SUCCESS);
+
+  // Names inserted are cached, and hits do not access any buffer
+  Buffer *head_p = buffer_head_p;
+  uint64_t prev_hit = dcache.hit;
+  assert(fs_lookup_dir_entry(disk_p, inode_p, "alpha") == 11);
+  assert(fs_lookup_dir_entry(disk_p, inode_p, "beta") == 12);
+  assert(dcache.hit == prev_hit + 2);
+  assert(buffer_head_p == head_p);
+
+  // Misses are cached as negative entries
+  uint64_t prev_miss = dcache.miss;
+  assert(fs_lookup_dir_entry(disk_p, inode_p, "gamma") == FS_INVALID_INODE);
+  assert(fs_lookup_dir_entry(disk_p, inode_p, "gamma") == FS_INVALID_INODE);
+  assert(dcache.miss == prev_miss + 1);
+  info("Positive and negative hits ...Pass");
+
+  // Naming an entry drops the negative entry of its new name
+  DirEntry *entry_p = fs_add_dir_entry(disk_p, inode_p);
+  assert(entry_p != NULL);
+  entry_p->inode = 13;
+  assert(fs_set_dir_name(disk_p, entry_p, "gamma", 
+                         FS_SET_DIR_NAME_DISALLOW_DOT) == FS_SUCCESS);
+  assert(fs_lookup_dir_entry(disk_p, inode_p, "gamma") == 13);
+  // And the positive entry of its old name
+  assert(fs_set_dir_name(disk_p, entry_p, "delta", 
+                         FS_SET_DIR_NAME_DISALLOW_DOT) == FS_SUCCESS);
+  assert(fs_lookup_dir_entry(disk_p, inode_p, "gamma") == FS_INVALID_INODE);
+  assert(fs_lookup_dir_entry(disk_p, inode_p, "delta") == 13);
+
+  // Removed names become negative entries
+  assert(fs_free_dir_entry(disk_p, inode_p, "alpha") == FS_SUCCESS);
+  prev_hit = dcache.hit;
+  assert(fs_lookup_dir_entry(disk_p, inode_p, "alpha") == FS_INVALID_INODE);
+  assert(dcache.hit == prev_hit + 1);
+  info("Invalidation ...Pass");
+
+  // The cache never grows beyond its budget
+  char name_buffer[128];
+  for(size_t i = 0;i < FS_DCACHE_ENTRY_MAX + 100;i++) {
+    sprintf(name_buffer, "n%lu", i);
+    assert(fs_lookup_dir_entry(disk_p, inode_p, name_buffer) == 
+           FS_INVALID_INODE);
+  }
+  assert(dcache.count == FS_DCACHE_ENTRY_MAX);
+  // Least recently used ones are evicted
+  prev_miss = dcache.miss;
+  assert(fs_lookup_dir_entry(disk_p, inode_p, "n0") == FS_INVALID_INODE);
+  assert(dcache.miss == prev_miss + 1);
+  info("Eviction (%lu entries) ...Pass", FS_DCACHE_ENTRY_MAX);
+
+  assert(fs_free_dir_entry(disk_p, inode_p, "beta") == FS_SUCCESS);
+  assert(fs_free_dir_entry(disk_p, inode_p, "delta") == FS_SUCCESS);
+
+  fs_unpin(disk_p, inode_p);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+/*
+ * test_make_dir() - Creates a directory with "." and ".." under the parent
+ */
+inode_id_t test_make_dir(Storage *disk_p, inode_id_t parent, const char *name) {
+  inode_id_t inode = fs_alloc_inode(disk_p);
+  assert(inode != FS_INVALID_INODE);
+  Inode *inode_p = fs_load_inode_sector(disk_p, inode, 1);
+  fs_pin(disk_p, inode_p);
+  fs_set_file_type(inode_p, FS_INODE_TYPE_DIR);
+  DirEntry *entry_p = fs_add_dir_entry(disk_p, inode_p);
+  entry_p->inode = inode;
+  fs_set_dir_name(disk_p, entry_p, ".", FS_SET_DIR_NAME_ALLOW_DOT);
+  entry_p = fs_add_dir_entry(disk_p, inode_p);
+  entry_p->inode = parent;
+  fs_set_dir_name(disk_p, entry_p, "..", FS_SET_DIR_NAME_ALLOW_DOT);
+  fs_unpin(disk_p, inode_p);
+
+  Inode *parent_p = fs_load_inode_sector(disk_p, parent, 1);
+  assert(fs_insert_dir_entry(disk_p, parent_p, name, inode) == FS_SUCCESS);
+  return inode;
+}
+
+void test_lookup_path(Storage *disk_p) {
+  info("=\n=Testing path lookup...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  const inode_id_t a = test_make_dir(disk_p, FS_ROOT_INODE, "a");
+  const inode_id_t b = test_make_dir(disk_p, a, "b");
+  const inode_id_t c = test_make_dir(disk_p, b, "c");
+  const int file_count = 20;
+  inode_id_t file_list[file_count];
+  char name_buffer[128];
+  for(int i = 0;i < file_count;i++) {
+    file_list[i] = fs_alloc_inode(disk_p);
+    assert(file_list[i] != FS_INVALID_INODE);
+    sprintf(name_buffer, "f%d", i);
+    Inode *inode_p = fs_load_inode_sector(disk_p, c, 1);
+    assert(fs_insert_dir_entry(disk_p, inode_p, name_buffer, file_list[i]) == 
+           FS_SUCCESS);
+  }
+  Inode *inode_p = fs_load_inode_sector(disk_p, a, 1);
+  assert(fs_insert_dir_entry(disk_p, inode_p, "x", file_list[0]) == 
+         FS_SUCCESS);
+
+  assert(fs_lookup_path(disk_p, "/") == FS_ROOT_INODE);
+  assert(fs_lookup_path(disk_p, "") == FS_ROOT_INODE);
+  assert(fs_lookup_path(disk_p, "/a/b") == b);
+  assert(fs_lookup_path(disk_p, "/a/b/c/") == c);
+  assert(fs_lookup_path(disk_p, "/a/b/c/f3") == file_list[3]);
+  assert(fs_lookup_path(disk_p, "a//b/./c/../c/f3") == file_list[3]);
+  assert(fs_lookup_path(disk_p, "/a/b/c/../../..") == FS_ROOT_INODE);
+  assert(fs_lookup_path(disk_p, "/a/nope") == FS_INVALID_INODE);
+  // Non-final components must be directories
+  assert(fs_lookup_path(disk_p, "/a/x/y") == FS_INVALID_INODE);
+  assert(fs_lookup_path(disk_p, "/a/b/c/f1/") == file_list[1]);
+  assert(fs_lookup_path(disk_p, "/a/very_long_name_x") == FS_INVALID_INODE);
+  // "." and ".." of an indexed directory
+  const inode_id_t big = test_make_dir(disk_p, FS_ROOT_INODE, "big");
+  const int big_count = context.dir_per_sector * FS_DIR_INDEX_MIN_SECTORS;
+  for(int i = 0;i < big_count;i++) {
+    sprintf(name_buffer, "n%d", i);
+    Inode *inode_p = fs_load_inode_sector(disk_p, big, 1);
+    assert(fs_insert_dir_entry(disk_p, inode_p, name_buffer, file_list[0]) == 
+           FS_SUCCESS);
+  }
+  DirIndexHeader header;
+  assert(fs_dir_index_load(disk_p, 
+                           fs_load_inode_sector(disk_p, big, 0), 
+                           &header) == 1);
+  fs_dcache_init();
+  assert(fs_lookup_path(disk_p, "/big/.") == big);
+  assert(fs_lookup_path(disk_p, "/big/..") == FS_ROOT_INODE);
+  assert(fs_lookup_path(disk_p, "/big/./n7") == file_list[0]);
+  assert(fs_lookup_path(disk_p, "/big/../a/b") == b);
+  info("Single path lookup ...Pass");
+
+  // Batch lookup in reverse order. Common components are looked up once
+  const char *path_list[file_count + 2];
+  char path_buffer[file_count][32];
+  for(int i = 0;i < file_count;i++) {
+    sprintf(path_buffer[i], "/a/b/c/f%d", file_count - 1 - i);
+    path_list[i] = path_buffer[i];
+  }
+  path_list[file_count] = "/a/b";
+  path_list[file_count + 1] = "/a/b/nope";
+  inode_id_t inode_list[file_count + 2];
+
+  fs_dcache_init();
+  const size_t found_count = \
+    fs_lookup_paths(disk_p, path_list, file_count + 2, inode_list);
+  info("  %lu names looked up for %d paths", 
+       (size_t)(dcache.hit + dcache.miss), 
+       file_count + 2);
+  // a, b, c, nope and all files
+  assert(dcache.hit + dcache.miss == (uint64_t)file_count + 4);
+  assert(found_count == file_count + 1);
+  for(int i = 0;i < file_count;i++) {
+    assert(inode_list[i] == file_list[file_count - 1 - i]);
+    assert(inode_list[i] == fs_lookup_path(disk_p, path_list[i]));
+  }
+  assert(inode_list[file_count] == b);
+  assert(inode_list[file_count + 1] == FS_INVALID_INODE);
+  info("Batched path lookup ...Pass");
+
+  // Start from a clean file system again
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+void test_icache(Storage *disk_p) {
+  info("=\n=Testing inode cache...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  inode_id_t inode = fs_alloc_inode(disk_p);
+  assert(inode != FS_INVALID_INODE);
+  const sector_t inode_sector = \
+    context.inode_start_sector + inode / context.inode_per_sector;
+  const Inode *table_p = \
+    (const Inode *)read_lba(disk_p, inode_sector) + 
+      inode % context.inode_per_sector;
+  assert(fs_get_file_size(table_p) == 0);
+
+  // Cached inodes are shared, and need no pin for file operations
+  Inode *inode_p = fs_iget(disk_p, inode);
+  uint64_t prev_hit = icache_hit;
+  assert(fs_iget(disk_p, inode) == inode_p);
+  assert(icache_hit == prev_hit + 1);
+  fs_iput(disk_p, inode_p);
+  assert(fs_get_inode_id(disk_p, inode_p) == inode);
+
+  const size_t sector_count = MAX_BUFFER * 2;
+  const size_t len = sector_count * disk_p->sector_size;
+  uint8_t *data_p = malloc(len);
+  uint8_t *read_p = malloc(len);
+  for(size_t i = 0;i < len;i++) {
+    data_p[i] = (uint8_t)(i * 7);
+  }
+  assert(fs_write(disk_p, inode_p, 0, len, data_p) == len);
+  assert(fs_read(disk_p, inode_p, 0, len, read_p) == len);
+  assert(memcmp(data_p, read_p, len) == 0);
+  assert(fs_get_file_size(inode_p) == len);
+  assert(buffer_count_pinned() == 0UL);
+
+  // The inode table is only updated on write back
+  table_p = \
+    (const Inode *)read_lba(disk_p, inode_sector) + 
+      inode % context.inode_per_sector;
+  assert(fs_get_file_size(table_p) == 0);
+  fs_sync(disk_p);
+  assert(fs_get_file_size(table_p) == len);
+  assert(memcmp(table_p, inode_p, sizeof(Inode)) == 0);
+  info("Lazy write back ...Pass");
+
+  // Evicting a dirty inode also writes it back
+  fs_set_file_size(inode_p, len / 2);
+  fs_set_dirty(disk_p, inode_p);
+  fs_iput(disk_p, inode_p);
+  for(inode_id_t i = 0;i < FS_ICACHE_INODE_MAX;i++) {
+    inode_id_t other = (inode + 1 + i) % context.total_inode_count;
+    fs_iput(disk_p, fs_iget(disk_p, other));
+  }
+  assert(fs_icache_find(inode) == NULL);
+  table_p = \
+    (const Inode *)read_lba(disk_p, inode_sector) + 
+      inode % context.inode_per_sector;
+  assert(fs_get_file_size(table_p) == len / 2);
+
+  // Loading the inode again reads the written back copy
+  inode_p = fs_iget(disk_p, inode);
+  assert(fs_get_file_size(inode_p) == len / 2);
+  fs_iput(disk_p, inode_p);
+  info("Eviction ...Pass");
+
+  // Growing and shrinking a cached directory changes its size only in the
+  // cache, which must still reach the disk
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  // Names are spread over several files to stay within the link count
+  inode_id_t file_list[12];
+  int link_list[12];
+  for(int i = 0;i < 12;i++) {
+    file_list[i] = fs_alloc_inode(disk_p);
+    assert(file_list[i] != FS_INVALID_INODE);
+    link_list[i] = context.dir_per_sector;
+  }
+  Inode *root_p = fs_iget(disk_p, FS_ROOT_INODE);
+  const int name_count = context.dir_per_sector * 12;
+  char name_buffer[FS_DIR_ENTRY_NAME_MAX + 1];
+  for(int i = 0;i < name_count;i++) {
+    sprintf(name_buffer, "d%d", i);
+    assert(fs_insert_dir_entry(disk_p, root_p, name_buffer, 
+                               file_list[i % 12]) == FS_SUCCESS);
+  }
+  const size_t dir_size = fs_get_file_size(root_p);
+  assert(dir_size == 13 * disk_p->sector_size);
+  fs_sync(disk_p);
+  // Empty the fifth sector, which is replaced by the last one
+  char (*victim_list)[FS_DIR_ENTRY_NAME_MAX + 1] = \
+    calloc(context.dir_per_sector, FS_DIR_ENTRY_NAME_MAX + 1);
+  const DirEntry *entry_p = \
+    fs_dir_entry_at(disk_p, root_p, 5 * context.dir_per_sector, 0);
+  for(int i = 0;i < context.dir_per_sector;i++) {
+    memcpy(victim_list[i], entry_p[i].name, FS_DIR_ENTRY_NAME_MAX);
+  }
+  for(int i = 0;i < context.dir_per_sector;i++) {
+    assert(fs_free_dir_entry(disk_p, root_p, victim_list[i]) == FS_SUCCESS);
+    link_list[atoi(victim_list[i] + 1) % 12]--;
+  }
+  free(victim_list);
+  assert(fs_get_file_size(root_p) == dir_size - disk_p->sector_size);
+  fs_iput(disk_p, root_p);
+  for(int i = 0;i < 12;i++) {
+    Inode *file_p = fs_iget(disk_p, file_list[i]);
+    file_p->nlinks = link_list[i];
+    fs_set_dirty(disk_p, file_p);
+    fs_iput(disk_p, file_p);
+  }
+  fs_sync(disk_p);
+  buffer_flush_all(disk_p);
+  fs_load_context(disk_p);
+  root_p = fs_iget(disk_p, FS_ROOT_INODE);
+  assert(fs_get_file_size(root_p) == dir_size - disk_p->sector_size);
+  assert(fs_lookup_dir_entry(disk_p, root_p, "missing") == FS_INVALID_INODE);
+  fs_iput(disk_p, root_p);
+  FsckResult result;
+  assert(fs_fsck(disk_p, 2, &result) == 0);
+  info("Cached directory size ...Pass");
+
+  // Pointers from fs_load_inode_sector() and fs_iget() are used in turn, and
+  // must refer to the same copy of the inode
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  const inode_id_t file = fs_alloc_inode(disk_p);
+  assert(file != FS_INVALID_INODE);
+  Dir dir = fs_open_dir(disk_p, FS_ROOT_INODE);
+  assert(fs_icache_find(FS_ROOT_INODE) != NULL);
+  // The inode is cached by fs_open_dir(). Insert through the pointer loaded
+  // from the sector, and then through fs_iget()
+  root_p = fs_load_inode_sector(disk_p, FS_ROOT_INODE, 
+                                FS_LOAD_INODE_SECTOR_READ_ONLY);
+  fs_pin(disk_p, root_p);
+  for(int i = 0;i < 50;i++) {
+    sprintf(name_buffer, "m%d", i);
+    assert(fs_insert_dir_entry(disk_p, root_p, name_buffer, file) == 
+           FS_SUCCESS);
+  }
+  fs_unpin(disk_p, root_p);
+  root_p = fs_iget(disk_p, FS_ROOT_INODE);
+  for(int i = 50;i < 100;i++) {
+    sprintf(name_buffer, "m%d", i);
+    assert(fs_insert_dir_entry(disk_p, root_p, name_buffer, file) == 
+           FS_SUCCESS);
+  }
+  fs_iput(disk_p, root_p);
+  // Count before the cache is written back, and after reloading
+  for(int round = 0;round < 2;round++) {
+    dir = fs_open_dir(disk_p, FS_ROOT_INODE);
+    int count = 0;
+    while(fs_next_dir(disk_p, &dir) != NULL) {
+      count++;
+    }
+    assert(count == 100);
+    if(round == 0) {
+      Inode *file_p = fs_iget(disk_p, file);
+      file_p->nlinks = 100;
+      fs_set_dirty(disk_p, file_p);
+      fs_iput(disk_p, file_p);
+      fs_sync(disk_p);
+      buffer_flush_all(disk_p);
+      fs_load_context(disk_p);
+    }
+  }
+  // A pinned sector is shared instead of cached
+  const inode_id_t other = fs_alloc_inode(disk_p);
+  assert(other != FS_INVALID_INODE && fs_icache_find(other) == NULL);
+  Inode *buffer_inode_p = \
+    fs_load_inode_sector(disk_p, other, FS_LOAD_INODE_SECTOR_WRITE);
+  fs_pin(disk_p, buffer_inode_p);
+  inode_p = fs_iget(disk_p, other);
+  assert(inode_p == buffer_inode_p && fs_icache_find(other) == NULL);
+  fs_release_inode(disk_p, other);
+  fs_iput(disk_p, inode_p);
+  fs_unpin(disk_p, buffer_inode_p);
+  assert(buffer_count_pinned() == 0UL);
+  assert(fs_fsck(disk_p, 2, &result) == 0);
+  info("Mixed access ...Pass");
+
+  free(data_p);
+  free(read_p);
+  // Start from a clean file system again
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+void test_readdir_bulk(Storage *disk_p) {
+  info("=\n=Testing bulk readdir...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  Inode *inode_p = fs_iget(disk_p, FS_ROOT_INODE);
+  const int total_entry = 300;
+  char name_buffer[128];
+  for(int i = 0;i < total_entry;i++) {
+    sprintf(name_buffer, "r%d", i);
+    assert(fs_insert_dir_entry(disk_p, inode_p, name_buffer, 
+                               (inode_id_t)i) == FS_SUCCESS);
+  }
+  // Leave holes in the directory
+  for(int i = 0;i < total_entry;i += 5) {
+    sprintf(name_buffer, "r%d", i);
+    assert(fs_free_dir_entry(disk_p, inode_p, name_buffer) == FS_SUCCESS);
+  }
+
+  // Read in small batches, and resume from a saved cookie each time
+  char *seen_p = calloc(total_entry, 1);
+  DirEntry entry_list[7];
+  Dir dir = fs_open_dir(disk_p, FS_ROOT_INODE);
+  int count = 0;
+  while(1) {
+    const uint32_t cookie = fs_dir_tell(&dir);
+    dir = fs_open_dir(disk_p, FS_ROOT_INODE);
+    fs_dir_seek(&dir, cookie);
+    size_t ret = fs_readdir_bulk(disk_p, &dir, entry_list, 7);
+    if(ret == 0) {
+      break;
+    }
+    for(size_t i = 0;i < ret;i++) {
+      const int index = entry_list[i].inode;
+      assert(index < total_entry && index % 5 != 0);
+      assert(seen_p[index] == 0);
+      sprintf(name_buffer, "r%d", index);
+      assert(memcmp(entry_list[i].name, name_buffer, strlen(name_buffer)) == 0);
+      seen_p[index] = 1;
+      count++;
+    }
+  }
+  assert(count == total_entry - total_entry / 5);
+
+  // Results match those of fs_next_dir()
+  dir = fs_open_dir(disk_p, FS_ROOT_INODE);
+  Dir bulk_dir = fs_open_dir(disk_p, FS_ROOT_INODE);
+  const DirEntry *entry_p;
+  while((entry_p = fs_next_dir(disk_p, &dir)) != NULL) {
+    assert(fs_readdir_bulk(disk_p, &bulk_dir, entry_list, 1) == 1);
+    assert(memcmp(entry_p, entry_list, sizeof(DirEntry)) == 0);
+  }
+  assert(fs_readdir_bulk(disk_p, &bulk_dir, entry_list, 1) == 0);
+  info("Read %d entries ...Pass", count);
+
+  for(int i = 0;i < total_entry;i++) {
+    if(i % 5 != 0) {
+      sprintf(name_buffer, "r%d", i);
+      assert(fs_free_dir_entry(disk_p, inode_p, name_buffer) == FS_SUCCESS);
+    }
+  }
+  fs_iput(disk_p, inode_p);
+  free(seen_p);
+
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+// Number of multi-sector writes made through test_write_multi()
+size_t test_write_multi_count;
+
+/*
+ * test_write_multi() - Counts multi-sector writes to the memory storage
+ */
+void test_write_multi(Storage *disk_p, 
+                      uint64_t lba, 
+                      size_t count, 
+                      const void *buffer) {
+  test_write_multi_count++;
+  mem_write_multi(disk_p, lba, count, buffer);
+
+  return;
+}
+
+void test_delalloc(Storage *disk_p) {
+  info("=\n=Testing delayed allocation...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  // One file goes through the inode cache, and the other through buffers
+  inode_id_t inode_list[2];
+  Inode *inode_p_list[2];
+  inode_list[0] = fs_alloc_inode(disk_p);
+  inode_list[1] = fs_alloc_inode(disk_p);
+  assert(inode_list[0] != FS_INVALID_INODE);
+  assert(inode_list[1] != FS_INVALID_INODE);
+  inode_p_list[0] = fs_iget(disk_p, inode_list[0]);
+  inode_p_list[1] = fs_load_inode_sector(disk_p, inode_list[1], 1);
+  fs_pin(disk_p, inode_p_list[1]);
+
+  // Both files must fit in the delayed allocation buffer
+  const size_t sector_count = \
+    (FS_DELALLOC_SECTOR_MAX / 2 - 1 < 200) ? \
+    FS_DELALLOC_SECTOR_MAX / 2 - 1 : 200;
+  const size_t test_size = disk_p->sector_size * sector_count + 77;
+  uint8_t *src_p = malloc(test_size * 2);
+  uint8_t *dest_p = malloc(test_size);
+  assert(src_p != NULL && dest_p != NULL);
+  for(size_t i = 0;i < test_size * 2;i++) {
+    src_p[i] = (uint8_t)(i * 13 + i / 509);
+  }
+
+  fs_set_delayed_alloc(disk_p, 1);
+  const size_t free_count = fs_count_free_sectors();
+  info("Interleaving writes to inode %u and %u...", 
+       (uint32_t)inode_list[0], (uint32_t)inode_list[1]);
+  const size_t chunk = 700;
+  for(size_t offset = 0;offset < test_size;offset += chunk) {
+    const size_t len = (test_size - offset < chunk) ? \
+      (test_size - offset) : chunk;
+    for(int i = 0;i < 2;i++) {
+      assert(fs_write(disk_p, inode_p_list[i], offset, len, 
+                      src_p + i * test_size + offset) == len);
+    }
+  }
+  // Nothing is allocated yet, and data is read from memory
+  assert(fs_count_free_sectors() == free_count);
+  assert(fs_get_file_sector(disk_p, inode_p_list[0], 0) == FS_INVALID_SECTOR);
+  for(int i = 0;i < 2;i++) {
+    assert(fs_get_file_size(inode_p_list[i]) == test_size);
+    assert(fs_read(disk_p, inode_p_list[i], 0, test_size, dest_p) == test_size);
+    assert(memcmp(src_p + i * test_size, dest_p, test_size) == 0);
+  }
+  info("  ...Pass");
+
+  info("Allocating on sync...");
+  fs_sync(disk_p);
+  for(int i = 0;i < 2;i++) {
+    sector_t first = FS_INVALID_SECTOR;
+    sector_t prev = FS_INVALID_SECTOR;
+    for(size_t j = 0;j <= sector_count;j++) {
+      const sector_t sector = \
+        fs_get_file_sector(disk_p, inode_p_list[i], j * disk_p->sector_size);
+      assert(sector != FS_INVALID_SECTOR);
+      assert(prev == FS_INVALID_SECTOR || sector > prev);
+      if(first == FS_INVALID_SECTOR) {
+        first = sector;
+      }
+      prev = sector;
+    }
+    // Data sectors are contiguous except for indirection sectors between them
+    info("  Inode %u: sector %u - %u", 
+         (uint32_t)inode_list[i], (uint32_t)first, (uint32_t)prev);
+    assert(prev - first + 1 <= sector_count + 1 + 2);
+    assert(fs_read(disk_p, inode_p_list[i], 0, test_size, dest_p) == test_size);
+    assert(memcmp(src_p + i * test_size, dest_p, test_size) == 0);
+  }
+  assert(fs_count_free_sectors() < free_count);
+  info("  ...Pass");
+
+  info("Overwriting allocated sectors...");
+  assert(fs_write(disk_p, inode_p_list[0], 1000, 5000, src_p + test_size) 
+         == 5000);
+  memcpy(src_p + 1000, src_p + test_size, 5000);
+  assert(fs_read(disk_p, inode_p_list[0], 0, test_size, dest_p) == test_size);
+  assert(memcmp(src_p, dest_p, test_size) == 0);
+  info("  ...Pass");
+
+  info("Batching aligned overwrites...");
+  const size_t sector_size = disk_p->sector_size;
+  sector_t start;
+  const size_t extent_count = \
+    fs_map_range(disk_p, inode_p_list[0], 0, FS_IO_BATCH_MAX, &start);
+  assert(start != FS_INVALID_SECTOR && extent_count > 1);
+  assert(disk_p->write_multi == mem_write_multi);
+  test_write_multi_count = 0;
+  disk_p->write_multi = test_write_multi;
+  assert(fs_write(disk_p, inode_p_list[0], 0, extent_count * sector_size, 
+                  src_p) == extent_count * sector_size);
+  disk_p->write_multi = mem_write_multi;
+  assert(test_write_multi_count == 1);
+  info("  %lu sectors in one request ...Pass", extent_count);
+
+  info("Reserving space for delayed sectors...");
+  // Delayed sectors under two leaf indirection sectors of a new file
+  const inode_id_t inode = fs_alloc_inode(disk_p);
+  assert(inode != FS_INVALID_INODE);
+  Inode *inode_p = fs_iget(disk_p, inode);
+  const size_t leaf_size = context.id_per_indir_sector * sector_size;
+  assert(fs_write(disk_p, inode_p, 0, sector_size, src_p) == sector_size);
+  assert(fs_write(disk_p, inode_p, 2 * leaf_size, sector_size, src_p) == 
+         sector_size);
+  assert(delalloc.reserved == 2 * (1 + FS_INDIR_LEVEL_MAX + 1));
+  // Other allocations leave the reserved sectors free
+  sector_t *sector_list = malloc(fs_count_free_sectors() * sizeof(sector_t));
+  assert(sector_list != NULL);
+  size_t alloc_count = 0;
+  while((sector_list[alloc_count] = fs_alloc_sector(disk_p)) != 
+        FS_INVALID_SECTOR) {
+    alloc_count++;
+  }
+  assert(fs_count_free_sectors() == delalloc.reserved);
+  // Writes that could not be reserved fail at once
+  assert(fs_write(disk_p, inode_p, sector_size, sector_size, src_p) == 0);
+  assert(fs_write(disk_p, inode_p, 5 * leaf_size, 1, src_p) == 0);
+  assert(fs_get_file_size(inode_p) == 2 * leaf_size + sector_size);
+  // Delayed sectors are allocated from the reserved space
+  fs_sync(disk_p);
+  assert(fs_get_file_sector(disk_p, inode_p, 2 * leaf_size) != 
+         FS_INVALID_SECTOR);
+  assert(fs_read(disk_p, inode_p, 2 * leaf_size, sector_size, dest_p) == 
+         sector_size);
+  assert(memcmp(src_p, dest_p, sector_size) == 0);
+  fs_iput(disk_p, inode_p);
+  free(sector_list);
+  info("  %lu sectors allocated besides ...Pass", alloc_count);
+
+  fs_set_delayed_alloc(disk_p, 0);
+  fs_iput(disk_p, inode_p_list[0]);
+  fs_unpin(disk_p, inode_p_list[1]);
+  free(src_p);
+  free(dest_p);
+  // Reclaim sectors used by the files
+  buffer_flush_all(disk_p);
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+void test_truncate(Storage *disk_p) {
+  info("=\n=Testing truncate and unlink...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  const size_t sector_size = disk_p->sector_size;
+  const size_t free_count = fs_count_free_sectors();
+  inode_id_t inode = fs_alloc_inode(disk_p);
+  assert(inode != FS_INVALID_INODE);
+  Inode *inode_p = fs_load_inode_sector(disk_p, inode, 1);
+  fs_pin(disk_p, inode_p);
+
+  // Make the file extra large if the disk is large enough
+  size_t sector_count = context.extra_large_start_sector + 10;
+  if(sector_count + 16 > free_count) {
+    sector_count = free_count - 16;
+  }
+  const size_t test_size = sector_count * sector_size;
+  uint8_t *src_p = malloc(test_size);
+  uint8_t *dest_p = malloc(test_size);
+  assert(src_p != NULL && dest_p != NULL);
+  for(size_t i = 0;i < test_size;i++) {
+    src_p[i] = (uint8_t)(i * 3 + i / 257 + 1);
+  }
+  assert(fs_write(disk_p, inode_p, 0, test_size, src_p) == test_size);
+  info("Wrote %lu sectors; extra large: %d", 
+       sector_count, fs_is_file_extra_large(inode_p));
+
+  // Number of indirection sectors of a file that is entirely written
+  const size_t id_count = context.id_per_indir_sector;
+#define TEST_TRUNCATE_USED(count) \
+    ((count) + ((count) + id_count - 1) / id_count)
+
+  info("Shrinking within an indirection sector...");
+  const size_t new_size = 300 * sector_size + 10;
+  fs_truncate(disk_p, inode_p, new_size);
+  assert(fs_get_file_size(inode_p) == new_size);
+  assert(fs_count_free_sectors() == free_count - TEST_TRUNCATE_USED(301));
+  // Extending again exposes zeros after the old end
+  fs_truncate(disk_p, inode_p, 302 * sector_size);
+  assert(fs_count_free_sectors() == free_count - TEST_TRUNCATE_USED(301));
+  assert(fs_read(disk_p, inode_p, 0, 302 * sector_size, dest_p) == 
+         302 * sector_size);
+  assert(memcmp(src_p, dest_p, new_size) == 0);
+  for(size_t i = new_size;i < 302 * sector_size;i++) {
+    assert(dest_p[i] == 0x00);
+  }
+  info("  ...Pass");
+
+  info("Shrinking into the addr. array...");
+  fs_truncate(disk_p, inode_p, 5 * sector_size);
+  assert(fs_count_free_sectors() == free_count - TEST_TRUNCATE_USED(5));
+  assert(fs_read(disk_p, inode_p, 0, test_size, dest_p) == 5 * sector_size);
+  assert(memcmp(src_p, dest_p, 5 * sector_size) == 0);
+  fs_truncate(disk_p, inode_p, 0);
+  assert(fs_count_free_sectors() == free_count);
+  assert(fs_is_file_large(inode_p) == 0);
+  info("  ...Pass");
+#undef TEST_TRUNCATE_USED
+
+  info("Truncating delayed sectors...");
+  fs_set_delayed_alloc(disk_p, 1);
+  assert(fs_write(disk_p, inode_p, 0, 20 * sector_size, src_p) == 
+         20 * sector_size);
+  fs_truncate(disk_p, inode_p, 10 * sector_size - 1);
+  fs_set_delayed_alloc(disk_p, 0);
+  assert(fs_count_free_sectors() == free_count - 10 - 1);
+  assert(fs_read(disk_p, inode_p, 0, test_size, dest_p) == 
+         10 * sector_size - 1);
+  assert(memcmp(src_p, dest_p, 10 * sector_size - 1) == 0);
+  fs_unpin(disk_p, inode_p);
+  info("  ...Pass");
+
+  info("Unlinking...");
+  Inode *root_p = fs_iget(disk_p, FS_ROOT_INODE);
+  assert(fs_insert_dir_entry(disk_p, root_p, "unlink", inode) == FS_SUCCESS);
+  assert(fs_unlink(disk_p, root_p, "unlink") == FS_SUCCESS);
+  assert(fs_unlink(disk_p, root_p, "unlink") == FS_ERR_NAME_NOT_FOUND);
+  assert(fs_lookup_dir_entry(disk_p, root_p, "unlink") == FS_INVALID_INODE);
+  fs_iput(disk_p, root_p);
+  inode_p = fs_load_inode_sector(disk_p, inode, 0);
+  assert((inode_p->flags & FS_INODE_IN_USE) == 0);
+  assert(fs_count_free_sectors() == free_count);
+  info("  ...Pass");
+
+  free(src_p);
+  free(dest_p);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+void test_sparse(Storage *disk_p) {
+  info("=\n=Testing sparse files...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  const size_t sector_size = disk_p->sector_size;
+  inode_id_t inode = fs_alloc_inode(disk_p);
+  assert(inode != FS_INVALID_INODE);
+  Inode *inode_p = fs_load_inode_sector(disk_p, inode, 1);
+  fs_pin(disk_p, inode_p);
+
+  // Data sectors at logical sector 0, 1000 and 1001, and the file ends with
+  // a long hole
+  const size_t file_size = FS_FILE_SIZE_MAX / sector_size * sector_size;
+  const size_t end = file_size / sector_size;
+  uint8_t data[DEFAULT_SECTOR_SIZE * 2];
+  memset(data, 0xAB, sizeof(data));
+  assert(fs_write(disk_p, inode_p, 0, sector_size, data) == sector_size);
+  assert(fs_write(disk_p, inode_p, 1000 * sector_size, 2 * sector_size, data)
+         == 2 * sector_size);
+  fs_truncate(disk_p, inode_p, file_size);
+
+  info("Mapping extents...");
+  sector_t start;
+  assert(fs_map_range(disk_p, inode_p, 0, end, &start) == 1);
+  assert(start != FS_INVALID_SECTOR);
+  assert(fs_map_range(disk_p, inode_p, 1, end - 1, &start) == 999);
+  assert(start == FS_INVALID_SECTOR);
+  assert(fs_map_range(disk_p, inode_p, 1000, end - 1000, &start) == 2);
+  assert(start == fs_get_file_sector(disk_p, inode_p, 1000 * sector_size));
+  assert(fs_map_range(disk_p, inode_p, 1002, end - 1002, &start) == 
+         end - 1002);
+  assert(start == FS_INVALID_SECTOR);
+  info("  ...Pass");
+
+  info("Seeking data and holes...");
+  assert(fs_seek_data(disk_p, inode_p, 0) == 0);
+  assert(fs_seek_hole(disk_p, inode_p, 0) == sector_size);
+  assert(fs_seek_data(disk_p, inode_p, 100) == 100);
+  assert(fs_seek_data(disk_p, inode_p, sector_size) == 1000 * sector_size);
+  assert(fs_seek_data(disk_p, inode_p, 1000 * sector_size + 7) == 
+         1000 * sector_size + 7);
+  assert(fs_seek_hole(disk_p, inode_p, 1000 * sector_size) == 
+         1002 * sector_size);
+  assert(fs_seek_data(disk_p, inode_p, 1002 * sector_size) == FS_SEEK_NONE);
+  assert(fs_seek_hole(disk_p, inode_p, file_size - 1) == file_size - 1);
+  assert(fs_seek_hole(disk_p, inode_p, file_size) == FS_SEEK_NONE);
+  // Delayed sectors are data
+  fs_set_delayed_alloc(disk_p, 1);
+  assert(fs_write(disk_p, inode_p, 5000 * sector_size, 1, data) == 1);
+  assert(fs_seek_data(disk_p, inode_p, 1002 * sector_size) == 
+         5000 * sector_size);
+  assert(fs_seek_hole(disk_p, inode_p, 5000 * sector_size) == 
+         5001 * sector_size);
+  fs_set_delayed_alloc(disk_p, 0);
+  info("  ...Pass");
+
+  info("Reading the entire file...");
+  // Files of the 32-bit layout are too large to be read entirely
+  const size_t read_size = \
+    (file_size < 32 * 1024 * 1024) ? file_size : 32 * 1024 * 1024;
+  uint8_t *dest_p = malloc(read_size);
+  assert(dest_p != NULL);
+  assert(fs_read(disk_p, inode_p, 0, read_size, dest_p) == read_size);
+  for(size_t i = 0;i < read_size;i++) {
+    const size_t logical = i / sector_size;
+    if(logical == 0 || logical == 1000 || logical == 1001 || 
+       i == 5000 * sector_size) {
+      assert(dest_p[i] == 0xAB);
+    } else {
+      assert(dest_p[i] == 0x00);
+    }
+  }
+  free(dest_p);
+  info("  ...Pass");
+
+  fs_truncate(disk_p, inode_p, 0);
+  fs_unpin(disk_p, inode_p);
+  fs_free_inode(disk_p, inode);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+void test_inline(Storage *disk_p) {
+  info("=\n=Testing inline files...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  const size_t free_count = fs_count_free_sectors();
+  inode_id_t inode = fs_alloc_inode(disk_p);
+  assert(inode != FS_INVALID_INODE);
+  Inode *inode_p = fs_iget(disk_p, inode);
+  uint8_t data[FS_INLINE_SIZE_MAX + 64];
+  for(size_t i = 0;i < sizeof(data);i++) {
+    data[i] = (uint8_t)(i + 1);
+  }
+  uint8_t dest[sizeof(data)];
+
+  info("Writing a tiny file...");
+  assert(fs_write(disk_p, inode_p, 0, 3, data) == 3);
+  assert(fs_is_file_inline(inode_p) == 1);
+  assert(fs_get_file_sector(disk_p, inode_p, 0) == FS_INVALID_SECTOR);
+  // Write after the end leaves zeros in between
+  assert(fs_write(disk_p, inode_p, 5, 2, data + 5) == 2);
+  assert(fs_count_free_sectors() == free_count);
+  // Read back from the inode sector
+  fs_iput(disk_p, inode_p);
+  fs_sync(disk_p);
+  buffer_flush_all(disk_p);
+  fs_icache_init();
+  inode_p = fs_iget(disk_p, inode);
+  assert(fs_is_file_inline(inode_p) == 1);
+  assert(fs_read(disk_p, inode_p, 0, sizeof(dest), dest) == 7);
+  assert(memcmp(dest, data, 3) == 0);
+  assert(dest[3] == 0x00 && dest[4] == 0x00);
+  assert(memcmp(dest + 5, data + 5, 2) == 0);
+  assert(fs_seek_data(disk_p, inode_p, 4) == 4);
+  assert(fs_seek_hole(disk_p, inode_p, 0) == 7);
+  info("  ...Pass");
+
+  info("Truncating an inline file...");
+  assert(fs_truncate(disk_p, inode_p, 1) == FS_SUCCESS);
+  assert(fs_truncate(disk_p, inode_p, FS_INLINE_SIZE_MAX) == FS_SUCCESS);
+  assert(fs_is_file_inline(inode_p) == 1);
+  assert(fs_read(disk_p, inode_p, 0, sizeof(dest), dest) == 
+         FS_INLINE_SIZE_MAX);
+  assert(dest[0] == data[0]);
+  for(size_t i = 1;i < FS_INLINE_SIZE_MAX;i++) {
+    assert(dest[i] == 0x00);
+  }
+  info("  ...Pass");
+
+  info("Growing out of the inode...");
+  assert(fs_write(disk_p, inode_p, 1, sizeof(data) - 1, data + 1) == 
+         sizeof(data) - 1);
+  assert(fs_is_file_inline(inode_p) == 0);
+  assert(fs_get_file_sector(disk_p, inode_p, 0) != FS_INVALID_SECTOR);
+  assert(fs_count_free_sectors() == free_count - 1);
+  assert(fs_read(disk_p, inode_p, 0, sizeof(dest), dest) == sizeof(data));
+  assert(memcmp(dest, data, sizeof(data)) == 0);
+  // It is not made inline again after shrinking, until it is emptied
+  assert(fs_truncate(disk_p, inode_p, 2) == FS_SUCCESS);
+  assert(fs_is_file_inline(inode_p) == 0);
+  assert(fs_truncate(disk_p, inode_p, 0) == FS_SUCCESS);
+  assert(fs_count_free_sectors() == free_count);
+  assert(fs_write(disk_p, inode_p, 0, 4, data) == 4);
+  assert(fs_is_file_inline(inode_p) == 1);
+  // Extending by truncate also moves the data
+  assert(fs_truncate(disk_p, inode_p, disk_p->sector_size * 3) == FS_SUCCESS);
+  assert(fs_is_file_inline(inode_p) == 0);
+  assert(fs_read(disk_p, inode_p, 0, 4, dest) == 4);
+  assert(memcmp(dest, data, 4) == 0);
+  info("  ...Pass");
+
+  fs_iput(disk_p, inode_p);
+  fs_release_inode(disk_p, inode);
+  assert(fs_count_free_sectors() == free_count);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+/*
+ * test_dir_slot_verify() - Checks the cached free slot summary against one
+ *                          that is built from the directory
+ */
+void test_dir_slot_verify(Storage *disk_p, Inode *inode_p, inode_id_t inode) {
+  DirSlotEntry *entry_p = fs_dir_slot_find(inode);
+  assert(entry_p != NULL);
+  const size_t sector_count = entry_p->sector_count;
+  uint16_t *free_count_p = malloc(sector_count * sizeof(uint16_t));
+  memcpy(free_count_p, entry_p->free_count_p, sector_count * sizeof(uint16_t));
+  fs_dir_slot_invalidate(inode);
+  entry_p = fs_dir_slot_load(disk_p, inode_p, inode);
+  assert(entry_p->sector_count == sector_count);
+  assert(sector_count == fs_get_file_size(inode_p) / disk_p->sector_size);
+  assert(memcmp(free_count_p, 
+                entry_p->free_count_p, 
+                sector_count * sizeof(uint16_t)) == 0);
+  free(free_count_p);
+
+  return;
+}
+
+/*
+ * test_dir_slot_is_freed() - Returns 1 if the i-th name is freed and added
+ *                            again by the test
+ *
+ * Names start after "." and "..". This frees all names of the third sector
+ */
+int test_dir_slot_is_freed(int i) {
+  return (i % 7 == 3) || ((i + 2) / context.dir_per_sector == 2);
+}
+
+void test_dir_slot(Storage *disk_p) {
+  info("=\n=Testing directory free slot summary...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  const inode_id_t inode = test_make_dir(disk_p, FS_ROOT_INODE, "slot");
+  Inode *inode_p = fs_iget(disk_p, inode);
+  const int total_entry = context.dir_per_sector * 6;
+  char name_buffer[128];
+  for(int i = 0;i < total_entry;i++) {
+    sprintf(name_buffer, "s%d", i);
+    assert(fs_insert_dir_entry(disk_p, inode_p, name_buffer, 
+                               (inode_id_t)i) == FS_SUCCESS);
+  }
+  const size_t dir_size = fs_get_file_size(inode_p);
+  test_dir_slot_verify(disk_p, inode_p, inode);
+  info("Built summary for %lu sectors", dir_size / disk_p->sector_size);
+
+  info("Reusing freed entries...");
+  // Free a few entries in the middle, and empty one sector entirely
+  for(int i = 0;i < total_entry;i++) {
+    if(test_dir_slot_is_freed(i)) {
+      sprintf(name_buffer, "s%d", i);
+      assert(fs_free_dir_entry(disk_p, inode_p, name_buffer) == FS_SUCCESS);
+    }
+  }
+  assert(fs_get_file_size(inode_p) == dir_size - disk_p->sector_size);
+  test_dir_slot_verify(disk_p, inode_p, inode);
+  int reused = 0;
+  for(int i = 0;i < total_entry;i++) {
+    if(test_dir_slot_is_freed(i)) {
+      sprintf(name_buffer, "t%d", i);
+      assert(fs_insert_dir_entry(disk_p, inode_p, name_buffer, 
+                                 (inode_id_t)i) == FS_SUCCESS);
+      reused++;
+    }
+  }
+  // Every freed entry is taken before a new sector is allocated
+  assert(fs_get_file_size(inode_p) == dir_size);
+  test_dir_slot_verify(disk_p, inode_p, inode);
+  for(int i = 0;i < total_entry;i++) {
+    sprintf(name_buffer, "%c%d", 
+            test_dir_slot_is_freed(i) ? 't' : 's', 
+            i);
+    assert(fs_lookup_dir_entry(disk_p, inode_p, name_buffer) == i);
+  }
+  info("Reused %d entries ...Pass", reused);
+
+  // Remove the test directory
+  for(int i = 0;i < total_entry;i++) {
+    sprintf(name_buffer, "%c%d", 
+            test_dir_slot_is_freed(i) ? 't' : 's', 
+            i);
+    assert(fs_free_dir_entry(disk_p, inode_p, name_buffer) == FS_SUCCESS);
+  }
+  test_dir_slot_verify(disk_p, inode_p, inode);
+  fs_iput(disk_p, inode_p);
+  Inode *root_p = fs_iget(disk_p, FS_ROOT_INODE);
+  assert(fs_unlink(disk_p, root_p, "slot") == FS_SUCCESS);
+  fs_iput(disk_p, root_p);
+  assert(fs_dir_slot_find(inode) == NULL);
+
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
 
-      break;
-    }
+void test_lazy_inode(Storage *disk_p) {
+  info("=\n=Testing lazy inode initialization...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
 
-    info("  ...Done");
+  // Fill the inode sectors with garbage, which must never be read as inodes
+  const size_t inode_sector_count = context.inode_sector_count;
+  uint8_t *garbage_p = malloc(inode_sector_count * disk_p->sector_size);
+  assert(garbage_p != NULL);
+  memset(garbage_p, 0xFF, inode_sector_count * disk_p->sector_size);
+  write_lba_multi(disk_p, FS_SB_SECTOR + 1, inode_sector_count, garbage_p);
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  // Only the sector of the root inode is initialized
+  assert(context.inode_init_sector_count == 1);
+
+  info("Allocating inodes...");
+  const int alloc_count = context.inode_per_sector * 3;
+  inode_id_t inode_list[context.inode_per_sector * 3];
+  for(int i = 0;i < alloc_count;i++) {
+    inode_list[i] = fs_alloc_inode(disk_p);
+    assert(inode_list[i] != FS_INVALID_INODE);
+    assert(inode_list[i] / context.inode_per_sector < 
+           context.inode_init_sector_count);
+    const Inode *inode_p = fs_load_inode_sector(disk_p, inode_list[i], 0);
+    assert(inode_p->flags == FS_INODE_IN_USE);
+    assert(fs_get_file_size(inode_p) == 0);
+    assert(inode_p->addr[0] == FS_INVALID_SECTOR);
+  }
+  const size_t init_count = context.inode_init_sector_count;
+  assert(init_count < inode_sector_count);
+  // Sectors after the mark are not written
+  const uint8_t *data_p = read_lba(disk_p, FS_SB_SECTOR + 1 + init_count);
+  for(size_t i = 0;i < disk_p->sector_size;i++) {
+    assert(data_p[i] == 0xFF);
+  }
+  info("  %lu of %lu inode sectors initialized ...Pass", 
+       init_count, inode_sector_count);
 
-    round++;
-  } // while(1)
+  info("Reloading the file system...");
+  fs_sync(disk_p);
+  buffer_flush_all(disk_p);
+  fs_load_context(disk_p);
+  assert(context.inode_init_sector_count == init_count);
+  fs_inode_map_build(disk_p);
+  for(int i = 0;i < alloc_count;i++) {
+    const Inode *inode_p = fs_load_inode_sector(disk_p, inode_list[i], 0);
+    assert(inode_p->flags & FS_INODE_IN_USE);
+  }
+  // Inodes that are not initialized are free in the bitmap
+  inode_id_t free_list[FS_FREE_ARRAY_MAX];
+  const int free_count = fs_inode_map_scan(free_list, FS_FREE_ARRAY_MAX);
+  assert(free_count == FS_FREE_ARRAY_MAX);
+  info("  ...Pass");
 
-  free(sector_map);
+  free(garbage_p);
   buffer_flush_all(disk_p);
   assert(buffer_count_pinned() == 0UL);
-
   return;
 }
 
-void test_alloc_inode(Storage *disk_p) {
-  info("=\n=Testing allocating inode...\n=");
+void test_fsck(Storage *disk_p) {
+  info("=\n=Testing file system check...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
 
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  const size_t sector_size = disk_p->sector_size;
+  const inode_id_t dir = test_make_dir(disk_p, FS_ROOT_INODE, "dir");
+  test_make_dir(disk_p, dir, "sub");
+  // Enough names for the directory to be indexed
+  const int name_count = context.dir_per_sector * FS_DIR_INDEX_MIN_SECTORS;
+  inode_id_t file = FS_INVALID_INODE;
+  for(int i = 0;i < name_count;i++) {
+    char name[FS_DIR_ENTRY_NAME_MAX + 1];
+    sprintf(name, "file%d", i);
+    const inode_id_t inode = fs_alloc_inode(disk_p);
+    assert(inode != FS_INVALID_INODE);
+    Inode *dir_p = fs_load_inode_sector(disk_p, dir, 1);
+    assert(fs_insert_dir_entry(disk_p, dir_p, name, inode) == FS_SUCCESS);
+    file = inode;
+  }
+  assert(fs_lookup_name(disk_p, dir, "file0") != FS_INVALID_INODE);
+  Inode *dir_p = fs_load_inode_sector(disk_p, dir, 0);
+  DirIndexHeader header;
+  assert(fs_dir_index_load(disk_p, dir_p, &header) == 1);
+
+  // The last file is large, and the one before it is inline
+  const size_t test_size = (FS_ADDR_ARRAY_MAX + 10) * sector_size;
+  uint8_t *data_p = malloc(test_size);
+  assert(data_p != NULL);
+  memset(data_p, 0x5A, test_size);
+  Inode *inode_p = fs_load_inode_sector(disk_p, file, 1);
+  assert(fs_write(disk_p, inode_p, 0, test_size, data_p) == test_size);
+  assert(fs_is_file_large(inode_p) == 1);
+  inode_p = fs_load_inode_sector(disk_p, file - 1, 1);
+  assert(fs_write(disk_p, inode_p, 0, 5, data_p) == 5);
+  assert(fs_is_file_inline(inode_p) == 1);
+  fs_sync(disk_p);
   buffer_flush_all(disk_p);
   assert(buffer_count_pinned() == 0UL);
 
-  const char *round_desp[] = {
-    "Low to high",
-    "High to low",
-    "Random",
-    "Verify"
-  };
+  info("Checking a consistent file system...");
+  FsckResult result;
+  assert(fs_fsck(disk_p, 4, &result) == 0);
+  fs_fsck_print(&result);
+  // Root, two directories and the files
+  assert(result.inode_count == (size_t)name_count + 3);
+  assert(result.dir_count == 3);
+  assert(result.free_sector_count == fs_count_free_sectors());
+  assert(result.used_sector_count + result.free_sector_count == 
+         context.free_sector_count);
+  // The same image in a file
+  char path[] = "/tmp/ofs_fsck_XXXXXX";
+  const int fd = mkstemp(path);
+  assert(fd >= 0);
+  const size_t image_size = disk_p->sector_count * sector_size;
+  assert(write(fd, disk_p->data_p, image_size) == (ssize_t)image_size);
+  close(fd);
+  Storage *file_disk_p = get_file_storage(path, 0);
+  assert(file_disk_p != NULL);
+  assert(file_disk_p->sector_count == disk_p->sector_count);
+  assert(fs_fsck(file_disk_p, 1, NULL) == 0);
+  free_file_storage(file_disk_p);
+  unlink(path);
+  info("  ...Pass");
 
-  // Number of rounds
-  int round_count = sizeof(round_desp) / sizeof(round_desp[0]);
-  
-  // Preparing the array for recording which inode is allocated
-  const size_t alloc_size = sizeof(uint8_t) * context.total_inode_count;
-  uint8_t *flag_p = (uint8_t *)malloc(alloc_size);
-  int round = 0;
+  info("Checking a leaked sector...");
+  const sector_t leaked = fs_alloc_sector(disk_p);
+  assert(leaked != FS_INVALID_SECTOR);
+  fs_sync(disk_p);
+  assert(fs_fsck(disk_p, 4, &result) == 1);
+  assert(result.leaked_sector_count == 1);
+  fs_free_sector(disk_p, leaked);
+  fs_sync(disk_p);
+  info("  ...Pass");
 
-  while(1) {
-    memset(flag_p, 0x00, alloc_size);
-    inode_id_t inode;
-    int count = 0;
-    int prev_percent = 0;
-    do {
-      // Starts from 0 and ends at max inode
-      inode = fs_alloc_inode(disk_p);
-      // If allocation is a success we set it to 1
-      if(inode != FS_INVALID_INODE) {
-        assert(inode < context.total_inode_count);
-        assert(flag_p[inode] == 0);
-        flag_p[inode] = 1;
-        count++;
+  info("Checking a shared sector and an unreachable inode...");
+  inode_p = fs_load_inode_sector(disk_p, file, 0);
+  const sector_t file_sector = fs_get_file_sector(disk_p, inode_p, 0);
+  const inode_id_t orphan = fs_alloc_inode(disk_p);
+  assert(orphan != FS_INVALID_INODE);
+  inode_p = fs_load_inode_sector(disk_p, orphan, 1);
+  inode_p->addr[0] = file_sector;
+  fs_set_file_size(inode_p, sector_size);
+  fs_sync(disk_p);
+  assert(fs_fsck(disk_p, 4, &result) == 3);
+  assert(result.dup_sector_count == 1);
+  assert(result.unreachable_inode_count == 1);
+  assert(result.bad_link_count == 1);
+  inode_p = fs_load_inode_sector(disk_p, orphan, 1);
+  fs_reset_addr(inode_p);
+  fs_set_file_size(inode_p, 0);
+  fs_free_inode(disk_p, orphan);
+  fs_sync(disk_p);
+  assert(fs_fsck(disk_p, 4, NULL) == 0);
+  info("  ...Pass");
 
-        // Also check that the inode is indeed allocated (do not write)
-        Inode *inode_p = fs_load_inode_sector(disk_p, inode, 0);
-        assert(inode_p->flags & FS_INODE_IN_USE);
+  info("Checking an entry of a free inode...");
+  const inode_id_t unused = fs_alloc_inode(disk_p);
+  assert(unused != FS_INVALID_INODE);
+  fs_free_inode(disk_p, unused);
+  dir_p = fs_load_inode_sector(disk_p, dir, 1);
+  assert(fs_insert_dir_entry(disk_p, dir_p, "dangling", unused) == 
+         FS_SUCCESS);
+  fs_sync(disk_p);
+  assert(fs_fsck(disk_p, 4, &result) == 1);
+  assert(result.bad_entry_count == 1);
+  dir_p = fs_load_inode_sector(disk_p, dir, 1);
+  assert(fs_free_dir_entry(disk_p, dir_p, "dangling") == FS_SUCCESS);
+  fs_sync(disk_p);
+  info("  ...Pass");
 
-        // This also tests get/set size for inode
-        // We use size max to cover both bytes
-        size_t test_size = FS_FILE_SIZE_MAX - count;
-        fs_set_file_size(inode_p, test_size);
-        assert(fs_get_file_size(inode_p) == test_size);
+  info("Checking a corrupt index header...");
+  dir_p = fs_load_inode_sector(disk_p, dir, 1);
+  DirEntry *dot_p = fs_dir_entry_at(disk_p, dir_p, 0, 1);
+  DirIndexHeader saved;
+  memcpy(&saved, dot_p->name, sizeof(DirIndexHeader));
+  DirIndexHeader bad = saved;
+  bad.shift = 200;
+  memcpy(dot_p->name, &bad, sizeof(DirIndexHeader));
+  fs_sync(disk_p);
+  assert(fs_fsck(disk_p, 4, &result) != 0);
+  assert(result.bad_inode_count == 1);
+  bad.shift = saved.shift;
+  bad.start = context.free_end_sector;
+  dir_p = fs_load_inode_sector(disk_p, dir, 1);
+  dot_p = fs_dir_entry_at(disk_p, dir_p, 0, 1);
+  memcpy(dot_p->name, &bad, sizeof(DirIndexHeader));
+  fs_sync(disk_p);
+  assert(fs_fsck(disk_p, 4, &result) != 0);
+  assert(result.bad_inode_count == 1);
+  dir_p = fs_load_inode_sector(disk_p, dir, 1);
+  dot_p = fs_dir_entry_at(disk_p, dir_p, 0, 1);
+  memcpy(dot_p->name, &saved, sizeof(DirIndexHeader));
+  fs_sync(disk_p);
+  assert(fs_fsck(disk_p, 4, NULL) == 0);
+  info("  ...Pass");
 
-        int current_percent = \
-          (int)(((double)count / context.total_inode_count) * 100);
-        if(current_percent != prev_percent) {
-          prev_percent = current_percent;
-          fprintf(stderr, "\r  Allocated %d%% inodes", current_percent);
-        }
-      }
-    } while(inode != FS_INVALID_INODE);
-    putchar('\n');
+  info("Checking a corrupt directory size...");
+  dir_p = fs_load_inode_sector(disk_p, dir, 1);
+  const size_t dir_size = fs_get_file_size(dir_p);
+  fs_set_file_size(dir_p, FS_FILE_SIZE_MAX - FS_FILE_SIZE_MAX % sector_size);
+  fs_sync(disk_p);
+  assert(fs_fsck(disk_p, 4, &result) != 0);
+  assert(result.bad_inode_count == 1);
+  dir_p = fs_load_inode_sector(disk_p, dir, 1);
+  fs_set_file_size(dir_p, dir_size);
+  fs_sync(disk_p);
+  assert(fs_fsck(disk_p, 4, NULL) == 0);
+  info("  ...Pass");
 
-    info("Round %d (%s): Allocated %lu inodes. Now verifying...", 
-         round, 
-         round_desp[round],
-         count);
+  info("Checking a sector that is referenced and free...");
+  fs_free_sector(disk_p, file_sector);
+  fs_sync(disk_p);
+  assert(fs_fsck(disk_p, 4, &result) == 1);
+  assert(result.dup_sector_count == 1);
+  info("  ...Pass");
 
-    for(int i = 0;i < context.total_inode_count;i++) {
-      if(flag_p[i] == 0) {
-        fatal_error("Inode %d is not allocated", i);
+  info("Checking another storage while mounted...");
+  // The other file system has a different layout
+  Storage *other_p = get_mem_storage(2048);
+  buffer_flush_all(disk_p);
+  fs_init(other_p, other_p->sector_count, FS_SB_SECTOR);
+  fs_sync(other_p);
+  buffer_flush_all(other_p);
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  const Context mounted_context = context;
+  assert(fs_fsck(other_p, 2, &result) == 0);
+  assert(memcmp(&context, &mounted_context, sizeof(Context)) == 0);
+  // The mounted file system is still usable
+  inode_p = fs_iget(disk_p, fs_alloc_inode(disk_p));
+  assert(fs_write(disk_p, inode_p, 0, test_size, data_p) == test_size);
+  Inode *root_p = fs_iget(disk_p, FS_ROOT_INODE);
+  assert(fs_insert_dir_entry(disk_p, root_p, "after", 
+                             fs_get_inode_id(disk_p, inode_p)) == FS_SUCCESS);
+  fs_iput(disk_p, root_p);
+  fs_iput(disk_p, inode_p);
+  fs_sync(disk_p);
+  assert(fs_fsck(disk_p, 2, &result) == 0);
+  free_mem_storage(other_p);
+  info("  ...Pass");
+
+  free(data_p);
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+/*
+ * test_write_host_file() - Writes a host file of the given size, where each
+ *                          byte depends on the seed
+ */
+void test_write_host_file(const char *path, size_t size, int seed) {
+  FILE *fp = fopen(path, "wb");
+  assert(fp != NULL);
+  for(size_t i = 0;i < size;i++) {
+    fputc((int)((i * 7 + i / 511 + seed) & 0xFF), fp);
+  }
+  fclose(fp);
+  return;
+}
+
+/*
+ * test_check_host_file() - Checks the content written by the above
+ */
+void test_check_host_file(const char *path, size_t size, int seed) {
+  FILE *fp = fopen(path, "rb");
+  assert(fp != NULL);
+  for(size_t i = 0;i < size;i++) {
+    assert(fgetc(fp) == (int)((i * 7 + i / 511 + seed) & 0xFF));
+  }
+  assert(fgetc(fp) == EOF);
+  fclose(fp);
+  return;
+}
+
+/*
+ * test_remove_host_tree() - Removes a host directory tree
+ */
+void test_remove_host_tree(const char *path) {
+  struct stat st;
+  assert(lstat(path, &st) == 0);
+  if(S_ISDIR(st.st_mode)) {
+    DIR *dir_p = opendir(path);
+    assert(dir_p != NULL);
+    struct dirent *dirent_p;
+    while((dirent_p = readdir(dir_p)) != NULL) {
+      if(strcmp(dirent_p->d_name, ".") != 0 && 
+         strcmp(dirent_p->d_name, "..") != 0) {
+        char child[512];
+        snprintf(child, sizeof(child), "%s/%s", path, dirent_p->d_name);
+        test_remove_host_tree(child);
       }
     }
+    closedir(dir_p);
+    assert(rmdir(path) == 0);
+  } else {
+    assert(unlink(path) == 0);
+  }
 
-    info("  ...Pass");
-    if(round < round_count - 1) {
-      info("  Free allocated sectors...");
-    }
+  return;
+}
 
-    if(round == 0) {
-      for(int i = 0;i < context.total_inode_count;i++) {
-        fs_free_inode(disk_p, i);
-      }
-    } else if(round == 1) {
-      for(int i = context.total_inode_count - 1;i >= 0;i--) {
-        fs_free_inode(disk_p, i);
-      }
-    } else if(round == 2) {
-      srand(time(NULL));
-      for(int i = 0;i < context.total_inode_count;i++) {
-        inode_id_t start = (inode_id_t)rand() % context.total_inode_count;
-        // Use the map as a hash table to find sectors that are not yet
-        // freed
-        while(flag_p[start] == 0) {
-          start++;
-          if(start == context.total_inode_count) {
-            start = 0;
-          }
-        }
+void test_import_export(Storage *disk_p) {
+  info("=\n=Testing import and export...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
 
-        // Clear it and then free
-        flag_p[start] = 0;
-        fs_free_inode(disk_p, start);
-      }
-    } else {
-      info("Cleaning up");
-      for(int i = 0;i < context.total_inode_count;i++) {
-        fs_free_inode(disk_p, i);
-      }
-      break;
+  const size_t sector_size = disk_p->sector_size;
+  const size_t large_size = (FS_ADDR_ARRAY_MAX + 300) * sector_size + 77;
+  char src[] = "/tmp/ofs_import_XXXXXX";
+  assert(mkdtemp(src) != NULL);
+  char path[256];
+  snprintf(path, sizeof(path), "%s/a", src);
+  assert(mkdir(path, 0755) == 0);
+  snprintf(path, sizeof(path), "%s/a/b", src);
+  assert(mkdir(path, 0700) == 0);
+  snprintf(path, sizeof(path), "%s/tiny", src);
+  test_write_host_file(path, 5, 1);
+  snprintf(path, sizeof(path), "%s/empty", src);
+  test_write_host_file(path, 0, 2);
+  snprintf(path, sizeof(path), "%s/a/medium", src);
+  test_write_host_file(path, 3 * sector_size + 17, 3);
+  snprintf(path, sizeof(path), "%s/a/b/large", src);
+  test_write_host_file(path, large_size, 4);
+  chmod(path, 0640);
+  // These names could not be imported
+  snprintf(path, sizeof(path), "%s/bad:name", src);
+  test_write_host_file(path, 10, 5);
+  snprintf(path, 
+           sizeof(path), 
+           "%s/a_file_name_that_is_too_long_for_any_layout", 
+           src);
+  test_write_host_file(path, 10, 6);
+
+  info("Importing...");
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  assert(fs_import(disk_p, src, 4) == FS_SUCCESS);
+  fs_sync(disk_p);
+  buffer_flush_all(disk_p);
+  FsckResult result;
+  assert(fs_fsck(disk_p, 2, &result) == 0);
+  // Root, two directories and four files
+  assert(result.inode_count == 7 && result.dir_count == 3);
+  assert(fs_lookup_path(disk_p, "/bad:name") == FS_INVALID_INODE);
+  const inode_id_t large = fs_lookup_path(disk_p, "/a/b/large");
+  assert(large != FS_INVALID_INODE);
+  Inode *inode_p = fs_iget(disk_p, large);
+  assert(fs_get_file_size(inode_p) == large_size);
+  assert((inode_p->flags & FS_INODE_MODE_MASK) == 0640);
+  // Data of the file is contiguous except for the indirection sectors
+  const size_t large_count = large_size / sector_size + 1;
+  const sector_t first = fs_get_file_sector(disk_p, inode_p, 0);
+  const sector_t last = \
+    fs_get_file_sector(disk_p, inode_p, large_size - large_size % sector_size);
+  assert((size_t)(last - first) == large_count - 1 + 
+         (large_count + context.id_per_indir_sector - 1) / 
+           context.id_per_indir_sector);
+  fs_iput(disk_p, inode_p);
+  inode_p = fs_iget(disk_p, fs_lookup_path(disk_p, "/tiny"));
+  assert(fs_is_file_inline(inode_p) == 1);
+  fs_iput(disk_p, inode_p);
+  info("  ...Pass");
+
+  info("Exporting...");
+  char dest[] = "/tmp/ofs_export_XXXXXX";
+  assert(mkdtemp(dest) != NULL);
+  assert(fs_export(disk_p, FS_ROOT_INODE, dest) == FS_SUCCESS);
+  snprintf(path, sizeof(path), "%s/tiny", dest);
+  test_check_host_file(path, 5, 1);
+  snprintf(path, sizeof(path), "%s/empty", dest);
+  test_check_host_file(path, 0, 2);
+  snprintf(path, sizeof(path), "%s/a/medium", dest);
+  test_check_host_file(path, 3 * sector_size + 17, 3);
+  snprintf(path, sizeof(path), "%s/a/b/large", dest);
+  test_check_host_file(path, large_size, 4);
+  struct stat st;
+  assert(stat(path, &st) == 0 && (st.st_mode & 0777) == 0640);
+  snprintf(path, sizeof(path), "%s/a/b", dest);
+  assert(stat(path, &st) == 0 && (st.st_mode & 0777) == 0700);
+  snprintf(path, sizeof(path), "%s/bad:name", dest);
+  assert(stat(path, &st) != 0);
+  info("  ...Pass");
+
+  info("Reading a host file that is shorter than scanned...");
+  FsImportNode node;
+  memset(&node, 0x00, sizeof(FsImportNode));
+  snprintf(path, sizeof(path), "%s/a/medium", src);
+  node.host_path = path;
+  node.size = 5 * sector_size;
+  FsImportPiece piece;
+  piece.node = 0;
+  piece.first = 0;
+  piece.count = 5;
+  piece.offset = 0;
+  FsImportState state;
+  memset(&state, 0x00, sizeof(FsImportState));
+  state.disk_p = disk_p;
+  state.node_p = &node;
+  state.node_count = 1;
+  state.piece_p = &piece;
+  state.piece_count = 1;
+  state.batch_p = malloc(5 * sector_size);
+  assert(state.batch_p != NULL);
+  fs_import_worker(&state);
+  assert(state.error == 1);
+  // The actual size is read without error
+  node.size = 3 * sector_size + 17;
+  piece.count = 4;
+  state.next_piece = 0;
+  state.error = 0;
+  fs_import_worker(&state);
+  assert(state.error == 0);
+  free(state.batch_p);
+  // A tiny file is read inline
+  snprintf(path, sizeof(path), "%s/tiny", src);
+  node.inode = fs_alloc_inode(disk_p);
+  node.size = 8;
+  state.error = 0;
+  assert(fs_import_map_file(&state, &node) == FS_SUCCESS);
+  assert(state.error == 1);
+  fs_release_inode(disk_p, node.inode);
+  info("  ...Pass");
+
+  test_remove_host_tree(src);
+  test_remove_host_tree(dest);
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+void test_indir_levels(Storage *disk_p) {
+  info("=\n=Testing indirection levels...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  const size_t sector_size = disk_p->sector_size;
+  const size_t id_count = context.id_per_indir_sector;
+  const size_t free_count = fs_count_free_sectors();
+  const int has_triple = !!(context.features & FS_FEATURE_TRIPLE_INDIR);
+  info("Single indirection slots: %lu; triple indirection: %d", 
+       context.indir_slot_count, has_triple);
+  assert(context.indir_slot_count == \
+         (size_t)FS_ADDR_ARRAY_MAX - 1 - has_triple);
+
+  // One sector under each level, and each of them needs its own chain of
+  // indirection sectors
+  size_t logical_list[4] = {
+    3, 
+    id_count + 5, 
+    context.extra_large_start_sector + id_count + 7, 
+    context.triple_large_start_sector + id_count * id_count + 2 * id_count + 9,
+  };
+  const size_t logical_count = has_triple ? 4 : 3;
+  const size_t indir_count = has_triple ? 1 + 1 + 2 + 3 : 1 + 1 + 2;
+  const inode_id_t inode = fs_alloc_inode(disk_p);
+  assert(inode != FS_INVALID_INODE);
+  Inode *root_p = fs_iget(disk_p, FS_ROOT_INODE);
+  assert(fs_insert_dir_entry(disk_p, root_p, "indir", inode) == FS_SUCCESS);
+  fs_iput(disk_p, root_p);
+  Inode *inode_p = fs_load_inode_sector(disk_p, inode, 1);
+  fs_pin(disk_p, inode_p);
+  uint8_t *data_p = malloc(sector_size);
+  assert(data_p != NULL);
+  for(size_t i = 0;i < logical_count;i++) {
+    memset(data_p, (int)(i + 1), sector_size);
+    assert(fs_write(disk_p, 
+                    inode_p, 
+                    logical_list[i] * sector_size, 
+                    sector_size, 
+                    data_p) == sector_size);
+  }
+  assert(fs_is_file_extra_large(inode_p) == 1);
+  assert(fs_count_free_sectors() == free_count - logical_count - indir_count);
+  if(has_triple) {
+    assert(inode_p->addr[FS_ADDR_ARRAY_MAX - 1] != FS_INVALID_SECTOR);
+    // Beyond the triple indirection range nothing could be allocated
+    const size_t end = \
+      context.triple_large_start_sector + fs_get_indir_span(3);
+    assert(fs_get_file_sector_for_write_near(disk_p, 
+                                             inode_p, 
+                                             end * sector_size, 
+                                             FS_INVALID_SECTOR) == \
+           FS_INVALID_SECTOR);
+    assert(fs_count_free_sectors() == \
+           free_count - logical_count - indir_count);
+  }
+
+  info("Reading and mapping...");
+  for(size_t i = 0;i < logical_count;i++) {
+    const size_t offset = logical_list[i] * sector_size;
+    assert(fs_read(disk_p, inode_p, offset, sector_size, data_p) == 
+           sector_size);
+    for(size_t j = 0;j < sector_size;j++) {
+      assert(data_p[j] == (uint8_t)(i + 1));
+    }
+    // The sector before it is a hole in the same leaf indirection sector
+    assert(fs_read(disk_p, inode_p, offset - sector_size, 1, data_p) == 1);
+    assert(data_p[0] == 0x00);
+  }
+  // Holes without indirection sectors are skipped in a few calls
+  const size_t end = logical_list[logical_count - 1] + 1;
+  size_t logical = 0;
+  size_t mapped = 0;
+  int call_count = 0;
+  while(logical < end) {
+    sector_t start;
+    const size_t count = \
+      fs_map_range(disk_p, inode_p, logical, end - logical, &start);
+    if(start != FS_INVALID_SECTOR) {
+      assert(count == 1);
+      assert(logical == logical_list[mapped]);
+      mapped++;
     }
+    logical += count;
+    call_count++;
+  }
+  assert(mapped == logical_count);
+  info("  Mapped %lu sectors in %d calls", logical_count, call_count);
+  assert(call_count <= 4 * (int)logical_count);
+  info("  ...Pass");
 
-    info("  ...Done");
-    round++;
+  info("Caching leaf indirection sectors...");
+  fs_map_cache_invalidate(inode);
+  for(size_t i = 1;i < logical_count;i++) {
+    const size_t offset = (logical_list[i] - 1) * sector_size;
+    const uint64_t prev_hit = map_cache_indir_hit;
+    assert(fs_get_file_sector(disk_p, inode_p, offset) == FS_INVALID_SECTOR);
+    assert(fs_get_file_sector(disk_p, inode_p, offset) == FS_INVALID_SECTOR);
+    // Only leaves under the double and triple indirection sectors are cached
+    assert(map_cache_indir_hit == prev_hit + (i >= 2));
   }
+  info("  ...Pass");
 
-  free(flag_p);
+  info("Checking the file system...");
+  fs_unpin(disk_p, inode_p);
+  fs_sync(disk_p);
+  buffer_flush_all(disk_p);
+  FsckResult result;
+  assert(fs_fsck(disk_p, 2, &result) == 0);
+  // Root and the file
+  assert(result.inode_count == 2);
+  assert(result.free_sector_count == fs_count_free_sectors());
+  info("  ...Pass");
+
+  info("Truncating level by level...");
+  inode_p = fs_load_inode_sector(disk_p, inode, 1);
+  fs_pin(disk_p, inode_p);
+  size_t used = logical_count + indir_count;
+  if(has_triple) {
+    // Partially truncated indirection sectors are kept
+    fs_truncate(disk_p, inode_p, logical_list[3] * sector_size);
+    assert(fs_count_free_sectors() == free_count - used + 1);
+    fs_truncate(disk_p, inode_p, 
+                context.triple_large_start_sector * sector_size);
+    used -= 1 + 3;
+    assert(inode_p->addr[FS_ADDR_ARRAY_MAX - 1] == FS_INVALID_SECTOR);
+    assert(fs_count_free_sectors() == free_count - used);
+  }
+  fs_truncate(disk_p, inode_p, context.extra_large_start_sector * sector_size);
+  used -= 1 + 2;
+  assert(fs_is_file_extra_large(inode_p) == 0);
+  assert(fs_count_free_sectors() == free_count - used);
+  fs_truncate(disk_p, inode_p, id_count * sector_size);
+  used -= 1 + 1;
+  assert(fs_count_free_sectors() == free_count - used);
+  assert(fs_read(disk_p, inode_p, 3 * sector_size, 1, data_p) == 1);
+  assert(data_p[0] == 1);
+  fs_truncate(disk_p, inode_p, 0);
+  assert(fs_is_file_large(inode_p) == 0);
+  assert(fs_count_free_sectors() == free_count);
+  fs_unpin(disk_p, inode_p);
+  root_p = fs_iget(disk_p, FS_ROOT_INODE);
+  assert(fs_unlink(disk_p, root_p, "indir") == FS_SUCCESS);
+  fs_iput(disk_p, root_p);
+  info("  ...Pass");
+
+  free(data_p);
   buffer_flush_all(disk_p);
   assert(buffer_count_pinned() == 0UL);
   return;
 }
 
-void test_get_sector(Storage *disk_p) {
-  info("=\n=Testing getting sector for read/write...\n=");
+void test_extent(Storage *disk_p) {
+  info("=\n=Testing extent-mapped files...\n=");
   buffer_flush_all(disk_p);
   assert(buffer_count_pinned() == 0UL);
 
-  // Allocate an inode object and then try filling its sectors
-  inode_id_t inode = fs_alloc_inode(disk_p);
+  _fs_init(disk_p, 
+           disk_p->sector_count, 
+           FS_SB_SECTOR, 
+           1, 
+           FS_DEFAULT_FEATURES | FS_FEATURE_EXTENT);
+  const size_t sector_size = disk_p->sector_size;
+  const size_t free_count = fs_count_free_sectors();
+  const inode_id_t inode = fs_alloc_inode(disk_p);
   assert(inode != FS_INVALID_INODE);
+  Inode *root_p = fs_iget(disk_p, FS_ROOT_INODE);
+  assert(fs_insert_dir_entry(disk_p, root_p, "extent", inode) == FS_SUCCESS);
+  fs_iput(disk_p, root_p);
   Inode *inode_p = fs_load_inode_sector(disk_p, inode, 1);
-  //buffer_pin(disk_p, inode_p);
-  assert(fs_is_file_large(inode_p) == 0 && 
-         fs_is_file_extra_large(inode_p) == 0);
-  // This is the maximum number of sectors we could support in one file
-  const size_t sector_count_for_test = \
-    context.id_per_indir_sector * \
-      (FS_ADDR_ARRAY_MAX - 1 + context.id_per_indir_sector);
-  info("# of sector ID per indirection sector: %u", 
-       (uint32_t)context.id_per_indir_sector); 
-  info("Allocating %u sectors for a single file...", 
-       (uint32_t)sector_count_for_test);
-  // Index is the sector in the file and content is the sector ID on the disk
-  sector_t *file_sector_map = malloc(sizeof(sector_t) * sector_count_for_test);
-  // Index is the sector on the disk - free start sector, and content is 1
-  // or 0
-  uint8_t *disk_sector_map = \
-    malloc(sizeof(uint8_t) * context.free_sector_count);
-  memset(disk_sector_map, 0x00, sizeof(uint8_t) * context.free_sector_count);
+  fs_pin(disk_p, inode_p);
+
+  info("Writing a contiguous file...");
+  const size_t sector_count = free_count / 4;
+  const size_t test_size = sector_count * sector_size;
+  uint8_t *src_p = malloc(test_size);
+  uint8_t *dest_p = malloc(test_size);
+  assert(src_p != NULL && dest_p != NULL);
+  for(size_t i = 0;i < test_size;i++) {
+    src_p[i] = (uint8_t)(i * 7 + i / 509 + 3);
+  }
+  assert(fs_write(disk_p, inode_p, 0, test_size, src_p) == test_size);
+  assert(fs_is_file_extent(inode_p) == 1);
+  assert(fs_is_file_large(inode_p) == 0);
+  assert(inode_p->addr[FS_EXTENT_COUNT_SLOT] == 1);
+  assert(inode_p->addr[FS_EXTENT_SECTOR_SLOT] == FS_INVALID_SECTOR);
+  // There is no indirection sector
+  assert(fs_count_free_sectors() == free_count - sector_count);
+  sector_t start;
+  assert(fs_map_range(disk_p, inode_p, 0, sector_count, &start) == 
+         sector_count);
+  assert(start == ((const Extent *)inode_p->addr)->physical);
+  // The whole file is one run in the mapping cache
+  fs_map_cache_invalidate(inode);
+  const uint64_t prev_miss = map_cache_miss;
+  for(size_t i = 0;i < sector_count;i++) {
+    assert(fs_get_file_sector(disk_p, inode_p, i * sector_size) == 
+           start + i);
+  }
+  assert(map_cache_miss == prev_miss + 1);
+  assert(fs_read(disk_p, inode_p, 0, test_size, dest_p) == test_size);
+  assert(memcmp(src_p, dest_p, test_size) == 0);
+  // Shrinking shortens the extent
+  fs_truncate(disk_p, inode_p, test_size / 2);
+  assert(fs_count_free_sectors() == 
+         free_count - (test_size / 2 + sector_size - 1) / sector_size);
+  assert(((const Extent *)inode_p->addr)->count == 
+         (test_size / 2 + sector_size - 1) / sector_size);
+  fs_truncate(disk_p, inode_p, 0);
+  assert(fs_is_file_extent(inode_p) == 0);
+  assert(fs_count_free_sectors() == free_count);
+  info("  ...Pass");
 
-  int count = 0;
-  for(size_t i = 0;i < sector_count_for_test;i++) {
-    // Note that this function requires byte offset
-    sector_t sector = \
-      fs_get_file_sector_for_write(disk_p, inode_p, i * disk_p->sector_size);
-    
-    // Run out of blocks
-    if(sector == FS_INVALID_SECTOR) {
-      break;
+  info("Spilling extents...");
+  // Sectors are placed one sector apart, such that each of them is an 
+  // extent. Logical sectors start after the addr. array, which converts the
+  // file
+  const size_t extent_count = context.extent_per_sector;
+  const sector_count_t reserve_count = (sector_count_t)(2 * extent_count + 4);
+  const sector_t base = \
+    fs_alloc_sectors(disk_p, reserve_count, FS_INVALID_SECTOR);
+  assert(base != FS_INVALID_SECTOR);
+  fs_free_sectors(disk_p, base, reserve_count);
+  for(size_t i = 0;i < extent_count;i++) {
+    const size_t offset = (FS_ADDR_ARRAY_MAX + i) * sector_size;
+    const sector_t sector = \
+      fs_get_file_sector_for_write_near(disk_p, inode_p, offset, base + 2 * i);
+    assert(sector == base + 2 * i);
+    memset(write_lba(disk_p, sector), (int)(i + 1), sector_size);
+    assert(fs_is_file_extent(inode_p) == 1);
+    assert(inode_p->addr[FS_EXTENT_COUNT_SLOT] == i + 1);
+    if(i < FS_EXTENT_INODE_MAX) {
+      assert(inode_p->addr[FS_EXTENT_SECTOR_SLOT] == FS_INVALID_SECTOR);
     } else {
-      count++;
+      assert(inode_p->addr[FS_EXTENT_SECTOR_SLOT] != FS_INVALID_SECTOR);
+    }
+  }
+  fs_truncate(disk_p, 
+              inode_p, 
+              (FS_ADDR_ARRAY_MAX + extent_count) * sector_size);
+  // The extent sector is also used
+  assert(fs_count_free_sectors() == free_count - extent_count - 1);
+  for(size_t i = 0;i < extent_count;i++) {
+    const size_t offset = (FS_ADDR_ARRAY_MAX + i) * sector_size;
+    assert(fs_get_file_sector(disk_p, inode_p, offset) == base + 2 * i);
+    assert(fs_read(disk_p, inode_p, offset, 1, dest_p) == 1);
+    assert(dest_p[0] == (uint8_t)(i + 1));
+  }
+  assert(fs_get_file_sector(disk_p, inode_p, 0) == FS_INVALID_SECTOR);
+  assert(fs_map_range(disk_p, inode_p, 0, 100, &start) == FS_ADDR_ARRAY_MAX);
+  assert(start == FS_INVALID_SECTOR);
+  info("  ...Pass");
+
+  info("Checking the file system...");
+  fs_unpin(disk_p, inode_p);
+  fs_sync(disk_p);
+  buffer_flush_all(disk_p);
+  FsckResult result;
+  assert(fs_fsck(disk_p, 2, &result) == 0);
+  assert(result.free_sector_count == fs_count_free_sectors());
+  inode_p = fs_load_inode_sector(disk_p, inode, 1);
+  fs_pin(disk_p, inode_p);
+  info("  ...Pass");
+
+  info("Converting a full extent sector...");
+  // Another extent does not fit, and the file falls back to indirection
+  // sectors. All sectors are under the first one
+  const size_t offset = (FS_ADDR_ARRAY_MAX + extent_count) * sector_size;
+  assert(fs_get_file_sector_for_write_near(disk_p, 
+                                           inode_p, 
+                                           offset, 
+                                           base + 2 * extent_count) != 
+         FS_INVALID_SECTOR);
+  assert(fs_is_file_extent(inode_p) == 0);
+  assert(fs_is_file_large(inode_p) == 1);
+  assert(fs_count_free_sectors() == free_count - extent_count - 2);
+  for(size_t i = 0;i < extent_count;i++) {
+    const size_t offset = (FS_ADDR_ARRAY_MAX + i) * sector_size;
+    assert(fs_get_file_sector(disk_p, inode_p, offset) == base + 2 * i);
+  }
+  fs_truncate(disk_p, inode_p, 0);
+  assert(fs_count_free_sectors() == free_count);
+  info("  ...Pass");
+
+  info("Truncating extents...");
+  for(size_t i = 0;i < FS_EXTENT_INODE_MAX + 2;i++) {
+    const size_t offset = (FS_ADDR_ARRAY_MAX + i) * sector_size;
+    assert(fs_get_file_sector_for_write_near(disk_p, 
+                                             inode_p, 
+                                             offset, 
+                                             base + 2 * i) == base + 2 * i);
+  }
+  assert(inode_p->addr[FS_EXTENT_SECTOR_SLOT] != FS_INVALID_SECTOR);
+  fs_truncate(disk_p, 
+              inode_p, 
+              (FS_ADDR_ARRAY_MAX + FS_EXTENT_INODE_MAX + 2) * sector_size);
+  // The remaining extents are moved back into the inode
+  fs_truncate(disk_p, 
+              inode_p, 
+              (FS_ADDR_ARRAY_MAX + FS_EXTENT_INODE_MAX) * sector_size);
+  assert(inode_p->addr[FS_EXTENT_SECTOR_SLOT] == FS_INVALID_SECTOR);
+  assert(inode_p->addr[FS_EXTENT_COUNT_SLOT] == FS_EXTENT_INODE_MAX);
+  assert(fs_count_free_sectors() == free_count - FS_EXTENT_INODE_MAX);
+  assert(fs_get_file_sector(disk_p, 
+                            inode_p, 
+                            (FS_ADDR_ARRAY_MAX + 1) * sector_size) == 
+         base + 2);
+  fs_unpin(disk_p, inode_p);
+  root_p = fs_iget(disk_p, FS_ROOT_INODE);
+  assert(fs_unlink(disk_p, root_p, "extent") == FS_SUCCESS);
+  fs_iput(disk_p, root_p);
+  assert(fs_count_free_sectors() == free_count);
+  info("  ...Pass");
+
+  free(src_p);
+  free(dest_p);
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
+
+#define TEST_ALLOC_GROUP_COUNT 64
+
+// This is the work of a thread that allocates in its own group
+typedef struct {
+  Storage *disk_p;
+  AllocGroup *group_p;
+  sector_t sector_list[TEST_ALLOC_GROUP_COUNT];
+} TestAllocGroupArg;
+
+void *test_alloc_group_thread(void *arg) {
+  TestAllocGroupArg *arg_p = (TestAllocGroupArg *)arg;
+  sector_t hint = (sector_t)arg_p->group_p->start;
+  for(int i = 0;i < TEST_ALLOC_GROUP_COUNT;i++) {
+    arg_p->sector_list[i] = fs_alloc_sector_near(arg_p->disk_p, hint);
+    hint = arg_p->sector_list[i] + 1;
+  }
+
+  return NULL;
+}
+
+void test_alloc_group(Storage *disk_p) {
+  info("=\n=Testing allocation groups...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  const size_t free_count = fs_count_free_sectors();
+  const size_t extent_count = fs_count_free_extents();
+  info("Splitting the storage into %lu groups...", group_table.count);
+  assert(group_table.count > 2);
+  size_t group_free_count = 0;
+  for(size_t i = 0;i < group_table.count;i++) {
+    const AllocGroup *group_p = group_table.group_p + i;
+    assert(group_p->start == (i == 0 ? context.free_start_sector : 
+                                       group_p[-1].end));
+    assert(group_p->inode_start == (i == 0 ? 0 : group_p[-1].inode_end));
+    assert(group_p->end - group_p->start >= FS_GROUP_SECTOR_MIN);
+    size_t count = 0;
+    for(size_t j = 0;j < group_p->map.count;j++) {
+      const FreeExtent *extent_p = group_p->map.extent_p + j;
+      assert(extent_p->start >= group_p->start);
+      assert((size_t)extent_p->start + extent_p->count <= group_p->end);
+      count += extent_p->count;
+    }
+    assert(count == group_p->free_sector_count);
+    group_free_count += count;
+  }
+  assert(group_table.group_p[group_table.count - 1].end == 
+         context.free_end_sector);
+  assert(group_free_count == free_count);
+  info("  ...Pass");
+
+  info("Placing files near their directory...");
+  Inode *root_p = fs_iget(disk_p, FS_ROOT_INODE);
+  const inode_id_t dir = fs_alloc_inode_near(disk_p, FS_ROOT_INODE, 1);
+  assert(dir != FS_INVALID_INODE);
+  // The root directory uses a sector of the first group, so the directory
+  // goes to a group with more free space
+  const size_t group = fs_group_of_inode(dir);
+  assert(group != fs_group_of_inode(FS_ROOT_INODE));
+  Inode *dir_p = fs_iget(disk_p, dir);
+  fs_set_file_type(dir_p, FS_INODE_TYPE_DIR);
+  DirEntry *entry_p = fs_add_dir_entry(disk_p, dir_p);
+  entry_p->inode = dir;
+  fs_set_dir_name(disk_p, entry_p, ".", FS_SET_DIR_NAME_ALLOW_DOT);
+  entry_p = fs_add_dir_entry(disk_p, dir_p);
+  entry_p->inode = FS_ROOT_INODE;
+  fs_set_dir_name(disk_p, entry_p, "..", FS_SET_DIR_NAME_ALLOW_DOT);
+  assert(fs_insert_dir_entry(disk_p, root_p, "group", dir) == FS_SUCCESS);
+  fs_iput(disk_p, root_p);
+
+  const AllocGroup *group_p = group_table.group_p + group;
+  const size_t sector_size = disk_p->sector_size;
+  const size_t file_size = 4 * sector_size;
+  uint8_t *data_p = malloc(file_size);
+  assert(data_p != NULL);
+  memset(data_p, 0x5A, file_size);
+  inode_id_t file_list[4];
+  for(int i = 0;i < 4;i++) {
+    file_list[i] = fs_alloc_inode_near(disk_p, dir, 0);
+    assert(file_list[i] != FS_INVALID_INODE);
+    assert(fs_group_of_inode(file_list[i]) == group);
+    char name[] = "file0";
+    name[4] = (char)('0' + i);
+    assert(fs_insert_dir_entry(disk_p, dir_p, name, file_list[i]) == 
+           FS_SUCCESS);
+    Inode *inode_p = fs_iget(disk_p, file_list[i]);
+    assert(fs_write(disk_p, inode_p, 0, file_size, data_p) == file_size);
+    for(size_t j = 0;j < 4;j++) {
+      const sector_t sector = \
+        fs_get_file_sector(disk_p, inode_p, j * sector_size);
+      assert(sector >= group_p->start && sector < group_p->end);
     }
-    //assert(sector != FS_INVALID_SECTOR);
-    assert(sector >= context.free_start_sector);
-    assert(sector < context.free_end_sector);
-    file_sector_map[i] = sector;
-    // The sector must not be allocated
-    assert(disk_sector_map[sector - context.free_start_sector] == 0);
-    disk_sector_map[sector - context.free_start_sector] = 1;
+    fs_iput(disk_p, inode_p);
   }
-  
-  info("  Allocated %d sectors to the inode", count);
-  info("  (total free sector: %u)", context.free_sector_count);
-  assert(fs_is_file_large(inode_p) == 1);
-  assert(fs_is_file_extra_large(inode_p) == 1);
+  // The directory sector is in the group as well
+  const sector_t dir_sector = fs_get_file_sector(disk_p, dir_p, 0);
+  assert(dir_sector >= group_p->start && dir_sector < group_p->end);
+  fs_iput(disk_p, dir_p);
+  free(data_p);
+
+  size_t free_inode_count = 0;
+  for(size_t i = 0;i < group_table.count;i++) {
+    free_inode_count += group_table.group_p[i].free_inode_count;
+  }
+  size_t expected_count = 0;
+  for(size_t i = 0;i < inode_map.word_count;i++) {
+    expected_count += __builtin_popcountll(~inode_map.bits_p[i]);
+  }
+  assert(free_inode_count == expected_count);
+  info("  ...Pass");
+
+  info("Allocating in two groups concurrently...");
+  const size_t used_count = free_count - fs_count_free_sectors();
+  TestAllocGroupArg arg_list[2];
+  pthread_t thread_list[2];
+  for(int i = 0;i < 2;i++) {
+    arg_list[i].disk_p = disk_p;
+    arg_list[i].group_p = group_table.group_p + 1 + i;
+    assert(pthread_create(&thread_list[i], 
+                          NULL, 
+                          test_alloc_group_thread, 
+                          &arg_list[i]) == 0);
+  }
+  for(int i = 0;i < 2;i++) {
+    pthread_join(thread_list[i], NULL);
+    const AllocGroup *group_p = arg_list[i].group_p;
+    for(int j = 0;j < TEST_ALLOC_GROUP_COUNT;j++) {
+      const sector_t sector = arg_list[i].sector_list[j];
+      assert(sector >= group_p->start && sector < group_p->end);
+      assert(fs_is_sector_free(sector) == 0);
+    }
+  }
+  assert(fs_count_free_sectors() == 
+         free_count - used_count - 2 * TEST_ALLOC_GROUP_COUNT);
+  for(int i = 0;i < 2;i++) {
+    for(int j = 0;j < TEST_ALLOC_GROUP_COUNT;j++) {
+      fs_free_sector(disk_p, arg_list[i].sector_list[j]);
+    }
+  }
+  assert(fs_count_free_sectors() == free_count - used_count);
+  // Sectors that are still cached in the magazine go back to their groups
+  fs_magazine_drain(disk_p);
+  info("  ...Pass");
+
+  info("Allocating across a group boundary...");
+  // Both groups next to the boundary are entirely free
+  size_t next = 2;
+  while(next == group || next - 1 == group) {
+    next++;
+  }
+  assert(next < group_table.count);
+  AllocGroup *next_p = group_table.group_p + next;
+  const size_t next_free_count = next_p->free_sector_count;
+  const size_t prev_free_count = next_p[-1].free_sector_count;
+  assert(next_free_count == next_p->end - next_p->start);
+  const size_t boundary_extent_count = fs_count_free_extents();
+  const sector_t hint = (sector_t)(next_p->start - 2);
+  assert(fs_alloc_sectors(disk_p, 4, hint) == hint);
+  assert(next_p->free_sector_count == next_free_count - 2);
+  assert(next_p[-1].free_sector_count == prev_free_count - 2);
+  fs_free_sectors(disk_p, hint, 4);
+  assert(next_p->free_sector_count == next_free_count);
+  // The freed pieces are merged again when the map is written
+  assert(fs_count_free_extents() == boundary_extent_count);
+  // Runs that cross the boundary are found without a hint as well
+  const sector_count_t run_count = (sector_count_t)(next_free_count + 8);
+  const sector_t start = fs_alloc_sectors(disk_p, run_count, FS_INVALID_SECTOR);
+  assert(start != FS_INVALID_SECTOR && start < next_p->start);
+  fs_free_sectors(disk_p, start, run_count);
+  assert(fs_count_free_sectors() == free_count - used_count);
+  info("  ...Pass");
+
+  info("Reloading the groups...");
+  fs_sync(disk_p);
+  buffer_flush_all(disk_p);
+  FsckResult result;
+  assert(fs_fsck(disk_p, 2, &result) == 0);
+  assert(result.free_sector_count == fs_count_free_sectors());
+  size_t count_list[FS_GROUP_MAX];
+  for(size_t i = 0;i < group_table.count;i++) {
+    count_list[i] = group_table.group_p[i].free_sector_count;
+  }
+  const size_t reload_extent_count = fs_count_free_extents();
+  fs_load_context(disk_p);
+  for(size_t i = 0;i < group_table.count;i++) {
+    assert(group_table.group_p[i].free_sector_count == count_list[i]);
+  }
+  assert(fs_count_free_extents() == reload_extent_count);
+  assert(reload_extent_count >= extent_count);
+  info("  ...Pass");
 
-  info("Checking whether indirection sectors are allocated...");
-  // We first evict all buffers to expose problems if any
-  // and then re-read the inode
   buffer_flush_all(disk_p);
   assert(buffer_count_pinned() == 0UL);
-  inode_p = fs_load_inode_sector(disk_p, inode, 0);
+  return;
+}
 
-  buffer_pin(disk_p, inode_p);
-  // Iterate to find indirection sectors and also set it
-  for(int i = 0;i < FS_ADDR_ARRAY_MAX;i++) {
-    sector_t sector = inode_p->addr[i];
-    // All must be set
-    assert(sector != FS_INVALID_SECTOR);
-    sector -= context.free_start_sector;
-    assert(disk_sector_map[sector] == 0);
-    disk_sector_map[sector] = 1;
+#define TEST_MAGAZINE_THREADS 4
+#define TEST_MAGAZINE_COUNT   200
+
+// This is the work of a thread that allocates and frees single sectors
+typedef struct {
+  Storage *disk_p;
+  sector_t sector_list[TEST_MAGAZINE_COUNT];
+} TestMagazineArg;
+
+void *test_magazine_thread(void *arg) {
+  TestMagazineArg *arg_p = (TestMagazineArg *)arg;
+  for(int i = 0;i < TEST_MAGAZINE_COUNT;i++) {
+    arg_p->sector_list[i] = fs_alloc_sector(arg_p->disk_p);
   }
 
-  // Set the last double-indirection sector
-  sector_t *data_p = \
-    (sector_t *)read_lba(disk_p, inode_p->addr[FS_ADDR_ARRAY_MAX - 1]);
-  for(sector_count_t i = 0;i < context.id_per_indir_sector;i++) {
-    // The last sector is not full
-    if(data_p[i] == FS_INVALID_SECTOR) {
-      break;
-    }
-    sector_t sector = data_p[i] - context.free_start_sector;
-    assert(disk_sector_map[sector] == 0);
-    disk_sector_map[sector] = 1;
+  return NULL;
+}
+
+void *test_magazine_free_thread(void *arg) {
+  TestMagazineArg *arg_p = (TestMagazineArg *)arg;
+  for(int i = 0;i < TEST_MAGAZINE_COUNT;i++) {
+    fs_free_sector(arg_p->disk_p, arg_p->sector_list[i]);
   }
-  buffer_unpin(disk_p, inode_p);
+
+  return NULL;
+}
+
+int test_magazine_cmp(const void *a, const void *b) {
+  const sector_t x = *(const sector_t *)a;
+  const sector_t y = *(const sector_t *)b;
+  return (x > y) - (x < y);
+}
+
+void test_magazine(Storage *disk_p) {
+  info("=\n=Testing allocation magazines...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  const size_t free_count = fs_count_free_sectors();
+  info("Allocating sectors from the magazine...");
+  const sector_t first = fs_alloc_sector(disk_p);
+  assert(first != FS_INVALID_SECTOR);
+  Magazine *magazine_p = thread_magazine_p;
+  assert(magazine_p != NULL);
+  // A whole batch is taken from the group at once, and sectors are handed 
+  // out in ascending order
+  assert(magazine_p->sector_count == FS_MAGAZINE_BATCH - 1);
+  assert(fs_count_free_sectors() == free_count - 1);
+  const size_t group_free_count = free_count - FS_MAGAZINE_BATCH;
+  assert(fs_count_free_sectors() - magazine_p->sector_count == 
+         group_free_count);
+  assert(fs_alloc_sector(disk_p) == first + 1);
+  // A freed sector is reused first
+  fs_free_sector(disk_p, first);
+  assert(fs_alloc_sector(disk_p) == first);
+  fs_free_sector(disk_p, first + 1);
+  fs_free_sector(disk_p, first);
+  assert(fs_count_free_sectors() == free_count);
   info("  ...Pass");
 
-  info("Checking whether all sectors are used...");
-  // Validate the disk map to make sure that the entire disk is full
-  for(sector_count_t i = 0;i < context.free_sector_count;i++) {
-    assert(disk_sector_map[i] == 1);
+  info("Spilling a full magazine...");
+  sector_t sector_list[FS_MAGAZINE_SIZE + 1];
+  for(int i = 0;i < FS_MAGAZINE_SIZE + 1;i++) {
+    sector_list[i] = fs_alloc_sector(disk_p);
+    assert(sector_list[i] != FS_INVALID_SECTOR);
   }
+  assert(magazine_p->sector_count < FS_MAGAZINE_BATCH);
+  for(int i = 0;i < FS_MAGAZINE_SIZE + 1;i++) {
+    fs_free_sector(disk_p, sector_list[i]);
+    assert(magazine_p->sector_count <= FS_MAGAZINE_SIZE);
+  }
+  assert(fs_count_free_sectors() == free_count);
   info("  ...Pass");
 
-  info("Reading the sector to verify...");
-  int read_count = 0;
-  // We can only read that many sectors
-  for(size_t i = 0;i < sector_count_for_test;i++) {
-    // If we exceed the maximum size
-    if(i >= (size_t)((sector_t)-1)) {
+  info("Allocating inodes from the magazine...");
+  const inode_id_t inode = fs_alloc_inode(disk_p);
+  assert(inode != FS_INVALID_INODE);
+  const size_t ninode = super_block.ninode;
+  assert(magazine_p->inode_count == FS_MAGAZINE_BATCH - 1);
+  // Allocating and freeing does not touch the super block any more
+  for(int i = 0;i < 10;i++) {
+    fs_free_inode(disk_p, inode);
+    assert(fs_alloc_inode(disk_p) == inode);
+  }
+  assert(super_block.ninode == ninode);
+  fs_free_inode(disk_p, inode);
+  // Inodes in the magazine are not allocated by fs_alloc_inode_near(), 
+  // even if all other inodes are
+  inode_id_t *near_list = \
+    malloc(context.total_inode_count * sizeof(inode_id_t));
+  assert(near_list != NULL);
+  size_t near_count = 0;
+  while(1) {
+    const inode_id_t near = fs_alloc_inode_near(disk_p, inode, 0);
+    if(near == FS_INVALID_INODE) {
       break;
-    } else {
-      read_count++;
     }
+    assert(test_inode_in_magazine(near) == 0);
+    near_list[near_count++] = near;
+  }
+  assert(near_count != 0);
+  assert(magazine_p->inode_count != 0);
+  for(size_t i = 0;i < near_count;i++) {
+    fs_free_inode(disk_p, near_list[i]);
+  }
+  free(near_list);
+  // The bits are cleared when the magazine is drained
+  fs_sync(disk_p);
+  assert(magazine_p->inode_count == 0);
+  test_inode_map_verify(disk_p);
+  info("  ...Pass");
 
-    sector_t sector = \
-      fs_get_file_sector(disk_p, inode_p, i * disk_p->sector_size);
-    if(i < count) {
-      assert(sector == file_sector_map[i]);
-    } else {
-      assert(sector == FS_INVALID_SECTOR);
+  info("Allocating in %d threads...", TEST_MAGAZINE_THREADS);
+  const size_t prev_magazine_count = magazine_count;
+  TestMagazineArg *arg_list = \
+    malloc(TEST_MAGAZINE_THREADS * sizeof(TestMagazineArg));
+  sector_t *all_list = \
+    malloc(TEST_MAGAZINE_THREADS * TEST_MAGAZINE_COUNT * sizeof(sector_t));
+  assert(arg_list != NULL && all_list != NULL);
+  pthread_t thread_list[TEST_MAGAZINE_THREADS];
+  for(int i = 0;i < TEST_MAGAZINE_THREADS;i++) {
+    arg_list[i].disk_p = disk_p;
+    assert(pthread_create(&thread_list[i], 
+                          NULL, 
+                          test_magazine_thread, 
+                          &arg_list[i]) == 0);
+  }
+  for(int i = 0;i < TEST_MAGAZINE_THREADS;i++) {
+    pthread_join(thread_list[i], NULL);
+    memcpy(all_list + i * TEST_MAGAZINE_COUNT, 
+           arg_list[i].sector_list, 
+           TEST_MAGAZINE_COUNT * sizeof(sector_t));
+  }
+  // No sector is handed out twice
+  const size_t total_count = TEST_MAGAZINE_THREADS * TEST_MAGAZINE_COUNT;
+  qsort(all_list, total_count, sizeof(sector_t), test_magazine_cmp);
+  for(size_t i = 0;i < total_count;i++) {
+    assert(all_list[i] != FS_INVALID_SECTOR);
+    assert(i == 0 || all_list[i] != all_list[i - 1]);
+  }
+  assert(fs_count_free_sectors() == free_count - total_count);
+  for(int i = 0;i < TEST_MAGAZINE_THREADS;i++) {
+    assert(pthread_create(&thread_list[i], 
+                          NULL, 
+                          test_magazine_free_thread, 
+                          &arg_list[i]) == 0);
+  }
+  for(int i = 0;i < TEST_MAGAZINE_THREADS;i++) {
+    pthread_join(thread_list[i], NULL);
+  }
+  assert(fs_count_free_sectors() == free_count);
+  // The counter matches the groups and the magazines
+  size_t sum_count = 0;
+  for(size_t i = 0;i < group_table.count;i++) {
+    sum_count += group_table.group_p[i].free_sector_count;
+  }
+  for(Magazine *current_p = magazine_list_p;
+      current_p != NULL;
+      current_p = current_p->next_p) {
+    sum_count += current_p->sector_count;
+  }
+  assert(sum_count == free_count);
+  // Magazines of exited threads are returned to the groups, and reused by 
+  // the threads created later
+  for(Magazine *current_p = magazine_list_p;
+      current_p != NULL;
+      current_p = current_p->next_p) {
+    if(current_p != magazine_p) {
+      assert(current_p->in_use == 0);
+      assert(current_p->sector_count == 0 && current_p->inode_count == 0);
     }
   }
-  info("  Verified %d sectors for read", read_count);
+  assert(magazine_count <= prev_magazine_count + TEST_MAGAZINE_THREADS);
+  free(arg_list);
+  free(all_list);
   info("  ...Pass");
-  
-  //buffer_unpin(disk_p, inode_p);
+
+  info("Draining magazines...");
+  fs_sync(disk_p);
+  for(Magazine *current_p = magazine_list_p;
+      current_p != NULL;
+      current_p = current_p->next_p) {
+    assert(current_p->sector_count == 0);
+    assert(current_p->inode_count == 0);
+  }
+  assert(fs_count_free_sectors() == free_count);
+  buffer_flush_all(disk_p);
+  FsckResult result;
+  assert(fs_fsck(disk_p, 2, &result) == 0);
+  assert(result.free_sector_count == free_count);
+  info("  ...Pass");
+
   buffer_flush_all(disk_p);
   assert(buffer_count_pinned() == 0UL);
-  free(file_sector_map);
-  free(disk_sector_map);
   return;
 }
 
-void test_init_root(Storage *disk_p) {
-  info("=\n=Testing init the root directory...\n=");
-  // This is the complete version of fs_init
+void test_super_block(Storage *disk_p) {
+  info("=\n=Testing the resident super block...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
   fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  info("Allocating without writing the super block...");
+  assert(super_block_dirty == 0);
+  SuperBlock on_disk;
+  memcpy(&on_disk, read_lba(disk_p, FS_SB_SECTOR), sizeof(SuperBlock));
+  assert(memcmp(&on_disk, &super_block, sizeof(SuperBlock)) == 0);
+  // The inode free array is refilled and partly moved into the magazine
+  inode_id_t inode_list[FS_MAGAZINE_SIZE];
+  for(int i = 0;i < FS_MAGAZINE_SIZE;i++) {
+    inode_list[i] = fs_alloc_inode(disk_p);
+    assert(inode_list[i] != FS_INVALID_INODE);
+  }
+  assert(super_block_dirty == 1);
+  assert(super_block.ninode != on_disk.ninode);
+  assert(memcmp(read_lba(disk_p, FS_SB_SECTOR), 
+                &on_disk, 
+                sizeof(SuperBlock)) == 0);
+  for(int i = 0;i < FS_MAGAZINE_SIZE;i++) {
+    fs_free_inode(disk_p, inode_list[i]);
+  }
+  info("  ...Pass");
+
+  info("Writing back on sync...");
+  fs_sync(disk_p);
+  assert(super_block_dirty == 0);
+  assert(memcmp(read_lba(disk_p, FS_SB_SECTOR), 
+                &super_block, 
+                sizeof(SuperBlock)) == 0);
+  memcpy(&on_disk, &super_block, sizeof(SuperBlock));
+  buffer_flush_all(disk_p);
+  fs_load_context(disk_p);
+  assert(memcmp(&on_disk, &super_block, sizeof(SuperBlock)) == 0);
+  FsckResult result;
+  assert(fs_fsck(disk_p, 2, &result) == 0);
+  info("  ...Pass");
 
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
   return;
 }
 
-void test_add_dir_entry(Storage *disk_p) {
-  info("=\n=Testing init the root directory...\n=");
-  
-  // We will write into this inode's addr array for allocating
-  // sectors
-  Inode *inode_p = fs_load_inode_sector(disk_p, FS_ROOT_INODE, 1);
-  const int total_entry = 200;
-  const char *fmt = "File %d";
-  info("Allocating %d entries to the root directory...", total_entry);
-  for(int i = 0;i < 200;i++) {
-    DirEntry *entry_p = fs_add_dir_entry(disk_p, inode_p);
-    assert(entry_p != NULL);
-    // Make it occupied otherwise we will allocate this one on the next round
-    entry_p->inode = FS_ROOT_INODE;
-    char name_buffer[128];
-    sprintf(name_buffer, fmt, i);
-    int ret = fs_set_dir_name(disk_p, 
-                              entry_p, 
-                              name_buffer, 
-                              FS_SET_DIR_NAME_DISALLOW_DOT);
-    assert(ret == FS_SUCCESS);  
+void test_statfs(Storage *disk_p) {
+  info("=\n=Testing free space counters...\n=");
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+
+  fs_init(disk_p, disk_p->sector_count, FS_SB_SECTOR);
+  info("Counting allocations...");
+  StatFs stat;
+  fs_statfs(disk_p, &stat);
+  assert(stat.sector_size == disk_p->sector_size);
+  assert(stat.total_sector_count == context.free_sector_count);
+  assert(stat.total_inode_count == context.total_inode_count);
+  // Only the root directory is in use
+  assert(stat.free_inode_count == context.total_inode_count - 1);
+  const size_t free_sector_count = stat.free_sector_count;
+  const inode_id_t inode = fs_alloc_inode(disk_p);
+  const sector_t sector = fs_alloc_sector(disk_p);
+  const sector_t start = fs_alloc_sectors(disk_p, 8, FS_INVALID_SECTOR);
+  assert(inode != FS_INVALID_INODE);
+  assert(sector != FS_INVALID_SECTOR && start != FS_INVALID_SECTOR);
+  fs_statfs(disk_p, &stat);
+  assert(stat.free_sector_count == free_sector_count - 9);
+  assert(stat.free_inode_count == context.total_inode_count - 2);
+  fs_free_sectors(disk_p, start, 8);
+  fs_free_sector(disk_p, sector);
+  fs_free_inode(disk_p, inode);
+  fs_statfs(disk_p, &stat);
+  assert(stat.free_sector_count == free_sector_count);
+  assert(stat.free_inode_count == context.total_inode_count - 1);
+  info("  ...Pass");
+
+  info("Writing the counters on sync...");
+  const inode_id_t dir = test_make_dir(disk_p, FS_ROOT_INODE, "dir");
+  const size_t test_size = 20 * disk_p->sector_size;
+  uint8_t *data_p = malloc(test_size);
+  assert(data_p != NULL);
+  memset(data_p, 0x5A, test_size);
+  for(int i = 0;i < 3;i++) {
+    char name[FS_DIR_ENTRY_NAME_MAX + 1];
+    sprintf(name, "file%d", i);
+    const inode_id_t file = fs_alloc_inode(disk_p);
+    assert(file != FS_INVALID_INODE);
+    Inode *dir_p = fs_load_inode_sector(disk_p, dir, 1);
+    assert(fs_insert_dir_entry(disk_p, dir_p, name, file) == FS_SUCCESS);
+    Inode *inode_p = fs_load_inode_sector(disk_p, file, 1);
+    assert(fs_write(disk_p, inode_p, 0, test_size, data_p) == test_size);
   }
-  info("  Done");
+  free(data_p);
+  fs_sync(disk_p);
+  fs_statfs(disk_p, &stat);
+  assert(stat.free_inode_count == context.total_inode_count - 5);
+  assert(stat.free_sector_count < free_sector_count - 60);
+  StatFs image_stat;
+  assert(fs_statfs_image(disk_p, &image_stat) == FS_SUCCESS);
+  assert(memcmp(&image_stat, &stat, sizeof(StatFs)) == 0);
+  buffer_flush_all(disk_p);
+  fs_load_context(disk_p);
+  // Only the super block is read to load the counters
+  assert(inode_map.valid == 0);
+  fs_statfs(disk_p, &image_stat);
+  assert(memcmp(&image_stat, &stat, sizeof(StatFs)) == 0);
+  FsckResult result;
+  assert(fs_fsck(disk_p, 2, &result) == 0);
+  info("  ...Pass");
 
+  info("Repairing wrong counters...");
+  SuperBlock *sb_p = (SuperBlock *)read_lba_for_write(disk_p, FS_SB_SECTOR);
+  sb_p->nfree_sector -= 3;
+  sb_p->nfree_inode += 5;
   buffer_flush_all(disk_p);
-  inode_p = fs_load_inode_sector(disk_p, FS_ROOT_INODE, 0);
-  size_t expected_size = \
-    disk_p->sector_size * 
-    (size_t)((total_entry / context.dir_per_sector) + 
-             ((total_entry % context.dir_per_sector == 0) ? 0 : 1));
-  info("Expecting %lu bytes (%lu sectors) for the entry. Actual %lu",
-       expected_size,
-       expected_size / disk_p->sector_size,
-       fs_get_file_size(inode_p));
-  info("  Number of entries per sector: %lu", context.dir_per_sector);
-  assert(fs_get_file_size(inode_p) == expected_size);
+  assert(fs_fsck(disk_p, 2, &result) == 2);
+  assert(result.bad_summary_count == 2);
+  // The free sector counter is corrected when loaded, but the free inode 
+  // counter is trusted
+  fs_load_context(disk_p);
+  assert(super_block_dirty == 1);
+  fs_statfs(disk_p, &image_stat);
+  assert(image_stat.free_sector_count == stat.free_sector_count);
+  assert(image_stat.free_inode_count == stat.free_inode_count + 5);
+  assert(fs_recount(disk_p) == 2);
+  fs_statfs(disk_p, &image_stat);
+  assert(memcmp(&image_stat, &stat, sizeof(StatFs)) == 0);
+  assert(fs_recount(disk_p) == 0);
+  buffer_flush_all(disk_p);
+  assert(fs_fsck(disk_p, 2, &result) == 0);
+  info("  ...Pass");
 
+  info("Recounting an image without counters...");
+  sb_p = (SuperBlock *)read_lba_for_write(disk_p, FS_SB_SECTOR);
+  sb_p->features &= ~FS_FEATURE_SUMMARY;
+  sb_p->nfree_sector = sb_p->nfree_inode = 0;
   buffer_flush_all(disk_p);
-  assert(buffer_count_pinned() == 0UL);
+  assert(fs_statfs_image(disk_p, &image_stat) == FS_ERR_NO_SUMMARY);
+  // Free inodes are counted using the inode table instead
+  fs_load_context(disk_p);
+  assert(inode_map.valid == 1);
+  fs_statfs(disk_p, &image_stat);
+  assert(memcmp(&image_stat, &stat, sizeof(StatFs)) == 0);
+  assert(fs_recount(disk_p) == 2);
+  assert(context.features & FS_FEATURE_SUMMARY);
+  assert(fs_statfs_image(disk_p, &image_stat) == FS_SUCCESS);
+  assert(memcmp(&image_stat, &stat, sizeof(StatFs)) == 0);
+  buffer_flush_all(disk_p);
+  assert(fs_fsck(disk_p, 2, &result) == 0);
+  info("  ...Pass");
 
-  info("Read all entries");
-  // Open the directory and get back an opaque handler
-  Dir dir = fs_open_dir(disk_p, FS_ROOT_INODE);
-  // Allocate a map to record the state of each file
-  //char *dir_map = malloc(sizeof(char) * 200);
-  //memset(dir_map, 0x00, sizeof(char) * 200);
-  for(int i = 0;i < 200;i++) {
-    char name_buffer[128];
-    sprintf(name_buffer, fmt, i);
-    int len = strlen(name_buffer);
-    // Get the current dir and next dir
-    const DirEntry *entry_p = fs_next_dir(disk_p, &dir);
-    if(memcmp(entry_p->name, name_buffer, len) != 0) {
-      info("FAIL: i = %d; Expect \"%s\" actual \"%s\"", 
-           i, 
-           name_buffer, 
-           entry_p->name);
-      assert(0);
-    }
-  }
+  buffer_flush_all(disk_p);
+  assert(buffer_count_pinned() == 0UL);
+  return;
+}
 
+void test_dir_scan(Storage *disk_p) {
+  info("=\n=Testing directory sector scan...\n=");
   buffer_flush_all(disk_p);
   assert(buffer_count_pinned() == 0UL);
 
-  info("Removing all entries");
-  inode_p = fs_load_inode_sector(disk_p, FS_ROOT_INODE, 0);
-  // Then test removing
-  for(int i = 0;i < 200;i++) {
-    char name_buffer[128];
-    sprintf(name_buffer, fmt, i);
-    int ret = fs_free_dir_entry(disk_p, inode_p, name_buffer);
-    if(ret != FS_SUCCESS) {
-      info("Error: ret = %d", ret);
-      assert(ret == FS_SUCCESS);
+  info("Comparing with field-wise scan...");
+  // Entries of a few sectors, such that more than one block is scanned
+  const int count = 4 * disk_p->sector_size / sizeof(DirEntry);
+  DirEntry *entry_p = malloc(4 * disk_p->sector_size);
+  assert(entry_p != NULL);
+  char key[FS_DIR_ENTRY_NAME_MAX];
+  memset(key, 0x00, sizeof(key));
+  memcpy(key, "target", 6);
+  uint8_t pattern[FS_DIR_PATTERN_SIZE];
+  fs_dir_make_pattern(pattern, key);
+  srand(5);
+  for(int round = 0;round < 200;round++) {
+    // Names are either the key, the key with one byte changed, or another
+    // name. Inodes are either free, or differ from the free value in some 
+    // bytes
+    for(int i = 0;i < count;i++) {
+      memcpy(entry_p[i].name, key, FS_DIR_ENTRY_NAME_MAX);
+      const int choice = rand() % 8;
+      if(choice < 3) {
+        entry_p[i].name[rand() % FS_DIR_ENTRY_NAME_MAX] ^= 1 << (rand() % 8);
+      } else if(choice < 6) {
+        sprintf(entry_p[i].name, "f%d", rand() % 1000);
+      }
+      entry_p[i].inode = FS_INVALID_INODE;
+      if(rand() % (round % 4 + 2) == 0) {
+        const int bit = rand() % (8 * sizeof(inode_id_t));
+        entry_p[i].inode ^= (inode_id_t)1 << bit;
+      }
     }
-  }
-  info("  Done");
-  info("Directory size after deletion: %lu", fs_get_file_size(inode_p));
 
-  // This is the size of the directory
-  size_t dir_size = fs_get_file_size(inode_p);
-  assert(dir_size == disk_p->sector_size);
+    int expected_name = count;
+    int expected_free = count;
+    int expected_count = 0;
+    for(int i = count - 1;i >= 0;i--) {
+      if(entry_p[i].inode == FS_INVALID_INODE) {
+        expected_free = i;
+        expected_count++;
+      } else if(memcmp(entry_p[i].name, key, FS_DIR_ENTRY_NAME_MAX) == 0) {
+        expected_name = i;
+      }
+    }
+    int free_count;
+    assert(fs_dir_scan_name(entry_p, count, pattern) == expected_name);
+    assert(fs_dir_scan_free(entry_p, count, NULL) == expected_free);
+    assert(fs_dir_scan_free(entry_p, count, &free_count) == expected_free);
+    assert(free_count == expected_count);
+  }
+  free(entry_p);
+  info("  ...Pass");
 
   buffer_flush_all(disk_p);
   assert(buffer_count_pinned() == 0UL);
-
   return;
 }
 
@@ -2865,6 +13930,30 @@ void (*tests[])(Storage *) = {
 #endif
   test_init_root,
   test_add_dir_entry,
+  test_file_rw,
+  test_map_cache,
+  test_free_extent,
+  test_inode_map,
+  test_dir_index,
+  test_dcache,
+  test_lookup_path,
+  test_icache,
+  test_readdir_bulk,
+  test_delalloc,
+  test_truncate,
+  test_sparse,
+  test_inline,
+  test_dir_slot,
+  test_lazy_inode,
+  test_fsck,
+  test_import_export,
+  test_indir_levels,
+  test_extent,
+  test_alloc_group,
+  test_magazine,
+  test_super_block,
+  test_statfs,
+  test_dir_scan,
   // This is the last stage
   free_mem_storage,
 };
@@ -2886,8 +13975,119 @@ int main() {
 // Main Function
 /////////////////////////////////////////////////////////////////////
 
-int main() {
-  return 0;
+/*
+ * main() - Runs a command on a file system image
+ *
+ *   fsck <image> [threads]: Checks the image, and exits with 1 if any 
+ *                           problem is found
+ *   import <image> <sectors> <host dir> [threads]: Creates an image of the
+ *                           given size with the content of the host 
+ *                           directory
+ *   export <image> <host dir>: Copies the content of the image into the 
+ *                           host directory
+ *   statfs <image>: Prints the size and free space of the image using only 
+ *                           the super block
+ *   recount <image>: Recounts free sectors and inodes, and repairs the 
+ *                           counters in the super block
+ */
+int main(int argc, char **argv) {
+  const char *command = (argc >= 2) ? argv[1] : "";
+  int thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(strcmp(command, "fsck") == 0 && argc >= 3) {
+    if(argc >= 4) {
+      thread_count = atoi(argv[3]);
+    }
+    Storage *disk_p = get_file_storage(argv[2], 0);
+    if(disk_p == NULL) {
+      fatal_error("Failed to open image %s", argv[2]);
+    }
+
+    FsckResult result;
+    fs_fsck(disk_p, thread_count, &result);
+    fs_fsck_print(&result);
+    free_file_storage(disk_p);
+    return result.error_count == 0 ? 0 : 1;
+  } else if(strcmp(command, "import") == 0 && argc >= 5) {
+    if(argc >= 6) {
+      thread_count = atoi(argv[5]);
+    }
+    const size_t sector_count = (size_t)atol(argv[3]);
+    Storage *disk_p = create_file_storage(argv[2], sector_count);
+    if(disk_p == NULL) {
+      fatal_error("Failed to create image %s", argv[2]);
+    }
+
+    buffer_init();
+    // Imported files are mostly contiguous, and are described by a few
+    // extents each
+    _fs_init(disk_p, 
+             sector_count, 
+             FS_SB_SECTOR, 
+             1, 
+             FS_DEFAULT_FEATURES | FS_FEATURE_EXTENT);
+    const int ret = fs_import(disk_p, argv[4], thread_count);
+    fs_sync(disk_p);
+    buffer_flush_all(disk_p);
+    free_file_storage(disk_p);
+    if(ret != FS_SUCCESS) {
+      fatal_error("Failed to import %s (error %d)", argv[4], ret);
+    }
+    return 0;
+  } else if(strcmp(command, "export") == 0 && argc >= 4) {
+    Storage *disk_p = get_file_storage(argv[2], 0);
+    if(disk_p == NULL) {
+      fatal_error("Failed to open image %s", argv[2]);
+    }
+
+    buffer_init();
+    fs_load_context(disk_p);
+    const int ret = fs_export(disk_p, FS_ROOT_INODE, argv[3]);
+    free_file_storage(disk_p);
+    return ret == FS_SUCCESS ? 0 : 1;
+  } else if(strcmp(command, "statfs") == 0 && argc >= 3) {
+    Storage *disk_p = get_file_storage(argv[2], 0);
+    if(disk_p == NULL) {
+      fatal_error("Failed to open image %s", argv[2]);
+    }
+
+    StatFs stat;
+    const int ret = fs_statfs_image(disk_p, &stat);
+    free_file_storage(disk_p);
+    if(ret != FS_SUCCESS) {
+      fatal_error("Image %s has no free space counters. Run recount first", 
+                  argv[2]);
+    }
+    info("Sector size: %lu", stat.sector_size);
+    info("Sectors: %lu (%lu free)", 
+         stat.total_sector_count, 
+         stat.free_sector_count);
+    info("Inodes: %lu (%lu free)", 
+         stat.total_inode_count, 
+         stat.free_inode_count);
+    return 0;
+  } else if(strcmp(command, "recount") == 0 && argc >= 3) {
+    Storage *disk_p = get_file_storage(argv[2], 1);
+    if(disk_p == NULL) {
+      fatal_error("Failed to open image %s", argv[2]);
+    }
+
+    buffer_init();
+    fs_load_context(disk_p);
+    const size_t count = fs_recount(disk_p);
+    buffer_flush_all(disk_p);
+    free_file_storage(disk_p);
+    info("Counters repaired: %lu", count);
+    return 0;
+  }
+
+  fprintf(stderr, 
+          "Usage: %s fsck <image> [threads]\n"
+          "       %s import <image> <sectors> <host dir> [threads]\n"
+          "       %s export <image> <host dir>\n"
+          "       %s statfs <image>\n"
+          "       %s recount <image>\n", 
+          argv[0], argv[0], argv[0], argv[0], argv[0]);
+  return 2;
 }
 
 #endif